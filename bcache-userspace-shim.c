@@ -23,6 +23,11 @@ enum fsck_err_opts fsck_err_opt;
 ({									\
 	bool _fix = false;						\
 									\
+	if (bch_fsck_halted()) {					\
+		ret = BCH_FSCK_ERRORS_NOT_FIXED;			\
+		goto fsck_err;						\
+	}								\
+									\
 	if (_can_fix) {							\
 		switch (fsck_err_opt) {					\
 		case FSCK_ERR_ASK:					\
@@ -47,7 +52,8 @@ enum fsck_err_opts fsck_err_opt;
 		_fix = true;						\
 									\
 	if (!_fix && !_can_ignore) {					\
-		printf("Fatal filesystem inconsistency, halting\n");	\
+		bch_err(c, "Fatal filesystem inconsistency, halting");	\
+		bch_fsck_halt();					\
 		ret = BCH_FSCK_ERRORS_NOT_FIXED;			\
 		goto fsck_err;						\
 	}								\
@@ -52,6 +52,7 @@ static void usage(void)
 	     "Debug:\n"
 	     "  bcache dump    Dump filesystem metadata to a qcow2 image\n"
 	     "  bcache list    List filesystem metadata in textual form\n"
+	     "  bcache trace   Record tracepoints while running another command\n"
 	     "\n"
 	     "Migrate:\n"
 	     "  bcache migrate Migrate an existing filesystem to bcachefs, in place\n"
@@ -59,19 +60,9 @@ static void usage(void)
 	     "                 Add default superblock, after bcache migrate\n");
 }
 
-int main(int argc, char *argv[])
+static int bcache_cmd(int argc, char *argv[])
 {
-	char *cmd;
-
-	setvbuf(stdout, NULL, _IOLBF, 0);
-
-	if (argc < 2) {
-		printf("%s: missing command\n", argv[0]);
-		usage();
-		exit(EXIT_FAILURE);
-	}
-
-	cmd = argv[1];
+	char *cmd = argv[1];
 
 	memmove(&argv[1], &argv[2], argc * sizeof(argv[0]));
 	argc--;
@@ -111,6 +102,12 @@ int main(int argc, char *argv[])
 		return cmd_dump(argc, argv);
 	if (!strcmp(cmd, "list"))
 		return cmd_list(argc, argv);
+	if (!strcmp(cmd, "trace")) {
+		int i = cmd_trace(argc, argv);
+
+		argv[i - 1] = argv[0];
+		return bcache_cmd(argc - i + 1, argv + i - 1);
+	}
 
 	if (!strcmp(cmd, "migrate"))
 		return cmd_migrate(argc, argv);
@@ -120,3 +117,16 @@ int main(int argc, char *argv[])
 	usage();
 	return 0;
 }
+
+int main(int argc, char *argv[])
+{
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (argc < 2) {
+		printf("%s: missing command\n", argv[0]);
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	return bcache_cmd(argc, argv);
+}
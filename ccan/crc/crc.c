@@ -27,6 +27,11 @@
 #include <ccan/array_size/array_size.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 /*
  * This is the CRC-32C table
@@ -107,7 +112,7 @@ static const uint32_t crc32c_tab[] = {
  * Steps through buffer one byte at at time, calculates reflected
  * crc using table.
  */
-uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+static uint32_t crc32c_bytewise(uint32_t crc, const void *buf, size_t size)
 {
 	const uint8_t *p = buf;
 
@@ -117,6 +122,87 @@ uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
 	return crc;
 }
 
+/*
+ * Slice-by-8: crc32c_slice[k][b] is the crc of byte b followed by k zero
+ * bytes, so eight bytes can be folded in with eight independent lookups.
+ */
+static uint32_t crc32c_slice[8][256];
+
+static uint32_t crc32c_sb8(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	for (; size >= 8; p += 8, size -= 8) {
+		crc ^= (uint32_t) p[0] |
+			((uint32_t) p[1] << 8) |
+			((uint32_t) p[2] << 16) |
+			((uint32_t) p[3] << 24);
+
+		crc = crc32c_slice[7][crc & 0xff] ^
+			crc32c_slice[6][(crc >> 8) & 0xff] ^
+			crc32c_slice[5][(crc >> 16) & 0xff] ^
+			crc32c_slice[4][crc >> 24] ^
+			crc32c_slice[3][p[4]] ^
+			crc32c_slice[2][p[5]] ^
+			crc32c_slice[1][p[6]] ^
+			crc32c_slice[0][p[7]];
+	}
+
+	return crc32c_bytewise(crc, p, size);
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 has a crc32 instruction - which is actually crc32c: */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint64_t crc64, v;
+
+	for (; size && ((uintptr_t) p & 7); size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	crc64 = crc;
+	for (; size >= 8; p += 8, size -= 8) {
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = crc64;
+
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_bytewise;
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+	unsigned i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32c_slice[0][i] = crc32c_tab[i];
+
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc32c_slice[k][i] = (crc32c_slice[k - 1][i] >> 8) ^
+				crc32c_tab[crc32c_slice[k - 1][i] & 0xff];
+
+	crc32c_fn = crc32c_sb8;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_fn = crc32c_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+{
+	return crc32c_fn(crc, buf, size);
+}
+
 const uint32_t *crc32c_table(void)
 {
 	return crc32c_tab;
@@ -0,0 +1,36 @@
+#include <ccan/crc/crc.c>
+#include <ccan/tap/tap.h>
+
+/* All crc32c implementations must agree with the bytewise one. */
+static bool check_impl(uint32_t (*fn)(uint32_t, const void *, size_t),
+		       const uint8_t *buf)
+{
+	unsigned off, len;
+
+	for (off = 0; off < 8; off++)
+		for (len = 0; len < 1024; len++)
+			if (fn(off * len, buf + off, len) !=
+			    crc32c_bytewise(off * len, buf + off, len))
+				return false;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[1024 + 8];
+	unsigned i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = random();
+
+	plan_tests(3);
+	ok1(check_impl(crc32c_sb8, buf));
+#if defined(__x86_64__)
+	ok1(!__builtin_cpu_supports("sse4.2") ||
+	    check_impl(crc32c_sse42, buf));
+#else
+	pass("no sse4.2");
+#endif
+	ok1(check_impl(crc32c, buf));
+	return exit_status();
+}
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <getopt.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,6 +17,8 @@
 #include "journal.h"
 #include "super.h"
 
+#include <linux/trace_events.h>
+
 static void dump_usage(void)
 {
 	puts("bcache dump - dump filesystem metadata\n"
@@ -23,6 +26,9 @@ static void dump_usage(void)
 	     "\n"
 	     "Options:\n"
 	     "  -o output     Output qcow2 image(s)\n"
+	     "  -B            Use buffered IO instead of O_DIRECT\n"
+	     "      --stats   Print latency statistics (count, mean, p50/p99/p999, max)\n"
+	     "                and mempool and slab statistics\n"
 	     "  -h            Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -66,7 +72,8 @@ static void dump_one_device(struct cache_set *c, struct cache *ca, int fd)
 		struct btree_iter iter;
 		struct btree *b;
 
-		for_each_btree_node(&iter, c, i, POS_MIN, 0, b) {
+		for_each_btree_node_readahead(&iter, c, i, POS_MIN, 0, b,
+					      BTREE_SCAN_READAHEAD) {
 			struct bkey_s_c_extent e = bkey_i_to_s_c_extent(&b->key);
 
 			extent_for_each_ptr(e, ptr)
@@ -78,10 +85,15 @@ static void dump_one_device(struct cache_set *c, struct cache *ca, int fd)
 		bch_btree_iter_unlock(&iter);
 	}
 
-	qcow2_write_image(ca->disk_sb.bdev->bd_fd, fd, &data,
+	qcow2_write_image(ca->disk_sb.bdev->bd_buffered_fd, fd, &data,
 			  max_t(unsigned, btree_bytes(c) / 8, block_bytes(c)));
 }
 
+static const struct option stats_opts[] = {
+	{ "stats",		no_argument, NULL, 'S' },
+	{ NULL }
+};
+
 int cmd_dump(int argc, char *argv[])
 {
 	struct bch_opts opts = bch_opts_empty();
@@ -89,7 +101,7 @@ int cmd_dump(int argc, char *argv[])
 	const char *err;
 	char *out = NULL;
 	unsigned i, nr_devices = 0;
-	bool force = false;
+	bool force = false, stats = false;
 	int fd, opt;
 
 	opts.nochanges	= true;
@@ -97,7 +109,8 @@ int cmd_dump(int argc, char *argv[])
 	opts.errors	= BCH_ON_ERROR_CONTINUE;
 	fsck_err_opt	= FSCK_ERR_NO;
 
-	while ((opt = getopt(argc, argv, "o:fh")) != -1)
+	while ((opt = getopt_long(argc, argv, "o:fBh",
+				  stats_opts, NULL)) != -1)
 		switch (opt) {
 		case 'o':
 			out = optarg;
@@ -105,6 +118,12 @@ int cmd_dump(int argc, char *argv[])
 		case 'f':
 			force = true;
 			break;
+		case 'B':
+			opts.buffered_io = true;
+			break;
+		case 'S':
+			stats = true;
+			break;
 		case 'h':
 			dump_usage();
 			exit(EXIT_SUCCESS);
@@ -149,6 +168,9 @@ int cmd_dump(int argc, char *argv[])
 
 	up_read(&c->gc_lock);
 
+	if (stats)
+		bcache_fs_stats_print(c, stdout);
+
 	bch_fs_stop(c);
 	return 0;
 }
@@ -160,7 +182,8 @@ static void list_keys(struct cache_set *c, enum btree_id btree_id,
 	struct bkey_s_c k;
 	char buf[512];
 
-	for_each_btree_key(&iter, c, btree_id, start, k) {
+	for_each_btree_key_readahead(&iter, c, btree_id, start, k,
+				     BTREE_SCAN_READAHEAD) {
 		if (bkey_cmp(k.k->p, end) > 0)
 			break;
 
@@ -178,7 +201,8 @@ static void list_btree_formats(struct cache_set *c, enum btree_id btree_id,
 	struct btree *b;
 	char buf[4096];
 
-	for_each_btree_node(&iter, c, btree_id, start, 0, b) {
+	for_each_btree_node_readahead(&iter, c, btree_id, start, 0, b,
+				      BTREE_SCAN_READAHEAD) {
 		if (bkey_cmp(b->key.k.p, end) > 0)
 			break;
 
@@ -188,6 +212,83 @@ static void list_btree_formats(struct cache_set *c, enum btree_id btree_id,
 	bch_btree_iter_unlock(&iter);
 }
 
+#define UNPACK_BENCH_PASSES	16
+
+static u64 bench_node_unpack(struct btree *b, bool compiled)
+{
+	struct bset_tree *t;
+	struct bkey_packed *k;
+	struct bkey u;
+	u64 start = local_clock(), sum = 0;
+	unsigned i;
+
+	for (i = 0; i < UNPACK_BENCH_PASSES; i++)
+		for_each_bset(b, t)
+			for (k = btree_bkey_first(b, t);
+			     k != btree_bkey_last(b, t);
+			     k = bkey_next(k)) {
+				if (!bkey_packed(k))
+					continue;
+
+				u = compiled
+					? bkey_unpack_key_format_checked(b, k)
+					: __bkey_unpack_key(&b->format, k);
+				sum += u.p.offset;
+			}
+
+	/* keep the unpacks from being optimized out: */
+	barrier_data(&sum);
+
+	return local_clock() - start;
+}
+
+static void bench_btree_unpack(struct cache_set *c, enum btree_id btree_id,
+			       struct bpos start, struct bpos end)
+{
+	struct btree_iter iter;
+	struct btree *b;
+	struct bset_tree *t;
+	struct bkey_packed *k;
+	u64 keys = 0, generic_ns = 0, compiled_ns = 0;
+	unsigned nodes = 0, nodes_compiled = 0;
+
+	for_each_btree_node_readahead(&iter, c, btree_id, start, 0, b,
+				      BTREE_SCAN_READAHEAD) {
+		if (bkey_cmp(b->key.k.p, end) > 0)
+			break;
+
+		nodes++;
+
+		for_each_bset(b, t)
+			for (k = btree_bkey_first(b, t);
+			     k != btree_bkey_last(b, t);
+			     k = bkey_next(k))
+				keys += bkey_packed(k);
+
+		generic_ns += bench_node_unpack(b, false);
+
+		if (b->unpack_fn) {
+			nodes_compiled++;
+			compiled_ns += bench_node_unpack(b, true);
+		}
+	}
+	bch_btree_iter_unlock(&iter);
+
+	keys *= UNPACK_BENCH_PASSES;
+
+	printf("%u nodes, %llu packed key unpacks per implementation\n",
+	       nodes, keys);
+	printf("generic:  %llu keys/sec\n",
+	       generic_ns ? keys * NSEC_PER_SEC / generic_ns : 0);
+
+	if (nodes_compiled != nodes)
+		printf("compiled: unavailable (%u/%u nodes have compiled unpack)\n",
+		       nodes_compiled, nodes);
+	else
+		printf("compiled: %llu keys/sec\n",
+		       compiled_ns ? keys * NSEC_PER_SEC / compiled_ns : 0);
+}
+
 static struct bpos parse_pos(char *buf)
 {
 	char *s = buf;
@@ -212,7 +313,11 @@ static void list_keys_usage(void)
 	     "  -b (extents|inodes|dirents|xattrs)    Btree to list from\n"
 	     "  -s inode:offset                       Start position to list from\n"
 	     "  -e inode:offset                       End position\n"
-	     "  -m (keys|formats)                     List mode\n"
+	     "  -m (keys|formats|unpack_bench)        List mode; unpack_bench times\n"
+	     "                                        compiled vs. generic key unpack\n"
+	     "  -B                                    Use buffered IO instead of O_DIRECT\n"
+	     "      --stats                           Print latency, mempool and slab\n"
+	     "                                        statistics to stderr\n"
 	     "  -h                                    Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -220,6 +325,7 @@ static void list_keys_usage(void)
 static const char * const list_modes[] = {
 	"keys",
 	"formats",
+	"unpack_bench",
 	NULL
 };
 
@@ -231,13 +337,15 @@ int cmd_list(int argc, char *argv[])
 	struct bpos start = POS_MIN, end = POS_MAX;
 	const char *err;
 	int mode = 0, opt;
+	bool stats = false;
 
 	opts.nochanges	= true;
 	opts.norecovery	= true;
 	opts.errors	= BCH_ON_ERROR_CONTINUE;
 	fsck_err_opt	= FSCK_ERR_NO;
 
-	while ((opt = getopt(argc, argv, "b:s:e:m:h")) != -1)
+	while ((opt = getopt_long(argc, argv, "b:s:e:m:Bh",
+				  stats_opts, NULL)) != -1)
 		switch (opt) {
 		case 'b':
 			btree_id = read_string_list_or_die(optarg,
@@ -253,6 +361,12 @@ int cmd_list(int argc, char *argv[])
 			mode = read_string_list_or_die(optarg,
 						list_modes, "list mode");
 			break;
+		case 'B':
+			opts.buffered_io = true;
+			break;
+		case 'S':
+			stats = true;
+			break;
 		case 'h':
 			list_keys_usage();
 			exit(EXIT_SUCCESS);
@@ -272,10 +386,82 @@ int cmd_list(int argc, char *argv[])
 	case 1:
 		list_btree_formats(c, btree_id, start, end, mode);
 		break;
+	case 2:
+		bench_btree_unpack(c, btree_id, start, end);
+		break;
 	default:
 		die("Invalid mode");
 	}
 
+	/* stdout is the listing: */
+	if (stats)
+		bcache_fs_stats_print(c, stderr);
+
 	bch_fs_stop(c);
 	return 0;
 }
+
+static void trace_usage(void)
+{
+	puts("bcache trace - record tracepoints while running a command\n"
+	     "Usage: bcache trace [OPTION]... <command> [<args>]\n"
+	     "\n"
+	     "Options:\n"
+	     "  -e events     Comma separated list of events to record, as globs\n"
+	     "                matching event or event class names (default: all)\n"
+	     "  -b size       Size of each thread's trace buffer (default: 1M)\n"
+	     "  -o file       Write the trace to file instead of stderr\n"
+	     "  -l            List events and exit\n"
+	     "  -h            Display this help and exit\n"
+	     "\n"
+	     "Tracing can also be enabled for any command by setting BCACHE_TRACE\n"
+	     "to a list of events, and optionally BCACHE_TRACE_BUF_SIZE and\n"
+	     "BCACHE_TRACE_FILE.\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+/*
+ * Enables tracing, and returns the index in @argv of the command to run - the
+ * trace is dumped when that command exits:
+ */
+int cmd_trace(int argc, char *argv[])
+{
+	const char *events = "all", *file = NULL;
+	unsigned long long buf_size = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "+e:b:o:lh")) != -1)
+		switch (opt) {
+		case 'e':
+			events = optarg;
+			break;
+		case 'b':
+			if (bch_strtoull_h(optarg, &buf_size))
+				die("bad buffer size %s", optarg);
+			break;
+		case 'o':
+			file = optarg;
+			break;
+		case 'l':
+			trace_list_events(stdout);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			trace_usage();
+			exit(EXIT_SUCCESS);
+		}
+
+	if (optind >= argc)
+		die("Please supply a command to trace");
+
+	ret = trace_init(events, buf_size, file);
+	if (ret == -ENOENT)
+		die("no events matching %s", events);
+	if (ret < 0)
+		die("error enabling tracing: %s", strerror(-ret));
+
+	ret = optind;
+
+	/* the command we run parses its own options - restart getopt(): */
+	optind = 0;
+	return ret;
+}
@@ -40,6 +40,7 @@ x(0,	data_replicas,		"#",			NULL)			\
 x(0,	metadata_replicas,	"#",			NULL)			\
 x(0,	encrypted,		NULL,			"Enable whole filesystem encryption (chacha20/poly1305)")\
 x(0,	no_passphrase,		NULL,			"Don't encrypt master encryption key")\
+x(0,	journal_gens,		NULL,			"Journal new bucket gens, instead of rewriting prios")\
 x('e',	error_action,		"(continue|readonly|panic)", NULL)		\
 x(0,	max_journal_entry_size,	"size",			NULL)			\
 x('L',	label,			"label",		NULL)			\
@@ -77,6 +78,8 @@ static void usage(void)
 	     "      --metadata_replicas=#   Number of metadata replicas\n"
 	     "      --encrypted             Enable whole filesystem encryption (chacha20/poly1305)\n"
 	     "      --no_passphrase         Don't encrypt master encryption key\n"
+	     "      --journal_gens          Journal new bucket gens, instead of rewriting\n"
+	     "                              prios (not readable by older versions)\n"
 	     "      --error_action=(continue|readonly|panic)\n"
 	     "                              Action to take on filesystem error\n"
 	     "      --max_journal_entry_size=size\n"
@@ -177,6 +180,9 @@ int cmd_format(int argc, char *argv[])
 		case O_no_passphrase:
 			no_passphrase = true;
 			break;
+		case O_journal_gens:
+			opts.journal_gens = true;
+			break;
 		case O_error_action:
 		case 'e':
 			opts.on_error_action =
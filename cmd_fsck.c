@@ -1,4 +1,7 @@
 
+#include <getopt.h>
+#include <sys/resource.h>
+
 #include "cmds.h"
 #include "libbcache.h"
 #include "super.h"
@@ -15,18 +18,36 @@ static void usage(void)
 	     "  -y     Assume \"yes\" to all questions\n"
 	     "  -f     Force checking even if filesystem is marked clean\n"
 	     "  -v     Be verbose\n"
+	     "  -B     Use buffered IO instead of O_DIRECT\n"
+	     "  -j n   Use n threads with -p, -y or -n (default, or 0: one\n"
+	     "         per cpu)\n"
+	     "  -m size\n"
+	     "         Limit memory used for link counts and the directory\n"
+	     "         structure check, making more passes if needed\n"
+	     "  --stats\n"
+	     "         Print latency statistics (count, mean, p50/p99/p999, max)\n"
+	     "         and mempool and slab statistics\n"
 	     " --h     Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
 
+static const struct option fsck_opts[] = {
+	{ "stats",		no_argument, NULL, 'S' },
+	{ NULL }
+};
+
 int cmd_fsck(int argc, char *argv[])
 {
 	struct bch_opts opts = bch_opts_empty();
 	struct cache_set *c = NULL;
 	const char *err;
+	unsigned nr_threads;
+	u64 mem_limit;
+	bool stats = false;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "pynfvh")) != -1)
+	while ((opt = getopt_long(argc, argv, "pynfvBj:m:h",
+				  fsck_opts, NULL)) != -1)
 		switch (opt) {
 		case 'p':
 			fsck_err_opt = FSCK_ERR_YES;
@@ -44,6 +65,24 @@ int cmd_fsck(int argc, char *argv[])
 		case 'v':
 			opts.verbose_recovery = true;
 			break;
+		case 'B':
+			opts.buffered_io = true;
+			break;
+		case 'j':
+			if (kstrtouint(optarg, 10, &nr_threads) ||
+			    nr_threads > 64)
+				die("invalid number of threads");
+			opts.fsck_threads = nr_threads;
+			break;
+		case 'm':
+			if (bch_strtoull_h(optarg, &mem_limit) ||
+			    !mem_limit || mem_limit > S64_MAX)
+				die("invalid memory limit %s", optarg);
+			opts.fsck_mem_limit = mem_limit;
+			break;
+		case 'S':
+			stats = true;
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -52,10 +91,24 @@ int cmd_fsck(int argc, char *argv[])
 	if (optind >= argc)
 		die("Please supply device(s) to check");
 
+	/* Can't ask questions from more than one thread at a time: */
+	if (fsck_err_opt == FSCK_ERR_ASK)
+		opts.fsck_threads = 1;
+
 	err = bch_fs_open(argv + optind, argc - optind, opts, &c);
 	if (err)
 		die("error opening %s: %s", argv[optind], err);
 
+	if (opt_defined(opts.fsck_mem_limit)) {
+		struct rusage usage;
+
+		if (!getrusage(RUSAGE_SELF, &usage))
+			printf("peak memory usage: %li KiB\n", usage.ru_maxrss);
+	}
+
+	if (stats)
+		bcache_fs_stats_print(c, stdout);
+
 	bch_fs_stop(c);
 	return 0;
 }
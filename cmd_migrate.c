@@ -24,6 +24,8 @@
 
 #include <linux/dcache.h>
 #include <linux/generic-radix-tree.h>
+#include <linux/semaphore.h>
+#include <linux/workqueue.h>
 #include <linux/xattr.h>
 #include "btree_update.h"
 #include "buckets.h"
@@ -31,6 +33,7 @@
 #include "fs.h"
 #include "inode.h"
 #include "io.h"
+#include "keylist.h"
 #include "str_hash.h"
 #include "super.h"
 #include "xattr.h"
@@ -244,58 +247,194 @@ static void copy_xattrs(struct cache_set *c, struct bch_inode_unpacked *dst,
 	}
 }
 
+/*
+ * Data that can't be linked in place has to be copied: reads go into a small
+ * ring of buffers, and the writes are issued asynchronously - so we're reading
+ * the next buffer while the previous ones are still being written.
+ *
+ * Each write is at most one encoded extent, so bch_write() never has to bounce
+ * more than the bounce mempool holds:
+ */
+#define COPY_BUF_SIZE		(BCH_ENCODED_EXTENT_MAX << 9)
+#define COPY_BUFS		16
+
+struct copy_buf {
+	char			data[COPY_BUF_SIZE] __aligned(PAGE_SIZE);
+	struct closure		cl;
+	struct bch_write_op	op;
+	struct bch_write_bio	bio;
+	struct bio_vec		bv[COPY_BUF_SIZE / PAGE_SIZE];
+};
+
+struct copy_bufs {
+	struct copy_bufs	*next;
+	struct copy_buf		b[COPY_BUFS];
+};
+
+/* Regular files are copied by a pool of workers, up to COPY_JOBS_MAX at once: */
+#define COPY_JOBS_MAX		64
+
+struct copy_fs_state {
+	u64			bcachefs_inum;
+	dev_t			dev;
+
+	GENRADIX(u64)		hardlinks;
+	ranges			extents;
+
+	struct workqueue_struct	*wq;
+	struct semaphore	jobs;
+
+	/* protects extents and free_bufs: */
+	struct mutex		lock;
+	struct copy_bufs	*free_bufs;
+
+	/*
+	 * Serializes read-modify-write of inodes that copy workers may also be
+	 * updating:
+	 */
+	struct mutex		inode_lock;
+};
+
+static struct copy_bufs *copy_bufs_get(struct copy_fs_state *s)
+{
+	struct copy_bufs *bufs;
+	unsigned i;
+
+	mutex_lock(&s->lock);
+	bufs = s->free_bufs;
+	if (bufs)
+		s->free_bufs = bufs->next;
+	mutex_unlock(&s->lock);
+
+	if (bufs)
+		return bufs;
+
+	if (posix_memalign((void **) &bufs, PAGE_SIZE, sizeof(*bufs)))
+		die("insufficient memory");
+
+	for (i = 0; i < COPY_BUFS; i++)
+		closure_init_stack(&bufs->b[i].cl);
+
+	return bufs;
+}
+
+static void copy_bufs_put(struct copy_fs_state *s, struct copy_bufs *bufs)
+{
+	mutex_lock(&s->lock);
+	bufs->next = s->free_bufs;
+	s->free_bufs = bufs;
+	mutex_unlock(&s->lock);
+}
+
+/*
+ * Starts writing @len bytes of @b at @dst_offset - doesn't wait for the write
+ * to complete, closure_sync(&b->cl) before reusing @b:
+ */
 static void write_data(struct cache_set *c,
 		       struct bch_inode_unpacked *dst_inode,
-		       u64 dst_offset, void *buf, size_t len)
+		       u64 dst_offset, struct copy_buf *b, size_t len)
 {
 	struct disk_reservation res;
-	struct bch_write_op op;
-	struct bch_write_bio bio;
-	struct bio_vec bv;
-	struct closure cl;
 
 	BUG_ON(dst_offset	& (block_bytes(c) - 1));
 	BUG_ON(len		& (block_bytes(c) - 1));
 
-	closure_init_stack(&cl);
+	closure_init_stack(&b->cl);
 
-	bio_init(&bio.bio);
-	bio.bio.bi_max_vecs	= 1;
-	bio.bio.bi_io_vec	= &bv;
-	bio.bio.bi_iter.bi_size	= len;
-	bch_bio_map(&bio.bio, buf);
+	bio_init(&b->bio.bio);
+	b->bio.bio.bi_max_vecs	= ARRAY_SIZE(b->bv);
+	b->bio.bio.bi_io_vec	= b->bv;
+	b->bio.bio.bi_iter.bi_size = len;
+	bch_bio_map(&b->bio.bio, b->data);
 
 	int ret = bch_disk_reservation_get(c, &res, len >> 9, 0);
 	if (ret)
 		die("error reserving space in new filesystem: %s", strerror(-ret));
 
-	bch_write_op_init(&op, c, &bio, res, c->write_points,
+	bch_write_op_init(&b->op, c, &b->bio, res, c->write_points,
 			  POS(dst_inode->inum, dst_offset >> 9), NULL, 0);
-	closure_call(&op.cl, bch_write, NULL, &cl);
-	closure_sync(&cl);
+	closure_call(&b->op.cl, bch_write, NULL, &b->cl);
 
 	dst_inode->i_sectors += len >> 9;
 }
 
-static char buf[1 << 20] __aligned(PAGE_SIZE);
+/*
+ * @len may have been rounded up to a block boundary past EOF - that part is
+ * zeroed, but any other short read is an error:
+ */
+static void read_data(struct cache_set *c, int fd, void *buf,
+		      size_t len, u64 offset)
+{
+	while (len) {
+		ssize_t r = pread(fd, buf, len, offset);
+
+		if (r < 0)
+			die("read error: %s", strerror(errno));
+		if (!r)
+			break;
+
+		buf	+= r;
+		len	-= r;
+		offset	+= r;
+	}
+
+	if (len >= block_bytes(c))
+		die("short read at offset %llu", offset);
 
-static void copy_data(struct cache_set *c,
+	memset(buf, 0, len);
+}
+
+static void copy_data(struct cache_set *c, struct copy_bufs *bufs,
 		      struct bch_inode_unpacked *dst_inode,
 		      int src_fd, u64 start, u64 end)
 {
+	unsigned i = 0;
+
 	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
+		struct copy_buf *b = &bufs->b[i++ % COPY_BUFS];
+		unsigned len = min_t(u64, end - start, COPY_BUF_SIZE);
 
-		xpread(src_fd, buf, len, start);
-		write_data(c, dst_inode, start, buf, len);
+		/* wait for the previous write from this buffer: */
+		closure_sync(&b->cl);
+
+		read_data(c, src_fd, b->data, len, start);
+		write_data(c, dst_inode, start, b, len);
 		start += len;
 	}
+
+	for (i = 0; i < COPY_BUFS; i++)
+		closure_sync(&bufs->b[i].cl);
+}
+
+/* Extents are inserted in batches of up to this many u64s of keys: */
+#define LINK_BATCH_U64s		(1 << 16)
+
+static void link_data_flush(struct cache_set *c, struct keylist *keys,
+			    u64 sectors)
+{
+	struct disk_reservation res;
+	int ret;
+
+	ret = bch_disk_reservation_get(c, &res, sectors,
+				       BCH_DISK_RESERVATION_NOFAIL);
+	if (ret)
+		die("error reserving space in new filesystem: %s",
+		    strerror(-ret));
+
+	ret = bch_btree_insert_list(c, BTREE_ID_EXTENTS, keys, &res, NULL, 0);
+	if (ret)
+		die("btree insert error %s", strerror(-ret));
+
+	bch_disk_reservation_put(c, &res);
 }
 
 static void link_data(struct cache_set *c, struct bch_inode_unpacked *dst,
 		      u64 logical, u64 physical, u64 length)
 {
 	struct cache *ca = c->cache[0];
+	u64 inline_keys[BKEY_EXTENT_U64s_MAX * 8];
+	struct keylist keys;
+	u64 batch_sectors = 0;
 
 	BUG_ON(logical	& (block_bytes(c) - 1));
 	BUG_ON(physical & (block_bytes(c) - 1));
@@ -307,19 +446,23 @@ static void link_data(struct cache_set *c, struct bch_inode_unpacked *dst,
 
 	BUG_ON(physical + length > bucket_to_sector(ca, ca->mi.nbuckets));
 
+	bch_keylist_init(&keys, inline_keys, ARRAY_SIZE(inline_keys));
+
 	while (length) {
 		struct bkey_i_extent *e;
-		BKEY_PADDED(k) k;
 		u64 b = sector_to_bucket(ca, physical >> 9);
-		struct disk_reservation res;
 		unsigned sectors;
-		int ret;
 
 		sectors = min(ca->mi.bucket_size -
 			      (physical & (ca->mi.bucket_size - 1)),
 			      length);
 
-		e = bkey_extent_init(&k.k);
+		if (bch_keylist_realloc(&keys, inline_keys,
+					ARRAY_SIZE(inline_keys),
+					BKEY_EXTENT_U64s_MAX))
+			die("insufficient memory");
+
+		e = bkey_extent_init(keys.top);
 		e->k.p.inode	= dst->inum;
 		e->k.p.offset	= logical + sectors;
 		e->k.size	= sectors;
@@ -328,42 +471,63 @@ static void link_data(struct cache_set *c, struct bch_inode_unpacked *dst,
 					.dev = 0,
 					.gen = ca->buckets[b].mark.gen,
 				  });
+		bch_keylist_push(&keys);
+		batch_sectors += sectors;
 
-		ret = bch_disk_reservation_get(c, &res, sectors,
-					       BCH_DISK_RESERVATION_NOFAIL);
-		if (ret)
-			die("error reserving space in new filesystem: %s",
-			    strerror(-ret));
-
-		ret = bch_btree_insert(c, BTREE_ID_EXTENTS, &e->k_i,
-				       &res, NULL, NULL, 0);
-		if (ret)
-			die("btree insert error %s", strerror(-ret));
-
-		bch_disk_reservation_put(c, &res);
+		if (bch_keylist_u64s(&keys) >= LINK_BATCH_U64s) {
+			link_data_flush(c, &keys, batch_sectors);
+			batch_sectors = 0;
+		}
 
 		dst->i_sectors	+= sectors;
 		logical		+= sectors;
 		physical	+= sectors;
 		length		-= sectors;
 	}
+
+	if (!bch_keylist_empty(&keys))
+		link_data_flush(c, &keys, batch_sectors);
+
+	bch_keylist_free(&keys, inline_keys);
 }
 
-static void copy_link(struct cache_set *c, struct bch_inode_unpacked *dst,
-		      char *src)
+static void copy_link(struct copy_fs_state *s, struct cache_set *c,
+		      struct bch_inode_unpacked *dst, char *src)
 {
-	ssize_t ret = readlink(src, buf, sizeof(buf));
+	struct copy_bufs *bufs = copy_bufs_get(s);
+	struct copy_buf *b = &bufs->b[0];
+
+	ssize_t ret = readlink(src, b->data, sizeof(b->data));
 	if (ret < 0)
 		die("readlink error: %s", strerror(errno));
 
-	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
+	memset(b->data + ret, 0, round_up(ret, block_bytes(c)) - ret);
+
+	write_data(c, dst, 0, b, round_up(ret, block_bytes(c)));
+	closure_sync(&b->cl);
+
+	copy_bufs_put(s, bufs);
+}
+
+static bool fiemap_extent_linkable(struct cache_set *c,
+				   struct fiemap_extent *e)
+{
+	return !(e->fe_flags & (FIEMAP_EXTENT_UNKNOWN|
+				FIEMAP_EXTENT_ENCODED|
+				FIEMAP_EXTENT_NOT_ALIGNED|
+				FIEMAP_EXTENT_DATA_INLINE)) &&
+		!(e->fe_logical		& (block_bytes(c) - 1)) &&
+		!(e->fe_physical	& (block_bytes(c) - 1)) &&
+		!(e->fe_length		& (block_bytes(c) - 1));
 }
 
-static void copy_file(struct cache_set *c, struct bch_inode_unpacked *dst,
-		      int src, char *src_path, ranges *extents)
+static void copy_file(struct copy_fs_state *s, struct cache_set *c,
+		      struct bch_inode_unpacked *dst, int src)
 {
+	struct copy_bufs *bufs = NULL;
 	struct fiemap_iter iter;
 	struct fiemap_extent e;
+	u64 done = 0, start, end;
 
 	fiemap_for_each(src, iter, e)
 		if (e.fe_flags & FIEMAP_EXTENT_UNKNOWN) {
@@ -371,39 +535,96 @@ static void copy_file(struct cache_set *c, struct bch_inode_unpacked *dst,
 			break;
 		}
 
+	/*
+	 * Extents are returned in order; @done is where the last one we copied
+	 * or linked ended. Copied extents are rounded out to block boundaries,
+	 * so clip them to what hasn't been copied or linked already - else
+	 * we'd write those blocks, and count their sectors, twice:
+	 */
 	fiemap_for_each(src, iter, e) {
-		if ((e.fe_logical	& (block_bytes(c) - 1)) ||
-		    (e.fe_length	& (block_bytes(c) - 1)))
-			die("Unaligned extent in %s - can't handle", src_path);
-
-		if (e.fe_flags & (FIEMAP_EXTENT_UNKNOWN|
-				  FIEMAP_EXTENT_ENCODED|
-				  FIEMAP_EXTENT_NOT_ALIGNED|
-				  FIEMAP_EXTENT_DATA_INLINE)) {
-			copy_data(c, dst,
-				  src,
-				  round_down(e.fe_logical, block_bytes(c)),
-				  round_up(e.fe_logical + e.fe_length,
-					   block_bytes(c)));
+		if (!fiemap_extent_linkable(c, &e)) {
+			start	= max(done, round_down(e.fe_logical,
+						       block_bytes(c)));
+			end	= round_up(e.fe_logical + e.fe_length,
+					   block_bytes(c));
+			if (start >= end)
+				continue;
+
+			if (!bufs)
+				bufs = copy_bufs_get(s);
+
+			copy_data(c, bufs, dst, src, start, end);
+			done = end;
 			continue;
 		}
 
-		if ((e.fe_physical	& (block_bytes(c) - 1)))
-			die("Unaligned extent in %s - can't handle", src_path);
+		mutex_lock(&s->lock);
+		range_add(&s->extents, e.fe_physical, e.fe_length);
+		mutex_unlock(&s->lock);
 
-		range_add(extents, e.fe_physical, e.fe_length);
 		link_data(c, dst, e.fe_logical, e.fe_physical, e.fe_length);
+		done = e.fe_logical + e.fe_length;
 	}
-}
 
-struct copy_fs_state {
-	u64			bcachefs_inum;
-	dev_t			dev;
+	if (bufs)
+		copy_bufs_put(s, bufs);
+}
 
-	GENRADIX(u64)		hardlinks;
-	ranges			extents;
+struct copy_file_job {
+	struct work_struct	work;
+	struct copy_fs_state	*s;
+	struct cache_set	*c;
+	struct bch_inode_unpacked inode;
+	int			fd;
 };
 
+static void copy_file_work(struct work_struct *work)
+{
+	struct copy_file_job *j =
+		container_of(work, struct copy_file_job, work);
+	struct copy_fs_state *s = j->s;
+	struct bch_inode_unpacked inode;
+	u64 sectors = j->inode.i_sectors;
+
+	copy_file(s, j->c, &j->inode, j->fd);
+	close(j->fd);
+
+	/*
+	 * copy_dir() may have added hardlinks to this inode since it was handed
+	 * to us - so re-read it, and only update i_sectors:
+	 */
+	if (j->inode.i_sectors != sectors) {
+		mutex_lock(&s->inode_lock);
+		int ret = bch_inode_find_by_inum(j->c, j->inode.inum, &inode);
+		if (ret)
+			die("error looking up inode: %s", strerror(-ret));
+
+		inode.i_sectors += j->inode.i_sectors - sectors;
+		update_inode(j->c, &inode);
+		mutex_unlock(&s->inode_lock);
+	}
+
+	free(j);
+	up(&s->jobs);
+}
+
+/* @inode must already have been written out: */
+static void copy_file_async(struct copy_fs_state *s, struct cache_set *c,
+			    struct bch_inode_unpacked *inode, const char *name)
+{
+	struct copy_file_job *j = xmalloc(sizeof(*j));
+
+	down(&s->jobs);
+
+	j->s		= s;
+	j->c		= c;
+	j->inode	= *inode;
+	j->fd		= xopen(name, O_RDONLY|O_NOATIME);
+
+	INIT_WORK(&j->work, copy_file_work);
+	queue_work(s->wq, &j->work);
+}
+
 static void copy_dir(struct copy_fs_state *s,
 		     struct cache_set *c,
 		     struct bch_inode_unpacked *dst,
@@ -437,7 +658,9 @@ static void copy_dir(struct copy_fs_state *s,
 			: NULL;
 
 		if (dst_inum && *dst_inum) {
+			mutex_lock(&s->inode_lock);
 			create_link(c, dst, d->d_name, *dst_inum, S_IFREG);
+			mutex_unlock(&s->inode_lock);
 			goto next;
 		}
 
@@ -461,15 +684,11 @@ static void copy_dir(struct copy_fs_state *s,
 			break;
 		case DT_REG:
 			inode.i_size = stat.st_size;
-
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_file(c, &inode, fd, child_path, &s->extents);
-			close(fd);
 			break;
 		case DT_LNK:
 			inode.i_size = stat.st_size;
 
-			copy_link(c, &inode, d->d_name);
+			copy_link(s, c, &inode, d->d_name);
 			break;
 		case DT_FIFO:
 		case DT_CHR:
@@ -483,6 +702,9 @@ static void copy_dir(struct copy_fs_state *s,
 		}
 
 		update_inode(c, &inode);
+
+		if (S_ISREG(stat.st_mode))
+			copy_file_async(s, c, &inode, d->d_name);
 next:
 		free(child_path);
 	}
@@ -581,10 +803,27 @@ static void copy_fs(struct cache_set *c, int src_fd, const char *src_path,
 		.dev		= stat.st_dev,
 		.extents	= *extents,
 	};
+	struct copy_bufs *bufs;
+
+	s.wq = alloc_workqueue("bcache_migrate", WQ_UNBOUND, 0);
+	if (!s.wq)
+		die("insufficient memory");
+
+	sema_init(&s.jobs, COPY_JOBS_MAX);
+	mutex_init(&s.lock);
+	mutex_init(&s.inode_lock);
 
 	/* now, copy: */
 	copy_dir(&s, c, &root_inode, src_fd, src_path);
 
+	/* wait for outstanding file copies: */
+	destroy_workqueue(s.wq);
+
+	while ((bufs = s.free_bufs)) {
+		s.free_bufs = bufs->next;
+		free(bufs);
+	}
+
 	reserve_old_fs_space(c, &root_inode, &s.extents);
 
 	update_inode(c, &root_inode);
@@ -619,6 +858,9 @@ static void migrate_usage(void)
 	     "      --encrypted        Enable whole filesystem encryption (chacha20/poly1305)\n"
 	     "      --no_passphrase    Don't encrypt master encryption key\n"
 	     "  -F                     Force, even if metadata file already exists\n"
+	     "  -B                     Use buffered IO instead of O_DIRECT\n"
+	     "      --stats            Print latency, mempool and slab statistics for\n"
+	     "                         the copy and fsck\n"
 	     "  -h                     Display this help and exit\n"
 	     "Report bugs to <linux-bcache@vger.kernel.org>");
 }
@@ -626,6 +868,7 @@ static void migrate_usage(void)
 static const struct option migrate_opts[] = {
 	{ "encrypted",		no_argument, NULL, 'e' },
 	{ "no_passphrase",	no_argument, NULL, 'p' },
+	{ "stats",		no_argument, NULL, 'S' },
 	{ NULL }
 };
 
@@ -634,10 +877,11 @@ int cmd_migrate(int argc, char *argv[])
 	struct format_opts format_opts = format_opts_default();
 	char *fs_path = NULL;
 	unsigned block_size;
-	bool no_passphrase = false, force = false;
+	bool no_passphrase = false, force = false, buffered_io = false;
+	bool stats = false;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "f:Fh",
+	while ((opt = getopt_long(argc, argv, "f:FBh",
 				  migrate_opts, NULL)) != -1)
 		switch (opt) {
 		case 'f':
@@ -652,6 +896,12 @@ int cmd_migrate(int argc, char *argv[])
 		case 'F':
 			force = true;
 			break;
+		case 'B':
+			buffered_io = true;
+			break;
+		case 'S':
+			stats = true;
+			break;
 		case 'h':
 			migrate_usage();
 			exit(EXIT_SUCCESS);
@@ -741,6 +991,9 @@ int cmd_migrate(int argc, char *argv[])
 	opts.nostart	= true;
 	opts.noexcl	= true;
 
+	if (buffered_io)
+		opts.buffered_io = true;
+
 	err = bch_fs_open(path, 1, opts, &c);
 	if (err)
 		die("Error opening new filesystem: %s", err);
@@ -753,6 +1006,9 @@ int cmd_migrate(int argc, char *argv[])
 
 	copy_fs(c, fs_fd, fs_path, bcachefs_inum, &extents);
 
+	if (stats)
+		bcache_fs_stats_print(c, stdout);
+
 	bch_fs_stop(c);
 
 	printf("Migrate complete, running fsck:\n");
@@ -764,6 +1020,9 @@ int cmd_migrate(int argc, char *argv[])
 	if (err)
 		die("Error opening new filesystem: %s", err);
 
+	if (stats)
+		bcache_fs_stats_print(c, stdout);
+
 	bch_fs_stop(c);
 	printf("fsck complete\n");
 	return 0;
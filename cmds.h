@@ -29,6 +29,7 @@ int cmd_fsck(int argc, char *argv[]);
 
 int cmd_dump(int argc, char *argv[]);
 int cmd_list(int argc, char *argv[]);
+int cmd_trace(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
@@ -10,6 +10,9 @@
 #define xchg_acquire(p, v)					\
 	__atomic_exchange_n(p, v, __ATOMIC_ACQUIRE)
 
+#define xchg_release(p, v)					\
+	__atomic_exchange_n(p, v, __ATOMIC_RELEASE)
+
 #define cmpxchg(p, old, new)					\
 ({								\
 	typeof(*(p)) __old = (old);				\
@@ -976,6 +976,8 @@ LE64_BITMASK(BCH_SB_DATA_REPLICAS_REQ,	struct bch_sb, flags[1], 24, 28);
 enum bch_sb_features {
 	BCH_FEATURE_LZ4			= 0,
 	BCH_FEATURE_GZIP		= 1,
+	BCH_FEATURE_JOURNAL_GENS	= 2,
+	BCH_FEATURE_NR,
 };
 
 /* options: */
@@ -1172,8 +1174,24 @@ enum {
 	 * recover we don't think there was a missing journal entry.
 	 */
 	JOURNAL_ENTRY_JOURNAL_SEQ_BLACKLISTED = 3,
+
+	/*
+	 * With BCH_FEATURE_JOURNAL_GENS, the new gens of buckets the allocator
+	 * has invalidated are journalled, instead of rewriting all the prios
+	 * every time - they're only rewritten when the journal needs the
+	 * space. An array of struct bch_bucket_gen:
+	 */
+	JOURNAL_ENTRY_BUCKET_GENS	= 4,
 };
 
+struct bch_bucket_gen {
+	__le64			v;
+};
+
+LE64_BITMASK(BUCKET_GEN_BUCKET,	struct bch_bucket_gen, v,  0, 48);
+LE64_BITMASK(BUCKET_GEN_DEV,	struct bch_bucket_gen, v, 48, 56);
+LE64_BITMASK(BUCKET_GEN_GEN,	struct bch_bucket_gen, v, 56, 64);
+
 /*
  * On disk format for a journal entry:
  * seq is monotonically increasing; every journal entry has its own unique
@@ -230,24 +230,29 @@ static inline struct bio *bio_next_split(struct bio *bio, int sectors,
 	return bio_split(bio, sectors, gfp, bs);
 }
 
+/* bios with up to this many vecs are allocated from the bio_set's slab: */
+#define BIO_INLINE_VECS		4
+
 struct bio_set {
 	unsigned int front_pad;
+	struct kmem_cache *bio_slab;
+	mempool_t bio_pool;
 };
 
-static inline void bioset_exit(struct bio_set *bs) {}
+static inline void bioset_exit(struct bio_set *bs)
+{
+	mempool_exit(&bs->bio_pool);
+	kmem_cache_destroy(bs->bio_slab);
+	bs->bio_slab = NULL;
+}
 
 static inline void bioset_free(struct bio_set *bs)
 {
+	bioset_exit(bs);
 	kfree(bs);
 }
 
-static inline int bioset_init(struct bio_set *bs,
-			      unsigned pool_size,
-			      unsigned front_pad)
-{
-	bs->front_pad = front_pad;
-	return 0;
-}
+extern int bioset_init(struct bio_set *, unsigned, unsigned);
 
 extern struct bio_set *bioset_create(unsigned int, unsigned int);
 extern struct bio_set *bioset_create_nobvec(unsigned int, unsigned int);
@@ -89,6 +89,8 @@ struct bio {
  */
 #define BIO_RESET_BITS	10
 
+#define BIO_MEMPOOLED	10	/* allocated from bi_pool's mempool */
+
 /*
  * We support 6 different bvec pools, the last one is magic in that it
  * is backed by a mempool.
@@ -40,6 +40,8 @@ struct user_namespace;
 #define FMODE_32BITHASH         ((__force fmode_t)0x200)
 /* 64bit hashes as llseek() offset (for directories) */
 #define FMODE_64BITHASH         ((__force fmode_t)0x400)
+/* userspace only: don't open with O_DIRECT, go through the page cache */
+#define FMODE_BUFFERED		((__force fmode_t)0x800)
 
 struct inode {
 	unsigned long		i_ino;
@@ -63,16 +65,26 @@ struct request_queue {
 };
 
 struct gendisk {
+	int			major;
+	int			first_minor;
 };
 
 struct block_device {
 	char			name[BDEVNAME_SIZE];
+	dev_t			bd_dev;
 	struct inode		*bd_inode;
 	struct request_queue	queue;
 	void			*bd_holder;
 	struct gendisk		*bd_disk;
 	struct gendisk		__bd_disk;
+	fmode_t			bd_mode;
 	int			bd_fd;
+	/*
+	 * Same device without O_DIRECT, for IO that isn't aligned to
+	 * bd_dio_align - equal to bd_fd if we're not doing direct IO at all:
+	 */
+	int			bd_buffered_fd;
+	unsigned		bd_dio_align;
 };
 
 void generic_make_request(struct bio *);
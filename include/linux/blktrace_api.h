@@ -0,0 +1,8 @@
+#ifndef __TOOLS_LINUX_BLKTRACE_API_H
+#define __TOOLS_LINUX_BLKTRACE_API_H
+
+#include <linux/types.h>
+
+extern void blk_fill_rwbs(char *rwbs, unsigned int op, u32 rw, int bytes);
+
+#endif /* __TOOLS_LINUX_BLKTRACE_API_H */
@@ -0,0 +1,23 @@
+#ifndef __TOOLS_LINUX_EXECMEM_H
+#define __TOOLS_LINUX_EXECMEM_H
+
+#include <linux/types.h>
+
+/*
+ * Small allocations of executable memory, for code generated at runtime.
+ *
+ * Memory is never writable and executable at the same address: the arena is
+ * a memfd mapped twice, read/execute for callers and read/write for
+ * text_poke_copy(), which is the only way to write to an allocation.
+ *
+ * Allocations are fixed size slots of EXECMEM_SLOT_SIZE bytes; execmem_alloc()
+ * returns NULL if the arena can't be set up (e.g. no memfd_create()), and
+ * callers are expected to fall back to code that isn't generated.
+ */
+#define EXECMEM_SLOT_SIZE	256
+
+void *execmem_alloc(size_t size);
+void execmem_free(void *ptr);
+void *text_poke_copy(void *addr, const void *src, size_t len);
+
+#endif /* __TOOLS_LINUX_EXECMEM_H */
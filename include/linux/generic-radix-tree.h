@@ -105,6 +105,13 @@ static inline void genradix_iter_init(struct genradix_iter *iter)
 	iter->pos	= 0;
 }
 
+/* Position @_iter at @_idx, for starting a walk partway through: */
+#define genradix_iter_seek(_iter, _radix, _idx)			\
+do {								\
+	(_iter)->offset	= __genradix_idx_to_offset(_radix, _idx);	\
+	(_iter)->pos	= (_idx);				\
+} while (0)
+
 void *__genradix_iter_peek(struct genradix_iter *, struct __genradix *, size_t);
 
 #define genradix_iter_peek(_iter, _radix)			\
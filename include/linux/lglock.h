@@ -1,18 +1,70 @@
 #ifndef __TOOLS_LINUX_LGLOCK_H
 #define __TOOLS_LINUX_LGLOCK_H
 
+#include <errno.h>
 #include <pthread.h>
 
+#include <linux/percpu.h>
+
+/*
+ * One mutex per cpu slot: the local lock only takes this thread's slot's mutex
+ * (it's a mutex and not just preemption being disabled because threads share a
+ * slot when there's more threads than cpus), the global lock takes all of them.
+ */
 struct lglock {
-	pthread_mutex_t lock;
+	pthread_mutex_t __percpu	*lock;
 };
 
-#define lg_lock_free(l)		do {} while (0)
-#define lg_lock_init(l)		pthread_mutex_init(&(l)->lock, NULL)
+static inline int lg_lock_init(struct lglock *lg)
+{
+	unsigned cpu;
+
+	lg->lock = alloc_percpu(pthread_mutex_t);
+	if (!lg->lock)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		pthread_mutex_init(per_cpu_ptr(lg->lock, cpu), NULL);
+	return 0;
+}
+
+static inline void lg_lock_free(struct lglock *lg)
+{
+	unsigned cpu;
+
+	if (!lg->lock)
+		return;
+
+	for_each_possible_cpu(cpu)
+		pthread_mutex_destroy(per_cpu_ptr(lg->lock, cpu));
+	free_percpu(lg->lock);
+	lg->lock = NULL;
+}
+
+static inline void lg_local_lock(struct lglock *lg)
+{
+	pthread_mutex_lock(this_cpu_ptr(lg->lock));
+}
+
+static inline void lg_local_unlock(struct lglock *lg)
+{
+	pthread_mutex_unlock(this_cpu_ptr(lg->lock));
+}
+
+static inline void lg_global_lock(struct lglock *lg)
+{
+	unsigned cpu;
+
+	for_each_possible_cpu(cpu)
+		pthread_mutex_lock(per_cpu_ptr(lg->lock, cpu));
+}
+
+static inline void lg_global_unlock(struct lglock *lg)
+{
+	unsigned cpu;
 
-#define lg_local_lock(l)	pthread_mutex_lock(&(l)->lock)
-#define lg_local_unlock(l)	pthread_mutex_unlock(&(l)->lock)
-#define lg_global_lock(l)	pthread_mutex_lock(&(l)->lock)
-#define lg_global_unlock(l)	pthread_mutex_unlock(&(l)->lock)
+	for_each_possible_cpu(cpu)
+		pthread_mutex_unlock(per_cpu_ptr(lg->lock, cpu));
+}
 
 #endif /* __TOOLS_LINUX_LGLOCK_H */
@@ -6,78 +6,135 @@
 
 #include <linux/compiler.h>
 #include <linux/bug.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
 struct kmem_cache;
 
+typedef void * (mempool_alloc_t)(gfp_t gfp_mask, void *pool_data);
+typedef void (mempool_free_t)(void *element, void *pool_data);
+
+/*
+ * Elements freed to a pool go to refill the reserve of min_nr elements first,
+ * then to a small per cpu cache that mempool_alloc() takes from before going to
+ * the allocator - so a pool that's in steady use doesn't allocate at all.
+ */
+#define MEMPOOL_CACHE_MAX	8
+#define MEMPOOL_CACHE_BYTES	(256U << 10)
+
+struct mempool_cache {
+	spinlock_t		lock;
+	unsigned		nr;
+	void			*elements[MEMPOOL_CACHE_MAX];
+};
+
+struct mempool_stats {
+	atomic64_t		alloc;		/* missed the cache: allocated */
+	atomic64_t		reserve;	/* allocation failed: used reserve */
+	atomic64_t		wait;		/* reserve empty: waited */
+};
+
 typedef struct mempool_s {
-	size_t		elem_size;
+	int			min_nr;
+	unsigned		cache_nr;
+	void			*pool_data;
+	mempool_alloc_t		*alloc;
+	mempool_free_t		*free;
+
+	/*
+	 * The reserve is a lock free stack of slots holding elements, and a
+	 * stack of empty slots: the stack heads are slot index + 1 in the low
+	 * 32 bits, and a generation number in the high bits against ABA.
+	 */
+	void			**slots;
+	u32			*next;
+	u64			full;
+	u64			empty;
+
+	struct mempool_cache __percpu *cache;
+	wait_queue_head_t	wait;
+
+	struct mempool_stats	stats;
 } mempool_t;
 
 static inline bool mempool_initialized(mempool_t *pool)
 {
-	return true;
+	return pool->alloc != NULL;
 }
 
-extern int mempool_resize(mempool_t *pool, int new_min_nr);
+int __mempool_init(mempool_t *, int, mempool_alloc_t *, mempool_free_t *,
+		   void *, size_t);
+void mempool_exit(mempool_t *);
+
+mempool_t *__mempool_create(int, mempool_alloc_t *, mempool_free_t *,
+			    void *, size_t);
+void mempool_destroy(mempool_t *);
 
-static inline void mempool_free(void *element, mempool_t *pool)
+static inline int mempool_init(mempool_t *pool, int min_nr,
+			       mempool_alloc_t *alloc_fn,
+			       mempool_free_t *free_fn, void *pool_data)
 {
-	free(element);
+	return __mempool_init(pool, min_nr, alloc_fn, free_fn, pool_data, 0);
 }
 
-static inline void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask) __malloc
+static inline mempool_t *mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
+					mempool_free_t *free_fn,
+					void *pool_data)
 {
-	BUG_ON(!pool->elem_size);
-	return kmalloc(pool->elem_size, gfp_mask);
+	return __mempool_create(min_nr, alloc_fn, free_fn, pool_data, 0);
 }
+extern int mempool_resize(mempool_t *pool, int new_min_nr);
 
-static inline void mempool_exit(mempool_t *pool) {}
+void *mempool_alloc(mempool_t *, gfp_t) __malloc;
+void mempool_free(void *, mempool_t *);
 
-static inline void mempool_destroy(mempool_t *pool)
-{
-	free(pool);
-}
+void *mempool_alloc_slab(gfp_t, void *);
+void mempool_free_slab(void *, void *);
+void *mempool_kmalloc(gfp_t, void *);
+void mempool_kfree(void *, void *);
+void *mempool_alloc_pages(gfp_t, void *);
+void mempool_free_pages(void *, void *);
 
 static inline int
 mempool_init_slab_pool(mempool_t *pool, int min_nr, struct kmem_cache *kc)
 {
-	pool->elem_size = 0;
-	return 0;
+	return __mempool_init(pool, min_nr, mempool_alloc_slab,
+			      mempool_free_slab, kc, kmem_cache_size(kc));
 }
 
 static inline mempool_t *
 mempool_create_slab_pool(int min_nr, struct kmem_cache *kc)
 {
-	mempool_t *pool = malloc(sizeof(*pool));
-	pool->elem_size = 0;
-	return pool;
+	return __mempool_create(min_nr, mempool_alloc_slab,
+				mempool_free_slab, kc, kmem_cache_size(kc));
 }
 
 static inline int mempool_init_kmalloc_pool(mempool_t *pool, int min_nr, size_t size)
 {
-	pool->elem_size = size;
-	return 0;
+	return __mempool_init(pool, min_nr, mempool_kmalloc, mempool_kfree,
+			      (void *) size, size);
 }
 
 static inline mempool_t *mempool_create_kmalloc_pool(int min_nr, size_t size)
 {
-	mempool_t *pool = malloc(sizeof(*pool));
-	pool->elem_size = size;
-	return pool;
+	return __mempool_create(min_nr, mempool_kmalloc, mempool_kfree,
+				(void *) size, size);
 }
 
 static inline int mempool_init_page_pool(mempool_t *pool, int min_nr, int order)
 {
-	pool->elem_size = PAGE_SIZE << order;
-	return 0;
+	return __mempool_init(pool, min_nr, mempool_alloc_pages,
+			      mempool_free_pages, (void *) (long) order,
+			      PAGE_SIZE << order);
 }
 
 static inline mempool_t *mempool_create_page_pool(int min_nr, int order)
 {
-	mempool_t *pool = malloc(sizeof(*pool));
-	pool->elem_size = PAGE_SIZE << order;
-	return pool;
+	return __mempool_create(min_nr, mempool_alloc_pages,
+				mempool_free_pages, (void *) (long) order,
+				PAGE_SIZE << order);
 }
 
 #endif /* _LINUX_MEMPOOL_H */
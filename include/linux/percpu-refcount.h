@@ -4,6 +4,7 @@
 #include <linux/atomic.h>
 #include <linux/kernel.h>
 #include <linux/percpu.h>
+#include <linux/rcupdate.h>
 
 struct percpu_ref;
 typedef void (percpu_ref_func_t)(struct percpu_ref *);
@@ -36,33 +37,61 @@ enum {
 
 struct percpu_ref {
 	atomic_long_t		count;
+	/*
+	 * The low bit of the pointer indicates whether the ref is in percpu
+	 * mode; if set, then get/put will manipulate the atomic_t.
+	 */
+	unsigned long		percpu_count_ptr;
 	percpu_ref_func_t	*release;
 	percpu_ref_func_t	*confirm_switch;
+	bool			force_atomic:1;
+	struct rcu_head		rcu;
 };
 
-static inline void percpu_ref_exit(struct percpu_ref *ref) {}
-
-static inline int __must_check percpu_ref_init(struct percpu_ref *ref,
+int __must_check percpu_ref_init(struct percpu_ref *ref,
 				 percpu_ref_func_t *release, unsigned int flags,
-				 gfp_t gfp)
-{
-	unsigned long start_count = 0;
+				 gfp_t gfp);
+void percpu_ref_exit(struct percpu_ref *ref);
+void percpu_ref_switch_to_atomic(struct percpu_ref *ref,
+				 percpu_ref_func_t *confirm_switch);
+void percpu_ref_switch_to_percpu(struct percpu_ref *ref);
+void percpu_ref_kill_and_confirm(struct percpu_ref *ref,
+				 percpu_ref_func_t *confirm_kill);
+void percpu_ref_reinit(struct percpu_ref *ref);
 
-	if (!(flags & PERCPU_REF_INIT_DEAD))
-		start_count++;
-
-	atomic_long_set(&ref->count, start_count);
-
-	ref->release = release;
-	return 0;
+/**
+ * percpu_ref_kill - drop the initial ref
+ * @ref: percpu_ref to kill
+ *
+ * Must be used to drop the initial ref on a percpu refcount; must be called
+ * precisely once before shutdown.
+ *
+ * Puts @ref in the atomic mode; the percpu counts are folded into the atomic
+ * counter after an RCU grace period, and @ref is released once that and the
+ * initial ref are both gone.
+ */
+static inline void percpu_ref_kill(struct percpu_ref *ref)
+{
+	percpu_ref_kill_and_confirm(ref, NULL);
 }
 
-static inline void percpu_ref_switch_to_atomic(struct percpu_ref *ref,
-				 percpu_ref_func_t *confirm_switch) {}
+/*
+ * Internal helper.  Don't use outside percpu-refcount proper.  The
+ * function doesn't return the pointer and let the caller test it for NULL
+ * because doing so forces the compiler to generate two conditional
+ * branches as it can't assume that @ref->percpu_count is not NULL.
+ */
+static inline bool __ref_is_percpu(struct percpu_ref *ref,
+				   unsigned long __percpu **percpu_countp)
+{
+	unsigned long percpu_ptr = READ_ONCE(ref->percpu_count_ptr);
 
-static inline void percpu_ref_switch_to_percpu(struct percpu_ref *ref) {}
+	if (unlikely(percpu_ptr & __PERCPU_REF_ATOMIC_DEAD))
+		return false;
 
-static inline void percpu_ref_reinit(struct percpu_ref *ref) {}
+	*percpu_countp = (unsigned long __percpu *)percpu_ptr;
+	return true;
+}
 
 /**
  * percpu_ref_get_many - increment a percpu refcount
@@ -75,7 +104,16 @@ static inline void percpu_ref_reinit(struct percpu_ref *ref) {}
  */
 static inline void percpu_ref_get_many(struct percpu_ref *ref, unsigned long nr)
 {
-	atomic_long_add(nr, &ref->count);
+	unsigned long __percpu *percpu_count;
+
+	rcu_read_lock();
+
+	if (__ref_is_percpu(ref, &percpu_count))
+		this_cpu_add(*percpu_count, nr);
+	else
+		atomic_long_add(nr, &ref->count);
+
+	rcu_read_unlock();
 }
 
 /**
@@ -102,7 +140,21 @@ static inline void percpu_ref_get(struct percpu_ref *ref)
  */
 static inline bool percpu_ref_tryget(struct percpu_ref *ref)
 {
-	return atomic_long_inc_not_zero(&ref->count);
+	unsigned long __percpu *percpu_count;
+	bool ret;
+
+	rcu_read_lock();
+
+	if (__ref_is_percpu(ref, &percpu_count)) {
+		this_cpu_inc(*percpu_count);
+		ret = true;
+	} else {
+		ret = atomic_long_inc_not_zero(&ref->count);
+	}
+
+	rcu_read_unlock();
+
+	return ret;
 }
 
 /**
@@ -122,7 +174,21 @@ static inline bool percpu_ref_tryget(struct percpu_ref *ref)
  */
 static inline bool percpu_ref_tryget_live(struct percpu_ref *ref)
 {
-	return atomic_long_inc_not_zero(&ref->count);
+	unsigned long __percpu *percpu_count;
+	bool ret = false;
+
+	rcu_read_lock();
+
+	if (__ref_is_percpu(ref, &percpu_count)) {
+		this_cpu_inc(*percpu_count);
+		ret = true;
+	} else if (!(ref->percpu_count_ptr & __PERCPU_REF_DEAD)) {
+		ret = atomic_long_inc_not_zero(&ref->count);
+	}
+
+	rcu_read_unlock();
+
+	return ret;
 }
 
 /**
@@ -137,8 +203,16 @@ static inline bool percpu_ref_tryget_live(struct percpu_ref *ref)
  */
 static inline void percpu_ref_put_many(struct percpu_ref *ref, unsigned long nr)
 {
-	if (unlikely(atomic_long_sub_and_test(nr, &ref->count)))
+	unsigned long __percpu *percpu_count;
+
+	rcu_read_lock();
+
+	if (__ref_is_percpu(ref, &percpu_count))
+		this_cpu_sub(*percpu_count, nr);
+	else if (unlikely(atomic_long_sub_and_test(nr, &ref->count)))
 		ref->release(ref);
+
+	rcu_read_unlock();
 }
 
 /**
@@ -155,18 +229,6 @@ static inline void percpu_ref_put(struct percpu_ref *ref)
 	percpu_ref_put_many(ref, 1);
 }
 
-/**
- * percpu_ref_kill - drop the initial ref
- * @ref: percpu_ref to kill
- *
- * Must be used to drop the initial ref on a percpu refcount; must be called
- * precisely once before shutdown.
- */
-static inline void percpu_ref_kill(struct percpu_ref *ref)
-{
-	percpu_ref_put(ref);
-}
-
 /**
  * percpu_ref_is_zero - test whether a percpu refcount reached zero
  * @ref: percpu_ref to test
@@ -177,12 +239,22 @@ static inline void percpu_ref_kill(struct percpu_ref *ref)
  */
 static inline bool percpu_ref_is_zero(struct percpu_ref *ref)
 {
+	unsigned long __percpu *percpu_count;
+
+	if (__ref_is_percpu(ref, &percpu_count))
+		return false;
 	return !atomic_long_read(&ref->count);
 }
 
+/**
+ * percpu_ref_is_dying - test whether a percpu refcount is dying or dead
+ * @ref: percpu_ref to test
+ *
+ * Returns %true if @ref is dying or dead.
+ */
 static inline bool percpu_ref_is_dying(struct percpu_ref *ref)
 {
-	return percpu_ref_is_zero(ref);
+	return ref->percpu_count_ptr & __PERCPU_REF_DEAD;
 }
 
 #endif /* __TOOLS_LINUX_PERCPU_REFCOUNT_H */
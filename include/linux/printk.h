@@ -40,7 +40,28 @@ static inline int scnprintf(char * buf, size_t size, const char * fmt, ...)
        return (i >= ssize) ? (ssize - 1) : i;
 }
 
-#define printk(...)	printf(__VA_ARGS__)
+/*
+ * printk() output from a thread with printk_capture set is appended to that
+ * buffer instead of going to stdout, so that work run in parallel can have its
+ * messages printed afterwards in a stable order:
+ */
+struct printk_capture {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+};
+
+extern __thread struct printk_capture *printk_capture;
+
+int __printk_capture(const char *, ...)
+	__attribute__((format(printf, 1, 2)));
+void printk_capture_flush(struct printk_capture *);
+void printk_capture_discard(struct printk_capture *);
+
+#define printk(...)							\
+	(printk_capture							\
+	 ? __printk_capture(__VA_ARGS__)				\
+	 : printf(__VA_ARGS__))
 
 #define no_printk(fmt, ...)				\
 ({							\
@@ -3,26 +3,90 @@
 
 #include <pthread.h>
 
+#include <linux/cache.h>
+#include <linux/compiler.h>
+#include <linux/percpu.h>
+
+/*
+ * Reader biased rw semaphore: readers only touch their own cpu slot's count,
+ * unless a writer is pending, in which case they back off and wait for it.
+ * Writers set ->writer, then wait for the reader counts to drain to zero.
+ *
+ * The read counts live in the rwsem (rather than in a percpu allocation) so
+ * that DECLARE_RWSEM() still works; slots beyond RWSEM_READER_SHARDS share a
+ * count. A count can go negative if up_read() is called from a different
+ * thread than down_read(), but only the sum matters.
+ */
+#define RWSEM_READER_SHARDS	16
+
 struct rw_semaphore {
-	pthread_rwlock_t	lock;
+	struct {
+		long		count;
+	} ____cacheline_aligned	readers[RWSEM_READER_SHARDS];
+
+	int			writer;
+	pthread_mutex_t		writer_lock;	/* serializes writers */
+	pthread_mutex_t		wait_lock;
+	pthread_cond_t		wait;
 };
 
 #define __RWSEM_INITIALIZER(name)				\
-	{ .lock = PTHREAD_RWLOCK_INITIALIZER }
+	{							\
+		.writer_lock	= PTHREAD_MUTEX_INITIALIZER,	\
+		.wait_lock	= PTHREAD_MUTEX_INITIALIZER,	\
+		.wait		= PTHREAD_COND_INITIALIZER,	\
+	}
 
 #define DECLARE_RWSEM(name) \
 	struct rw_semaphore name = __RWSEM_INITIALIZER(name)
 
-static inline void init_rwsem(struct rw_semaphore *lock)
+static inline void init_rwsem(struct rw_semaphore *sem)
+{
+	*sem = (struct rw_semaphore) __RWSEM_INITIALIZER(*sem);
+}
+
+void __down_read(struct rw_semaphore *);
+void __rwsem_wake(struct rw_semaphore *);
+void down_write(struct rw_semaphore *);
+void up_write(struct rw_semaphore *);
+
+static inline long *rwsem_reader_count(struct rw_semaphore *sem)
+{
+	return &sem->readers[raw_smp_processor_id() &
+			     (RWSEM_READER_SHARDS - 1)].count;
+}
+
+/*
+ * The increment of our read count and the check of ->writer are both seq_cst,
+ * and so are the writer's store to ->writer and its reads of the counts: either
+ * we see the writer, or the writer sees our count.
+ */
+static inline bool down_read_trylock(struct rw_semaphore *sem)
 {
-	pthread_rwlock_init(&lock->lock, NULL);
+	long *count = rwsem_reader_count(sem);
+
+	__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+
+	if (likely(!__atomic_load_n(&sem->writer, __ATOMIC_SEQ_CST)))
+		return true;
+
+	__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+	__rwsem_wake(sem);
+	return false;
 }
 
-#define down_read(l)		pthread_rwlock_rdlock(&(l)->lock)
-#define down_read_trylock(l)	(!pthread_rwlock_tryrdlock(&(l)->lock))
-#define up_read(l)		pthread_rwlock_unlock(&(l)->lock)
+static inline void down_read(struct rw_semaphore *sem)
+{
+	if (unlikely(!down_read_trylock(sem)))
+		__down_read(sem);
+}
+
+static inline void up_read(struct rw_semaphore *sem)
+{
+	__atomic_sub_fetch(rwsem_reader_count(sem), 1, __ATOMIC_SEQ_CST);
 
-#define down_write(l)		pthread_rwlock_wrlock(&(l)->lock)
-#define up_write(l)		pthread_rwlock_unlock(&(l)->lock)
+	if (unlikely(__atomic_load_n(&sem->writer, __ATOMIC_SEQ_CST)))
+		__rwsem_wake(sem);
+}
 
 #endif /* __TOOLS_LINUX_RWSEM_H */
@@ -12,14 +12,50 @@
 #define ARCH_KMALLOC_MINALIGN		16
 #define KMALLOC_MAX_SIZE		SIZE_MAX
 
+/*
+ * kmalloc() sizes up to KMALLOC_MAX_CACHE_SIZE come from power of two size
+ * class caches, bigger allocations from malloc(); kfree() works on either.
+ */
+#define KMALLOC_SHIFT_LOW		4
+#define KMALLOC_SHIFT_HIGH		(PAGE_SHIFT + 5)
+#define KMALLOC_MAX_CACHE_SIZE		(1UL << KMALLOC_SHIFT_HIGH)
+
+#define SLAB_HWCACHE_ALIGN		0x00002000UL
+#define SLAB_PANIC			0x00040000UL
+#define SLAB_RECLAIM_ACCOUNT		0x00020000UL
+
+struct kmem_cache_stats {
+	u64			nr_objs;	/* allocated from the backing */
+	u64			nr_active;	/* currently allocated */
+	u64			allocs;
+	u64			hits;		/* allocs from per cpu magazine */
+	u64			misses;		/* allocs that went to the depot */
+};
+
+struct kmem_cache *kmem_cache_create(const char *, size_t, size_t,
+				     unsigned long, void (*)(void *));
+void kmem_cache_destroy(struct kmem_cache *);
+size_t kmem_cache_size(struct kmem_cache *);
+const char *kmem_cache_name(struct kmem_cache *);
+void kmem_cache_for_each(void (*)(struct kmem_cache *, void *), void *);
+void kmem_cache_stats(struct kmem_cache *, struct kmem_cache_stats *);
+
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t) __malloc;
+void kmem_cache_free(struct kmem_cache *, void *);
+
+#define kmem_cache_zalloc(s, flags)	kmem_cache_alloc(s, (flags)|__GFP_ZERO)
+
+#define KMEM_CACHE(__struct, __flags)					\
+	kmem_cache_create(#__struct, sizeof(struct __struct),		\
+			  __alignof__(struct __struct), (__flags), NULL)
+
+void *__kmalloc(size_t, gfp_t) __malloc;
+void kfree(const void *);
+size_t ksize(const void *);
+
 static inline void *kmalloc(size_t size, gfp_t flags)
 {
-	void *p = malloc(size);
-
-	if (p && (flags & __GFP_ZERO))
-		memset(p, 0, size);
-
-	return p;
+	return __kmalloc(size, flags);
 }
 
 static inline void *krealloc(void *old, size_t size, gfp_t flags)
@@ -29,32 +65,42 @@ static inline void *krealloc(void *old, size_t size, gfp_t flags)
 	if (new && (flags & __GFP_ZERO))
 		memset(new, 0, size);
 
-	if (new) {
-		memcpy(new, old,
-		       min(malloc_usable_size(old),
-			   malloc_usable_size(new)));
-		free(old);
+	/* krealloc(NULL, ...) is kmalloc(): don't pass NULL to memcpy() */
+	if (new && old) {
+		memcpy(new, old, min(ksize(old), ksize(new)));
+		kfree(old);
 	}
 
 	return new;
 }
 
-#define kzalloc(size, flags)		calloc(1, size)
-#define kcalloc(n, size, flags)		calloc(n, size)
-#define kmalloc_array(n, size, flags)	calloc(n, size)
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	if (size && n > SIZE_MAX / size)
+		return NULL;
+
+	return kmalloc(n * size, flags|__GFP_ZERO);
+}
+
+#define kzalloc(size, flags)		kmalloc(size, (flags)|__GFP_ZERO)
+#define kcalloc(n, size, flags)		kmalloc_array(n, size, flags)
 
 #define vmalloc(size)			malloc(size)
 #define vzalloc(size)			calloc(1, size)
 
-#define kfree(p)			free(p)
-#define kvfree(p)			free(p)
-#define kzfree(p)			free(p)
+#define kvfree(p)			kfree(p)
+#define kzfree(p)			kfree(p)
 
+/* Orders up to KMALLOC_SHIFT_HIGH come from the (naturally aligned) kmalloc caches: */
 static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
 {
 	size_t size = PAGE_SIZE << order;
-	void *p = memalign(PAGE_SIZE, size);
+	void *p;
+
+	if (size <= KMALLOC_MAX_CACHE_SIZE)
+		return kmalloc(size, flags);
 
+	p = memalign(PAGE_SIZE, size);
 	if (p && (flags & __GFP_ZERO))
 		memset(p, 0, size);
 
@@ -69,13 +115,13 @@ static inline struct page *alloc_pages(gfp_t flags, unsigned int order)
 #define __free_pages(page, order)			\
 do {							\
 	(void) order;					\
-	free(page);					\
+	kfree(page);					\
 } while (0)
 
 #define free_pages(addr, order)				\
 do {							\
 	(void) order;					\
-	free((void *) (addr));				\
+	kfree((void *) (addr));				\
 } while (0)
 
 #define __free_page(page) __free_pages((page), 0)
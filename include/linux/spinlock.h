@@ -3,26 +3,47 @@
 
 #include <linux/atomic.h>
 
+/*
+ * Unlike in the kernel, the holder of a spinlock can be preempted - so after
+ * spinning for a bit we give up and sleep on a futex:
+ *
+ * count is 0 when unlocked, 1 when locked, and 2 when locked and there may be
+ * sleeping waiters that unlock has to wake up.
+ */
 typedef struct {
 	int		count;
 } raw_spinlock_t;
 
 #define __RAW_SPIN_LOCK_UNLOCKED(name)	(raw_spinlock_t) { .count = 0 }
 
+void raw_spin_lock_slowpath(raw_spinlock_t *lock);
+void raw_spin_unlock_wake(raw_spinlock_t *lock);
+
 static inline void raw_spin_lock_init(raw_spinlock_t *lock)
 {
 	smp_store_release(&lock->count, 0);
 }
 
+static inline bool raw_spin_trylock(raw_spinlock_t *lock)
+{
+	return !cmpxchg_acquire(&lock->count, 0, 1);
+}
+
 static inline void raw_spin_lock(raw_spinlock_t *lock)
 {
-	while (xchg_acquire(&lock->count, 1))
-		;
+	if (unlikely(!raw_spin_trylock(lock)))
+		raw_spin_lock_slowpath(lock);
 }
 
 static inline void raw_spin_unlock(raw_spinlock_t *lock)
 {
-	smp_store_release(&lock->count, 0);
+	if (unlikely(xchg_release(&lock->count, 0) == 2))
+		raw_spin_unlock_wake(lock);
+}
+
+static inline bool raw_spin_is_locked(raw_spinlock_t *lock)
+{
+	return READ_ONCE(lock->count) != 0;
 }
 
 #define raw_spin_lock_irq(lock)		raw_spin_lock(lock)
@@ -45,6 +66,8 @@ typedef raw_spinlock_t spinlock_t;
 #define spin_lock_init(lock)		raw_spin_lock_init(lock)
 #define spin_lock(lock)			raw_spin_lock(lock)
 #define spin_unlock(lock)		raw_spin_unlock(lock)
+#define spin_trylock(lock)		raw_spin_trylock(lock)
+#define spin_is_locked(lock)		raw_spin_is_locked(lock)
 
 #define spin_lock_nested(lock, n)	spin_lock(lock)
 
@@ -0,0 +1,39 @@
+#ifndef __TOOLS_LINUX_TRACE_EVENTS_H
+#define __TOOLS_LINUX_TRACE_EVENTS_H
+
+#include <stdio.h>
+
+#include <linux/tracepoint.h>
+
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+
+/*
+ * With USDT probes, every tracepoint fires a probe named after the event with
+ * a pointer to the event's fields and their size, for perf and bpftrace:
+ */
+#define trace_usdt(system, name, entry, size)				\
+	DTRACE_PROBE2(system, name, entry, size)
+#else
+#define trace_usdt(system, name, entry, size)	do {} while (0)
+#endif
+
+struct trace_event_call {
+	struct tracepoint	*tp;
+	const char		*class;
+	unsigned		id;
+	unsigned		size;
+	bool			record;
+	void			(*print)(FILE *, const void *);
+};
+
+void trace_event_write(struct trace_event_call *, const void *, unsigned);
+
+__attribute__((format(printf, 2, 3)))
+void trace_printf(FILE *, const char *, ...);
+
+void trace_list_events(FILE *);
+int trace_init(const char *, size_t, const char *);
+void trace_dump(FILE *);
+
+#endif /* __TOOLS_LINUX_TRACE_EVENTS_H */
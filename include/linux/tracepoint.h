@@ -1,6 +1,26 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <errno.h>
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+/*
+ * Tracepoints are defined by the TRACE_EVENT() headers in include/trace/events,
+ * once, in the file that defines CREATE_TRACE_POINTS (see
+ * include/trace/trace_events.h); when enabled, events are recorded into per
+ * thread ring buffers (see linux/trace.c).
+ *
+ * Everywhere else, trace_foo() is just a test of foo's enabled flag - the
+ * arguments aren't even evaluated unless the tracepoint is enabled.
+ */
+
+struct tracepoint {
+	const char	*name;
+	bool		enabled;
+};
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
@@ -8,10 +28,17 @@
 #define TP_CONDITION(args...)	args
 
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
+	extern struct tracepoint __tracepoint_##name;			\
+	void __trace_##name(proto);					\
 	static inline void trace_##name(proto)				\
-	{ }								\
+	{								\
+		if (unlikely(READ_ONCE(__tracepoint_##name.enabled)))	\
+			__trace_##name(args);				\
+	}								\
 	static inline void trace_##name##_rcuidle(proto)		\
-	{ }								\
+	{								\
+		trace_##name(args);					\
+	}								\
 	static inline int						\
 	register_trace_##name(void (*probe)(data_proto),		\
 			      void *data)				\
@@ -30,7 +57,7 @@
 	static inline bool						\
 	trace_##name##_enabled(void)					\
 	{								\
-		return false;						\
+		return READ_ONCE(__tracepoint_##name.enabled);		\
 	}
 
 #define DEFINE_TRACE_FN(name, reg, unreg)
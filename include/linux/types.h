@@ -21,15 +21,19 @@ typedef unsigned short		umode_t;
 
 typedef unsigned gfp_t;
 
-#define GFP_KERNEL	0
+#define __GFP_IO		0
+#define __GFP_NOWARN		0
+#define __GFP_NORETRY		0
+#define __GFP_ZERO		1
+#define __GFP_DIRECT_RECLAIM	2
+
+#define GFP_KERNEL	__GFP_DIRECT_RECLAIM
 #define GFP_ATOMIC	0
-#define GFP_NOFS	0
-#define GFP_NOIO	0
+#define GFP_NOFS	__GFP_DIRECT_RECLAIM
+#define GFP_NOIO	__GFP_DIRECT_RECLAIM
 #define GFP_NOWAIT	0
-#define __GFP_IO	0
-#define __GFP_NOWARN	0
-#define __GFP_NORETRY	0
-#define __GFP_ZERO	1
+
+#define gfpflags_allow_blocking(gfp)	(!!((gfp) & __GFP_DIRECT_RECLAIM))
 
 #define PAGE_ALLOC_COSTLY_ORDER	6
 
@@ -436,6 +436,11 @@ DEFINE_EVENT(btree_node, bcache_btree_read,
 	TP_ARGS(c, b)
 );
 
+DEFINE_EVENT(btree_node, bcache_btree_node_prefetch,
+	TP_PROTO(struct cache_set *c, struct btree *b),
+	TP_ARGS(c, b)
+);
+
 TRACE_EVENT(bcache_btree_write,
 	TP_PROTO(struct btree *b, unsigned bytes, unsigned sectors),
 	TP_ARGS(b, bytes, sectors),
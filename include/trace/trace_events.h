@@ -0,0 +1,133 @@
+/*
+ * Stage 1 of the trace events.
+ *
+ * Override the macros in <linux/tracepoint.h> to define the following:
+ *
+ * struct trace_event_raw_<call> {
+ *	<item> <TP_STRUCT__entry>;
+ *	...
+ * };
+ *
+ * Stage 2 defines the function that prints an event's fields with its
+ * TP_printk() format:
+ *
+ * static void trace_event_print_<call>(FILE *out, const void *entry);
+ *
+ * Stage 3 defines the tracepoint itself, and the function that trace_<call>()
+ * calls when the tracepoint is enabled - it fills in the fields with the
+ * event's TP_fast_assign() and copies them into the current thread's trace
+ * buffer:
+ *
+ * void __trace_<call>(<proto>);
+ *
+ * Events are collected in the trace_events section, which linux/trace.c
+ * walks at startup to assign event ids.
+ */
+
+#include <linux/trace_events.h>
+
+#undef TRACE_EVENT
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)		\
+	DECLARE_EVENT_CLASS(name,					\
+			     PARAMS(proto),				\
+			     PARAMS(args),				\
+			     PARAMS(tstruct),				\
+			     PARAMS(assign),				\
+			     PARAMS(print))				\
+	DEFINE_EVENT(name, name, PARAMS(proto), PARAMS(args))
+
+#undef DEFINE_EVENT_FN
+#define DEFINE_EVENT_FN(template, name, proto, args, reg, unreg)	\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+/* The event's own print format is ignored - it's printed with its class's: */
+#undef DEFINE_EVENT_PRINT
+#define DEFINE_EVENT_PRINT(template, name, proto, args, print)		\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+/* Stage 1: */
+
+#undef __field
+#define __field(type, item)		type	item;
+
+#undef __array
+#define __array(type, item, len)	type	item[len];
+
+#undef TP_STRUCT__entry
+#define TP_STRUCT__entry(args...) args
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+	struct trace_event_raw_##name {					\
+		tstruct							\
+	};
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(template, name, proto, args)
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Stage 2: */
+
+#undef __entry
+#define __entry field
+
+#undef TP_printk
+#define TP_printk(fmt, args...) fmt, ##args
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+static void trace_event_print_##name(FILE *out, const void *entry)	\
+{									\
+	const struct trace_event_raw_##name *field = entry;		\
+									\
+	trace_printf(out, print);					\
+}
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(template, name, proto, args)
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Stage 3: */
+
+#undef __entry
+#define __entry entry
+
+#undef TP_fast_assign
+#define TP_fast_assign(args...) args
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+static inline void							\
+trace_event_assign_##name(struct trace_event_raw_##name *entry, proto)	\
+{									\
+	assign								\
+}
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(template, event, proto, args)			\
+struct tracepoint __tracepoint_##event = {				\
+	.name	= #event,						\
+};									\
+									\
+static struct trace_event_call event_##event = {			\
+	.tp	= &__tracepoint_##event,				\
+	.class	= #template,						\
+	.size	= sizeof(struct trace_event_raw_##template),		\
+	.print	= trace_event_print_##template,				\
+};									\
+									\
+static struct trace_event_call *__event_##event				\
+__attribute__((section("trace_events"), used)) = &event_##event;	\
+									\
+void __trace_##event(proto)						\
+{									\
+	struct trace_event_raw_##template entry;			\
+									\
+	trace_event_assign_##template(&entry, args);			\
+	trace_usdt(TRACE_SYSTEM, event, &entry, sizeof(entry));		\
+	trace_event_write(&event_##event, &entry, sizeof(entry));	\
+}
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
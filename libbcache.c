@@ -18,6 +18,7 @@
 #include "crypto.h"
 #include "opts.h"
 #include "super-io.h"
+#include "bcache.h"
 
 #define NSEC_PER_SEC	1000000000L
 
@@ -208,6 +209,9 @@ struct bch_sb *bcache_format(struct format_opts opts,
 		SET_BCH_SB_ENCRYPTION_TYPE(sb, 1);
 	}
 
+	if (opts.journal_gens)
+		bch_sb_set_feature(sb, BCH_FEATURE_JOURNAL_GENS);
+
 	mi = vstruct_end(sb);
 	u64s = (sizeof(struct bch_sb_field_members) +
 		sizeof(struct bch_member) * nr_devs) / sizeof(u64);
@@ -424,3 +428,113 @@ void bcache_super_print(struct bch_sb *sb, int units)
 		       BCH_MEMBER_DISCARD(m));
 	}
 }
+
+static void time_stats_print(struct time_stats *stats, FILE *out,
+			     const char *name, const char *units,
+			     u64 nsec_per_unit)
+{
+	struct time_stats_summary s;
+	char label[40];
+
+	bch_time_stats_summary(stats, &s);
+	if (!s.count)
+		return;
+
+	snprintf(label, sizeof(label), "%s (%s)", name, units);
+
+	fprintf(out, "%-28s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		label, s.count,
+		(double) s.mean	/ nsec_per_unit,
+		(double) s.p50	/ nsec_per_unit,
+		(double) s.p99	/ nsec_per_unit,
+		(double) s.p999	/ nsec_per_unit,
+		(double) s.max	/ nsec_per_unit);
+}
+
+/* The latency distribution of each of the filesystem's time stats: */
+static void fs_time_stats_print(struct cache_set *c, FILE *out)
+{
+	fprintf(out, "%-28s %10s %10s %10s %10s %10s %10s\n",
+		"time stats", "count", "mean", "p50", "p99", "p999", "max");
+
+#define BCH_TIME_STAT(name, frequency_units, duration_units)		\
+	time_stats_print(&c->name##_time, out, #name, #duration_units,	\
+			 NSEC_PER_##duration_units);
+	BCH_TIME_STATS()
+#undef BCH_TIME_STAT
+}
+
+static void mempool_stats_print(mempool_t *pool, FILE *out, const char *name)
+{
+	if (!mempool_initialized(pool))
+		return;
+
+	fprintf(out, "%-28s %10u %10llu %10llu %10llu\n",
+		name, pool->min_nr,
+		(u64) atomic64_read(&pool->stats.alloc),
+		(u64) atomic64_read(&pool->stats.reserve),
+		(u64) atomic64_read(&pool->stats.wait));
+}
+
+/*
+ * How often each of the filesystem's mempools missed its cache and allocated,
+ * had to use its reserve, or had to wait for an element to be freed:
+ */
+static void fs_mempool_stats_print(struct cache_set *c, FILE *out)
+{
+	fprintf(out, "%-28s %10s %10s %10s %10s\n",
+		"mempool", "reserve", "allocs", "used rsv", "waits");
+
+#define pool(p)		mempool_stats_print(&c->p, out, #p)
+	pool(btree_read_bio.bio_pool);
+	pool(btree_reserve_pool);
+	pool(btree_interior_update_pool);
+	pool(bio_read.bio_pool);
+	pool(bio_read_split.bio_pool);
+	pool(bio_write.bio_pool);
+	pool(bio_bounce_pages);
+	pool(lz4_workspace_pool);
+	pool(compression_bounce[READ]);
+	pool(compression_bounce[WRITE]);
+	pool(fill_iter);
+	pool(btree_bounce_pool);
+	pool(search);
+#undef pool
+}
+
+static void slab_stats_print(struct kmem_cache *s, void *out)
+{
+	struct kmem_cache_stats stats;
+
+	kmem_cache_stats(s, &stats);
+	if (!stats.allocs)
+		return;
+
+	fprintf(out, "%-28s %10zu %10llu %10llu %10llu %10llu %10llu\n",
+		kmem_cache_name(s), kmem_cache_size(s),
+		stats.nr_objs, stats.nr_active,
+		stats.allocs, stats.hits, stats.misses);
+}
+
+/*
+ * Slab caches are shared by everything in the process, not just this
+ * filesystem - print the ones that have been used:
+ */
+static void slab_caches_stats_print(FILE *out)
+{
+	fprintf(out, "%-28s %10s %10s %10s %10s %10s %10s\n",
+		"slab cache", "size", "objs", "active",
+		"allocs", "hits", "misses");
+
+	kmem_cache_for_each(slab_stats_print, out);
+}
+
+/* Print the filesystem's latency and memory allocation statistics: */
+void bcache_fs_stats_print(struct cache_set *c, FILE *out)
+{
+	fs_time_stats_print(c, out);
+	fputc('\n', out);
+	fs_mempool_stats_print(c, out);
+	fputc('\n', out);
+	slab_caches_stats_print(out);
+}
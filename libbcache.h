@@ -41,6 +41,8 @@ struct format_opts {
 
 	bool		encrypted;
 	char		*passphrase;
+
+	bool		journal_gens;
 };
 
 static inline struct format_opts format_opts_default()
@@ -78,4 +80,8 @@ struct bch_sb *bcache_super_read(const char *);
 
 void bcache_super_print(struct bch_sb *, int);
 
+struct cache_set;
+
+void bcache_fs_stats_print(struct cache_set *, FILE *);
+
 #endif /* _LIBBCACHE_H */
@@ -260,25 +260,50 @@ static int bch_prio_write(struct cache *ca)
 	struct journal *j = &c->journal;
 	struct journal_res res;
 	bool need_new_journal_entry;
-	int i, ret;
+	int i, nr, ret;
 
 	bch_zero(res);
 
 	if (c->opts.nochanges)
 		return 0;
 
+	WRITE_ONCE(ca->prio_write_needed, false);
+
+	/*
+	 * Prio sets are chained, each pointing to the next - so rewriting a
+	 * set means rewriting every set before it, but the sets after the
+	 * last dirty one can be left where they are.
+	 *
+	 * Only gen changes dirty a set: the prios in a clean set on disk may
+	 * be stale, but they're only used as LRU hints (and rescaling the
+	 * prios redirties everything, so they can't go out of range):
+	 */
+	for (nr = prio_buckets(ca); nr; --nr)
+		if (test_bit(nr - 1, ca->prio_sets_dirty))
+			break;
+
+	if (!nr)
+		goto out;
+
 	trace_bcache_prio_write_start(ca);
 
-	atomic64_add(ca->mi.bucket_size * prio_buckets(ca),
+	atomic64_add(ca->mi.bucket_size * nr,
 		     &ca->meta_sectors_written);
 
-	for (i = prio_buckets(ca) - 1; i >= 0; --i) {
+	for (i = nr - 1; i >= 0; --i) {
 		struct bucket *g;
 		struct prio_set *p = ca->disk_buckets;
 		struct bucket_disk *d = p->data;
 		struct bucket_disk *end = d + prios_per_bucket(ca);
 		size_t r;
 
+		/*
+		 * Clear the dirty bit before reading the gens, so a gen that
+		 * changes under us redirties the set:
+		 */
+		clear_bit(i, ca->prio_sets_dirty);
+		smp_mb__after_atomic();
+
 		for (r = i * prios_per_bucket(ca);
 		     r < ca->mi.nbuckets && d < end;
 		     r++, d++) {
@@ -321,8 +346,11 @@ static int bch_prio_write(struct cache *ca)
 		ret = prio_io(ca, r, REQ_OP_WRITE);
 		if (bch_dev_fatal_io_err_on(ret, ca,
 					  "prio write to bucket %zu", r) ||
-		    bch_meta_write_fault("prio"))
+		    bch_meta_write_fault("prio")) {
+			while (i < nr)
+				set_bit(i++, ca->prio_sets_dirty);
 			return ret;
+		}
 	}
 
 	spin_lock(&j->lock);
@@ -358,7 +386,7 @@ static int bch_prio_write(struct cache *ca)
 
 	spin_lock(&ca->prio_buckets_lock);
 
-	for (i = 0; i < prio_buckets(ca); i++) {
+	for (i = 0; i < nr; i++) {
 		if (ca->prio_last_buckets[i])
 			__bch_bucket_free(ca,
 				&ca->buckets[ca->prio_last_buckets[i]]);
@@ -369,9 +397,109 @@ static int bch_prio_write(struct cache *ca)
 	spin_unlock(&ca->prio_buckets_lock);
 
 	trace_bcache_prio_write_end(ca);
+out:
+	/* Journalled gens are all in the prios now: */
+	bch_journal_pin_drop(j, &ca->prio_gens_pin);
 	return 0;
 }
 
+/*
+ * Journal reclaim wants an entry with gens we journalled - have the allocator
+ * thread write the prios, which drops the pin:
+ */
+void bch_prio_gens_flush(struct journal *j, struct journal_entry_pin *pin)
+{
+	struct cache *ca = container_of(pin, struct cache, prio_gens_pin);
+
+	WRITE_ONCE(ca->prio_write_needed, true);
+	bch_wake_allocator(ca);
+}
+
+/* Journal reclaim asked for the prios, and we have the buckets to write them: */
+static bool prio_write_pending(struct cache *ca)
+{
+	return READ_ONCE(ca->prio_write_needed) &&
+		fifo_full(&ca->free[RESERVE_PRIO]);
+}
+
+static int prio_journal_gens_add(struct journal *j,
+				 const struct bch_bucket_gen *g,
+				 unsigned nr, u64 *seq)
+{
+	struct journal_res res;
+	unsigned u64s = jset_u64s(nr);
+	int ret;
+
+	bch_zero(res);
+
+	ret = bch_journal_res_get(j, &res, u64s, u64s);
+	if (ret)
+		return ret;
+
+	bch_journal_add_bucket_gens(j, &res, g, nr);
+	*seq = res.seq;
+	bch_journal_res_put(j, &res);
+	return 0;
+}
+
+/*
+ * free_inc is full of newly invalidated buckets, and their new gens have to be
+ * persistent before they can be reused.
+ *
+ * Rewriting the prios does that, but it's at least a bucket write every time -
+ * and every set up to the last dirty one, which is most of them once the
+ * invalidated buckets are spread out over the device. With
+ * BCH_FEATURE_JOURNAL_GENS we journal the new gens instead - 8 bytes per bucket
+ * - and only rewrite the prios when journal reclaim needs the entries they're
+ * in:
+ */
+static int bch_prio_journal_gens(struct cache *ca)
+{
+	struct cache_set *c = ca->set;
+	struct journal *j = &c->journal;
+	struct bch_bucket_gen g[128];
+	size_t iter;
+	long bucket;
+	unsigned nr = 0;
+	u64 seq = 0;
+	int ret;
+
+	if (c->opts.nochanges)
+		return 0;
+
+	if (!bch_sb_test_feature(c->disk_sb, BCH_FEATURE_JOURNAL_GENS) ||
+	    !test_bit(JOURNAL_REPLAY_DONE, &j->flags) ||
+	    !ca->prio_buckets[0] ||
+	    READ_ONCE(ca->prio_write_needed))
+		return bch_prio_write(ca);
+
+	/* Pin the entry the first new gens go in, until the prios are written: */
+	if (!journal_pin_active(&ca->prio_gens_pin))
+		bch_journal_pin_add(j, &ca->prio_gens_pin, bch_prio_gens_flush);
+
+	fifo_for_each_entry(bucket, &ca->free_inc, iter) {
+		g[nr].v = 0;
+		SET_BUCKET_GEN_BUCKET(&g[nr], bucket);
+		SET_BUCKET_GEN_DEV(&g[nr], ca->dev_idx);
+		SET_BUCKET_GEN_GEN(&g[nr], ca->buckets[bucket].mark.gen);
+
+		if (++nr == ARRAY_SIZE(g)) {
+			ret = prio_journal_gens_add(j, g, nr, &seq);
+			if (ret)
+				return ret;
+			nr = 0;
+		}
+	}
+
+	if (nr) {
+		ret = prio_journal_gens_add(j, g, nr, &seq);
+		if (ret)
+			return ret;
+	}
+
+	return seq ? bch_journal_flush_seq(j, seq) : 0;
+}
+
 int bch_prio_read(struct cache *ca)
 {
 	struct cache_set *c = ca->set;
@@ -443,6 +571,18 @@ int bch_prio_read(struct cache *ca)
 
 		bucket_cmpxchg(&ca->buckets[b], new, new.gen = d->gen);
 	}
+
+	/*
+	 * Everything we just read matches what's on disk, so prio_write() can
+	 * keep pointing to these buckets until their sets are dirtied:
+	 */
+	spin_lock(&ca->prio_buckets_lock);
+	memcpy(ca->prio_buckets, ca->prio_last_buckets,
+	       sizeof(u64) * bucket_nr);
+	spin_unlock(&ca->prio_buckets_lock);
+
+	for (b = 0; b < bucket_nr; b++)
+		clear_bit(b, ca->prio_sets_dirty);
 fsck_err:
 	return 0;
 }
@@ -467,6 +607,16 @@ static int wait_buckets_available(struct cache *ca)
 			break;
 		}
 
+		if (prio_write_pending(ca)) {
+			__set_current_state(TASK_RUNNING);
+			up_read(&c->gc_lock);
+			ret = bch_prio_write(ca);
+			down_read(&c->gc_lock);
+			if (ret)
+				break;
+			continue;
+		}
+
 		if (ca->inc_gen_needs_gc >= fifo_free(&ca->free_inc)) {
 			if (c->gc_thread) {
 				trace_bcache_gc_cannot_inc_gens(ca->set);
@@ -555,7 +705,26 @@ static void bch_rescale_prios(struct cache_set *c, int rw)
 			g->prio[rw] = clock->hand -
 				(clock->hand - g->prio[rw]) / 2;
 
+		/*
+		 * Rescale the LRU index's copies of read_prio the same way, so
+		 * rescaling doesn't look like every bucket was just read:
+		 */
+		if (rw == READ) {
+			struct bucket_lru *n;
+
+			spin_lock(&ca->bucket_lru_lock);
+			for (n = ca->bucket_lru;
+			     n < ca->bucket_lru + ca->mi.nbuckets;
+			     n++)
+				n->prio = clock->hand -
+					(u16) (clock->hand - n->prio) / 2;
+			spin_unlock(&ca->bucket_lru_lock);
+		}
+
 		bch_recalc_min_prio(ca, rw);
+
+		/* Every prio on disk is now out of date: */
+		bch_prio_sets_dirty_all(ca);
 	}
 }
 
@@ -617,6 +786,12 @@ static inline bool can_inc_bucket_gen(struct cache *ca, struct bucket *g)
 	return bucket_gc_gen(ca, g) < BUCKET_GC_GEN_MAX;
 }
 
+static bool __bch_can_invalidate_bucket(struct cache *ca, struct bucket *g)
+{
+	return is_available_bucket(READ_ONCE(g->mark)) &&
+		can_inc_bucket_gen(ca, g);
+}
+
 static bool bch_can_invalidate_bucket(struct cache *ca, struct bucket *g)
 {
 	if (!is_available_bucket(READ_ONCE(g->mark)))
@@ -644,7 +819,7 @@ static void bch_invalidate_one_bucket(struct cache *ca, struct bucket *g)
 }
 
 /*
- * Determines what order we're going to reuse buckets, smallest bucket_key()
+ * Determines what order we're going to reuse buckets, smallest bucket_sort_key()
  * first.
  *
  *
@@ -659,49 +834,231 @@ static void bch_invalidate_one_bucket(struct cache *ca, struct bucket *g)
  *   pointer into it, which gives us an indication of the cost of an eventual
  *   btree GC to rewrite nodes with stale pointers.
  */
+static unsigned long bucket_sort_key(struct cache *ca, struct bucket *g)
+{
+	u16 min_prio = ca->min_prio[READ];
+	unsigned long prio = (u16) (g->read_prio - min_prio);
+	unsigned long range = (u16) (ca->set->prio_clock[READ].hand - min_prio);
+
+	prio = (prio * 7) / max(range, 1UL);
+
+	return (((prio + 1) * bucket_sectors_used(g)) << 8) |
+		bucket_gc_gen(ca, g);
+}
+
+/* Bucket LRU index */
+
+/*
+ * Rather than scanning every bucket on the device each time free_inc needs
+ * refilling, invalidate_buckets_lru() pulls buckets from an index of available
+ * buckets that's updated whenever a bucket mark changes in a way that could
+ * change its position - i.e. whenever bucket_lru_level() changes.
+ *
+ * Within a level, buckets are ordered by when they were added; read_prio isn't
+ * updated under any lock, so when a bucket reaches the head of its list we
+ * check if it's been read since it was added, and if so give it a second chance
+ * at the tail.
+ *
+ * Only the heads of the levels are candidates, so picking each bucket costs
+ * O(BUCKET_LRU_LEVELS), not O(nbuckets) - but that makes the order within a
+ * level FIFO (with second chances), not LRU: a level only bounds cached
+ * sectors to a factor of two, and the prio term scales the sort key by up to
+ * 8x on top of that. bucket_sort_key() just picks between the level heads.
+ */
+
+static void bucket_lru_del(struct cache *ca, size_t b)
+{
+	struct bucket_lru *n = ca->bucket_lru + b;
+
+	ca->bucket_lru[n->prev].next = n->next;
+	ca->bucket_lru[n->next].prev = n->prev;
+
+	if (n->level == BUCKET_LRU_NEEDS_GC)
+		ca->bucket_lru_needs_gc--;
+
+	n->level = 0;
+}
+
+static void bucket_lru_add_tail(struct cache *ca, size_t b, unsigned level)
+{
+	struct bucket_lru *n = ca->bucket_lru + b;
+	size_t head = ca->mi.nbuckets + level;
+	struct bucket_lru *h = ca->bucket_lru + head;
+
+	n->prev = h->prev;
+	n->next = head;
+	ca->bucket_lru[h->prev].next = b;
+	h->prev = b;
+
+	n->prio = ca->buckets[b].read_prio;
+	n->level = level;
+
+	if (level == BUCKET_LRU_NEEDS_GC)
+		ca->bucket_lru_needs_gc++;
+}
+
+static void __bch_bucket_lru_update(struct cache *ca, struct bucket *g)
+{
+	size_t b = g - ca->buckets;
+	struct bucket_lru *n = ca->bucket_lru + b;
+	unsigned level;
 
-#define bucket_sort_key(g)						\
-({									\
-	unsigned long prio = g->read_prio - ca->min_prio[READ];		\
-	prio = (prio * 7) / (ca->set->prio_clock[READ].hand -		\
-			     ca->min_prio[READ]);			\
-									\
-	(((prio + 1) * bucket_sectors_used(g)) << 8) | bucket_gc_gen(ca, g);\
-})
+	spin_lock(&ca->bucket_lru_lock);
+
+	/*
+	 * Marks are updated locklessly, so the mark we were called for may
+	 * already be stale: always go by the current mark.
+	 */
+	level = bucket_lru_level(READ_ONCE(g->mark));
+
+	if (n->level != level) {
+		if (n->level)
+			bucket_lru_del(ca, b);
+		if (level)
+			bucket_lru_add_tail(ca, b, level);
+	}
+
+	spin_unlock(&ca->bucket_lru_lock);
+}
+
+/**
+ * bch_bucket_lru_update - move a bucket to the right list after its mark
+ * changed
+ *
+ * Called from bucket_stats_update(), after the new mark is visible. While gc
+ * is running bucket marks are being recomputed from scratch, so the index is
+ * left alone until bch_dev_bucket_lru_resync() when gc finishes.
+ */
+void bch_bucket_lru_update(struct cache *ca, struct bucket *g)
+{
+	if (READ_ONCE(ca->set->gc_pos.phase) != GC_PHASE_DONE)
+		return;
+
+	__bch_bucket_lru_update(ca, g);
+}
+
+/**
+ * bch_dev_bucket_lru_resync - bring the LRU index up to date with the bucket
+ * marks, and give buckets parked waiting on gc another chance
+ *
+ * Buckets already on the right list keep their place.
+ */
+void bch_dev_bucket_lru_resync(struct cache *ca)
+{
+	struct bucket *g;
+
+	mutex_lock(&ca->set->bucket_lock);
+	bch_recalc_min_prio(ca, READ);
+	bch_recalc_min_prio(ca, WRITE);
+	mutex_unlock(&ca->set->bucket_lock);
+
+	/* Pairs with the cmpxchg of the bucket mark in bucket_cmpxchg(): */
+	smp_mb();
+
+	for_each_bucket(g, ca)
+		if (READ_ONCE(ca->bucket_lru[g - ca->buckets].level) !=
+		    bucket_lru_level(READ_ONCE(g->mark)))
+			__bch_bucket_lru_update(ca, g);
+}
+
+void bch_dev_bucket_lru_init(struct cache *ca)
+{
+	size_t head;
+
+	for (head = ca->mi.nbuckets;
+	     head < ca->mi.nbuckets + BUCKET_LRU_NR;
+	     head++)
+		ca->bucket_lru[head].prev = ca->bucket_lru[head].next = head;
+}
+
+/* Oldest bucket on @level that can be invalidated now: */
+static struct bucket *bucket_lru_peek(struct cache *ca, unsigned level)
+{
+	size_t head = ca->mi.nbuckets + level;
+	size_t b;
+
+	while ((b = ca->bucket_lru[head].next) != head) {
+		struct bucket *g = ca->buckets + b;
+
+		if (ca->bucket_lru[b].prio != g->read_prio) {
+			/* Read since it was added - second chance: */
+			bucket_lru_del(ca, b);
+			bucket_lru_add_tail(ca, b, level);
+			continue;
+		}
+
+		if (!__bch_can_invalidate_bucket(ca, g)) {
+			/* Park it until gc has updated oldest_gens: */
+			bucket_lru_del(ca, b);
+			bucket_lru_add_tail(ca, b, BUCKET_LRU_NEEDS_GC);
+			continue;
+		}
+
+		return g;
+	}
+
+	return NULL;
+}
+
+static struct bucket *bucket_lru_pop(struct cache *ca)
+{
+	struct bucket *g, *best = NULL;
+	unsigned long key, best_key = ULONG_MAX;
+	unsigned level;
+
+	for (level = 1; level <= BUCKET_LRU_LEVELS; level++) {
+		g = bucket_lru_peek(ca, level);
+		if (!g)
+			continue;
+
+		key = bucket_sort_key(ca, g);
+		if (key < best_key) {
+			best = g;
+			best_key = key;
+		}
+	}
+
+	if (best)
+		bucket_lru_del(ca, best - ca->buckets);
+
+	return best;
+}
 
 static void invalidate_buckets_lru(struct cache *ca)
 {
 	struct bucket_heap_entry e;
 	struct bucket *g;
-	unsigned i;
+	size_t nr;
 
 	mutex_lock(&ca->heap_lock);
 
 	ca->heap.used = 0;
 
 	mutex_lock(&ca->set->bucket_lock);
-	bch_recalc_min_prio(ca, READ);
-	bch_recalc_min_prio(ca, WRITE);
 
 	/*
-	 * Find buckets with lowest read priority, by building a maxheap sorted
-	 * by read priority and repeatedly replacing the maximum element until
-	 * all buckets have been visited.
+	 * Pull the buckets with the lowest sort keys out of the index - they
+	 * stay off it until they're invalidated, so we don't see them twice:
 	 */
-	for_each_bucket(g, ca) {
-		if (!bch_can_invalidate_bucket(ca, g))
-			continue;
-
-		bucket_heap_push(ca, g, bucket_sort_key(g));
-	}
+	nr = min_t(size_t, fifo_free(&ca->free_inc), ca->heap.size);
 
-	/* Sort buckets by physical location on disk for better locality */
-	for (i = 0; i < ca->heap.used; i++) {
-		struct bucket_heap_entry *e = &ca->heap.data[i];
+	spin_lock(&ca->bucket_lru_lock);
+	while (ca->heap.used < nr && (g = bucket_lru_pop(ca))) {
+		if (bucket_gc_gen(ca, g) >= BUCKET_GC_GEN_MAX - 1)
+			ca->inc_gen_needs_gc++;
 
-		e->val = e->g - ca->buckets;
+		ca->heap.data[ca->heap.used++] =
+			(struct bucket_heap_entry) { g, g - ca->buckets };
 	}
 
+	/*
+	 * Parked buckets are counted here, once per pass, not as they're
+	 * parked:
+	 */
+	ca->inc_gen_needs_gc += ca->bucket_lru_needs_gc;
+	spin_unlock(&ca->bucket_lru_lock);
+
+	/* Sort buckets by physical location on disk for better locality */
 	heap_resort(&ca->heap, bucket_max_cmp);
 
 	/*
@@ -710,7 +1067,7 @@ static void invalidate_buckets_lru(struct cache *ca)
 	 */
 	while (!fifo_full(&ca->free_inc) &&
 	       heap_pop(&ca->heap, e, bucket_max_cmp)) {
-		BUG_ON(!bch_can_invalidate_bucket(ca, e.g));
+		BUG_ON(!__bch_can_invalidate_bucket(ca, e.g));
 		bch_invalidate_one_bucket(ca, e.g);
 	}
 
@@ -886,6 +1243,19 @@ static int bch_allocator_thread(void *arg)
 					__set_current_state(TASK_RUNNING);
 					goto out;
 				}
+
+				/*
+				 * The journal may be waiting on us to write the
+				 * prios, before whoever we're waiting on can
+				 * allocate:
+				 */
+				if (prio_write_pending(ca)) {
+					__set_current_state(TASK_RUNNING);
+					if (bch_prio_write(ca))
+						goto err;
+					continue;
+				}
+
 				schedule();
 				try_to_freeze();
 			}
@@ -932,30 +1302,28 @@ static int bch_allocator_thread(void *arg)
 		 * free_inc is full of newly-invalidated buckets, must write out
 		 * prios and gens before they can be re-used
 		 */
-		ret = bch_prio_write(ca);
-		if (ret) {
-			/*
-			 * Emergency read only - allocator thread has to
-			 * shutdown.
-			 *
-			 * N.B. we better be going into RO mode, else
-			 * allocations would hang indefinitely - whatever
-			 * generated the error will have sent us into RO mode.
-			 *
-			 * Clear out the free_inc freelist so things are
-			 * consistent-ish:
-			 */
-			spin_lock(&ca->freelist_lock);
-			while (!fifo_empty(&ca->free_inc)) {
-				long bucket;
+		ret = bch_prio_journal_gens(ca);
+		if (ret)
+			goto err;
+	}
+err:
+	/*
+	 * Emergency read only - allocator thread has to shutdown.
+	 *
+	 * N.B. we better be going into RO mode, else allocations would hang
+	 * indefinitely - whatever generated the error will have sent us into
+	 * RO mode.
+	 *
+	 * Clear out the free_inc freelist so things are consistent-ish:
+	 */
+	spin_lock(&ca->freelist_lock);
+	while (!fifo_empty(&ca->free_inc)) {
+		long bucket;
 
-				fifo_pop(&ca->free_inc, bucket);
-				bch_mark_free_bucket(ca, ca->buckets + bucket);
-			}
-			spin_unlock(&ca->freelist_lock);
-			goto out;
-		}
+		fifo_pop(&ca->free_inc, bucket);
+		bch_mark_free_bucket(ca, ca->buckets + bucket);
 	}
+	spin_unlock(&ca->freelist_lock);
 out:
 	/*
 	 * Avoid a race with bucket_stats_update() trying to wake us up after
@@ -1784,6 +2152,17 @@ void bch_dev_allocator_stop(struct cache *ca)
 		put_task_struct(p);
 	}
 
+	/*
+	 * Gens journalled since the prios were last written pin the journal,
+	 * which is about to be flushed - write them out, and drop the pin even
+	 * if that fails:
+	 */
+	if (journal_pin_active(&ca->prio_gens_pin)) {
+		if (p && test_bit(JOURNAL_STARTED, &c->journal.flags))
+			bch_prio_write(ca);
+		bch_journal_pin_drop(&c->journal, &ca->prio_gens_pin);
+	}
+
 	/* Next, close write points that point to this device... */
 
 	for (i = 0; i < ARRAY_SIZE(c->write_points); i++)
@@ -1845,6 +2224,8 @@ int bch_dev_allocator_start(struct cache *ca)
 	get_task_struct(k);
 	ca->alloc_thread = k;
 
+	bch_dev_bucket_lru_resync(ca);
+
 	bch_dev_group_add(tier, ca);
 	bch_dev_group_add(&c->cache_all, ca);
 	bch_dev_group_add(&c->journal.devs, ca);
@@ -8,6 +8,8 @@ struct bucket;
 struct cache;
 struct cache_set;
 struct cache_group;
+struct journal;
+struct journal_entry_pin;
 
 static inline size_t prios_per_bucket(const struct cache *ca)
 {
@@ -20,13 +22,31 @@ static inline size_t prio_buckets(const struct cache *ca)
 	return DIV_ROUND_UP((size_t) (ca)->mi.nbuckets, prios_per_bucket(ca));
 }
 
+static inline void bch_prio_set_dirty(struct cache *ca, size_t b)
+{
+	set_bit(b / prios_per_bucket(ca), ca->prio_sets_dirty);
+}
+
+static inline void bch_prio_sets_dirty_all(struct cache *ca)
+{
+	size_t i;
+
+	for (i = 0; i < prio_buckets(ca); i++)
+		set_bit(i, ca->prio_sets_dirty);
+}
+
 void bch_dev_group_remove(struct cache_group *, struct cache *);
 void bch_dev_group_add(struct cache_group *, struct cache *);
 
 int bch_prio_read(struct cache *);
+void bch_prio_gens_flush(struct journal *, struct journal_entry_pin *);
 
 void bch_recalc_min_prio(struct cache *, int);
 
+void bch_bucket_lru_update(struct cache *, struct bucket *);
+void bch_dev_bucket_lru_resync(struct cache *);
+void bch_dev_bucket_lru_init(struct cache *);
+
 size_t bch_bucket_alloc(struct cache *, enum alloc_reserve);
 
 void bch_open_bucket_put(struct cache_set *, struct open_bucket *);
@@ -387,8 +387,24 @@ struct cache {
 	u64			*prio_buckets;
 	u64			*prio_last_buckets;
 	spinlock_t		prio_buckets_lock;
+
+	/*
+	 * One bit per prio set (prio bucket), set when a gen in that set has
+	 * changed since it was last written - prio_write() only rewrites the
+	 * chain up to the last dirty set:
+	 */
+	unsigned long		*prio_sets_dirty;
 	struct bio		*bio_prio;
 
+	/*
+	 * With BCH_FEATURE_JOURNAL_GENS: pins the oldest journal entry with
+	 * gens that have been journalled since the prios were last written.
+	 * When journal reclaim wants it gone, it sets prio_write_needed and
+	 * the allocator thread writes the prios:
+	 */
+	struct journal_entry_pin prio_gens_pin;
+	bool			prio_write_needed;
+
 	/*
 	 * free: Buckets that are ready to be used
 	 *
@@ -428,6 +444,21 @@ struct cache {
 	struct mutex		heap_lock;
 	DECLARE_HEAP(struct bucket_heap_entry, heap);
 
+	/*
+	 * Available buckets, ordered for invalidate_buckets_lru() - kept up to
+	 * date as bucket marks change, see bch_bucket_lru_update():
+	 */
+	spinlock_t		bucket_lru_lock;
+	struct bucket_lru	*bucket_lru;
+	size_t			bucket_lru_needs_gc;
+
+	/*
+	 * Bucket -> extents reverse index, if enabled with the backpointers
+	 * option: see bch_dev_backpointer_ranges()
+	 */
+	struct bucket_backpointer *backpointers;
+	spinlock_t		backpointer_locks[BUCKET_BACKPOINTER_LOCKS];
+
 	/* Moving GC: */
 	struct task_struct	*moving_gc_read;
 
@@ -512,6 +543,8 @@ struct cache_set {
 	/* ro/rw, add/remove devices: */
 	struct mutex		state_lock;
 	enum bch_fs_state	state;
+	/* bch_fs_stop() waits on this for __bch_fs_stop3(): */
+	struct closure		*stop_wait;
 
 	/* Counts outstanding writes, for clean transition to read-only */
 	struct percpu_ref	writes;
@@ -290,7 +290,6 @@ struct bkey __bkey_unpack_key(const struct bkey_format *format,
 	return out;
 }
 
-#ifndef HAVE_BCACHE_COMPILED_UNPACK
 struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 				     const struct bkey_packed *in)
 {
@@ -307,7 +306,6 @@ struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 
 	return out;
 }
-#endif
 
 /**
  * bkey_pack_key -- pack just the key, not the value
@@ -437,6 +437,8 @@ static void bset_aux_tree_verify(struct btree *b)
 
 void bch_btree_keys_free(struct btree *b)
 {
+	execmem_free(b->unpack_fn);
+	b->unpack_fn = NULL;
 	vfree(b->aux_data);
 	b->aux_data = NULL;
 }
@@ -449,6 +451,10 @@ int bch_btree_keys_alloc(struct btree *b, unsigned page_order, gfp_t gfp)
 	if (!b->aux_data)
 		return -ENOMEM;
 
+#ifdef HAVE_BCACHE_COMPILED_UNPACK
+	/* if we can't get executable memory we use the generic unpack: */
+	b->unpack_fn	= execmem_alloc(EXECMEM_SLOT_SIZE);
+#endif
 	return 0;
 }
 
@@ -2,6 +2,7 @@
 #define _BCACHE_BSET_H
 
 #include <linux/bcache.h>
+#include <linux/execmem.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 
@@ -184,8 +185,8 @@ bkey_unpack_key_format_checked(const struct btree *b,
 	struct bkey dst;
 
 #ifdef HAVE_BCACHE_COMPILED_UNPACK
-	{
-		compiled_unpack_fn unpack_fn = b->aux_data;
+	if (likely(b->unpack_fn)) {
+		compiled_unpack_fn unpack_fn = b->unpack_fn;
 		unpack_fn(&dst, src);
 
 		if (IS_ENABLED(CONFIG_BCACHE_DEBUG)) {
@@ -193,10 +194,9 @@ bkey_unpack_key_format_checked(const struct btree *b,
 
 			BUG_ON(memcmp(&dst, &dst2, sizeof(dst)));
 		}
-	}
-#else
-	dst = __bkey_unpack_key(&b->format, src);
+	} else
 #endif
+		dst = __bkey_unpack_key(&b->format, src);
 	return dst;
 }
 
@@ -216,10 +216,10 @@ bkey_unpack_pos_format_checked(const struct btree *b,
 			       const struct bkey_packed *src)
 {
 #ifdef HAVE_BCACHE_COMPILED_UNPACK
-	return bkey_unpack_key_format_checked(b, src).p;
-#else
-	return __bkey_unpack_pos(&b->format, src);
+	if (likely(b->unpack_fn))
+		return bkey_unpack_key_format_checked(b, src).p;
 #endif
+	return __bkey_unpack_pos(&b->format, src);
 }
 
 static inline struct bpos bkey_unpack_pos(const struct btree *b,
@@ -300,6 +300,9 @@ static inline void btree_node_set_format(struct btree *b,
 
 	b->unpack_fn_len = len;
 
+	if (b->unpack_fn)
+		text_poke_copy(b->unpack_fn, b->aux_data, len);
+
 	bch_bset_set_no_aux_tree(b, b->set);
 }
 
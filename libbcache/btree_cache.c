@@ -593,6 +593,60 @@ static noinline struct btree *bch_btree_node_fill(struct btree_iter *iter,
 	return b;
 }
 
+/**
+ * bch_btree_node_prefetch - start reading a btree node into the cache
+ *
+ * For readahead: if the node isn't already cached, allocate it and read it
+ * asynchronously. This never cannibalizes other cached nodes - if memory for
+ * the node can't be allocated without evicting something, we skip it. As with
+ * bch_btree_node_fill(), the parent of the node must be locked.
+ */
+void bch_btree_node_prefetch(struct btree_iter *iter,
+			     const struct bkey_i *k, unsigned level)
+{
+	struct cache_set *c = iter->c;
+	struct btree *b;
+
+	BUG_ON(!btree_node_locked(iter, level + 1));
+	BUG_ON(level >= BTREE_MAX_DEPTH);
+
+	rcu_read_lock();
+	b = mca_find(c, k);
+	rcu_read_unlock();
+
+	if (b)
+		return;
+
+	/* mca_alloc() would cannibalize if we hold the cannibalize lock: */
+	if (c->btree_cache_alloc_lock == current)
+		return;
+
+	b = mca_alloc(c);
+	if (IS_ERR(b))
+		return;
+
+	bkey_copy(&b->key, k);
+	if (mca_hash_insert(c, b, level, iter->btree_id))
+		goto err;
+
+	trace_bcache_btree_node_prefetch(c, b);
+
+	if (!bch_btree_node_read_async(c, b))
+		return;
+
+	mca_hash_remove(c, b);
+err:
+	/* mark as unhashed... */
+	bkey_i_to_extent(&b->key)->v._data[0] = 0;
+
+	mutex_lock(&c->btree_cache_lock);
+	list_move(&b->list, &c->btree_cache_freeable);
+	mutex_unlock(&c->btree_cache_lock);
+
+	six_unlock_write(&b->lock);
+	six_unlock_intent(&b->lock);
+}
+
 /**
  * bch_btree_node_get - find a btree node in the cache and lock it, reading it
  * in from disk if necessary.
@@ -19,6 +19,8 @@ int mca_cannibalize_lock(struct cache_set *, struct closure *);
 
 struct btree *mca_alloc(struct cache_set *);
 
+void bch_btree_node_prefetch(struct btree_iter *, const struct bkey_i *,
+			     unsigned);
 struct btree *bch_btree_node_get(struct btree_iter *, const struct bkey_i *,
 				 unsigned, enum six_lock_type);
 
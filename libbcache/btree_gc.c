@@ -100,9 +100,15 @@ u8 bch_btree_key_recalc_oldest_gen(struct cache_set *c, struct bkey_s_c k)
 
 		extent_for_each_online_device(c, e, ptr, ca) {
 			size_t b = PTR_BUCKET_NR(ca, ptr);
+			u8 old, v = READ_ONCE(ca->oldest_gens[b]);
 
-			if (__gen_after(ca->oldest_gens[b], ptr->gen))
-				ca->oldest_gens[b] = ptr->gen;
+			/* initial gc marks from several threads: */
+			do {
+				old = v;
+				if (!__gen_after(old, ptr->gen))
+					break;
+			} while ((v = cmpxchg(&ca->oldest_gens[b],
+					      old, ptr->gen)) != old);
 
 			max_stale = max(max_stale, ptr_stale(ca, ptr));
 		}
@@ -116,29 +122,60 @@ u8 bch_btree_key_recalc_oldest_gen(struct cache_set *c, struct bkey_s_c k)
 /*
  * For runtime mark and sweep:
  */
-static u8 bch_btree_mark_key(struct cache_set *c, enum bkey_type type,
-			     struct bkey_s_c k)
+static u8 __bch_btree_mark_key(struct cache_set *c, enum bkey_type type,
+			       struct bkey_s_c k, struct bch_fs_usage *stats)
 {
 	switch (type) {
 	case BKEY_TYPE_BTREE:
-		bch_gc_mark_key(c, k, c->sb.btree_node_size, true);
+		__bch_gc_mark_key(c, k, c->sb.btree_node_size, true, stats);
 		return 0;
 	case BKEY_TYPE_EXTENTS:
-		bch_gc_mark_key(c, k, k.k->size, false);
+		__bch_gc_mark_key(c, k, k.k->size, false, stats);
 		return bch_btree_key_recalc_oldest_gen(c, k);
 	default:
 		BUG();
 	}
 }
 
+static u8 bch_btree_mark_key(struct cache_set *c, enum bkey_type type,
+			     struct bkey_s_c k)
+{
+	struct bch_fs_usage stats;
+	u8 ret;
+
+	bch_zero(stats);
+	ret = __bch_btree_mark_key(c, type, k, &stats);
+	bch_fs_stats_merge(c, &stats);
+
+	return ret;
+}
+
+static u8 __bch_btree_mark_key_initial(struct cache_set *c,
+				       enum bkey_type type,
+				       struct bkey_s_c k,
+				       struct bch_fs_usage *stats)
+{
+	u64 old, v = atomic64_read(&c->key_version);
+
+	while (k.k->version.lo > v &&
+	       (old = atomic64_cmpxchg(&c->key_version, v,
+				       k.k->version.lo)) != v)
+		v = old;
+
+	return __bch_btree_mark_key(c, type, k, stats);
+}
+
 u8 bch_btree_mark_key_initial(struct cache_set *c, enum bkey_type type,
 			  struct bkey_s_c k)
 {
-	atomic64_set(&c->key_version,
-		     max_t(u64, k.k->version.lo,
-			   atomic64_read(&c->key_version)));
+	struct bch_fs_usage stats;
+	u8 ret;
 
-	return bch_btree_mark_key(c, type, k);
+	bch_zero(stats);
+	ret = __bch_btree_mark_key_initial(c, type, k, &stats);
+	bch_fs_stats_merge(c, &stats);
+
+	return ret;
 }
 
 static bool btree_gc_mark_node(struct cache_set *c, struct btree *b)
@@ -469,6 +506,9 @@ void bch_gc(struct cache_set *c)
 	/* Indicates that gc is no longer in progress: */
 	gc_pos_set(c, gc_phase(GC_PHASE_DONE));
 
+	for_each_cache(ca, c, i)
+		bch_dev_bucket_lru_resync(ca);
+
 	up_write(&c->gc_lock);
 	trace_bcache_gc_end(c);
 	bch_time_stats_update(&c->btree_gc_time, start_time);
@@ -737,7 +777,7 @@ static int bch_coalesce_btree(struct cache_set *c, enum btree_id btree_id)
 	 */
 	memset(merge, 0, sizeof(merge));
 
-	__for_each_btree_node(&iter, c, btree_id, POS_MIN, 0, b, U8_MAX) {
+	__for_each_btree_node(&iter, c, btree_id, POS_MIN, 0, b, U8_MAX, 0) {
 		memmove(merge + 1, merge,
 			sizeof(merge) - sizeof(merge[0]));
 		memmove(lock_seq + 1, lock_seq,
@@ -889,52 +929,239 @@ int bch_gc_thread_start(struct cache_set *c)
 
 /* Initial GC computes bucket marks during startup */
 
-static void bch_initial_gc_btree(struct cache_set *c, enum btree_id id)
+/*
+ * Initial GC is run in parallel: each btree is marked by its own job, and the
+ * extents btree is further split into one job per child of the root node.
+ *
+ * A job marks every node whose max key is in [start, end] - nodes at a given
+ * level don't overlap and an interior node's max key is the max key of its last
+ * child, so every node below the root is marked by exactly one job. When a
+ * btree is split the root itself is marked before the jobs are started.
+ *
+ * Bucket marks are updated with cmpxchg(), and each job accumulates its own
+ * cache set usage and merges it when done, so the result doesn't depend on how
+ * the jobs were scheduled.
+ */
+struct initial_gc_job {
+	struct work_struct	work;
+	struct closure		*cl;
+	struct cache_set	*c;
+	enum btree_id		id;
+	unsigned		max_level;
+	struct bpos		start;
+	struct bpos		end;
+	struct bch_fs_usage	stats;
+};
+
+static void bch_initial_gc_node(struct cache_set *c, struct btree *b,
+				struct bch_fs_usage *stats)
+{
+	if (btree_node_has_ptrs(b)) {
+		struct btree_node_iter node_iter;
+		struct bkey unpacked;
+		struct bkey_s_c k;
+
+		for_each_btree_node_key_unpack(b, k, &node_iter,
+					       btree_node_is_extents(b),
+					       &unpacked)
+			__bch_btree_mark_key_initial(c, btree_node_type(b),
+						     k, stats);
+	}
+}
+
+static void bch_initial_gc_work(struct work_struct *work)
 {
+	struct initial_gc_job *job =
+		container_of(work, struct initial_gc_job, work);
+	struct cache_set *c = job->c;
 	struct btree_iter iter;
 	struct btree *b;
 	struct range_checks r;
+	struct bpos pos = job->start;
+	unsigned i;
 
 	btree_node_range_checks_init(&r, 0);
 
-	if (!c->btree_roots[id].b)
-		return;
+	for (i = 0; i < BTREE_MAX_DEPTH; i++)
+		r.l[i].min = r.l[i].max = job->start;
+
+	/*
+	 * Extents are indexed by their end, so the previous job's last node
+	 * ends at our start and a lookup of our start would land in it - start
+	 * the iterator just past it:
+	 */
+	if (job->id == BTREE_ID_EXTENTS && bkey_cmp(pos, POS_MIN))
+		pos = bkey_successor(pos);
 
 	/*
 	 * We have to hit every btree node before starting journal replay, in
 	 * order for the journal seq blacklist machinery to work:
 	 */
-	for_each_btree_node(&iter, c, id, POS_MIN, 0, b) {
+	for_each_btree_node_readahead(&iter, c, job->id, pos, 0, b,
+				      BTREE_SCAN_READAHEAD) {
+		if (bkey_cmp(b->key.k.p, job->end) > 0)
+			break;
+
+		if (b->level > job->max_level)
+			continue;
+
+		btree_node_range_checks(c, b, &r);
+		bch_initial_gc_node(c, b, &job->stats);
+
+		bch_btree_iter_cond_resched(&iter);
+	}
+
+	bch_btree_iter_unlock(&iter);
+
+	bch_fs_stats_merge(c, &job->stats);
+	closure_put(job->cl);
+}
+
+static void initial_gc_job_init(struct initial_gc_job *job,
+				struct closure *cl, struct cache_set *c,
+				enum btree_id id, unsigned max_level,
+				struct bpos start, struct bpos end)
+{
+	INIT_WORK(&job->work, bch_initial_gc_work);
+	job->cl		= cl;
+	job->c		= c;
+	job->id		= id;
+	job->max_level	= max_level;
+	job->start	= start;
+	job->end	= end;
+	bch_zero(job->stats);
+}
+
+/*
+ * Mark the root of @id and set up one job per child of the root; returns the
+ * number of jobs, or -ENOMEM:
+ */
+static int bch_initial_gc_split_btree(struct cache_set *c, enum btree_id id,
+				      struct closure *cl,
+				      struct initial_gc_job **jobs)
+{
+	struct btree_iter iter;
+	struct btree_node_iter node_iter;
+	struct range_checks r;
+	struct bch_fs_usage stats;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+	struct btree *b;
+	struct bpos start = POS_MIN;
+	unsigned level = c->btree_roots[id].b->level;
+	int nr = 0;
+
+	*jobs = NULL;
+	bch_zero(stats);
+
+	for_each_btree_node(&iter, c, id, POS_MIN, level, b) {
+		/* the root could have been split since we checked its level: */
+		if (b->level != level || bkey_cmp(b->key.k.p, POS_MAX))
+			break;
+
+		btree_node_range_checks_init(&r, level);
 		btree_node_range_checks(c, b, &r);
 
-		if (btree_node_has_ptrs(b)) {
-			struct btree_node_iter node_iter;
-			struct bkey unpacked;
-			struct bkey_s_c k;
+		for_each_btree_node_key_unpack(b, k, &node_iter, false,
+					       &unpacked)
+			nr++;
+
+		if (!nr)
+			break;
 
-			for_each_btree_node_key_unpack(b, k, &node_iter,
-						       btree_node_is_extents(b),
-						       &unpacked)
-				bch_btree_mark_key_initial(c, btree_node_type(b), k);
+		*jobs = kcalloc(nr, sizeof(**jobs), GFP_KERNEL);
+		if (!*jobs) {
+			nr = -ENOMEM;
+			break;
 		}
 
-		bch_btree_iter_cond_resched(&iter);
+		nr = 0;
+		for_each_btree_node_key_unpack(b, k, &node_iter, false,
+					       &unpacked) {
+			__bch_btree_mark_key_initial(c, BKEY_TYPE_BTREE,
+						     k, &stats);
+
+			initial_gc_job_init(&(*jobs)[nr++], cl, c, id,
+					    level - 1, start, k.k->p);
+
+			if (bkey_cmp(k.k->p, POS_MAX))
+				start = btree_type_successor(id, k.k->p);
+		}
+		break;
 	}
 
 	bch_btree_iter_unlock(&iter);
+	bch_fs_stats_merge(c, &stats);
 
-	bch_btree_mark_key(c, BKEY_TYPE_BTREE,
-			   bkey_i_to_s_c(&c->btree_roots[id].b->key));
+	return nr;
 }
 
 int bch_initial_gc(struct cache_set *c, struct list_head *journal)
 {
+	struct workqueue_struct *wq;
+	struct initial_gc_job *jobs[BTREE_ID_NR] = { NULL };
+	int nr[BTREE_ID_NR] = { 0 };
+	struct closure cl;
 	enum btree_id id;
+	int i, ret = 0;
 
 	bch_mark_metadata(c);
 
+	wq = alloc_workqueue("bcache_initial_gc", WQ_UNBOUND, 0);
+	if (!wq)
+		return -ENOMEM;
+
+	closure_init_stack(&cl);
+
+	for (id = 0; id < BTREE_ID_NR; id++) {
+		if (!c->btree_roots[id].b)
+			continue;
+
+		if (id == BTREE_ID_EXTENTS &&
+		    c->btree_roots[id].b->level) {
+			nr[id] = bch_initial_gc_split_btree(c, id, &cl,
+							    &jobs[id]);
+			if (nr[id] < 0) {
+				ret = nr[id];
+				nr[id] = 0;
+				break;
+			}
+
+			/* root was split - fall back to a single job: */
+			if (nr[id])
+				continue;
+		}
+
+		jobs[id] = kcalloc(1, sizeof(*jobs[id]), GFP_KERNEL);
+		if (!jobs[id]) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		nr[id] = 1;
+		initial_gc_job_init(jobs[id], &cl, c, id, BTREE_MAX_DEPTH,
+				    POS_MIN, POS_MAX);
+	}
+
 	for (id = 0; id < BTREE_ID_NR; id++)
-		bch_initial_gc_btree(c, id);
+		for (i = 0; i < nr[id]; i++) {
+			closure_get(&cl);
+			queue_work(wq, &jobs[id][i].work);
+		}
+
+	closure_sync(&cl);
+	destroy_workqueue(wq);
+
+	for (id = 0; id < BTREE_ID_NR; id++) {
+		kfree(jobs[id]);
+
+		if (c->btree_roots[id].b)
+			bch_btree_mark_key(c, BKEY_TYPE_BTREE,
+				bkey_i_to_s_c(&c->btree_roots[id].b->key));
+	}
+
+	if (ret)
+		return ret;
 
 	if (journal)
 		bch_journal_mark(c, journal);
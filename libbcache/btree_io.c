@@ -1182,51 +1182,145 @@ static void btree_node_read_endio(struct bio *bio)
 	closure_put(bio->bi_private);
 }
 
-void bch_btree_node_read(struct cache_set *c, struct btree *b)
+static struct bio *btree_node_read_bio(struct cache_set *c, struct btree *b,
+				       struct extent_pick_ptr *pick)
 {
-	uint64_t start_time = local_clock();
-	struct closure cl;
 	struct bio *bio;
-	struct extent_pick_ptr pick;
 
 	trace_bcache_btree_read(c, b);
 
-	closure_init_stack(&cl);
-
-	pick = bch_btree_pick_ptr(c, b);
-	if (bch_fs_fatal_err_on(!pick.ca, c,
+	*pick = bch_btree_pick_ptr(c, b);
+	if (bch_fs_fatal_err_on(!pick->ca, c,
 				"no cache device for btree node")) {
 		set_btree_node_read_error(b);
-		return;
+		return NULL;
 	}
 
 	bio = bio_alloc_bioset(GFP_NOIO, btree_pages(c), &c->btree_read_bio);
-	bio->bi_bdev		= pick.ca->disk_sb.bdev;
-	bio->bi_iter.bi_sector	= pick.ptr.offset;
+	bio->bi_bdev		= pick->ca->disk_sb.bdev;
+	bio->bi_iter.bi_sector	= pick->ptr.offset;
 	bio->bi_iter.bi_size	= btree_bytes(c);
-	bio->bi_end_io		= btree_node_read_endio;
-	bio->bi_private		= &cl;
-	bio_set_op_attrs(bio, REQ_OP_READ, REQ_META|READ_SYNC);
 
 	bch_bio_map(bio, b->data);
+	return bio;
+}
 
-	closure_get(&cl);
-	bch_generic_make_request(bio, c);
-	closure_sync(&cl);
-
+static void btree_node_read_complete(struct cache_set *c, struct btree *b,
+				     struct bio *bio,
+				     struct extent_pick_ptr *pick,
+				     u64 start_time)
+{
 	if (bch_dev_fatal_io_err_on(bio->bi_error,
-				  pick.ca, "IO error reading bucket %zu",
-				  PTR_BUCKET_NR(pick.ca, &pick.ptr)) ||
+				  pick->ca, "IO error reading bucket %zu",
+				  PTR_BUCKET_NR(pick->ca, &pick->ptr)) ||
 	    bch_meta_read_fault("btree")) {
 		set_btree_node_read_error(b);
 		goto out;
 	}
 
-	bch_btree_node_read_done(c, b, pick.ca, &pick.ptr);
+	bch_btree_node_read_done(c, b, pick->ca, &pick->ptr);
 	bch_time_stats_update(&c->btree_read_time, start_time);
 out:
 	bio_put(bio);
-	percpu_ref_put(&pick.ca->ref);
+	percpu_ref_put(&pick->ca->ref);
+}
+
+void bch_btree_node_read(struct cache_set *c, struct btree *b)
+{
+	uint64_t start_time = local_clock();
+	struct closure cl;
+	struct bio *bio;
+	struct extent_pick_ptr pick;
+
+	closure_init_stack(&cl);
+
+	bio = btree_node_read_bio(c, b, &pick);
+	if (!bio)
+		return;
+
+	bio->bi_end_io		= btree_node_read_endio;
+	bio->bi_private		= &cl;
+	bio_set_op_attrs(bio, REQ_OP_READ, REQ_META|READ_SYNC);
+
+	closure_get(&cl);
+	bch_generic_make_request(bio, c);
+	closure_sync(&cl);
+
+	btree_node_read_complete(c, b, bio, &pick, start_time);
+}
+
+struct btree_read_async {
+	struct work_struct	work;
+	struct cache_set	*c;
+	struct btree		*b;
+	struct bio		*bio;
+	struct extent_pick_ptr	pick;
+	u64			start_time;
+};
+
+static void btree_node_read_async_work(struct work_struct *work)
+{
+	struct btree_read_async *rb =
+		container_of(work, struct btree_read_async, work);
+	struct btree *b = rb->b;
+
+	btree_node_read_complete(rb->c, b, rb->bio, &rb->pick,
+				 rb->start_time);
+
+	six_unlock_write(&b->lock);
+	six_unlock_intent(&b->lock);
+	closure_put(&rb->c->cl);
+	kfree(rb);
+}
+
+static void btree_node_read_async_endio(struct bio *bio)
+{
+	struct btree_read_async *rb = bio->bi_private;
+
+	/* don't verify and sort the node in the completion path: */
+	queue_work(system_unbound_wq, &rb->work);
+}
+
+/**
+ * bch_btree_node_read_async - start reading a btree node, without waiting
+ *
+ * @b must be intent and write locked; both locks are dropped when the read
+ * completes, so anyone else who finds the node in the btree cache blocks on
+ * its lock until then.
+ *
+ * Returns -ENOMEM if the read couldn't be started, in which case @b is still
+ * locked and hasn't been read.
+ */
+int bch_btree_node_read_async(struct cache_set *c, struct btree *b)
+{
+	struct btree_read_async *rb;
+
+	rb = kmalloc(sizeof(*rb), GFP_NOIO);
+	if (!rb)
+		return -ENOMEM;
+
+	INIT_WORK(&rb->work, btree_node_read_async_work);
+	rb->c		= c;
+	rb->b		= b;
+	rb->start_time	= local_clock();
+
+	rb->bio = btree_node_read_bio(c, b, &rb->pick);
+	if (!rb->bio) {
+		kfree(rb);
+		six_unlock_write(&b->lock);
+		six_unlock_intent(&b->lock);
+		return 0;
+	}
+
+	/* bch_fs_stop() waits on c->cl for reads still in flight: */
+	closure_get(&c->cl);
+
+	rb->bio->bi_end_io	= btree_node_read_async_endio;
+	rb->bio->bi_private	= rb;
+	bio_set_op_attrs(rb->bio, REQ_OP_READ, REQ_META);
+
+	bch_generic_make_request(rb->bio, c);
+	return 0;
 }
 
 int bch_btree_root_read(struct cache_set *c, enum btree_id id,
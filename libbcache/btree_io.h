@@ -53,6 +53,7 @@ void bch_btree_init_next(struct cache_set *, struct btree *,
 void bch_btree_node_read_done(struct cache_set *, struct btree *,
 			      struct cache *, const struct bch_extent_ptr *);
 void bch_btree_node_read(struct cache_set *, struct btree *);
+int bch_btree_node_read_async(struct cache_set *, struct btree *);
 int bch_btree_root_read(struct cache_set *, enum btree_id,
 			const struct bkey_i *, unsigned);
 
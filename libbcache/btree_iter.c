@@ -711,15 +711,44 @@ static inline int btree_iter_lock_root(struct btree_iter *iter,
 	}
 }
 
+/*
+ * Start reading in the iter->readahead children of the current interior node
+ * after the one we're about to descend into - the node has to be locked:
+ */
+static noinline void btree_iter_readahead(struct btree_iter *iter)
+{
+	struct btree *b = iter->nodes[iter->level];
+	struct btree_node_iter node_iter = iter->node_iters[iter->level];
+	struct bkey_packed *k;
+	BKEY_PADDED(k) tmp;
+	unsigned nr = iter->readahead;
+
+	while (nr--) {
+		bch_btree_node_iter_advance(&node_iter, b);
+
+		k = bch_btree_node_iter_peek(&node_iter, b);
+		if (!k)
+			break;
+
+		bkey_unpack(b, &tmp.k, k);
+		bch_btree_node_prefetch(iter, &tmp.k, iter->level - 1);
+	}
+}
+
 static inline int btree_iter_down(struct btree_iter *iter)
 {
-	struct btree *b;
-	struct bkey_s_c k = __btree_iter_peek(iter);
+	struct btree *b = iter->nodes[iter->level];
+	struct bkey_packed *k =
+		bch_btree_node_iter_peek(&iter->node_iters[iter->level], b);
 	unsigned level = iter->level - 1;
 	enum six_lock_type lock_type = btree_lock_want(iter, level);
 	BKEY_PADDED(k) tmp;
 
-	bkey_reassemble(&tmp.k, k);
+	/* Not via iter->k, which has the key we last returned: */
+	bkey_unpack(b, &tmp.k, k);
+
+	if (iter->readahead)
+		btree_iter_readahead(iter);
 
 	b = bch_btree_node_get(iter, &tmp.k, level, lock_type);
 	if (unlikely(IS_ERR(b)))
@@ -858,10 +887,18 @@ int __must_check __bch_btree_iter_traverse(struct btree_iter *iter)
 	 * root) - advance its node iterator if necessary:
 	 */
 	if (iter->nodes[iter->level]) {
-		struct bkey_s_c k;
+		struct btree *b = iter->nodes[iter->level];
+		struct bkey_packed *k;
+		struct bkey u;
 
-		while ((k = __btree_iter_peek_all(iter)).k &&
-		       !btree_iter_pos_cmp(iter->pos, k.k, iter->is_extents))
+		/*
+		 * Don't unpack into iter->k - bch_btree_iter_advance_pos()
+		 * still needs the key we last returned:
+		 */
+		while ((k = bch_btree_node_iter_peek_all(
+					&iter->node_iters[iter->level], b)) &&
+		       (u = bkey_unpack_key(b, k),
+			!btree_iter_pos_cmp(iter->pos, &u, iter->is_extents)))
 			__btree_iter_advance(iter);
 	}
 
@@ -1116,6 +1153,7 @@ void __bch_btree_iter_init(struct btree_iter *iter, struct cache_set *c,
 	iter->btree_id			= btree_id;
 	iter->at_end_of_leaf		= 0;
 	iter->error			= 0;
+	iter->readahead			= 0;
 	iter->c				= c;
 	iter->pos			= pos;
 	memset(iter->nodes, 0, sizeof(iter->nodes));
@@ -30,6 +30,12 @@ struct btree_iter {
 
 	s8			error;
 
+	/*
+	 * Number of sibling nodes to start reading in ahead of the iterator
+	 * each time it descends from an interior node - for sequential scans:
+	 */
+	u8			readahead;
+
 	struct cache_set	*c;
 
 	/* Current position of the iterator */
@@ -215,30 +221,44 @@ static inline int btree_iter_cmp(const struct btree_iter *l,
 	return __btree_iter_cmp(l->btree_id, l->pos, r);
 }
 
+/* Readahead depth for iterators that walk a whole btree: */
+#define BTREE_SCAN_READAHEAD	8
+
 #define __for_each_btree_node(_iter, _c, _btree_id, _start, _depth,	\
-			      _b, _locks_want)				\
+			      _b, _locks_want, _readahead)		\
 	for (__bch_btree_iter_init((_iter), (_c), (_btree_id),		\
 				   _start, _locks_want, _depth),	\
 	     (_iter)->is_extents = false,				\
+	     (_iter)->readahead = (_readahead),				\
 	     _b = bch_btree_iter_peek_node(_iter);			\
 	     (_b);							\
 	     (_b) = bch_btree_iter_next_node(_iter, _depth))
 
 #define for_each_btree_node(_iter, _c, _btree_id, _start, _depth, _b)	\
-	__for_each_btree_node(_iter, _c, _btree_id, _start, _depth, _b, 0)
+	__for_each_btree_node(_iter, _c, _btree_id, _start, _depth, _b, 0, 0)
+
+#define for_each_btree_node_readahead(_iter, _c, _btree_id, _start,	\
+				      _depth, _b, _readahead)		\
+	__for_each_btree_node(_iter, _c, _btree_id, _start, _depth, _b,	\
+			      0, _readahead)
 
 #define __for_each_btree_key(_iter, _c, _btree_id,  _start,		\
-			     _k, _locks_want)				\
+			     _k, _locks_want, _readahead)		\
 	for (__bch_btree_iter_init((_iter), (_c), (_btree_id),		\
-				   _start, _locks_want, 0);		\
+				   _start, _locks_want, 0),		\
+	     (_iter)->readahead = (_readahead);				\
 	     !IS_ERR_OR_NULL(((_k) = bch_btree_iter_peek(_iter)).k);	\
 	     bch_btree_iter_advance_pos(_iter))
 
 #define for_each_btree_key(_iter, _c, _btree_id,  _start, _k)		\
-	__for_each_btree_key(_iter, _c, _btree_id, _start, _k, 0)
+	__for_each_btree_key(_iter, _c, _btree_id, _start, _k, 0, 0)
 
 #define for_each_btree_key_intent(_iter, _c, _btree_id,  _start, _k)	\
-	__for_each_btree_key(_iter, _c, _btree_id, _start, _k, 1)
+	__for_each_btree_key(_iter, _c, _btree_id, _start, _k, 1, 0)
+
+#define for_each_btree_key_readahead(_iter, _c, _btree_id,  _start,	\
+				     _k, _readahead)			\
+	__for_each_btree_key(_iter, _c, _btree_id, _start, _k, 0, _readahead)
 
 #define __for_each_btree_key_with_holes(_iter, _c, _btree_id,		\
 					_start, _k, _locks_want)	\
@@ -78,6 +78,8 @@ struct btree {
 
 	struct btree_node	*data;
 	void			*aux_data;
+	/* executable copy of the unpack function compiled into aux_data: */
+	void			*unpack_fn;
 
 	/*
 	 * Sets of sorted keys - the real btree node - plus a binary search tree
@@ -1904,6 +1904,50 @@ static int btree_trans_entry_cmp(const void *_l, const void *_r)
 	return btree_iter_cmp(l->iter, r->iter);
 }
 
+static int btree_trans_journal_res_get(struct btree_insert *trans,
+				       unsigned u64s_min, unsigned u64s)
+{
+	memset(&trans->journal_res, 0, sizeof(trans->journal_res));
+
+	return !(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)
+		? bch_journal_res_get(&trans->c->journal,
+				      &trans->journal_res,
+				      u64s_min, u64s)
+		: 0;
+}
+
+/*
+ * Insert one entry into its write locked leaf: sets @split if the leaf has to
+ * be split first, and @cycle_gc_lock if gc_lock has to be taken before
+ * retrying.
+ */
+static int btree_trans_insert_entry(struct btree_insert *trans,
+				    struct btree_insert_entry *i,
+				    struct btree_iter **split,
+				    bool *cycle_gc_lock)
+{
+	switch (btree_insert_key(trans, i)) {
+	case BTREE_INSERT_OK:
+		i->done = true;
+		return 0;
+	case BTREE_INSERT_JOURNAL_RES_FULL:
+	case BTREE_INSERT_NEED_TRAVERSE:
+		return -EINTR;
+	case BTREE_INSERT_NEED_RESCHED:
+		return -EAGAIN;
+	case BTREE_INSERT_BTREE_NODE_FULL:
+		*split = i->iter;
+		return 0;
+	case BTREE_INSERT_ENOSPC:
+		return -ENOSPC;
+	case BTREE_INSERT_NEED_GC_LOCK:
+		*cycle_gc_lock = true;
+		return -EINTR;
+	default:
+		BUG();
+	}
+}
+
 /* Normal update interface: */
 
 /**
@@ -1948,13 +1992,7 @@ retry:
 		if (!i->done)
 			u64s += jset_u64s(i->k->k.u64s + i->extra_res);
 
-	memset(&trans->journal_res, 0, sizeof(trans->journal_res));
-
-	ret = !(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)
-		? bch_journal_res_get(&c->journal,
-				      &trans->journal_res,
-				      u64s, u64s)
-		: 0;
+	ret = btree_trans_journal_res_get(trans, u64s, u64s);
 	if (ret)
 		goto err;
 
@@ -1987,33 +2025,15 @@ retry:
 	cycle_gc_lock = false;
 
 	trans_for_each_entry(trans, i) {
+		int ret2;
+
 		if (i->done)
 			continue;
 
-		switch (btree_insert_key(trans, i)) {
-		case BTREE_INSERT_OK:
-			i->done = true;
-			break;
-		case BTREE_INSERT_JOURNAL_RES_FULL:
-		case BTREE_INSERT_NEED_TRAVERSE:
-			ret = -EINTR;
-			break;
-		case BTREE_INSERT_NEED_RESCHED:
-			ret = -EAGAIN;
-			break;
-		case BTREE_INSERT_BTREE_NODE_FULL:
-			split = i->iter;
-			break;
-		case BTREE_INSERT_ENOSPC:
-			ret = -ENOSPC;
-			break;
-		case BTREE_INSERT_NEED_GC_LOCK:
-			cycle_gc_lock = true;
-			ret = -EINTR;
-			break;
-		default:
-			BUG();
-		}
+		ret2 = btree_trans_insert_entry(trans, i, &split,
+						&cycle_gc_lock);
+		if (ret2)
+			ret = ret2;
 
 		if (!trans->did_work && (ret || split))
 			break;
@@ -2117,6 +2137,153 @@ int bch_btree_insert_list_at(struct btree_iter *iter,
 	return 0;
 }
 
+/**
+ * bch_btree_insert_list - bulk insert a sorted list of keys
+ * @c:			pointer to struct cache_set
+ * @id:			btree to insert into
+ * @keys:		keys to insert: sorted, and not overlapping
+ * @disk_res:		disk reservation
+ * @journal_seq:	if non-null, set to the journal sequence number of the
+ *			last insert
+ * @flags:		BTREE_INSERT_* flags (not BTREE_INSERT_ATOMIC)
+ *
+ * Equivalent to calling bch_btree_insert() on each key, but for loading lots of
+ * keys at once: instead of a transaction per key, each batch of keys that goes
+ * into the same leaf shares one traversal, one write lock on the leaf and one
+ * journal reservation. Leaves are filled sequentially and split as they fill
+ * up, as with normal inserts.
+ *
+ * Inserted keys are dropped from @keys - on error, @keys is left containing
+ * the keys that weren't inserted.
+ */
+int bch_btree_insert_list(struct cache_set *c, enum btree_id id,
+			  struct keylist *keys,
+			  struct disk_reservation *disk_res,
+			  u64 *journal_seq, unsigned flags)
+{
+	struct btree_iter iter;
+	struct btree_insert_entry entry;
+	struct btree_insert trans = {
+		.c		= c,
+		.disk_res	= disk_res,
+		.journal_seq	= journal_seq,
+		.flags		= flags,
+		.nr		= 1,
+		.entries	= &entry,
+	};
+	struct bkey_i *k = keys->keys;
+	int ret = 0, ret2;
+
+	BUG_ON(flags & BTREE_INSERT_ATOMIC);
+	verify_keys_sorted(keys);
+
+	if (bch_keylist_empty(keys))
+		return 0;
+
+	if (unlikely(!percpu_ref_tryget(&c->writes)))
+		return -EROFS;
+
+	bch_btree_iter_init_intent(&iter, c, id, bkey_start_pos(&k->k));
+
+	while (k != keys->top) {
+		struct btree *b;
+		struct btree_iter *split = NULL;
+		struct bkey_i *i;
+		unsigned key_u64s = 0, u64s = 0, leaf_u64s;
+		bool cycle_gc_lock = false;
+
+		bch_btree_iter_set_pos(&iter, bkey_start_pos(&k->k));
+
+		ret = bch_btree_iter_traverse(&iter);
+		if (ret)
+			break;
+
+		b = iter.nodes[0];
+
+		/*
+		 * Size the journal reservation for the keys that'll fit in this
+		 * leaf - the leaf's space is in key u64s, the reservation in
+		 * journal entry u64s:
+		 */
+		leaf_u64s = bch_btree_keys_u64s_remaining(c, b);
+
+		for (i = k;
+		     i != keys->top &&
+		     btree_iter_pos_cmp(bkey_start_pos(&i->k), &b->key.k,
+					iter.is_extents) &&
+		     key_u64s + i->k.u64s <= leaf_u64s;
+		     i = bkey_next(i)) {
+			key_u64s += i->k.u64s;
+			u64s += jset_u64s(i->k.u64s);
+		}
+
+		u64s = max(u64s, jset_u64s(k->k.u64s));
+
+		ret = btree_trans_journal_res_get(&trans,
+					jset_u64s(k->k.u64s), u64s);
+		if (ret)
+			break;
+
+		btree_node_lock_for_insert(b, &iter);
+
+		while (k != keys->top &&
+		       btree_iter_pos_cmp(bkey_start_pos(&k->k), &b->key.k,
+					  iter.is_extents)) {
+			entry = BTREE_INSERT_ENTRY(&iter, k);
+
+			if (!journal_res_insert_fits(&trans, &entry))
+				break;
+
+			if (!bch_btree_node_insert_fits(c, b, k->k.u64s)) {
+				split = &iter;
+				break;
+			}
+
+			bch_btree_iter_set_pos_same_leaf(&iter,
+						bkey_start_pos(&k->k));
+
+			ret = btree_trans_insert_entry(&trans, &entry, &split,
+						       &cycle_gc_lock);
+			if (ret || split)
+				break;
+
+			k = bkey_next(k);
+		}
+
+		btree_node_unlock_write(b, &iter);
+		bch_journal_res_put(&c->journal, &trans.journal_res);
+
+		/* Anything that just needs a retraverse, we'll do next pass: */
+		if (ret == -EINTR || ret == -EAGAIN)
+			ret = 0;
+		if (ret)
+			break;
+
+		if (split) {
+			ret = bch_btree_split_leaf(split, flags);
+			if (ret == -EINTR)
+				ret = 0;
+			if (ret)
+				break;
+		}
+
+		if (cycle_gc_lock) {
+			bch_btree_iter_unlock(&iter);
+			down_read(&c->gc_lock);
+			up_read(&c->gc_lock);
+		}
+	}
+
+	ret2 = bch_btree_iter_unlock(&iter);
+	percpu_ref_put(&c->writes);
+
+	/* Drop the keys we inserted: */
+	memmove_u64s_down(keys->keys, k, (u64 *) keys->top - (u64 *) k);
+	keys->top_p -= (u64 *) k - keys->keys_p;
+
+	return ret ?: ret2;
+}
+
 /**
  * bch_btree_insert_check_key - insert dummy key into btree
  *
@@ -386,6 +386,8 @@ int __bch_btree_insert_at(struct btree_insert *);
 int bch_btree_insert_list_at(struct btree_iter *, struct keylist *,
 			     struct disk_reservation *,
 			     struct extent_insert_hook *, u64 *, unsigned);
+int bch_btree_insert_list(struct cache_set *, enum btree_id, struct keylist *,
+			  struct disk_reservation *, u64 *, unsigned);
 
 static inline bool journal_res_insert_fits(struct btree_insert *trans,
 					   struct btree_insert_entry *insert)
@@ -252,7 +252,7 @@ static bool bucket_became_unavailable(struct cache_set *c,
 	       c->gc_pos.phase == GC_PHASE_DONE;
 }
 
-static void bucket_stats_update(struct cache *ca,
+static void bucket_stats_update(struct cache *ca, struct bucket *g,
 				struct bucket_mark old, struct bucket_mark new,
 				struct bch_fs_usage *bch_alloc_stats)
 {
@@ -277,41 +277,113 @@ static void bucket_stats_update(struct cache *ca,
 			new.dirty_sectors;
 	}
 
-	preempt_disable();
-	cache_stats = this_cpu_ptr(ca->bucket_stats_percpu);
+	/*
+	 * Bucket marks may be updated from several threads at once (e.g. by
+	 * initial gc), so use this_cpu_add() rather than a plain read-modify-write:
+	 */
+	cache_stats = ca->bucket_stats_percpu;
 
-	cache_stats->sectors_cached +=
-		(int) new.cached_sectors - (int) old.cached_sectors;
+	this_cpu_add(cache_stats->sectors_cached,
+		     (int) new.cached_sectors - (int) old.cached_sectors);
 
 	if (is_meta_bucket(old))
-		cache_stats->sectors_meta -= old.dirty_sectors;
+		this_cpu_sub(cache_stats->sectors_meta, old.dirty_sectors);
 	else
-		cache_stats->sectors_dirty -= old.dirty_sectors;
+		this_cpu_sub(cache_stats->sectors_dirty, old.dirty_sectors);
 
 	if (is_meta_bucket(new))
-		cache_stats->sectors_meta += new.dirty_sectors;
+		this_cpu_add(cache_stats->sectors_meta, new.dirty_sectors);
 	else
-		cache_stats->sectors_dirty += new.dirty_sectors;
+		this_cpu_add(cache_stats->sectors_dirty, new.dirty_sectors);
+
+	this_cpu_add(cache_stats->buckets_alloc,
+		(int) new.owned_by_allocator - (int) old.owned_by_allocator);
 
-	cache_stats->buckets_alloc +=
-		(int) new.owned_by_allocator - (int) old.owned_by_allocator;
+	this_cpu_add(cache_stats->buckets_meta,
+		     is_meta_bucket(new) - is_meta_bucket(old));
+	this_cpu_add(cache_stats->buckets_cached,
+		     is_cached_bucket(new) - is_cached_bucket(old));
+	this_cpu_add(cache_stats->buckets_dirty,
+		     is_dirty_bucket(new) - is_dirty_bucket(old));
 
-	cache_stats->buckets_meta += is_meta_bucket(new) - is_meta_bucket(old);
-	cache_stats->buckets_cached += is_cached_bucket(new) - is_cached_bucket(old);
-	cache_stats->buckets_dirty += is_dirty_bucket(new) - is_dirty_bucket(old);
-	preempt_enable();
+	if (bucket_lru_level(old) != bucket_lru_level(new))
+		bch_bucket_lru_update(ca, g);
 
 	if (!is_available_bucket(old) && is_available_bucket(new))
 		bch_wake_allocator(ca);
 }
 
+/* Reverse index: */
+
+static spinlock_t *bucket_backpointer_lock(struct cache *ca, struct bucket *g)
+{
+	return &ca->backpointer_locks[(g - ca->buckets) %
+				      BUCKET_BACKPOINTER_LOCKS];
+}
+
+static void bucket_backpointer_add(struct cache *ca, struct bucket *g,
+				   struct bkey_s_c_extent e)
+{
+	struct bucket_backpointer *bp = ca->backpointers + (g - ca->buckets);
+	spinlock_t *lock = bucket_backpointer_lock(ca, g);
+	struct bpos start = bkey_start_pos(e.k);
+
+	spin_lock(lock);
+	if (!bkey_cmp(bp->start, bp->end)) {
+		bp->start	= start;
+		bp->end		= e.k->p;
+	} else {
+		if (bkey_cmp(start, bp->start) < 0)
+			bp->start = start;
+		if (bkey_cmp(e.k->p, bp->end) > 0)
+			bp->end = e.k->p;
+	}
+	spin_unlock(lock);
+}
+
+static void bucket_backpointer_reset(struct cache *ca, struct bucket *g)
+{
+	struct bucket_backpointer *bp = ca->backpointers + (g - ca->buckets);
+	spinlock_t *lock = bucket_backpointer_lock(ca, g);
+	struct bucket_mark m;
+
+	spin_lock(lock);
+	/* A pointer may have been added since the caller saw it empty: */
+	m = READ_ONCE(g->mark);
+	if (!m.dirty_sectors && !m.cached_sectors)
+		bp->start = bp->end = POS_MIN;
+	spin_unlock(lock);
+}
+
+/**
+ * bch_bucket_backpointer - the part of the extents btree that may have
+ * pointers into @g
+ *
+ * Returns false if nothing points into @g, or if the reverse index isn't
+ * enabled.
+ */
+bool bch_bucket_backpointer(struct cache *ca, struct bucket *g,
+			    struct bucket_backpointer *ret)
+{
+	spinlock_t *lock = bucket_backpointer_lock(ca, g);
+
+	if (!ca->backpointers)
+		return false;
+
+	spin_lock(lock);
+	*ret = ca->backpointers[g - ca->buckets];
+	spin_unlock(lock);
+
+	return bkey_cmp(ret->start, ret->end) != 0;
+}
+
 #define bucket_data_cmpxchg(ca, g, new, expr)			\
 ({								\
 	struct bch_fs_usage _stats;				\
 	struct bucket_mark _old = bucket_cmpxchg(g, new, expr);	\
 								\
 	bch_zero(_stats);					\
-	bucket_stats_update(ca, _old, new, &_stats);		\
+	bucket_stats_update(ca, g, _old, new, &_stats);		\
 	_old;							\
 })
 
@@ -332,7 +404,14 @@ void bch_invalidate_bucket(struct cache *ca, struct bucket *g)
 		new.gen++;
 	}));
 
-	bucket_stats_update(ca, old, new, &stats);
+	bucket_stats_update(ca, g, old, new, &stats);
+
+	/* The new gen has to be written out before the bucket can be reused: */
+	bch_prio_set_dirty(ca, g - ca->buckets);
+
+	/* The gen changed, so any pointers into the bucket are now stale: */
+	if (ca->backpointers)
+		bucket_backpointer_reset(ca, g);
 
 	BUG_ON(old.dirty_sectors);
 
@@ -538,11 +617,25 @@ static void bch_mark_pointer(struct cache_set *c,
 			      old.counter,
 			      new.counter)) != old.counter);
 
-	bucket_stats_update(ca, old, new, NULL);
+	bucket_stats_update(ca, g, old, new, NULL);
 
 	BUG_ON(!may_make_unavailable &&
 	       bucket_became_unavailable(c, old, new));
 
+	/*
+	 * Btree node pointers aren't in the extents btree, and aren't found by
+	 * walking it. While gc is running, sector counts are only partial - so
+	 * don't take them hitting zero to mean nothing points here:
+	 */
+	if (ca->backpointers && type != S_META) {
+		if (sectors > 0)
+			bucket_backpointer_add(ca, g, e);
+		else if (!new.dirty_sectors &&
+			 !new.cached_sectors &&
+			 c->gc_pos.phase == GC_PHASE_DONE)
+			bucket_backpointer_reset(ca, g);
+	}
+
 	if (saturated &&
 	    atomic_long_add_return(saturated,
 				   &ca->saturated_count) >=
@@ -608,6 +701,21 @@ void __bch_gc_mark_key(struct cache_set *c, struct bkey_s_c k,
 	__bch_mark_key(c, k, sectors, metadata, true, stats, false, 0);
 }
 
+/*
+ * Add stats accumulated by __bch_gc_mark_key() to the cache set's percpu
+ * counters; safe against concurrent gc threads merging their own stats:
+ */
+void bch_fs_stats_merge(struct cache_set *c, struct bch_fs_usage *stats)
+{
+	struct bch_fs_usage __percpu *acc = c->bucket_stats_percpu;
+	unsigned i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(u64); i++)
+		if (((u64 *) stats)[i])
+			this_cpu_add(((u64 __percpu *) acc)[i],
+				     ((u64 *) stats)[i]);
+}
+
 void bch_gc_mark_key(struct cache_set *c, struct bkey_s_c k,
 		     s64 sectors, bool metadata)
 {
@@ -615,10 +723,7 @@ void bch_gc_mark_key(struct cache_set *c, struct bkey_s_c k,
 
 	bch_zero(stats);
 	__bch_gc_mark_key(c, k, sectors, metadata, &stats);
-
-	preempt_disable();
-	bucket_stats_add(this_cpu_ptr(c->bucket_stats_percpu), &stats);
-	preempt_enable();
+	bch_fs_stats_merge(c, &stats);
 }
 
 void bch_mark_key(struct cache_set *c, struct bkey_s_c k,
@@ -238,6 +238,21 @@ static inline bool is_available_bucket(struct bucket_mark mark)
 		!mark.nouse);
 }
 
+static inline bool bucket_has_data(struct bucket_mark mark)
+{
+	return mark.data_type == BUCKET_DATA &&
+		(mark.dirty_sectors || mark.cached_sectors);
+}
+
+/* Which list of the LRU index a bucket belongs on, 0 for none: */
+static inline unsigned bucket_lru_level(struct bucket_mark mark)
+{
+	return is_available_bucket(mark)
+		? min_t(unsigned, fls(mark.cached_sectors) + 1,
+			BUCKET_LRU_LEVELS)
+		: 0;
+}
+
 static inline bool bucket_needs_journal_commit(struct bucket_mark m,
 					       u16 last_seq_ondisk)
 {
@@ -247,6 +262,9 @@ static inline bool bucket_needs_journal_commit(struct bucket_mark m,
 
 void bch_bucket_seq_cleanup(struct cache_set *);
 
+bool bch_bucket_backpointer(struct cache *, struct bucket *,
+			    struct bucket_backpointer *);
+
 void bch_invalidate_bucket(struct cache *, struct bucket *);
 void bch_mark_free_bucket(struct cache *, struct bucket *);
 void bch_mark_alloc_bucket(struct cache *, struct bucket *, bool);
@@ -255,6 +273,7 @@ void bch_mark_metadata_bucket(struct cache *, struct bucket *,
 
 void __bch_gc_mark_key(struct cache_set *, struct bkey_s_c, s64, bool,
 		       struct bch_fs_usage *);
+void bch_fs_stats_merge(struct cache_set *, struct bch_fs_usage *);
 void bch_gc_mark_key(struct cache_set *, struct bkey_s_c, s64, bool);
 void bch_mark_key(struct cache_set *, struct bkey_s_c, s64, bool,
 		  struct gc_pos, struct bch_fs_usage *, u64);
@@ -102,6 +102,39 @@ struct bucket_heap_entry {
 	unsigned long val;
 };
 
+/*
+ * Reverse index entry: the part of the extents btree that may have pointers
+ * into a bucket. It's a superset - it only grows as pointers are added, and is
+ * reset when the bucket is emptied or reused. An empty bucket has start == end.
+ */
+struct bucket_backpointer {
+	struct bpos		start;
+	struct bpos		end;
+};
+
+#define BUCKET_BACKPOINTER_LOCKS	64
+
+/*
+ * The LRU index of available buckets (see bch_bucket_lru_update()) has one list
+ * per level, where a bucket's level is 1 + fls(cached_sectors); buckets whose
+ * gens can't be incremented until gc runs are parked on their own list.
+ *
+ * Lists are circular, linked by bucket index; the list heads are the entries
+ * after the last bucket, at nbuckets + level.
+ */
+#define BUCKET_LRU_LEVELS	16
+#define BUCKET_LRU_NEEDS_GC	(BUCKET_LRU_LEVELS + 1)
+#define BUCKET_LRU_NR		(BUCKET_LRU_LEVELS + 2)
+
+struct bucket_lru {
+	u32			prev;
+	u32			next;
+	/* bucket's read_prio when it was added to the list: */
+	u16			prio;
+	/* 0 if not on any list: */
+	u8			level;
+};
+
 /*
  * A reservation for space on disk:
  */
@@ -14,6 +14,11 @@
 #include <crypto/hash.h>
 #include <crypto/poly1305.h>
 #include <keys/user-type.h>
+#include <asm/unaligned.h>
+
+#if defined(__x86_64__) && !defined(__KERNEL__)
+#include <immintrin.h>
+#endif
 
 /*
  * Portions Copyright (c) 1996-2001, PostgreSQL Global Development Group (Any
@@ -125,7 +130,7 @@ static const u64 crc_table[256] = {
 	0x9AFCE626CE85B507ULL,
 };
 
-u64 bch_crc64_update(u64 crc, const void *_data, size_t len)
+static u64 bch_crc64_bytewise(u64 crc, const void *_data, size_t len)
 {
 	const unsigned char *data = _data;
 
@@ -137,6 +142,154 @@ u64 bch_crc64_update(u64 crc, const void *_data, size_t len)
 	return crc;
 }
 
+/*
+ * Slice-by-8: crc_slice[k][b] is the crc of byte b followed by k zero bytes, so
+ * we can fold in eight bytes at a time with eight independent lookups:
+ */
+static u64 crc_slice[8][256];
+
+static u64 bch_crc64_sb8(u64 crc, const void *_data, size_t len)
+{
+	const unsigned char *data = _data;
+
+	for (; len >= 8; data += 8, len -= 8) {
+		crc ^= get_unaligned_be64(data);
+
+		crc = crc_slice[7][crc >> 56] ^
+			crc_slice[6][(crc >> 48) & 0xff] ^
+			crc_slice[5][(crc >> 40) & 0xff] ^
+			crc_slice[4][(crc >> 32) & 0xff] ^
+			crc_slice[3][(crc >> 24) & 0xff] ^
+			crc_slice[2][(crc >> 16) & 0xff] ^
+			crc_slice[1][(crc >> 8) & 0xff] ^
+			crc_slice[0][crc & 0xff];
+	}
+
+	return bch_crc64_bytewise(crc, data, len);
+}
+
+#if defined(__x86_64__) && !defined(__KERNEL__)
+
+/*
+ * Carryless multiply folding, as in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" - but since crc64 is not bit
+ * reflected, no shifting is needed:
+ *
+ * A 128 bit chunk A = H * x^64 + L that's followed by n more bits of input is
+ * congruent (mod P) to H * (x^(n+64) mod P) + L * (x^n mod P) at the position
+ * of the last n bits: so we fold four 128 bit accumulators forward 512 bits at
+ * a time, then fold those into one, and finish the last 16 bytes - and the
+ * unaligned tail - with the table.
+ */
+
+#define CRC64_POLY	0x42F0E1EBA9EA3693ULL
+
+static u64 crc64_fold_512[2], crc64_fold_128[2];
+
+/* x^n mod P: */
+static u64 crc64_xpow(unsigned n)
+{
+	u64 r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r >> 63) ? CRC64_POLY : 0);
+	return r;
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc64_load(const unsigned char *p)
+{
+	/* big endian: first byte is the high coefficient */
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), bswap);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc64_fold(__m128i a, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+			     _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static u64 bch_crc64_pclmul(u64 crc, const void *_data, size_t len)
+{
+	const unsigned char *data = _data;
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i k512 = _mm_set_epi64x(crc64_fold_512[1], crc64_fold_512[0]);
+	__m128i k128 = _mm_set_epi64x(crc64_fold_128[1], crc64_fold_128[0]);
+	__m128i a0, a1, a2, a3;
+	unsigned char buf[16];
+
+	if (len < 128)
+		return bch_crc64_sb8(crc, data, len);
+
+	/* the initial crc is just xored into the first 8 bytes: */
+	a0 = _mm_xor_si128(crc64_load(data), _mm_set_epi64x(crc, 0));
+	a1 = crc64_load(data + 16);
+	a2 = crc64_load(data + 32);
+	a3 = crc64_load(data + 48);
+	data += 64;
+	len -= 64;
+
+	for (; len >= 64; data += 64, len -= 64) {
+		a0 = _mm_xor_si128(crc64_fold(a0, k512), crc64_load(data));
+		a1 = _mm_xor_si128(crc64_fold(a1, k512), crc64_load(data + 16));
+		a2 = _mm_xor_si128(crc64_fold(a2, k512), crc64_load(data + 32));
+		a3 = _mm_xor_si128(crc64_fold(a3, k512), crc64_load(data + 48));
+	}
+
+	a0 = _mm_xor_si128(crc64_fold(a0, k128), a1);
+	a0 = _mm_xor_si128(crc64_fold(a0, k128), a2);
+	a0 = _mm_xor_si128(crc64_fold(a0, k128), a3);
+
+	for (; len >= 16; data += 16, len -= 16)
+		a0 = _mm_xor_si128(crc64_fold(a0, k128), crc64_load(data));
+
+	_mm_storeu_si128((__m128i *) buf, _mm_shuffle_epi8(a0, bswap));
+
+	crc = bch_crc64_sb8(0, buf, sizeof(buf));
+	return bch_crc64_sb8(crc, data, len);
+}
+#endif
+
+static u64 (*bch_crc64_fn)(u64, const void *, size_t) = bch_crc64_bytewise;
+
+void bch_crc64_init(void)
+{
+	unsigned i, k;
+
+	for (i = 0; i < 256; i++)
+		crc_slice[0][i] = crc_table[i];
+
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc_slice[k][i] = (crc_slice[k - 1][i] << 8) ^
+				crc_table[crc_slice[k - 1][i] >> 56];
+
+	bch_crc64_fn = bch_crc64_sb8;
+
+#if defined(__x86_64__) && !defined(__KERNEL__)
+	crc64_fold_512[1]	= crc64_xpow(512 + 64);
+	crc64_fold_512[0]	= crc64_xpow(512);
+	crc64_fold_128[1]	= crc64_xpow(128 + 64);
+	crc64_fold_128[0]	= crc64_xpow(128);
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("ssse3"))
+		bch_crc64_fn = bch_crc64_pclmul;
+#endif
+}
+
+u64 bch_crc64_update(u64 crc, const void *data, size_t len)
+{
+	return bch_crc64_fn(crc, data, len);
+}
+
 static u64 bch_checksum_init(unsigned type)
 {
 	switch (type) {
@@ -368,6 +521,68 @@ void bch_encrypt_bio(struct cache_set *c, unsigned type,
 	do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
 }
 
+/*
+ * For encrypted checksum types, the checksum is a MAC over the ciphertext: these
+ * do the encryption and the MAC a segment at a time, so that each segment only
+ * has to be pulled into cache once instead of once per pass over the bio.
+ */
+static struct bch_csum __bch_crypt_checksum_bio(struct cache_set *c,
+						unsigned type,
+						struct nonce nonce,
+						struct bio *bio,
+						bool encrypt)
+{
+	SHASH_DESC_ON_STACK(desc, c->poly1305);
+	u8 digest[POLY1305_DIGEST_SIZE];
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	struct bch_csum ret;
+
+	bch_zero(ret);
+	gen_poly_key(c, desc, nonce);
+
+	bio_for_each_segment(bv, bio, iter) {
+		void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
+
+		if (encrypt)
+			do_encrypt(c->chacha20, nonce, p, bv.bv_len);
+
+		crypto_shash_update(desc, p, bv.bv_len);
+
+		if (!encrypt)
+			do_encrypt(c->chacha20, nonce, p, bv.bv_len);
+
+		kunmap_atomic(p);
+
+		le32_add_cpu(nonce.d, bv.bv_len / CHACHA20_BLOCK_SIZE);
+	}
+
+	crypto_shash_final(desc, digest);
+
+	memcpy(&ret, digest, bch_crc_bytes[type]);
+	return ret;
+}
+
+/* Equivalent to bch_encrypt_bio() followed by bch_checksum_bio(): */
+struct bch_csum bch_encrypt_checksum_bio(struct cache_set *c, unsigned type,
+					 struct nonce nonce, struct bio *bio)
+{
+	if (!bch_csum_type_is_encryption(type))
+		return bch_checksum_bio(c, type, nonce, bio);
+
+	return __bch_crypt_checksum_bio(c, type, nonce, bio, true);
+}
+
+/* Equivalent to bch_checksum_bio() followed by bch_encrypt_bio(): */
+struct bch_csum bch_checksum_decrypt_bio(struct cache_set *c, unsigned type,
+					 struct nonce nonce, struct bio *bio)
+{
+	if (!bch_csum_type_is_encryption(type))
+		return bch_checksum_bio(c, type, nonce, bio);
+
+	return __bch_crypt_checksum_bio(c, type, nonce, bio, false);
+}
+
 #ifdef __KERNEL__
 int bch_request_key(struct bch_sb *sb, struct bch_key *key)
 {
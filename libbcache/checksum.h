@@ -6,6 +6,7 @@
 
 #include <crypto/chacha20.h>
 
+void bch_crc64_init(void);
 u64 bch_crc64_update(u64, const void *, size_t);
 
 #define BCH_NONCE_EXTENT	cpu_to_le32(1 << 28)
@@ -39,6 +40,10 @@ struct bch_csum bch_checksum_bio(struct cache_set *, unsigned,
 				 struct nonce, struct bio *);
 void bch_encrypt_bio(struct cache_set *, unsigned,
 		    struct nonce, struct bio *);
+struct bch_csum bch_encrypt_checksum_bio(struct cache_set *, unsigned,
+					 struct nonce, struct bio *);
+struct bch_csum bch_checksum_decrypt_bio(struct cache_set *, unsigned,
+					 struct nonce, struct bio *);
 
 int bch_disable_encryption(struct cache_set *);
 int bch_enable_encryption(struct cache_set *, bool);
@@ -19,16 +19,20 @@ static void *__bounce_alloc(struct cache_set *c, unsigned size,
 {
 	void *data;
 
-	*bounced = BOUNCED_KMALLOCED;
-	data = kmalloc(size, GFP_NOIO|__GFP_NOWARN);
-	if (data)
-		return data;
-
+	/*
+	 * The mempool keeps recently freed bounce buffers cached, so try it
+	 * first - these are big allocations to be making on every IO:
+	 */
 	*bounced = BOUNCED_MEMPOOLED;
 	data = mempool_alloc(&c->compression_bounce[direction], GFP_NOWAIT);
 	if (data)
 		return page_address(data);
 
+	*bounced = BOUNCED_KMALLOCED;
+	data = kmalloc(size, GFP_NOIO|__GFP_NOWARN);
+	if (data)
+		return data;
+
 	*bounced = BOUNCED_VMALLOCED;
 	data = vmalloc(size);
 	if (data)
@@ -101,6 +101,10 @@ enum {
 	BCH_FSCK_UNKNOWN_VERSION	= 4,
 };
 
+/* Parallel fsck - see fs-gc.c: */
+bool bch_fsck_halted(void);
+void bch_fsck_halt(void);
+
 /* These macros return true if error should be fixed: */
 
 /* XXX: mark in superblock that filesystem contains errors, if we ignore: */
@@ -110,6 +114,11 @@ enum {
 ({									\
 	bool _fix = false;						\
 									\
+	if (bch_fsck_halted()) {					\
+		ret = BCH_FSCK_ERRORS_NOT_FIXED;			\
+		goto fsck_err;						\
+	}								\
+									\
 	if (_can_fix && (c)->opts.fix_errors) {				\
 		bch_err(c, msg ", fixing", ##__VA_ARGS__);		\
 		set_bit(BCH_FS_FSCK_FIXED_ERRORS, &(c)->flags);	\
@@ -119,6 +128,7 @@ enum {
 		bch_err(c, msg " (ignoring)", ##__VA_ARGS__);		\
 	} else {							\
 		bch_err(c, msg " ("_nofix_msg")", ##__VA_ARGS__);	\
+		bch_fsck_halt();					\
 		ret = BCH_FSCK_ERRORS_NOT_FIXED;			\
 		goto fsck_err;						\
 	}								\
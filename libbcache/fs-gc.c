@@ -10,6 +10,7 @@
 #include "super.h"
 
 #include <linux/generic-radix-tree.h>
+#include <linux/kthread.h>
 
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
@@ -47,6 +48,9 @@ err:
 	return ret;
 }
 
+/* Parallel fsck jobs may reattach inodes at the same time: */
+static DEFINE_MUTEX(lostfound_lock);
+
 static int reattach_inode(struct cache_set *c,
 			  struct bch_inode_unpacked *lostfound_inode,
 			  u64 inum)
@@ -61,6 +65,8 @@ static int reattach_inode(struct cache_set *c,
 	snprintf(name_buf, sizeof(name_buf), "%llu", inum);
 	name = (struct qstr) QSTR(name_buf);
 
+	mutex_lock(&lostfound_lock);
+
 	lostfound_inode->i_nlink++;
 
 	bch_inode_pack(&packed, lostfound_inode);
@@ -68,11 +74,14 @@ static int reattach_inode(struct cache_set *c,
 	ret = bch_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
 			       NULL, NULL, NULL, 0);
 	if (ret)
-		return ret;
+		goto out;
 
-	return bch_dirent_create(c, lostfound_inode->inum,
-				 &lostfound_hash_info,
-				 DT_DIR, &name, inum, NULL, 0);
+	ret = bch_dirent_create(c, lostfound_inode->inum,
+				&lostfound_hash_info,
+				DT_DIR, &name, inum, NULL, 0);
+out:
+	mutex_unlock(&lostfound_lock);
+	return ret;
 }
 
 struct inode_walker {
@@ -108,11 +117,11 @@ static int walk_inode(struct cache_set *c, struct inode_walker *w, u64 inum)
 }
 
 /*
- * Walk extents: verify that extents have a corresponding S_ISREG inode, and
- * that i_size an i_sectors are consistent
+ * Walk extents of inodes [start, end): verify that extents have a
+ * corresponding S_ISREG inode, and that i_size an i_sectors are consistent
  */
 noinline_for_stack
-static int check_extents(struct cache_set *c)
+static int check_extents(struct cache_set *c, u64 start, u64 end)
 {
 	struct inode_walker w = inode_walker_init();
 	struct btree_iter iter;
@@ -120,8 +129,17 @@ static int check_extents(struct cache_set *c)
 	u64 i_sectors;
 	int ret = 0;
 
-	for_each_btree_key(&iter, c, BTREE_ID_EXTENTS,
-			   POS(BCACHE_ROOT_INO, 0), k) {
+	for_each_btree_key_readahead(&iter, c, BTREE_ID_EXTENTS,
+				     POS(start, 0), k,
+				     BTREE_SCAN_READAHEAD) {
+		if (k.k->p.inode >= end)
+			break;
+
+		if (bch_fsck_halted()) {
+			ret = BCH_FSCK_ERRORS_NOT_FIXED;
+			break;
+		}
+
 		if (k.k->type == KEY_TYPE_DISCARD)
 			continue;
 
@@ -154,24 +172,33 @@ fsck_err:
 }
 
 /*
- * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
- * validate d_type
+ * Walk dirents of directories [start, end): verify that they all have a
+ * corresponding S_ISDIR inode, validate d_type
  */
 noinline_for_stack
-static int check_dirents(struct cache_set *c)
+static int check_dirents(struct cache_set *c, u64 start, u64 end)
 {
 	struct inode_walker w = inode_walker_init();
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret = 0;
 
-	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS,
-			   POS(BCACHE_ROOT_INO, 0), k) {
+	for_each_btree_key_readahead(&iter, c, BTREE_ID_DIRENTS,
+				     POS(start, 0), k,
+				     BTREE_SCAN_READAHEAD) {
 		struct bkey_s_c_dirent d;
 		struct bch_inode_unpacked target;
 		bool have_target;
 		u64 d_inum;
 
+		if (k.k->p.inode >= end)
+			break;
+
+		if (bch_fsck_halted()) {
+			ret = BCH_FSCK_ERRORS_NOT_FIXED;
+			break;
+		}
+
 		ret = walk_inode(c, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -206,8 +233,9 @@ static int check_dirents(struct cache_set *c)
 		ret = 0;
 
 		if (fsck_err_on(!have_target, c,
-				"dirent points to missing inode %llu, type %u filename %s",
-				d_inum, d.v->d_type, d.v->d_name)) {
+				"dirent points to missing inode %llu, type %u filename %.*s",
+				d_inum, d.v->d_type,
+				bch_dirent_name_bytes(d), d.v->d_name)) {
 			ret = remove_dirent(c, &iter, d);
 			if (ret)
 				goto err;
@@ -217,10 +245,10 @@ static int check_dirents(struct cache_set *c)
 		if (fsck_err_on(have_target &&
 				d.v->d_type !=
 				mode_to_type(le16_to_cpu(target.i_mode)), c,
-				"incorrect d_type: got %u should be %u, filename %s",
+				"incorrect d_type: got %u should be %u, filename %.*s",
 				d.v->d_type,
 				mode_to_type(le16_to_cpu(target.i_mode)),
-				d.v->d_name)) {
+				bch_dirent_name_bytes(d), d.v->d_name)) {
 			struct bkey_i_dirent *n;
 
 			n = kmalloc(bkey_bytes(d.k), GFP_KERNEL);
@@ -247,18 +275,28 @@ fsck_err:
 }
 
 /*
- * Walk xattrs: verify that they all have a corresponding inode
+ * Walk xattrs of inodes [start, end): verify that they all have a
+ * corresponding inode
  */
 noinline_for_stack
-static int check_xattrs(struct cache_set *c)
+static int check_xattrs(struct cache_set *c, u64 start, u64 end)
 {
 	struct inode_walker w = inode_walker_init();
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret = 0;
 
-	for_each_btree_key(&iter, c, BTREE_ID_XATTRS,
-			   POS(BCACHE_ROOT_INO, 0), k) {
+	for_each_btree_key_readahead(&iter, c, BTREE_ID_XATTRS,
+				     POS(start, 0), k,
+				     BTREE_SCAN_READAHEAD) {
+		if (k.k->p.inode >= end)
+			break;
+
+		if (bch_fsck_halted()) {
+			ret = BCH_FSCK_ERRORS_NOT_FIXED;
+			break;
+		}
+
 		ret = walk_inode(c, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -393,6 +431,12 @@ static inline int inode_bitmap_set(struct inode_bitmap *b, size_t nr)
 	return 0;
 }
 
+static inline void inode_bitmap_clear(struct inode_bitmap *b)
+{
+	if (b->bits)
+		memset(b->bits, 0, b->size / 8);
+}
+
 struct pathbuf {
 	size_t		nr;
 	size_t		size;
@@ -424,33 +468,108 @@ static int path_down(struct pathbuf *p, u64 inum)
 	return 0;
 }
 
-noinline_for_stack
-static int check_directory_structure(struct cache_set *c,
-				     struct bch_inode_unpacked *lostfound_inode)
+static bool path_contains(struct pathbuf *p, u64 inum)
+{
+	size_t i;
+
+	for (i = 0; i < p->nr; i++)
+		if (p->entries[i].inum == inum)
+			return true;
+	return false;
+}
+
+/*
+ * With a memory limit, we can't have a bitmap of every directory: instead
+ * directories are checked a window of inode numbers at a time.
+ *
+ * First, check_dir_links() finds directories with multiple hardlinks by walking
+ * every dirent once per window - afterwards the directories reachable from the
+ * root form a tree, so check_dirs_reachable() can walk it once per window
+ * without remembering the directories outside the current window.
+ */
+static int check_dir_links(struct cache_set *c, struct inode_bitmap *dirs,
+			   u64 start, u64 end, u64 *max_dir_inum)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent dirent;
+	u64 d_inum;
+	int ret = 0;
+
+	inode_bitmap_clear(dirs);
+
+	if (start <= BCACHE_ROOT_INO && BCACHE_ROOT_INO < end) {
+		ret = inode_bitmap_set(dirs, BCACHE_ROOT_INO - start);
+		if (ret)
+			return ret;
+	}
+
+	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS_MIN, k) {
+		if (k.k->type != BCH_DIRENT)
+			continue;
+
+		dirent = bkey_s_c_to_dirent(k);
+
+		if (dirent.v->d_type != DT_DIR)
+			continue;
+
+		d_inum = le64_to_cpu(dirent.v->d_inum);
+		*max_dir_inum = max(*max_dir_inum, d_inum);
+
+		if (d_inum < start || d_inum >= end)
+			continue;
+
+		if (fsck_err_on(inode_bitmap_test(dirs, d_inum - start), c,
+				"directory with multiple hardlinks")) {
+			ret = remove_dirent(c, &iter, dirent);
+			if (ret)
+				goto err;
+			continue;
+		}
+
+		ret = inode_bitmap_set(dirs, d_inum - start);
+		if (ret)
+			goto err;
+	}
+err:
+fsck_err:
+	return bch_btree_iter_unlock(&iter) ?: ret;
+}
+
+/*
+ * DFS from the root, marking directories in [start, end) as reached, then
+ * reattach directories in [start, end) that weren't reached:
+ */
+static int check_dirs_reachable(struct cache_set *c,
+				struct bch_inode_unpacked *lostfound_inode,
+				struct inode_bitmap *dirs_done,
+				struct pathbuf *path,
+				u64 start, u64 end,
+				bool *had_unreachable)
 {
-	struct inode_bitmap dirs_done = { NULL, 0 };
-	struct pathbuf path = { 0, 0, NULL };
 	struct pathbuf_entry *e;
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	struct bkey_s_c_dirent dirent;
-	bool had_unreachable;
 	u64 d_inum;
 	int ret = 0;
 
-	/* DFS: */
-restart_dfs:
-	ret = inode_bitmap_set(&dirs_done, BCACHE_ROOT_INO);
-	if (ret)
-		goto err;
+	inode_bitmap_clear(dirs_done);
+	path->nr = 0;
 
-	ret = path_down(&path, BCACHE_ROOT_INO);
+	if (start <= BCACHE_ROOT_INO && BCACHE_ROOT_INO < end) {
+		ret = inode_bitmap_set(dirs_done, BCACHE_ROOT_INO - start);
+		if (ret)
+			return ret;
+	}
+
+	ret = path_down(path, BCACHE_ROOT_INO);
 	if (ret)
 		return ret;
 
-	while (path.nr) {
+	while (path->nr) {
 next:
-		e = &path.entries[path.nr - 1];
+		e = &path->entries[path->nr - 1];
 
 		if (e->offset == U64_MAX)
 			goto up;
@@ -472,19 +591,32 @@ next:
 
 			d_inum = le64_to_cpu(dirent.v->d_inum);
 
-			if (fsck_err_on(inode_bitmap_test(&dirs_done, d_inum), c,
-					"directory with multiple hardlinks")) {
-				ret = remove_dirent(c, &iter, dirent);
+			if (d_inum >= start && d_inum < end) {
+				bool seen = inode_bitmap_test(dirs_done,
+							      d_inum - start);
+
+				if (fsck_err_on(seen, c,
+						"directory with multiple hardlinks")) {
+					ret = remove_dirent(c, &iter, dirent);
+					if (ret)
+						goto err;
+					continue;
+				}
+
+				/* not fixing it - don't walk it twice: */
+				if (seen)
+					continue;
+
+				ret = inode_bitmap_set(dirs_done,
+						       d_inum - start);
 				if (ret)
 					goto err;
+			} else if (path_contains(path, d_inum)) {
+				/* loop check_dir_links() wasn't allowed to fix */
 				continue;
 			}
 
-			ret = inode_bitmap_set(&dirs_done, d_inum);
-			if (ret)
-				goto err;
-
-			ret = path_down(&path, d_inum);
+			ret = path_down(path, d_inum);
 			if (ret)
 				goto err;
 
@@ -493,19 +625,21 @@ next:
 		}
 		ret = bch_btree_iter_unlock(&iter);
 		if (ret)
-			goto err;
+			return ret;
 up:
-		path.nr--;
+		path->nr--;
 	}
 
-	had_unreachable = false;
+	for_each_btree_key(&iter, c, BTREE_ID_INODES, POS(start, 0), k) {
+		if (k.k->p.inode >= end)
+			break;
 
-	for_each_btree_key(&iter, c, BTREE_ID_INODES, POS_MIN, k) {
 		if (k.k->type != BCH_INODE_FS ||
 		    !S_ISDIR(le16_to_cpu(bkey_s_c_to_inode(k).v->i_mode)))
 			continue;
 
-		if (fsck_err_on(!inode_bitmap_test(&dirs_done, k.k->p.inode), c,
+		if (fsck_err_on(!inode_bitmap_test(dirs_done,
+						   k.k->p.inode - start), c,
 				"unreachable directory found (inum %llu)",
 				k.k->p.inode)) {
 			bch_btree_iter_unlock(&iter);
@@ -514,30 +648,78 @@ up:
 			if (ret)
 				goto err;
 
-			had_unreachable = true;
+			*had_unreachable = true;
 		}
 	}
-	ret = bch_btree_iter_unlock(&iter);
-	if (ret)
-		goto err;
+err:
+fsck_err:
+	return bch_btree_iter_unlock(&iter) ?: ret;
+}
 
-	if (had_unreachable) {
-		bch_info(c, "reattached unreachable directories, restarting pass to check for loops");
-		kfree(dirs_done.bits);
-		kfree(path.entries);
-		memset(&dirs_done, 0, sizeof(dirs_done));
-		memset(&path, 0, sizeof(path));
-		goto restart_dfs;
+noinline_for_stack
+static int check_directory_structure(struct cache_set *c,
+				     struct bch_inode_unpacked *lostfound_inode)
+{
+	struct inode_bitmap dirs_done = { NULL, 0 };
+	struct pathbuf path = { 0, 0, NULL };
+	u64 mem_limit = c->opts.fsck_mem_limit;
+	u64 window = 0, start, end, max_dir_inum;
+	unsigned passes = 0;
+	bool had_unreachable;
+	int ret = 0;
+
+	/* one bit per inode in the window: */
+	if (mem_limit)
+		window = rounddown_pow_of_two(clamp_t(u64, mem_limit,
+						      PAGE_SIZE, 1ULL << 40) * 8);
+restart:
+	had_unreachable = false;
+	max_dir_inum = U64_MAX;
+
+	if (window) {
+		max_dir_inum = BCACHE_ROOT_INO;
+
+		for (start = 0; start <= max_dir_inum; start = end) {
+			end = start + window;
+			if (end < start)
+				end = U64_MAX;
+
+			ret = check_dir_links(c, &dirs_done, start, end,
+					      &max_dir_inum);
+			passes++;
+			if (ret)
+				goto out;
+
+			if (end == U64_MAX)
+				break;
+		}
+	}
+
+	/* the last window goes to the end, to find directories with no links: */
+	for (start = 0;; start = end) {
+		end = window && max_dir_inum - start >= window
+			? start + window
+			: U64_MAX;
+
+		ret = check_dirs_reachable(c, lostfound_inode,
+					   &dirs_done, &path, start, end,
+					   &had_unreachable);
+		passes++;
+		if (ret || end == U64_MAX)
+			break;
 	}
 
+	if (!ret && had_unreachable) {
+		bch_info(c, "reattached unreachable directories, restarting pass to check for loops");
+		goto restart;
+	}
 out:
+	if (window)
+		bch_info(c, "checked directory structure in %u passes", passes);
+
 	kfree(dirs_done.bits);
 	kfree(path.entries);
 	return ret;
-err:
-fsck_err:
-	ret = bch_btree_iter_unlock(&iter) ?: ret;
-	goto out;
 }
 
 struct nlink {
@@ -547,7 +729,44 @@ struct nlink {
 
 typedef GENRADIX(struct nlink) nlink_table;
 
+/*
+ * Memory used by the link count tables, for fsck with a memory limit: a pass
+ * ends where adding another page would go over the limit, as if the allocation
+ * had failed - but the first inode of a pass is always counted, so that we
+ * make progress.
+ *
+ * Only leaf pages are counted, so the limit is approximate: the genradix's
+ * interior nodes add another page for every PAGE_SIZE / sizeof(void *) leaves,
+ * plus the path from the root.
+ */
+struct nlink_mem {
+	u64		limit;
+	atomic64_t	used;
+};
+
+static struct nlink *nlink_alloc(nlink_table *links, u64 idx,
+				 struct nlink_mem *mem)
+{
+	struct nlink *link = genradix_ptr(links, idx);
+
+	if (link || !mem->limit)
+		return link ?: genradix_ptr_alloc(links, idx, GFP_KERNEL);
+
+	if (atomic64_add_return(PAGE_SIZE, &mem->used) > mem->limit && idx)
+		goto nomem;
+
+	link = genradix_ptr_alloc(links, idx, GFP_KERNEL);
+	if (!link)
+		goto nomem;
+
+	return link;
+nomem:
+	atomic64_sub(PAGE_SIZE, &mem->used);
+	return NULL;
+}
+
 static void inc_link(struct cache_set *c, nlink_table *links,
+		     struct nlink_mem *mem,
 		     u64 range_start, u64 *range_end,
 		     u64 inum, bool dir)
 {
@@ -556,7 +775,7 @@ static void inc_link(struct cache_set *c, nlink_table *links,
 	if (inum < range_start || inum >= *range_end)
 		return;
 
-	link = genradix_ptr_alloc(links, inum - range_start, GFP_KERNEL);
+	link = nlink_alloc(links, inum - range_start, mem);
 	if (!link) {
 		bch_verbose(c, "allocation failed during fs gc - will need another pass");
 		*range_end = inum;
@@ -569,9 +788,15 @@ static void inc_link(struct cache_set *c, nlink_table *links,
 		link->count++;
 }
 
+/*
+ * Count links from the dirents of directories [start, end) to inodes
+ * [range_start, *range_end):
+ */
 noinline_for_stack
 static int bch_gc_walk_dirents(struct cache_set *c, nlink_table *links,
-			       u64 range_start, u64 *range_end)
+			       struct nlink_mem *mem,
+			       u64 range_start, u64 *range_end,
+			       u64 start, u64 end)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -579,19 +804,29 @@ static int bch_gc_walk_dirents(struct cache_set *c, nlink_table *links,
 	u64 d_inum;
 	int ret;
 
-	inc_link(c, links, range_start, range_end, BCACHE_ROOT_INO, false);
+	if (start <= BCACHE_ROOT_INO && BCACHE_ROOT_INO < end)
+		inc_link(c, links, mem, range_start, range_end,
+			 BCACHE_ROOT_INO, false);
+
+	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS(start, 0), k) {
+		if (k.k->p.inode >= end)
+			break;
+
+		if (bch_fsck_halted()) {
+			bch_btree_iter_unlock(&iter);
+			return BCH_FSCK_ERRORS_NOT_FIXED;
+		}
 
-	for_each_btree_key(&iter, c, BTREE_ID_DIRENTS, POS_MIN, k) {
 		switch (k.k->type) {
 		case BCH_DIRENT:
 			d = bkey_s_c_to_dirent(k);
 			d_inum = le64_to_cpu(d.v->d_inum);
 
 			if (d.v->d_type == DT_DIR)
-				inc_link(c, links, range_start, range_end,
+				inc_link(c, links, mem, range_start, range_end,
 					 d.k->p.inode, true);
 
-			inc_link(c, links, range_start, range_end,
+			inc_link(c, links, mem, range_start, range_end,
 				 d_inum, false);
 
 			break;
@@ -773,11 +1008,15 @@ fsck_err:
 	return ret;
 }
 
+/*
+ * Check inodes [start, end) against @links, which has the link counts of inodes
+ * from range_start on:
+ */
 noinline_for_stack
 static int bch_gc_walk_inodes(struct cache_set *c,
 			      struct bch_inode_unpacked *lostfound_inode,
-			      nlink_table *links,
-			      u64 range_start, u64 range_end)
+			      nlink_table *links, u64 range_start,
+			      u64 start, u64 end)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -786,14 +1025,21 @@ static int bch_gc_walk_inodes(struct cache_set *c,
 	int ret = 0, ret2 = 0;
 	u64 nlinks_pos;
 
-	bch_btree_iter_init(&iter, c, BTREE_ID_INODES, POS(range_start, 0));
-	genradix_iter_init(&nlinks_iter);
+	bch_btree_iter_init(&iter, c, BTREE_ID_INODES, POS(start, 0));
+	genradix_iter_seek(&nlinks_iter, links, start - range_start);
 
 	while ((k = bch_btree_iter_peek(&iter)).k &&
 	       !btree_iter_err(k)) {
+		if (bch_fsck_halted()) {
+			ret = BCH_FSCK_ERRORS_NOT_FIXED;
+			break;
+		}
 peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
 
-		if (!link && (!k.k || iter.pos.inode >= range_end))
+		if (link && range_start + nlinks_iter.pos >= end)
+			link = NULL;
+
+		if (!link && (!k.k || iter.pos.inode >= end))
 			break;
 
 		nlinks_pos = range_start + nlinks_iter.pos;
@@ -846,36 +1092,412 @@ fsck_err:
 	return ret ?: ret2;
 }
 
+/*
+ * Parallel fsck:
+ *
+ * Passes that look at one inode's keys at a time are split into jobs by inode
+ * number, using the keys in the root of the btree being walked as split points,
+ * and the jobs are run by up to fsck_threads threads, which take them in order.
+ * Each job captures its own output, which is printed in job order once all the
+ * jobs have finished.
+ *
+ * A single threaded fsck stops at the first job that fails - so when a job
+ * fails, the jobs after it are halted: they check before every key they walk
+ * and every repair they make, and their output is thrown away. Errors are then
+ * reported just as a single threaded fsck would report them; the difference is
+ * that repairs a later job made before the failure aren't undone.
+ */
+struct fsck_run {
+	struct fsck_job		*jobs;
+	unsigned		nr;
+	atomic_t		next;
+	/* index of the first job that failed, or nr: */
+	atomic_t		failed;
+};
+
+struct fsck_job {
+	struct fsck_run		*run;
+	unsigned		idx;
+	struct cache_set	*c;
+	int			(*fn)(struct fsck_job *);
+	u64			start;
+	u64			end;
+	int			ret;
+	struct printk_capture	log;
+
+	/* check_inode_nlinks(): */
+	struct bch_inode_unpacked *lostfound_inode;
+	nlink_table		*links;
+	struct nlink_mem	*mem;
+	u64			range_start;
+	u64			range_end;
+};
+
+static __thread struct fsck_job *fsck_job_current;
+
+/* Has a job before the one this thread is running failed? */
+bool bch_fsck_halted(void)
+{
+	struct fsck_job *job = fsck_job_current;
+
+	return job && atomic_read(&job->run->failed) < job->idx;
+}
+
+/* The job this thread is running failed - halt the jobs after it: */
+void bch_fsck_halt(void)
+{
+	struct fsck_job *job = fsck_job_current;
+	int v, old;
+
+	if (!job)
+		return;
+
+	v = atomic_read(&job->run->failed);
+	while (v > job->idx &&
+	       (old = atomic_cmpxchg(&job->run->failed, v, job->idx)) != v)
+		v = old;
+}
+
+/*
+ * Set up to @nr jobs running @fn over the inodes in @id from @start on, split
+ * at roughly even intervals of the children of the root; returns the number of
+ * jobs:
+ */
+static unsigned fsck_split_btree(struct cache_set *c, enum btree_id id,
+				 u64 start, unsigned nr,
+				 int (*fn)(struct fsck_job *),
+				 struct fsck_job *jobs)
+{
+	struct btree_iter iter;
+	struct btree_node_iter node_iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+	struct btree *b;
+	unsigned i, level, nr_keys = 0, nr_jobs = 1;
+	u64 split;
+
+	jobs[0].start = start;
+
+	if (nr <= 1 || !c->btree_roots[id].b ||
+	    !(level = c->btree_roots[id].b->level))
+		goto out;
+
+	for_each_btree_node(&iter, c, id, POS_MIN, level, b) {
+		/* the root could have been split since we checked its level: */
+		if (b->level != level || bkey_cmp(b->key.k.p, POS_MAX))
+			break;
+
+		for_each_btree_node_key_unpack(b, k, &node_iter, false,
+					       &unpacked)
+			nr_keys++;
+
+		i = 0;
+		for_each_btree_node_key_unpack(b, k, &node_iter, false,
+					       &unpacked) {
+			if (nr_jobs == nr || k.k->p.inode == U64_MAX)
+				break;
+
+			if (++i * nr < nr_keys * nr_jobs)
+				continue;
+
+			/* don't split an inode's keys between two jobs: */
+			split = k.k->p.inode + 1;
+			if (split <= jobs[nr_jobs - 1].start)
+				continue;
+
+			jobs[nr_jobs - 1].end	= split;
+			jobs[nr_jobs++].start	= split;
+		}
+		break;
+	}
+
+	bch_btree_iter_unlock(&iter);
+out:
+	jobs[nr_jobs - 1].end = U64_MAX;
+
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i].c	= c;
+		jobs[i].fn	= fn;
+	}
+
+	return nr_jobs;
+}
+
+static int fsck_thread(void *arg)
+{
+	struct fsck_run *run = arg;
+	struct fsck_job *job;
+	unsigned i;
+
+	while ((i = atomic_inc_return(&run->next) - 1) < run->nr) {
+		/* a single threaded fsck wouldn't have got this far: */
+		if (atomic_read(&run->failed) < i)
+			break;
+
+		job = &run->jobs[i];
+
+		fsck_job_current	= job;
+		printk_capture		= &job->log;
+
+		job->ret = job->fn(job);
+		if (job->ret)
+			bch_fsck_halt();
+
+		printk_capture		= NULL;
+		fsck_job_current	= NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Run @jobs with up to @nr_threads at a time; returns the first error, in job
+ * order:
+ */
+static int fsck_run_jobs(struct fsck_job *jobs, unsigned nr,
+			 unsigned nr_threads)
+{
+	struct fsck_run run = { .jobs = jobs, .nr = nr };
+	struct task_struct **threads = NULL;
+	unsigned i, failed, nr_started = 0;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		jobs[i].run	= &run;
+		jobs[i].idx	= i;
+		jobs[i].ret	= 0;
+	}
+
+	nr_threads = min(nr_threads, nr);
+	if (nr_threads > 1)
+		threads = kcalloc(nr_threads, sizeof(*threads), GFP_KERNEL);
+
+	if (!threads) {
+		for (i = 0; i < nr && !ret; i++)
+			ret = jobs[i].ret = jobs[i].fn(&jobs[i]);
+		return ret;
+	}
+
+	atomic_set(&run.next, 0);
+	atomic_set(&run.failed, nr);
+
+	for (i = 0; i < nr_threads; i++) {
+		struct task_struct *p =
+			kthread_create(fsck_thread, &run, "bcache_fsck");
+
+		if (IS_ERR(p))
+			break;
+
+		get_task_struct(p);
+		wake_up_process(p);
+		threads[nr_started++] = p;
+	}
+
+	if (!nr_started)
+		fsck_thread(&run);
+
+	for (i = 0; i < nr_started; i++) {
+		kthread_stop(threads[i]);
+		put_task_struct(threads[i]);
+	}
+	kfree(threads);
+
+	failed = atomic_read(&run.failed);
+
+	for (i = 0; i < nr; i++)
+		if (i <= failed) {
+			printk_capture_flush(&jobs[i].log);
+			ret = ret ?: jobs[i].ret;
+		} else {
+			printk_capture_discard(&jobs[i].log);
+		}
+
+	return ret;
+}
+
+static int check_extents_job(struct fsck_job *job)
+{
+	return check_extents(job->c, job->start, job->end);
+}
+
+static int check_dirents_job(struct fsck_job *job)
+{
+	return check_dirents(job->c, job->start, job->end);
+}
+
+static int check_xattrs_job(struct fsck_job *job)
+{
+	return check_xattrs(job->c, job->start, job->end);
+}
+
+/*
+ * check_extents(), check_dirents() and check_xattrs() only look up inodes, and
+ * only modify keys of the inode they're looking at - so they're independent of
+ * each other, and can all be run at once:
+ */
+noinline_for_stack
+static int check_inode_keys(struct cache_set *c, unsigned nr_threads)
+{
+	struct fsck_job *jobs;
+	unsigned nr = 0;
+	int ret;
+
+	jobs = kcalloc(3 * nr_threads, sizeof(*jobs), GFP_KERNEL);
+	if (!jobs)
+		return -ENOMEM;
+
+	nr += fsck_split_btree(c, BTREE_ID_EXTENTS, BCACHE_ROOT_INO,
+			       nr_threads, check_extents_job, jobs + nr);
+	nr += fsck_split_btree(c, BTREE_ID_DIRENTS, BCACHE_ROOT_INO,
+			       nr_threads, check_dirents_job, jobs + nr);
+	nr += fsck_split_btree(c, BTREE_ID_XATTRS, BCACHE_ROOT_INO,
+			       nr_threads, check_xattrs_job, jobs + nr);
+
+	ret = fsck_run_jobs(jobs, nr, nr_threads);
+
+	kfree(jobs);
+	return ret;
+}
+
+static int bch_gc_walk_dirents_job(struct fsck_job *job)
+{
+	return bch_gc_walk_dirents(job->c, job->links, job->mem,
+				   job->range_start, &job->range_end,
+				   job->start, job->end);
+}
+
+static int bch_gc_walk_inodes_job(struct fsck_job *job)
+{
+	u64 start = max(job->start, job->range_start);
+	u64 end = min(job->end, job->range_end);
+
+	if (start >= end)
+		return 0;
+
+	return bch_gc_walk_inodes(job->c, job->lostfound_inode, job->links,
+				  job->range_start, start, end);
+}
+
+/* Add the link counts in @src to @dst, for inodes below *range_end: */
+static void nlink_table_merge(struct cache_set *c, nlink_table *dst,
+			      nlink_table *src, u64 range_start,
+			      u64 *range_end)
+{
+	struct genradix_iter iter;
+	struct nlink *s, *d;
+
+	genradix_iter_init(&iter);
+
+	while ((s = genradix_iter_peek(&iter, src)) &&
+	       range_start + iter.pos < *range_end) {
+		if (s->count || s->dir_count) {
+			d = genradix_ptr_alloc(dst, iter.pos, GFP_KERNEL);
+			if (!d) {
+				bch_verbose(c, "allocation failed during fs gc - will need another pass");
+				*range_end = range_start + iter.pos;
+				break;
+			}
+
+			d->count	+= s->count;
+			d->dir_count	+= s->dir_count;
+		}
+
+		genradix_iter_advance(&iter, src);
+	}
+}
+
+/*
+ * Each dirents job counts links into its own table; the tables are summed into
+ * the first one, which the inodes jobs then check against.
+ *
+ * The summed table can't use more memory than the per job tables did, so with
+ * a memory limit and more than one job, the jobs get half of it:
+ */
 noinline_for_stack
 static int check_inode_nlinks(struct cache_set *c,
-			      struct bch_inode_unpacked *lostfound_inode)
+			      struct bch_inode_unpacked *lostfound_inode,
+			      unsigned nr_threads)
 {
-	nlink_table links;
+	struct fsck_job *dirent_jobs, *inode_jobs;
+	struct nlink_mem mem;
+	nlink_table *links;
+	unsigned i, nr_dirent_jobs, nr_inode_jobs, passes = 0;
 	u64 this_iter_range_start, next_iter_range_start = 0;
 	int ret = 0;
 
-	genradix_init(&links);
+	dirent_jobs	= kcalloc(nr_threads, sizeof(*dirent_jobs), GFP_KERNEL);
+	inode_jobs	= kcalloc(nr_threads, sizeof(*inode_jobs), GFP_KERNEL);
+	links		= kcalloc(nr_threads, sizeof(*links), GFP_KERNEL);
+	if (!dirent_jobs || !inode_jobs || !links) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	nr_dirent_jobs = fsck_split_btree(c, BTREE_ID_DIRENTS, 0, nr_threads,
+					  bch_gc_walk_dirents_job, dirent_jobs);
+	nr_inode_jobs = fsck_split_btree(c, BTREE_ID_INODES, 0, nr_threads,
+					 bch_gc_walk_inodes_job, inode_jobs);
+
+	/* a limit of 0 means no limit, so don't round a tiny limit down to 0: */
+	mem.limit = c->opts.fsck_mem_limit;
+	if (nr_dirent_jobs > 1 && mem.limit)
+		mem.limit = max_t(u64, mem.limit / 2, 1);
+
+	for (i = 0; i < nr_dirent_jobs; i++) {
+		genradix_init(&links[i]);
+		dirent_jobs[i].links	= &links[i];
+		dirent_jobs[i].mem	= &mem;
+	}
 
 	do {
 		this_iter_range_start = next_iter_range_start;
 		next_iter_range_start = U64_MAX;
+		atomic64_set(&mem.used, 0);
+		passes++;
 
-		ret = bch_gc_walk_dirents(c, &links,
-					  this_iter_range_start,
-					  &next_iter_range_start);
+		for (i = 0; i < nr_dirent_jobs; i++) {
+			dirent_jobs[i].range_start	= this_iter_range_start;
+			dirent_jobs[i].range_end	= U64_MAX;
+		}
+
+		ret = fsck_run_jobs(dirent_jobs, nr_dirent_jobs, nr_threads);
 		if (ret)
 			break;
 
-		ret = bch_gc_walk_inodes(c, lostfound_inode, &links,
-					 this_iter_range_start,
-					 next_iter_range_start);
+		for (i = 0; i < nr_dirent_jobs; i++)
+			next_iter_range_start = min(next_iter_range_start,
+						    dirent_jobs[i].range_end);
+
+		for (i = 1; i < nr_dirent_jobs; i++) {
+			nlink_table_merge(c, &links[0], &links[i],
+					  this_iter_range_start,
+					  &next_iter_range_start);
+			genradix_free(&links[i]);
+		}
+
+		for (i = 0; i < nr_inode_jobs; i++) {
+			inode_jobs[i].lostfound_inode	= lostfound_inode;
+			inode_jobs[i].links		= &links[0];
+			inode_jobs[i].range_start	= this_iter_range_start;
+			inode_jobs[i].range_end		= next_iter_range_start;
+		}
+
+		ret = fsck_run_jobs(inode_jobs, nr_inode_jobs, nr_threads);
 		if (ret)
 			break;
 
-		genradix_free(&links);
+		genradix_free(&links[0]);
 	} while (next_iter_range_start != U64_MAX);
 
-	genradix_free(&links);
+	for (i = 0; i < nr_dirent_jobs; i++)
+		genradix_free(&links[i]);
+
+	if (c->opts.fsck_mem_limit)
+		bch_info(c, "checked inode link counts in %u passes", passes);
+out:
+	kfree(links);
+	kfree(inode_jobs);
+	kfree(dirent_jobs);
 
 	return ret;
 }
@@ -887,6 +1509,7 @@ static int check_inode_nlinks(struct cache_set *c,
 int bch_fsck(struct cache_set *c, bool full_fsck)
 {
 	struct bch_inode_unpacked root_inode, lostfound_inode;
+	unsigned nr_threads = c->opts.fsck_threads ?: num_online_cpus();
 	int ret;
 
 	ret = check_root(c, &root_inode);
@@ -900,15 +1523,7 @@ int bch_fsck(struct cache_set *c, bool full_fsck)
 	if (!full_fsck)
 		goto check_nlinks;
 
-	ret = check_extents(c);
-	if (ret)
-		return ret;
-
-	ret = check_dirents(c);
-	if (ret)
-		return ret;
-
-	ret = check_xattrs(c);
+	ret = check_inode_keys(c, nr_threads);
 	if (ret)
 		return ret;
 
@@ -916,7 +1531,7 @@ int bch_fsck(struct cache_set *c, bool full_fsck)
 	if (ret)
 		return ret;
 check_nlinks:
-	ret = check_inode_nlinks(c, &lostfound_inode);
+	ret = check_inode_nlinks(c, &lostfound_inode, nr_threads);
 	if (ret)
 		return ret;
 
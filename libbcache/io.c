@@ -516,9 +516,8 @@ static int bch_write_extent(struct bch_write_op *op,
 					     src_len >> 9,
 					     compression_type),
 
-			bch_encrypt_bio(c, csum_type, nonce, bio);
-
-			csum = bch_checksum_bio(c, csum_type, nonce, bio);
+			csum = bch_encrypt_checksum_bio(c, csum_type,
+							nonce, bio);
 			swap(bio->bi_iter.bi_size, dst_len);
 
 			init_append_extent(op,
@@ -939,7 +938,17 @@ static int bio_checksum_uncompress(struct cache_set *c,
 		src->bi_iter = rbio->parent_iter;
 	}
 
-	csum = bch_checksum_bio(c, rbio->crc.csum_type, nonce, src);
+	/*
+	 * If we're not bouncing or decompressing we'll be decrypting the whole
+	 * bio in place, and can do it in the same pass as the checksum:
+	 */
+	if (rbio->crc.compression_type == BCH_COMPRESSION_NONE &&
+	    !rbio->bounce)
+		csum = bch_checksum_decrypt_bio(c, rbio->crc.csum_type,
+						nonce, src);
+	else
+		csum = bch_checksum_bio(c, rbio->crc.csum_type, nonce, src);
+
 	if (bch_dev_nonfatal_io_err_on(bch_crc_cmp(rbio->crc.csum, csum), rbio->ca,
 			"data checksum error, inode %llu offset %llu: expected %0llx%0llx got %0llx%0llx (type %u)",
 			rbio->inode, (u64) rbio->parent_iter.bi_sector << 9,
@@ -973,8 +982,6 @@ static int bio_checksum_uncompress(struct cache_set *c,
 
 		bio_copy_data_iter(dst, dst_iter,
 				   src, src->bi_iter);
-	} else {
-		bch_encrypt_bio(c, rbio->crc.csum_type, nonce, src);
 	}
 
 	return ret;
@@ -20,7 +20,9 @@
 #include "journal.h"
 #include "super-io.h"
 #include "vstructs.h"
+#include "writeback.h"
 
+#include <linux/sort.h>
 #include <trace/events/bcache.h>
 
 static void journal_write(struct closure *);
@@ -368,10 +370,8 @@ out:
  */
 
 struct journal_list {
-	struct closure		cl;
 	struct mutex		lock;
 	struct list_head	*head;
-	int			ret;
 };
 
 #define JOURNAL_ENTRY_ADD_OK		0
@@ -522,14 +522,60 @@ fsck_err:
 	return ret;
 }
 
-#define JOURNAL_ENTRY_REREAD	5
+static int journal_validate_bucket_gens(struct cache_set *c,
+					struct jset_entry *entry)
+{
+	struct bch_bucket_gen *g = (void *) entry->_data;
+	struct cache *ca;
+	bool bad;
+	int ret = 0;
+
+	if (mustfix_fsck_err_on(!bch_sb_test_feature(c->disk_sb,
+					BCH_FEATURE_JOURNAL_GENS), c,
+			"bucket gens in journal, but journal_gens not enabled")) {
+		journal_entry_null_range(entry, vstruct_next(entry));
+		return 0;
+	}
+
+	while ((void *) g < vstruct_end(entry)) {
+		void *next = vstruct_next(entry);
+		unsigned dev = BUCKET_GEN_DEV(g);
+		u64 b = BUCKET_GEN_BUCKET(g);
+
+		rcu_read_lock();
+		ca = dev < c->sb.nr_devices
+			? rcu_dereference(c->cache[dev])
+			: NULL;
+		bad = !ca ||
+			b < ca->mi.first_bucket ||
+			b >= ca->mi.nbuckets;
+		rcu_read_unlock();
+
+		if (mustfix_fsck_err_on(bad, c,
+				"invalid bucket gen in journal: device %u bucket %llu",
+				dev, b)) {
+			le16_add_cpu(&entry->u64s, -1);
+			memmove(g, g + 1, next - (void *) (g + 1));
+			journal_entry_null_range(vstruct_next(entry), next);
+			continue;
+		}
+
+		g++;
+	}
+fsck_err:
+	return ret;
+}
+
 #define JOURNAL_ENTRY_NONE	6
 #define JOURNAL_ENTRY_BAD	7
 
+/*
+ * @csum_ok: the checksum has already been checked, and the entry decrypted, by
+ * journal_bucket_csum()
+ */
 static int journal_entry_validate(struct cache_set *c,
 				  struct jset *j, u64 sector,
-				  unsigned bucket_sectors_left,
-				  unsigned sectors_read)
+				  unsigned bucket_sectors_left, bool csum_ok)
 {
 	struct jset_entry *entry;
 	size_t bytes = vstruct_bytes(j);
@@ -552,8 +598,8 @@ static int journal_entry_validate(struct cache_set *c,
 		return JOURNAL_ENTRY_BAD;
 	}
 
-	if (bytes > sectors_read << 9)
-		return JOURNAL_ENTRY_REREAD;
+	if (csum_ok)
+		goto decrypted;
 
 	if (fsck_err_on(!bch_checksum_type_valid(c, JSET_CSUM_TYPE(j)), c,
 			"journal entry with unknown csum type %llu sector %lluu",
@@ -571,7 +617,7 @@ static int journal_entry_validate(struct cache_set *c,
 	bch_encrypt(c, JSET_CSUM_TYPE(j), journal_nonce(j),
 		    j->encrypted_start,
 		    vstruct_end(j) - (void *) j->encrypted_start);
-
+decrypted:
 	if (mustfix_fsck_err_on(le64_to_cpu(j->last_seq) > le64_to_cpu(j->seq), c,
 			"invalid journal entry: last_seq > seq"))
 		j->last_seq = j->seq;
@@ -626,6 +672,12 @@ static int journal_entry_validate(struct cache_set *c,
 			}
 
 			break;
+
+		case JOURNAL_ENTRY_BUCKET_GENS:
+			ret = journal_validate_bucket_gens(c, entry);
+			if (ret)
+				goto fsck_err;
+			break;
 		default:
 			mustfix_fsck_err(c, "invalid journal entry type %llu",
 				 JOURNAL_ENTRY_TYPE(entry));
@@ -638,38 +690,92 @@ fsck_err:
 	return ret;
 }
 
-struct journal_read_buf {
-	void		*data;
-	size_t		size;
+/*
+ * Journal buckets are read whole, with up to JOURNAL_READ_DEPTH reads in flight
+ * per device, and every device's reads in flight at once.
+ *
+ * As each read completes, a worker checks the checksums of the entries in the
+ * bucket and decrypts them. The thread doing the read takes the buckets in
+ * whatever order they finish, does the rest of the validation and adds their
+ * entries to the journal list, and starts the next read on that device.
+ * journal_entry_add() keeps the list sorted by seq, so what we end up with
+ * doesn't depend on the order buckets were processed in.
+ *
+ * Each bucket's messages are captured, and printed in (device, bucket) order
+ * once everything has been read. If a bucket fails, buckets after it are thrown
+ * away as they complete, and those before it are still processed - so the
+ * error we return, and the output, are the same as if we'd read the buckets one
+ * at a time.
+ *
+ * Interactive fsck asks about errors as it finds them, which can't be captured:
+ * with fsck_threads = 1, buckets are processed in (device, bucket) order
+ * instead - still with the checksums done by the workers.
+ */
+#define JOURNAL_READ_DEPTH	16
+#define JOURNAL_READ_MEM	(32U << 20)
+
+struct journal_read {
+	struct cache_set	*c;
+	struct journal_list	jlist;
+	bool			ordered;
+
+	/* reads that have been checksummed, in the order they finished: */
+	spinlock_t		lock;
+	struct list_head	done;
+	wait_queue_head_t	wait;
+
+	unsigned		nr_busy;
+
+	/* (device, bucket) position of the first read that failed: */
+	u64			failed;
+	int			ret;
 };
 
-static int journal_read_buf_realloc(struct journal_read_buf *b,
-				    size_t new_size)
-{
-	void *n;
+struct journal_bucket_read {
+	struct journal_dev_read	*r;
+	struct work_struct	work;
+	struct list_head	list;
+	struct bio		*bio;
+	void			*data;
+	/* blocks with entries whose checksum is good, and have been decrypted: */
+	unsigned long		*csum_ok;
+	unsigned		bucket;
+	bool			busy;
+	bool			done;
+};
 
-	new_size = roundup_pow_of_two(new_size);
-	n = (void *) __get_free_pages(GFP_KERNEL, get_order(new_size));
-	if (!n)
-		return -ENOMEM;
+struct journal_dev_read {
+	struct journal_read	*jr;
+	struct cache		*ca;
+	unsigned		idx;
 
-	free_pages((unsigned long) b->data, get_order(b->size));
-	b->data = n;
-	b->size = new_size;
-	return 0;
+	/* next bucket to read: */
+	unsigned		next;
+	unsigned		nr_busy;
+	struct printk_capture	*logs;
+
+	unsigned		nr;
+	struct journal_bucket_read reads[JOURNAL_READ_DEPTH];
+};
+
+static inline u64 journal_read_pos(struct journal_dev_read *r, unsigned bucket)
+{
+	return ((u64) r->idx << 32) | bucket;
 }
 
-static int journal_read_bucket(struct cache *ca,
-			       struct journal_read_buf *buf,
-			       struct journal_list *jlist,
-			       unsigned bucket, u64 *seq, bool *entries_found)
+/*
+ * Validate the journal entries in a bucket we've read, and add them to the list
+ * of entries to be replayed:
+ */
+static int journal_bucket_add_entries(struct journal_bucket_read *rb)
 {
+	struct cache *ca = rb->r->ca;
 	struct cache_set *c = ca->set;
 	struct journal_device *ja = &ca->journal;
-	struct bio *bio = ja->bio;
-	struct jset *j = NULL;
-	unsigned sectors, sectors_read = 0;
-	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
+	struct jset *j = rb->data;
+	unsigned bucket = rb->bucket, sectors;
+	u64 start = bucket_to_sector(ca, ja->buckets[bucket]),
+	    offset = start,
 	    end = offset + ca->mi.bucket_size;
 	bool saw_bad = false;
 	int ret = 0;
@@ -677,41 +783,12 @@ static int journal_read_bucket(struct cache *ca,
 	pr_debug("reading %u", bucket);
 
 	while (offset < end) {
-		if (!sectors_read) {
-reread:			sectors_read = min_t(unsigned,
-				end - offset, buf->size >> 9);
-
-			bio_reset(bio);
-			bio->bi_bdev		= ca->disk_sb.bdev;
-			bio->bi_iter.bi_sector	= offset;
-			bio->bi_iter.bi_size	= sectors_read << 9;
-			bio_set_op_attrs(bio, REQ_OP_READ, 0);
-			bch_bio_map(bio, buf->data);
-
-			ret = submit_bio_wait(bio);
-
-			if (bch_dev_fatal_io_err_on(ret, ca,
-						  "journal read from sector %llu",
-						  offset) ||
-			    bch_meta_read_fault("journal"))
-				return -EIO;
-
-			j = buf->data;
-		}
-
-		ret = journal_entry_validate(c, j, offset,
-					end - offset, sectors_read);
+		ret = journal_entry_validate(c, j, offset, end - offset,
+				test_bit((offset - start) / c->sb.block_size,
+					 rb->csum_ok));
 		switch (ret) {
 		case BCH_FSCK_OK:
 			break;
-		case JOURNAL_ENTRY_REREAD:
-			if (vstruct_bytes(j) > buf->size) {
-				ret = journal_read_buf_realloc(buf,
-							vstruct_bytes(j));
-				if (ret)
-					return ret;
-			}
-			goto reread;
 		case JOURNAL_ENTRY_NONE:
 			if (!saw_bad)
 				return 0;
@@ -736,136 +813,284 @@ reread:			sectors_read = min_t(unsigned,
 
 		ja->bucket_seq[bucket] = le64_to_cpu(j->seq);
 
-		ret = journal_entry_add(c, jlist, j);
+		ret = journal_entry_add(c, &rb->r->jr->jlist, j);
 		switch (ret) {
 		case JOURNAL_ENTRY_ADD_OK:
-			*entries_found = true;
-			break;
 		case JOURNAL_ENTRY_ADD_OUT_OF_RANGE:
 			break;
 		default:
 			return ret;
 		}
 
-		if (le64_to_cpu(j->seq) > *seq)
-			*seq = le64_to_cpu(j->seq);
-
 		sectors = vstruct_sectors(j, c->block_bits);
 next_block:
 		pr_debug("next");
 		offset		+= sectors;
-		sectors_read	-= sectors;
 		j = ((void *) j) + (sectors << 9);
 	}
 
 	return 0;
 }
 
-static void bch_journal_read_device(struct closure *cl)
-{
-#define read_bucket(b)							\
-	({								\
-		bool entries_found = false;				\
-		ret = journal_read_bucket(ca, &buf, jlist, b, &seq,	\
-					  &entries_found);		\
-		if (ret)						\
-			goto err;					\
-		__set_bit(b, bitmap);					\
-		entries_found;						\
-	 })
-
-	struct journal_device *ja =
-		container_of(cl, struct journal_device, read);
-	struct cache *ca = container_of(ja, struct cache, journal);
-	struct journal_list *jlist =
-		container_of(cl->parent, struct journal_list, cl);
-	struct request_queue *q = bdev_get_queue(ca->disk_sb.bdev);
-	struct journal_read_buf buf = { NULL, 0 };
-
-	DECLARE_BITMAP(bitmap, ja->nr);
-	unsigned i, l, r;
+/*
+ * Check the checksums of the entries in a bucket, and decrypt them - walking
+ * the bucket the same way journal_bucket_add_entries() will, but leaving any
+ * errors for it to report:
+ */
+static void journal_bucket_csum(struct journal_bucket_read *rb)
+{
+	struct cache *ca = rb->r->ca;
+	struct cache_set *c = ca->set;
+	struct jset *j = rb->data;
+	unsigned offset = 0, end = ca->mi.bucket_size, sectors;
+	bool saw_bad = false;
 	u64 seq = 0;
-	int ret;
 
-	if (!ja->nr)
-		goto out;
+	while (offset < end) {
+		if (le64_to_cpu(j->magic) != jset_magic(c)) {
+			if (!saw_bad)
+				return;
+			goto bad;
+		}
 
-	bitmap_zero(bitmap, ja->nr);
-	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
-	if (ret)
-		goto err;
+		if (le32_to_cpu(j->version) != BCACHE_JSET_VERSION ||
+		    le64_to_cpu(j->seq) < seq)
+			return;
 
-	pr_debug("%u journal buckets", ja->nr);
+		if (vstruct_bytes(j) > (end - offset) << 9 ||
+		    !bch_checksum_type_valid(c, JSET_CSUM_TYPE(j)) ||
+		    bch_crc_cmp(csum_vstruct(c, JSET_CSUM_TYPE(j),
+					     journal_nonce(j), j), j->csum))
+			goto bad;
 
-	/*
-	 * If the device supports discard but not secure discard, we can't do
-	 * the fancy fibonacci hash/binary search because the live journal
-	 * entries might not form a contiguous range:
-	 */
-	for (i = 0; i < ja->nr; i++)
-		read_bucket(i);
-	goto search_done;
+		bch_encrypt(c, JSET_CSUM_TYPE(j), journal_nonce(j),
+			    j->encrypted_start,
+			    vstruct_end(j) - (void *) j->encrypted_start);
+
+		__set_bit(offset / c->sb.block_size, rb->csum_ok);
+		seq	= le64_to_cpu(j->seq);
+		sectors = vstruct_sectors(j, c->block_bits);
+		goto next_block;
+bad:
+		saw_bad = true;
+		sectors = c->sb.block_size;
+next_block:
+		offset	+= sectors;
+		j = ((void *) j) + (sectors << 9);
+	}
+}
 
-	if (!blk_queue_nonrot(q))
-		goto linear_scan;
+static void journal_read_csum_work(struct work_struct *work)
+{
+	struct journal_bucket_read *rb =
+		container_of(work, struct journal_bucket_read, work);
+	struct journal_read *jr = rb->r->jr;
 
-	/*
-	 * Read journal buckets ordered by golden ratio hash to quickly
-	 * find a sequence of buckets with valid journal entries
-	 */
-	for (i = 0; i < ja->nr; i++) {
-		l = (i * 2654435769U) % ja->nr;
+	if (!rb->bio->bi_error)
+		journal_bucket_csum(rb);
 
-		if (test_bit(l, bitmap))
-			break;
+	/* Wake up under the lock - once we drop it, jr may be gone: */
+	spin_lock(&jr->lock);
+	rb->done = true;
+	list_add_tail(&rb->list, &jr->done);
+	wake_up(&jr->wait);
+	spin_unlock(&jr->lock);
+}
+
+static void journal_read_endio(struct bio *bio)
+{
+	struct journal_bucket_read *rb = bio->bi_private;
 
-		if (read_bucket(l))
-			goto bsearch;
+	queue_work(system_unbound_wq, &rb->work);
+}
+
+static void journal_read_bucket(struct journal_bucket_read *rb,
+				unsigned bucket)
+{
+	struct cache *ca = rb->r->ca;
+	struct bio *bio = rb->bio;
+
+	rb->bucket	= bucket;
+	rb->done	= false;
+	bitmap_zero(rb->csum_ok, ca->mi.bucket_size / ca->set->sb.block_size);
+
+	bio_reset(bio);
+	bio->bi_bdev		= ca->disk_sb.bdev;
+	bio->bi_iter.bi_sector	= bucket_to_sector(ca,
+					ca->journal.buckets[bucket]);
+	bio->bi_iter.bi_size	= bucket_bytes(ca);
+	bio->bi_end_io		= journal_read_endio;
+	bio->bi_private		= rb;
+	bio_set_op_attrs(bio, REQ_OP_READ, 0);
+	bch_bio_map(bio, rb->data);
+
+	generic_make_request(bio);
+}
+
+/* Start reading the next bucket with @rb, if there's one we still want: */
+static void journal_read_next_bucket(struct journal_bucket_read *rb)
+{
+	struct journal_dev_read *r = rb->r;
+
+	if (r->next < r->ca->journal.nr &&
+	    journal_read_pos(r, r->next) < r->jr->failed) {
+		journal_read_bucket(rb, r->next++);
+	} else if (rb->busy) {
+		rb->busy = false;
+		r->nr_busy--;
+		r->jr->nr_busy--;
 	}
+}
 
-	/*
-	 * If that fails, check all the buckets we haven't checked
-	 * already
-	 */
-	pr_debug("falling back to linear search");
-linear_scan:
-	for (l = find_first_zero_bit(bitmap, ja->nr);
-	     l < ja->nr;
-	     l = find_next_zero_bit(bitmap, ja->nr, l + 1))
-		if (read_bucket(l))
-			goto bsearch;
-
-	/* no journal entries on this device? */
-	if (l == ja->nr)
-		goto out;
-bsearch:
-	/* Binary search */
-	r = find_next_bit(bitmap, ja->nr, l + 1);
-	pr_debug("starting binary search, l %u r %u", l, r);
+static struct journal_bucket_read *
+journal_read_take(struct journal_read *jr, struct journal_bucket_read *want)
+{
+	struct journal_bucket_read *rb = NULL;
 
-	while (l + 1 < r) {
-		unsigned m = (l + r) >> 1;
-		u64 cur_seq = seq;
+	spin_lock(&jr->lock);
+	if (want ? want->done : !list_empty(&jr->done)) {
+		rb = want ?: list_first_entry(&jr->done,
+					      struct journal_bucket_read, list);
+		list_del(&rb->list);
+	}
+	spin_unlock(&jr->lock);
 
-		read_bucket(m);
+	return rb;
+}
 
-		if (cur_seq != seq)
-			l = m;
-		else
-			r = m;
+/* The read for the lowest (device, bucket) position still to be processed: */
+static struct journal_bucket_read *
+journal_read_oldest(struct journal_dev_read *r, unsigned nr)
+{
+	struct journal_bucket_read *rb, *oldest = NULL;
+
+	for (; nr && !r->nr_busy; r++, --nr)
+		;
+
+	for (rb = r->reads; rb < r->reads + r->nr; rb++)
+		if (rb->busy && (!oldest || rb->bucket < oldest->bucket))
+			oldest = rb;
+
+	return oldest;
+}
+
+/*
+ * Wait for a read that's been checksummed - whichever finishes first, or the
+ * next one in order if we're processing them in order:
+ */
+static struct journal_bucket_read *journal_read_next(struct journal_read *jr,
+						     struct journal_dev_read *r,
+						     unsigned nr)
+{
+	struct journal_bucket_read *want = NULL, *rb;
+
+	if (!jr->nr_busy)
+		return NULL;
+
+	if (jr->ordered)
+		want = journal_read_oldest(r, nr);
+
+	wait_event(jr->wait, (rb = journal_read_take(jr, want)));
+	return rb;
+}
+
+static int journal_read_process(struct journal_bucket_read *rb)
+{
+	struct cache *ca = rb->r->ca;
+
+	if (bch_dev_fatal_io_err_on(rb->bio->bi_error, ca,
+			"journal read from sector %llu",
+			bucket_to_sector(ca, ca->journal.buckets[rb->bucket])) ||
+	    bch_meta_read_fault("journal"))
+		return -EIO;
+
+	return journal_bucket_add_entries(rb);
+}
+
+static void journal_dev_read_exit(struct journal_dev_read *r)
+{
+	unsigned order = get_order(bucket_bytes(r->ca));
+	unsigned i;
+
+	for (i = 0; i < r->nr; i++) {
+		kfree(r->reads[i].csum_ok);
+		free_pages((unsigned long) r->reads[i].data, order);
+		bio_put(r->reads[i].bio);
 	}
 
-search_done:
+	if (r->logs)
+		for (i = 0; i < r->ca->journal.nr; i++)
+			printk_capture_discard(&r->logs[i]);
+	kfree(r->logs);
+}
+
+static int journal_dev_read_init(struct journal_dev_read *r,
+				 struct journal_read *jr,
+				 struct cache *ca, unsigned idx)
+{
+	size_t bytes = bucket_bytes(ca);
+	unsigned blocks = ca->mi.bucket_size / ca->set->sb.block_size;
+	unsigned i, nr;
+
+	nr = min_t(size_t, JOURNAL_READ_DEPTH, JOURNAL_READ_MEM / bytes);
+	nr = clamp_t(unsigned, nr, 1, ca->journal.nr);
+
+	r->jr	= jr;
+	r->ca	= ca;
+	r->idx	= idx;
+
+	r->logs = kcalloc(ca->journal.nr, sizeof(r->logs[0]), GFP_KERNEL);
+	if (!r->logs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		struct journal_bucket_read *rb = &r->reads[i];
+
+		rb->csum_ok = kcalloc(BITS_TO_LONGS(blocks),
+				      sizeof(unsigned long), GFP_KERNEL);
+		if (!rb->csum_ok)
+			break;
+
+		rb->data = (void *) __get_free_pages(GFP_KERNEL,
+						     get_order(bytes));
+		if (!rb->data) {
+			kfree(rb->csum_ok);
+			break;
+		}
+
+		rb->bio = bio_kmalloc(GFP_KERNEL,
+				      DIV_ROUND_UP(bytes, PAGE_SIZE));
+		if (!rb->bio) {
+			free_pages((unsigned long) rb->data, get_order(bytes));
+			kfree(rb->csum_ok);
+			break;
+		}
+
+		rb->r = r;
+		INIT_WORK(&rb->work, journal_read_csum_work);
+		r->nr++;
+	}
+
+	/* fewer reads in flight if we're short on memory: */
+	return r->nr ? 0 : -ENOMEM;
+}
+
+/*
+ * Find the journal bucket with the highest sequence number, now that we've
+ * read them all:
+ */
+static void journal_dev_set_idx(struct cache *ca)
+{
+	struct journal_device *ja = &ca->journal;
+	u64 seq = 0;
+	unsigned i;
+
 	/*
-	 * Find the journal bucket with the highest sequence number:
-	 *
 	 * If there's duplicate journal entries in multiple buckets (which
 	 * definitely isn't supposed to happen, but...) - make sure to start
 	 * cur_idx at the last of those buckets, so we don't deadlock trying to
 	 * allocate
 	 */
-	seq = 0;
-
 	for (i = 0; i < ja->nr; i++)
 		if (ja->bucket_seq[i] >= seq &&
 		    ja->bucket_seq[i] != ja->bucket_seq[(i + 1) % ja->nr]) {
@@ -884,26 +1109,82 @@ search_done:
 	 * pinned when it first runs:
 	 */
 	ja->last_idx = (ja->cur_idx + 1) % ja->nr;
+}
 
-	/*
-	 * Read buckets in reverse order until we stop finding more journal
-	 * entries:
-	 */
-	for (i = (ja->cur_idx + ja->nr - 1) % ja->nr;
-	     i != ja->cur_idx;
-	     i = (i + ja->nr - 1) % ja->nr)
-		if (!test_bit(i, bitmap) &&
-		    !read_bucket(i))
-			break;
+/* Read every journal bucket on every device, adding entries to @list: */
+static int journal_read_buckets(struct cache_set *c, struct list_head *list)
+{
+	struct journal_read jr = {
+		.c		= c,
+		.ordered	= c->opts.fsck_threads == 1,
+		.failed		= U64_MAX,
+	};
+	struct journal_dev_read *r;
+	struct journal_bucket_read *rb;
+	struct cache *ca;
+	unsigned iter, i, nr = 0;
+	int ret = 0;
+
+	mutex_init(&jr.jlist.lock);
+	jr.jlist.head = list;
+	spin_lock_init(&jr.lock);
+	INIT_LIST_HEAD(&jr.done);
+	init_waitqueue_head(&jr.wait);
+
+	r = kcalloc(c->sb.nr_devices, sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	for_each_cache(ca, c, iter)
+		if (ca->journal.nr) {
+			ret = journal_dev_read_init(&r[nr], &jr, ca, nr);
+			nr++;
+			if (ret)
+				goto out;
+		}
+
+	/* Start reading every device's journal: */
+	for (iter = 0; iter < nr; iter++)
+		for (i = 0; i < r[iter].nr; i++) {
+			rb = &r[iter].reads[i];
+			rb->busy = true;
+			r[iter].nr_busy++;
+			jr.nr_busy++;
+			journal_read_next_bucket(rb);
+		}
+
+	while ((rb = journal_read_next(&jr, r, nr))) {
+		u64 pos = journal_read_pos(rb->r, rb->bucket);
+
+		if (pos < jr.failed) {
+			if (!jr.ordered)
+				printk_capture = &rb->r->logs[rb->bucket];
+			ret = journal_read_process(rb);
+			printk_capture = NULL;
+
+			if (ret) {
+				jr.failed	= pos;
+				jr.ret		= ret;
+			}
+		}
+
+		journal_read_next_bucket(rb);
+	}
+
+	for (iter = 0; iter < nr; iter++)
+		for (i = 0; i < r[iter].ca->journal.nr; i++)
+			if (journal_read_pos(&r[iter], i) <= jr.failed)
+				printk_capture_flush(&r[iter].logs[i]);
+
+	ret = jr.ret;
+	if (!ret)
+		for (iter = 0; iter < nr; iter++)
+			journal_dev_set_idx(r[iter].ca);
 out:
-	free_pages((unsigned long) buf.data, get_order(buf.size));
-	closure_return(cl);
-err:
-	mutex_lock(&jlist->lock);
-	jlist->ret = ret;
-	mutex_unlock(&jlist->lock);
-	goto out;
-#undef read_bucket
+	for (iter = 0; iter < nr; iter++)
+		journal_dev_read_exit(&r[iter]);
+	kfree(r);
+	return ret;
 }
 
 void bch_journal_entries_free(struct list_head *list)
@@ -960,30 +1241,16 @@ static inline bool journal_has_keys(struct list_head *list)
 int bch_journal_read(struct cache_set *c, struct list_head *list)
 {
 	struct jset_entry *prio_ptrs;
-	struct journal_list jlist;
 	struct journal_replay *i;
 	struct jset *j;
 	struct journal_entry_pin_list *p;
-	struct cache *ca;
 	u64 cur_seq, end_seq;
 	unsigned iter;
-	int ret = 0;
-
-	closure_init_stack(&jlist.cl);
-	mutex_init(&jlist.lock);
-	jlist.head = list;
-	jlist.ret = 0;
-
-	for_each_cache(ca, c, iter)
-		closure_call(&ca->journal.read,
-			     bch_journal_read_device,
-			     system_unbound_wq,
-			     &jlist.cl);
-
-	closure_sync(&jlist.cl);
+	int ret;
 
-	if (jlist.ret)
-		return jlist.ret;
+	ret = journal_read_buckets(c, list);
+	if (ret)
+		return ret;
 
 	if (list_empty(list)){
 		bch_err(c, "no journal entries found");
@@ -1455,73 +1722,418 @@ void bch_journal_start(struct cache_set *c)
 	queue_delayed_work(system_freezable_wq, &j->reclaim_work, 0);
 }
 
+/*
+ * Journal replay:
+ *
+ * Rather than inserting keys one at a time in journal order, the keys for each
+ * btree are gathered from all the entries being replayed, sorted by position,
+ * and keys that would only be overwritten by a later key are dropped; the rest
+ * are bulk inserted with bch_btree_insert_list(), a leaf at a time. Btrees are
+ * independent of each other, so each is replayed by its own worker.
+ *
+ * Keys in the same position (or, for extents, overlapping keys) are still
+ * applied in journal order, so the end result is the same as replaying each
+ * entry in turn.
+ */
+struct journal_replay_key {
+	struct bkey_i		*k;
+	/* position in the journal, across all entries being replayed: */
+	u64			order;
+};
+
+struct journal_replay_btree {
+	struct work_struct	work;
+	struct closure		*cl;
+	struct cache_set	*c;
+	enum btree_id		id;
+	struct journal_replay_key *keys;
+	size_t			nr;
+	size_t			u64s;
+	size_t			dropped;
+	int			ret;
+};
+
+static int journal_replay_key_cmp(const void *_l, const void *_r)
+{
+	const struct journal_replay_key *l = _l;
+	const struct journal_replay_key *r = _r;
+
+	return bkey_cmp(bkey_start_pos(&l->k->k), bkey_start_pos(&r->k->k)) ?:
+		(l->order > r->order) - (l->order < r->order);
+}
+
+static int journal_replay_order_cmp(const void *_l, const void *_r)
+{
+	const struct journal_replay_key *l = _l;
+	const struct journal_replay_key *r = _r;
+
+	return (l->order > r->order) - (l->order < r->order);
+}
+
+static struct journal_entry_pin_list *
+journal_replay_pin_list(struct journal *j, struct journal_replay *i)
+{
+	return &j->pin.data[((j->pin.back - 1 -
+			      (atomic64_read(&j->seq) -
+			       le64_to_cpu(i->j.seq))) &
+			     j->pin.mask)];
+}
+
+/*
+ * With BCH_FEATURE_JOURNAL_GENS, the allocator journals the new gens of buckets
+ * it invalidates, and only rewrites the prios when journal reclaim needs the
+ * space - so once the prios have been read, apply the gens journalled since.
+ *
+ * Those are the ones in entries that point to the same prio buckets as the last
+ * entry: the allocator thread both writes the prios and journals gens, waiting
+ * on the journal each time, so gens journalled before the prios were written
+ * are in entries that still point to the old prio buckets.
+ */
+void bch_journal_read_gens(struct cache_set *c, struct list_head *list)
+{
+	struct journal *j = &c->journal;
+	struct journal_replay *r;
+	struct jset_entry *entry, *prio_ptrs;
+	struct bch_bucket_gen *g;
+	struct bucket_mark new;
+	struct cache *ca;
+	unsigned dev;
+	u64 b;
+
+	list_for_each_entry(r, list, list) {
+		prio_ptrs = bch_journal_find_entry(&r->j,
+					JOURNAL_ENTRY_PRIO_PTRS, 0);
+
+		for_each_jset_entry_type(entry, &r->j, JOURNAL_ENTRY_BUCKET_GENS)
+			for (g = (void *) entry->_data;
+			     (void *) g < vstruct_end(entry);
+			     g++) {
+				dev = BUCKET_GEN_DEV(g);
+
+				if (!prio_ptrs ||
+				    dev >= le16_to_cpu(prio_ptrs->u64s) ||
+				    prio_ptrs->_data[dev] !=
+				    j->prio_buckets[dev])
+					continue;
+
+				rcu_read_lock();
+				ca = rcu_dereference(c->cache[dev]);
+				if (ca) {
+					b = BUCKET_GEN_BUCKET(g);
+					bucket_cmpxchg(&ca->buckets[b], new,
+						       new.gen = BUCKET_GEN_GEN(g));
+					bch_prio_set_dirty(ca, b);
+
+					/* Until the prios are written again: */
+					if (!journal_pin_active(&ca->prio_gens_pin))
+						journal_pin_add_entry(j,
+							journal_replay_pin_list(j, r),
+							&ca->prio_gens_pin,
+							bch_prio_gens_flush);
+				}
+				rcu_read_unlock();
+			}
+	}
+}
+
+/*
+ * Account for an extent that's entirely overwritten by a later key, as if it
+ * had been inserted and then overwritten - replayed keys were already marked by
+ * bch_journal_mark(). GC isn't running yet, so we can't race with it:
+ */
+static void journal_replay_drop_extent(struct cache_set *c, struct bkey_i *k)
+{
+	struct bch_fs_usage stats;
+
+	bch_zero(stats);
+
+	bch_mark_key(c, bkey_i_to_s_c(k), -((s64) k->k.size), false,
+		     gc_pos_btree_root(BTREE_ID_EXTENTS), &stats, 0);
+
+	if (bkey_extent_is_data(&k->k) &&
+	    !bkey_extent_is_cached(&k->k))
+		bcache_dev_sectors_dirty_add(c, k->k.p.inode,
+					     bkey_start_offset(&k->k),
+					     -((int) k->k.size));
+
+	bch_fs_stats_apply(c, &stats, NULL,
+			   gc_pos_btree_root(BTREE_ID_EXTENTS));
+}
+
+/*
+ * @keys are overlapping extents, in journal order: drop the ones the next key
+ * that overlaps them overwrites entirely. If a key is only partly overwritten
+ * before being entirely overwritten we keep it, so that accounting (which isn't
+ * exact for partially overwritten compressed extents) is done exactly as it
+ * would have been without the reordering.
+ *
+ * Returns true if what's left can be inserted in sorted order.
+ */
+static bool journal_replay_drop_extents(struct journal_replay_btree *r,
+					struct journal_replay_key *keys,
+					size_t nr)
+{
+	struct bkey_i *prev = NULL;
+	size_t i, j;
+	bool sorted = true;
+
+	for (i = 0; i < nr; i++) {
+		struct bkey *l = &keys[i].k->k;
+
+		for (j = i + 1; j < nr; j++) {
+			struct bkey *n = &keys[j].k->k;
+
+			if (bkey_cmp(bkey_start_pos(n), l->p) >= 0 ||
+			    bkey_cmp(n->p, bkey_start_pos(l)) <= 0)
+				continue;
+
+			if (bkey_cmp(bkey_start_pos(n), bkey_start_pos(l)) <= 0 &&
+			    bkey_cmp(n->p, l->p) >= 0) {
+				journal_replay_drop_extent(r->c, keys[i].k);
+				keys[i].k = NULL;
+				r->dropped++;
+			}
+			break;
+		}
+
+		if (!keys[i].k)
+			continue;
+
+		if (prev && bkey_cmp(prev->k.p, bkey_start_pos(l)) > 0)
+			sorted = false;
+		prev = keys[i].k;
+	}
+
+	return sorted;
+}
+
+static int journal_replay_flush(struct journal_replay_btree *r,
+				struct keylist *keys,
+				struct disk_reservation *disk_res)
+{
+	return bch_btree_insert_list(r->c, r->id, keys, disk_res, NULL,
+				     BTREE_INSERT_NOFAIL|
+				     BTREE_INSERT_JOURNAL_REPLAY);
+}
+
+static int journal_replay_btree(struct journal_replay_btree *r)
+{
+	struct cache_set *c = r->c;
+	struct journal_replay_key *keys = r->keys;
+	struct disk_reservation disk_res;
+	struct keylist list;
+	struct bpos end;
+	size_t i, j, n;
+	int ret = 0;
+
+	sort(keys, r->nr, sizeof(keys[0]), journal_replay_key_cmp, NULL);
+
+	list.keys_p = kvmalloc(r->u64s * sizeof(u64), GFP_KERNEL);
+	if (!list.keys_p)
+		return -ENOMEM;
+	list.top_p = list.keys_p;
+
+	/*
+	 * We might cause compressed extents to be split, so we need to pass in
+	 * a disk_reservation:
+	 */
+	BUG_ON(bch_disk_reservation_get(c, &disk_res, 0, 0));
+
+	for (i = 0; i < r->nr && !ret; i = j) {
+		if (r->id != BTREE_ID_EXTENTS) {
+			/* Only the last key at a given position matters: */
+			for (j = i + 1;
+			     j < r->nr &&
+			     !bkey_cmp(keys[j].k->k.p, keys[i].k->k.p);
+			     j++)
+				r->dropped++;
+
+			bch_keylist_add(&list, keys[j - 1].k);
+			continue;
+		}
+
+		/* Find the run of keys overlapping @keys[i]: */
+		end = keys[i].k->k.p;
+		for (j = i + 1;
+		     j < r->nr &&
+		     bkey_cmp(bkey_start_pos(&keys[j].k->k), end) < 0;
+		     j++)
+			if (bkey_cmp(keys[j].k->k.p, end) > 0)
+				end = keys[j].k->k.p;
+
+		if (j - i == 1) {
+			bch_keylist_add(&list, keys[i].k);
+			continue;
+		}
+
+		sort(keys + i, j - i, sizeof(keys[0]),
+		     journal_replay_order_cmp, NULL);
+
+		if (journal_replay_drop_extents(r, keys + i, j - i)) {
+			for (n = i; n < j; n++)
+				if (keys[n].k)
+					bch_keylist_add(&list, keys[n].k);
+			continue;
+		}
+
+		/* What's left still overlaps - insert in journal order: */
+		if (!bch_keylist_empty(&list)) {
+			ret = journal_replay_flush(r, &list, &disk_res);
+			if (ret)
+				break;
+		}
+
+		for (n = i; n < j && !ret; n++)
+			if (keys[n].k)
+				ret = bch_btree_insert(c, r->id, keys[n].k,
+						       &disk_res, NULL, NULL,
+						       BTREE_INSERT_NOFAIL|
+						       BTREE_INSERT_JOURNAL_REPLAY);
+
+		cond_resched();
+	}
+
+	if (!ret && !bch_keylist_empty(&list))
+		ret = journal_replay_flush(r, &list, &disk_res);
+
+	bch_disk_reservation_put(c, &disk_res);
+	kvfree(list.keys_p);
+
+	return ret;
+}
+
+static void journal_replay_btree_work(struct work_struct *work)
+{
+	struct journal_replay_btree *r =
+		container_of(work, struct journal_replay_btree, work);
+
+	r->ret = journal_replay_btree(r);
+	closure_put(r->cl);
+}
+
 int bch_journal_replay(struct cache_set *c, struct list_head *list)
 {
 	int ret = 0, keys = 0, entries = 0;
 	struct journal *j = &c->journal;
+	struct journal_replay_btree btrees[BTREE_ID_NR];
+	struct workqueue_struct *wq = NULL;
+	struct closure cl;
 	struct bkey_i *k, *_n;
 	struct jset_entry *entry;
-	struct journal_replay *i, *n;
+	struct journal_replay *i;
+	size_t dropped = 0;
+	u64 order = 0;
+	unsigned id;
 
-	list_for_each_entry_safe(i, n, list, list) {
-		j->cur_pin_list =
-			&j->pin.data[((j->pin.back - 1 -
-				       (atomic64_read(&j->seq) -
-					le64_to_cpu(i->j.seq))) &
-				      j->pin.mask)];
+	memset(btrees, 0, sizeof(btrees));
 
+	list_for_each_entry(i, list, list)
 		for_each_jset_key(k, _n, entry, &i->j) {
-			struct disk_reservation disk_res;
+			btrees[entry->btree_id].nr++;
+			btrees[entry->btree_id].u64s += k->k.u64s;
+		}
 
-			/*
-			 * We might cause compressed extents to be split, so we
-			 * need to pass in a disk_reservation:
-			 */
-			BUG_ON(bch_disk_reservation_get(c, &disk_res, 0, 0));
+	for (id = 0; id < BTREE_ID_NR; id++) {
+		btrees[id].c	= c;
+		btrees[id].id	= id;
 
-			trace_bcache_journal_replay_key(&k->k);
+		if (btrees[id].nr) {
+			btrees[id].keys = kvmalloc(btrees[id].nr *
+						   sizeof(btrees[id].keys[0]),
+						   GFP_KERNEL);
+			if (!btrees[id].keys) {
+				ret = -ENOMEM;
+				goto err;
+			}
 
-			ret = bch_btree_insert(c, entry->btree_id, k,
-					       &disk_res, NULL, NULL,
-					       BTREE_INSERT_NOFAIL|
-					       BTREE_INSERT_JOURNAL_REPLAY);
-			bch_disk_reservation_put(c, &disk_res);
+			btrees[id].nr = 0;
+		}
+	}
 
-			if (ret)
-				goto err;
+	list_for_each_entry(i, list, list) {
+		for_each_jset_key(k, _n, entry, &i->j) {
+			struct journal_replay_btree *r = &btrees[entry->btree_id];
 
-			cond_resched();
+			trace_bcache_journal_replay_key(&k->k);
+
+			r->keys[r->nr++] = (struct journal_replay_key) {
+				.k	= k,
+				.order	= order++,
+			};
 			keys++;
 		}
 
-		if (atomic_dec_and_test(&j->cur_pin_list->count))
-			wake_up(&j->wait);
-
 		entries++;
 	}
 
-	if (keys) {
-		bch_btree_flush(c);
+	if (!keys)
+		goto keys_done;
 
-		/*
-		 * Write a new journal entry _before_ we start journalling new data -
-		 * otherwise, we could end up with btree node bsets with journal seqs
-		 * arbitrarily far in the future vs. the most recently written journal
-		 * entry on disk, if we crash before writing the next journal entry:
-		 */
-		ret = bch_journal_meta(&c->journal);
-		if (ret)
-			goto err;
+	wq = alloc_workqueue("bcache_journal_replay", WQ_UNBOUND, 0);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/*
+	 * Keys are no longer replayed an entry at a time, so btree nodes are
+	 * pinned to the oldest entry being replayed until we're done:
+	 */
+	j->cur_pin_list = journal_replay_pin_list(j,
+			list_first_entry(list, struct journal_replay, list));
+
+	closure_init_stack(&cl);
+
+	for (id = 0; id < BTREE_ID_NR; id++)
+		if (btrees[id].nr) {
+			INIT_WORK(&btrees[id].work, journal_replay_btree_work);
+			btrees[id].cl = &cl;
+
+			closure_get(&cl);
+			queue_work(wq, &btrees[id].work);
+		}
+
+	closure_sync(&cl);
+	destroy_workqueue(wq);
+
+	for (id = 0; id < BTREE_ID_NR; id++) {
+		ret = ret ?: btrees[id].ret;
+		dropped += btrees[id].dropped;
 	}
 
-	bch_info(c, "journal replay done, %i keys in %i entries, seq %llu",
-		 keys, entries, (u64) atomic64_read(&j->seq));
+	if (ret)
+		goto err;
+keys_done:
+	list_for_each_entry(i, list, list)
+		if (atomic_dec_and_test(&journal_replay_pin_list(j, i)->count))
+			wake_up(&j->wait);
+
+	if (!keys)
+		goto done;
+
+	bch_btree_flush(c);
+
+	/*
+	 * Write a new journal entry _before_ we start journalling new data -
+	 * otherwise, we could end up with btree node bsets with journal seqs
+	 * arbitrarily far in the future vs. the most recently written journal
+	 * entry on disk, if we crash before writing the next journal entry:
+	 */
+	ret = bch_journal_meta(&c->journal);
+	if (ret)
+		goto err;
+done:
+	bch_info(c, "journal replay done, %i keys in %i entries (%zu overwritten), seq %llu",
+		 keys, entries, dropped, (u64) atomic64_read(&j->seq));
 
 	bch_journal_set_replay_done(&c->journal);
 err:
 	if (ret)
 		bch_err(c, "journal replay error: %d", ret);
 
+	for (id = 0; id < BTREE_ID_NR; id++)
+		kvfree(btrees[id].keys);
+
 	bch_journal_entries_free(list);
 
 	return ret;
@@ -2116,6 +2728,16 @@ static void journal_write_done(struct closure *cl)
 	atomic64_sub(((union journal_res_state) { .prev_buf_unwritten = 1 }).v,
 		     &j->reservations.counter);
 
+	/*
+	 * Updating last_seq_ondisk may let journal_reclaim_work() discard more
+	 * buckets.
+	 *
+	 * This has to come before the wake up: bch_fs_journal_stop() waits on this
+	 * write and then cancels reclaim_work, which we mustn't requeue after
+	 * it's been cancelled:
+	 */
+	mod_delayed_work(system_freezable_wq, &j->reclaim_work, 0);
+
 	/*
 	 * XXX: this is racy, we could technically end up doing the wake up
 	 * after the journal_buf struct has been reused for the next write
@@ -2133,12 +2755,6 @@ static void journal_write_done(struct closure *cl)
 
 	closure_wake_up(&w->wait);
 	wake_up(&j->wait);
-
-	/*
-	 * Updating last_seq_ondisk may let journal_reclaim_work() discard more
-	 * buckets:
-	 */
-	mod_delayed_work(system_freezable_wq, &j->reclaim_work, 0);
 }
 
 static void journal_write(struct closure *cl)
@@ -208,6 +208,24 @@ static inline void bch_journal_add_keys(struct journal *j, struct journal_res *r
 	res->u64s	-= actual;
 }
 
+static inline void bch_journal_add_bucket_gens(struct journal *j,
+					       struct journal_res *res,
+					       const struct bch_bucket_gen *g,
+					       unsigned nr)
+{
+	struct journal_buf *buf = &j->buf[res->idx];
+	unsigned actual = jset_u64s(nr);
+
+	EBUG_ON(!res->ref);
+	BUG_ON(actual > res->u64s);
+
+	bch_journal_add_entry_at(buf, g, nr, JOURNAL_ENTRY_BUCKET_GENS,
+				 0, 0, res->offset);
+
+	res->offset	+= actual;
+	res->u64s	-= actual;
+}
+
 void bch_journal_buf_put_slowpath(struct journal *, bool);
 
 static inline void bch_journal_buf_put(struct journal *j, unsigned idx,
@@ -337,6 +355,7 @@ static inline bool journal_flushes_device(struct cache *ca)
 
 void bch_journal_start(struct cache_set *);
 void bch_journal_mark(struct cache_set *, struct list_head *);
+void bch_journal_read_gens(struct cache_set *, struct list_head *);
 void bch_journal_entries_free(struct list_head *);
 int bch_journal_read(struct cache_set *, struct list_head *);
 int bch_journal_replay(struct cache_set *, struct list_head *);
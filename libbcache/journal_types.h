@@ -234,9 +234,6 @@ struct journal_device {
 
 	/* Bio for journal reads/writes to this device */
 	struct bio		*bio;
-
-	/* for bch_journal_read_device */
-	struct closure		read;
 };
 
 #endif /* _BCACHE_JOURNAL_TYPES_H */
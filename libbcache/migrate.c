@@ -90,6 +90,7 @@ int bch_move_data_off_device(struct cache *ca)
 	 */
 
 	do {
+		struct move_ranges ranges;
 		struct btree_iter iter;
 		struct bkey_s_c k;
 
@@ -97,11 +98,21 @@ int bch_move_data_off_device(struct cache *ca)
 		atomic_set(&ctxt.error_count, 0);
 		atomic_set(&ctxt.error_flags, 0);
 
-		bch_btree_iter_init(&iter, c, BTREE_ID_EXTENTS, POS_MIN);
+		bch_move_ranges_init(&ranges);
+		bch_move_ranges_add(&ranges, ca, bucket_has_data);
+		bch_move_ranges_done(&ranges);
+
+		bch_btree_iter_init(&iter, c, BTREE_ID_EXTENTS,
+				    bch_move_ranges_start(&ranges));
 
 		while (!bch_move_ctxt_wait(&ctxt) &&
 		       (k = bch_btree_iter_peek(&iter)).k &&
 		       !(ret = btree_iter_err(k))) {
+			if (!bch_move_ranges_contains(&ranges, &iter, k)) {
+				bch_btree_iter_unlock(&iter);
+				continue;
+			}
+
 			if (!bkey_extent_is_data(k.k) ||
 			    !bch_extent_has_device(bkey_s_c_to_extent(k),
 						   ca->dev_idx))
@@ -130,6 +141,7 @@ next:
 		}
 		bch_btree_iter_unlock(&iter);
 		bch_move_ctxt_exit(&ctxt);
+		bch_move_ranges_exit(&ranges);
 
 		if (ret)
 			return ret;
@@ -9,6 +9,7 @@
 #include "keylist.h"
 
 #include <linux/ioprio.h>
+#include <linux/sort.h>
 
 #include <trace/events/bcache.h>
 
@@ -398,3 +399,130 @@ void bch_move_ctxt_init(struct moving_context *ctxt,
 	INIT_LIST_HEAD(&ctxt->reads);
 	init_waitqueue_head(&ctxt->wait);
 }
+
+/* Ranges of the extents btree to walk: */
+
+/* Add the ranges of the buckets on @ca for which @pred is true: */
+void bch_move_ranges_add(struct move_ranges *r, struct cache *ca,
+			 bool (*pred)(struct bucket_mark))
+{
+	struct bucket_backpointer *d;
+	struct bucket *g;
+	size_t nr = 0;
+
+	if (r->all)
+		return;
+
+	for_each_bucket(g, ca)
+		nr += pred(READ_ONCE(g->mark));
+
+	if (!ca->backpointers ||
+	    !(d = kvmalloc(sizeof(*d) * (r->nr + nr), GFP_KERNEL)))
+		goto walk_all;
+
+	if (r->d)
+		memcpy(d, r->d, sizeof(*d) * r->nr);
+	kvfree(r->d);
+	r->d = d;
+	nr += r->nr;
+
+	for_each_bucket(g, ca) {
+		if (!pred(READ_ONCE(g->mark)))
+			continue;
+
+		/*
+		 * Marks may have changed since we counted - if more buckets
+		 * match now, we can't drop their ranges: a pass that finds no
+		 * keys is taken to mean the buckets are empty:
+		 */
+		if (r->nr == nr)
+			goto walk_all;
+
+		if (bch_bucket_backpointer(ca, g, &r->d[r->nr]))
+			r->nr++;
+	}
+
+	return;
+walk_all:
+	/* no reverse index (or no memory for it), walk everything: */
+	bch_move_ranges_exit(r);
+	r->all = true;
+}
+
+static int backpointer_cmp(const void *_l, const void *_r)
+{
+	const struct bucket_backpointer *l = _l, *r = _r;
+
+	return bkey_cmp(l->start, r->start);
+}
+
+/* Sort ranges and merge the ones that overlap, once they've all been added: */
+void bch_move_ranges_done(struct move_ranges *r)
+{
+	size_t i, nr = 0;
+
+	if (r->all)
+		return;
+
+	sort(r->d, r->nr, sizeof(r->d[0]), backpointer_cmp, NULL);
+
+	for (i = 0; i < r->nr; i++)
+		if (nr && bkey_cmp(r->d[i].start, r->d[nr - 1].end) <= 0)
+			r->d[nr - 1].end = bkey_cmp(r->d[i].end,
+						    r->d[nr - 1].end) > 0
+				? r->d[i].end
+				: r->d[nr - 1].end;
+		else
+			r->d[nr++] = r->d[i];
+
+	r->nr	= nr;
+	r->idx	= 0;
+}
+
+void bch_move_ranges_exit(struct move_ranges *r)
+{
+	kvfree(r->d);
+	memset(r, 0, sizeof(*r));
+}
+
+void bch_move_ranges_init(struct move_ranges *r)
+{
+	memset(r, 0, sizeof(*r));
+}
+
+struct bpos bch_move_ranges_start(struct move_ranges *r)
+{
+	return r->all ? POS_MIN
+		: r->nr ? r->d[0].start
+		: POS_MAX;
+}
+
+/**
+ * bch_move_ranges_contains - check if @k may point into the buckets we're
+ * moving from
+ *
+ * If not, @iter is moved forward to the start of the next range (or to the end
+ * of the btree, if there are no more), and the caller should peek again.
+ */
+bool bch_move_ranges_contains(struct move_ranges *r, struct btree_iter *iter,
+			      struct bkey_s_c k)
+{
+	if (r->all)
+		return true;
+
+	while (r->idx < r->nr &&
+	       bkey_cmp(bkey_start_pos(k.k), r->d[r->idx].end) >= 0)
+		r->idx++;
+
+	if (r->idx == r->nr) {
+		bch_btree_iter_set_pos(iter, POS_MAX);
+		return false;
+	}
+
+	if (bkey_cmp(k.k->p, r->d[r->idx].start) <= 0) {
+		bch_btree_iter_set_pos(iter, r->d[r->idx].start);
+		return false;
+	}
+
+	return true;
+}
@@ -84,4 +84,26 @@ void bch_move_ctxt_exit(struct moving_context *);
 void bch_move_ctxt_init(struct moving_context *, struct bch_ratelimit *,
 			unsigned);
 
+/*
+ * The parts of the extents btree that may point into the buckets being moved
+ * from - found with the reverse index if it's enabled, otherwise the whole
+ * btree:
+ */
+struct move_ranges {
+	bool			all;
+	size_t			nr;
+	size_t			idx;
+	struct bucket_backpointer *d;
+};
+
+void bch_move_ranges_add(struct move_ranges *, struct cache *,
+			 bool (*)(struct bucket_mark));
+void bch_move_ranges_done(struct move_ranges *);
+void bch_move_ranges_exit(struct move_ranges *);
+void bch_move_ranges_init(struct move_ranges *);
+
+struct bpos bch_move_ranges_start(struct move_ranges *);
+bool bch_move_ranges_contains(struct move_ranges *, struct btree_iter *,
+			      struct bkey_s_c);
+
 #endif /* _BCACHE_MOVE_H */
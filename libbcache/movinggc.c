@@ -55,21 +55,32 @@ static int issue_moving_gc_move(struct cache *ca,
 	return ret;
 }
 
+static bool bucket_marked_copygc(struct bucket_mark m)
+{
+	return m.copygc;
+}
+
 static void read_moving(struct cache *ca, size_t buckets_to_move,
 			u64 sectors_to_move)
 {
 	struct cache_set *c = ca->set;
 	struct bucket *g;
 	struct moving_context ctxt;
+	struct move_ranges ranges;
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	u64 sectors_not_moved = 0;
 	size_t buckets_not_moved = 0;
 
+	bch_move_ranges_init(&ranges);
+	bch_move_ranges_add(&ranges, ca, bucket_marked_copygc);
+	bch_move_ranges_done(&ranges);
+
 	bch_ratelimit_reset(&ca->moving_gc_pd.rate);
 	bch_move_ctxt_init(&ctxt, &ca->moving_gc_pd.rate,
 				SECTORS_IN_FLIGHT_PER_DEVICE);
-	bch_btree_iter_init(&iter, c, BTREE_ID_EXTENTS, POS_MIN);
+	bch_btree_iter_init(&iter, c, BTREE_ID_EXTENTS,
+			    bch_move_ranges_start(&ranges));
 
 	while (1) {
 		if (kthread_should_stop())
@@ -82,6 +93,11 @@ static void read_moving(struct cache *ca, size_t buckets_to_move,
 		if (btree_iter_err(k))
 			goto out;
 
+		if (!bch_move_ranges_contains(&ranges, &iter, k)) {
+			bch_btree_iter_unlock(&iter);
+			continue;
+		}
+
 		if (!moving_pred(ca, k))
 			goto next;
 
@@ -103,6 +119,7 @@ next:
 
 	bch_btree_iter_unlock(&iter);
 	bch_move_ctxt_exit(&ctxt);
+	bch_move_ranges_exit(&ranges);
 	trace_bcache_moving_gc_end(ca, ctxt.sectors_moved, ctxt.keys_moved,
 				   buckets_to_move);
 
@@ -121,6 +138,7 @@ next:
 out:
 	bch_btree_iter_unlock(&iter);
 	bch_move_ctxt_exit(&ctxt);
+	bch_move_ranges_exit(&ranges);
 	trace_bcache_moving_gc_end(ca, ctxt.sectors_moved, ctxt.keys_moved,
 				   buckets_to_move);
 }
@@ -83,6 +83,10 @@ enum opt_type {
 		s8,  OPT_BOOL())					\
 	BCH_OPT(nofsck,			0444,	NO_SB_OPT,		\
 		s8,  OPT_BOOL())					\
+	BCH_OPT(fsck_threads,		0444,	NO_SB_OPT,		\
+		s8,  OPT_UINT(0, 64))					\
+	BCH_OPT(fsck_mem_limit,		0444,	NO_SB_OPT,		\
+		s64, OPT_UINT(0, S64_MAX))				\
 	BCH_OPT(fix_errors,		0444,	NO_SB_OPT,		\
 		s8,  OPT_BOOL())					\
 	BCH_OPT(nochanges,		0444,	NO_SB_OPT,		\
@@ -93,6 +97,10 @@ enum opt_type {
 		s8,  OPT_BOOL())					\
 	BCH_OPT(noexcl,			0444,	NO_SB_OPT,		\
 		s8,  OPT_BOOL())					\
+	BCH_OPT(buffered_io,		0444,	NO_SB_OPT,		\
+		s8,  OPT_BOOL())					\
+	BCH_OPT(backpointers,		0444,	NO_SB_OPT,		\
+		s8,  OPT_BOOL())					\
 	BCH_OPT(sb,			0444,	NO_SB_OPT,		\
 		s64, OPT_UINT(0, S64_MAX))				\
 
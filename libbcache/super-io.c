@@ -296,6 +296,10 @@ const char *bch_validate_cache_super(struct bcache_superblock *disk_sb)
 	    le64_to_cpu(sb->version) != BCACHE_SB_VERSION_CDEV_V4)
 		return "Unsupported superblock version";
 
+	if (le64_to_cpu(sb->features[0]) & (~0ULL << BCH_FEATURE_NR) ||
+	    sb->features[1])
+		return "Unsupported features";
+
 	block_size = le16_to_cpu(sb->block_size);
 
 	if (!is_power_of_2(block_size) ||
@@ -676,6 +680,9 @@ const char *bch_read_super(struct bcache_superblock *sb,
 	if (!(opt_defined(opts.nochanges) && opts.nochanges))
 		sb->mode |= FMODE_WRITE;
 
+	if (opt_defined(opts.buffered_io) && opts.buffered_io)
+		sb->mode |= FMODE_BUFFERED;
+
 	err = bch_blkdev_open(path, sb->mode, sb, &sb->bdev);
 	if (err)
 		return err;
@@ -308,6 +308,10 @@ static void bch_fs_free(struct cache_set *c)
 	bdi_destroy(&c->bdi);
 	lg_lock_free(&c->bucket_stats_lock);
 	free_percpu(c->bucket_stats_percpu);
+#define BCH_TIME_STAT(name, frequency_units, duration_units)		\
+	bch_time_stats_exit(&c->name##_time);
+	BCH_TIME_STATS()
+#undef BCH_TIME_STAT
 	mempool_exit(&c->btree_bounce_pool);
 	mempool_exit(&c->bio_bounce_pages);
 	bioset_exit(&c->bio_write);
@@ -395,7 +399,11 @@ static void __bch_fs_stop3(struct closure *cl)
 {
 	struct cache_set *c = container_of(cl, struct cache_set, cl);
 
-	bch_fs_exit(c);
+	/* bch_fs_stop() is waiting to tear it down itself: */
+	if (c->stop_wait)
+		closure_put(c->stop_wait);
+	else
+		bch_fs_exit(c);
 }
 
 /*
@@ -437,6 +445,10 @@ void bch_fs_stop_async(struct cache_set *c)
 
 void bch_fs_stop(struct cache_set *c)
 {
+	struct closure cl;
+
+	closure_init_stack(&cl);
+
 	mutex_lock(&c->state_lock);
 	BUG_ON(c->state == BCH_FS_STOPPING);
 	c->state = BCH_FS_STOPPING;
@@ -445,12 +457,21 @@ void bch_fs_stop(struct cache_set *c)
 	bch_blockdevs_stop(c);
 
 	closure_sync(&c->caching);
-	closure_debug_destroy(&c->caching);
 
 	bch_fs_offline(c);
 
+	/* drops c->caching's ref on c->cl: */
+	continue_at_noreturn(&c->caching, NULL, NULL);
+
+	/*
+	 * Drop our ref on c->cl, and wait for __bch_fs_stop3() - it only runs
+	 * once nothing else holds a ref, e.g. the final journal write, which
+	 * may complete on another thread after bch_fs_journal_stop() returns:
+	 */
+	closure_get(&cl);
+	c->stop_wait = &cl;
 	closure_put(&c->cl);
-	closure_sync(&c->cl);
+	closure_sync(&cl);
 
 	bch_fs_exit(c);
 	kobject_put(&c->kobj);
@@ -518,7 +539,8 @@ static struct cache_set *bch_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	init_rwsem(&c->gc_lock);
 
 #define BCH_TIME_STAT(name, frequency_units, duration_units)		\
-	spin_lock_init(&c->name##_time.lock);
+	if (bch_time_stats_init(&c->name##_time))			\
+		goto err;
 	BCH_TIME_STATS()
 #undef BCH_TIME_STAT
 
@@ -771,6 +793,8 @@ static const char *__bch_fs_start(struct cache_set *c)
 			}
 		}
 
+		bch_journal_read_gens(c, &journal);
+
 		c->prio_clock[READ].hand = le16_to_cpu(j->read_clock);
 		c->prio_clock[WRITE].hand = le16_to_cpu(j->write_clock);
 
@@ -1047,9 +1071,12 @@ static void bch_dev_free(struct cache *ca)
 	bioset_exit(&ca->replica_set);
 	free_percpu(ca->bucket_stats_percpu);
 	free_pages((unsigned long) ca->disk_buckets, ilog2(bucket_pages(ca)));
+	kfree(ca->prio_sets_dirty);
 	kfree(ca->prio_buckets);
 	kfree(ca->bio_prio);
 	kfree(ca->journal.bio);
+	vfree(ca->backpointers);
+	vfree(ca->bucket_lru);
 	vfree(ca->buckets);
 	vfree(ca->oldest_gens);
 	free_heap(&ca->heap);
@@ -1166,6 +1193,9 @@ static const char *bch_dev_alloc(struct bcache_superblock *sb,
 	spin_lock_init(&ca->freelist_lock);
 	spin_lock_init(&ca->prio_buckets_lock);
 	mutex_init(&ca->heap_lock);
+	spin_lock_init(&ca->bucket_lru_lock);
+	for (i = 0; i < ARRAY_SIZE(ca->backpointer_locks); i++)
+		spin_lock_init(&ca->backpointer_locks[i]);
 	bch_dev_moving_gc_init(ca);
 
 	ca->disk_sb = *sb;
@@ -1186,6 +1216,11 @@ static const char *bch_dev_alloc(struct bcache_superblock *sb,
 	ca->uuid = member->uuid;
 	ca->bucket_bits = ilog2(ca->mi.bucket_size);
 
+	/* The bucket LRU index links buckets by their 32 bit index: */
+	err = "too many buckets for the bucket LRU index";
+	if (ca->mi.nbuckets + BUCKET_LRU_NR > U32_MAX)
+		goto err;
+
 	/* XXX: tune these */
 	movinggc_reserve = max_t(size_t, 16, ca->mi.nbuckets >> 7);
 	reserve_none = max_t(size_t, 4, ca->mi.nbuckets >> 9);
@@ -1197,6 +1232,7 @@ static const char *bch_dev_alloc(struct bcache_superblock *sb,
 	free_inc_reserve = movinggc_reserve / 2;
 	heap_size = movinggc_reserve * 8;
 
+	err = "cannot allocate memory";
 	if (!init_fifo(&ca->free[RESERVE_PRIO], prio_buckets(ca), GFP_KERNEL) ||
 	    !init_fifo(&ca->free[RESERVE_BTREE], BTREE_NODE_RESERVE, GFP_KERNEL) ||
 	    !init_fifo(&ca->free[RESERVE_MOVINGGC],
@@ -1208,8 +1244,16 @@ static const char *bch_dev_alloc(struct bcache_superblock *sb,
 					  ca->mi.nbuckets)) ||
 	    !(ca->buckets	= vzalloc(sizeof(struct bucket) *
 					  ca->mi.nbuckets)) ||
+	    !(ca->bucket_lru	= vzalloc(sizeof(struct bucket_lru) *
+					  (ca->mi.nbuckets + BUCKET_LRU_NR))) ||
+	    (c->opts.backpointers &&
+	     !(ca->backpointers = vzalloc(sizeof(struct bucket_backpointer) *
+					  ca->mi.nbuckets))) ||
 	    !(ca->prio_buckets	= kzalloc(sizeof(uint64_t) * prio_buckets(ca) *
 					  2, GFP_KERNEL)) ||
+	    !(ca->prio_sets_dirty = kcalloc(BITS_TO_LONGS(prio_buckets(ca)),
+					    sizeof(unsigned long),
+					    GFP_KERNEL)) ||
 	    !(ca->disk_buckets	= alloc_bucket_pages(GFP_KERNEL, ca)) ||
 	    !(ca->bucket_stats_percpu = alloc_percpu(struct bch_dev_usage)) ||
 	    !(ca->bio_prio = bio_kmalloc(GFP_NOIO, bucket_pages(ca))) ||
@@ -1220,6 +1264,8 @@ static const char *bch_dev_alloc(struct bcache_superblock *sb,
 		goto err;
 
 	ca->prio_last_buckets = ca->prio_buckets + prio_buckets(ca);
+	bch_prio_sets_dirty_all(ca);
+	bch_dev_bucket_lru_init(ca);
 
 	total_reserve = ca->free_inc.size;
 	for (i = 0; i < RESERVE_NR; i++)
@@ -1882,6 +1928,7 @@ static int __init bcache_init(void)
 	register_reboot_notifier(&reboot);
 	closure_debug_init();
 	bkey_pack_test();
+	bch_crc64_init();
 
 	bch_sha256 = crypto_alloc_shash("sha256", 0, 0);
 	if (IS_ERR(bch_sha256))
@@ -106,9 +106,11 @@ static s64 read_tiering(struct cache_set *c, struct bch_tier *tier)
 {
 	struct moving_context ctxt;
 	struct tiering_state s;
+	struct move_ranges ranges;
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	unsigned nr_devices = READ_ONCE(tier->devs.nr);
+	struct cache *ca;
+	unsigned i, nr_devices = READ_ONCE(tier->devs.nr);
 	int ret;
 
 	if (!nr_devices)
@@ -120,14 +122,30 @@ static s64 read_tiering(struct cache_set *c, struct bch_tier *tier)
 	s.tier		= tier;
 	s.stripe_size	= 2048; /* 1 mb for now */
 
+	/*
+	 * Extents that need another replica on this tier have their other
+	 * pointers on faster tiers:
+	 */
+	bch_move_ranges_init(&ranges);
+	for_each_cache(ca, c, i)
+		if (ca->mi.tier < tier->idx)
+			bch_move_ranges_add(&ranges, ca, bucket_has_data);
+	bch_move_ranges_done(&ranges);
+
 	bch_move_ctxt_init(&ctxt, &tier->pd.rate,
 			   nr_devices * SECTORS_IN_FLIGHT_PER_DEVICE);
-	bch_btree_iter_init(&iter, c, BTREE_ID_EXTENTS, POS_MIN);
+	bch_btree_iter_init(&iter, c, BTREE_ID_EXTENTS,
+			    bch_move_ranges_start(&ranges));
 
 	while (!kthread_should_stop() &&
 	       !bch_move_ctxt_wait(&ctxt) &&
 	       (k = bch_btree_iter_peek(&iter)).k &&
 	       !btree_iter_err(k)) {
+		if (!bch_move_ranges_contains(&ranges, &iter, k)) {
+			bch_btree_iter_unlock(&iter);
+			continue;
+		}
+
 		if (!tiering_pred(c, &s, k))
 			goto next;
 
@@ -155,6 +173,7 @@ next:
 	bch_btree_iter_unlock(&iter);
 	tier_put_device(&s);
 	bch_move_ctxt_exit(&ctxt);
+	bch_move_ranges_exit(&ranges);
 	trace_bcache_tiering_end(c, ctxt.sectors_moved, ctxt.keys_moved);
 
 	return ctxt.sectors_moved;
@@ -147,57 +147,155 @@ bool bch_is_zero(const void *_p, size_t n)
 	return true;
 }
 
+static inline unsigned time_stats_bucket(u64 v)
+{
+	unsigned shift;
+
+	if (v < TIME_STATS_SUB_BUCKETS)
+		return v;
+
+	shift = fls64(v) - 1 - TIME_STATS_SUB_BITS;
+
+	return min_t(u64, shift * TIME_STATS_SUB_BUCKETS + (v >> shift),
+		     TIME_STATS_NR_BUCKETS - 1);
+}
+
+/* Largest duration that falls in bucket @i: */
+static u64 time_stats_bucket_max(unsigned i)
+{
+	unsigned shift;
+
+	if (i < TIME_STATS_SUB_BUCKETS)
+		return i;
+
+	shift = i / TIME_STATS_SUB_BUCKETS - 1;
+
+	return ((u64) (i % TIME_STATS_SUB_BUCKETS +
+		       TIME_STATS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void bch_time_stats_exit(struct time_stats *stats)
+{
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+}
+
+int bch_time_stats_init(struct time_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	stats->cpu = alloc_percpu(struct time_stats_cpu);
+	return stats->cpu ? 0 : -ENOMEM;
+}
+
 void bch_time_stats_clear(struct time_stats *stats)
 {
-	spin_lock(&stats->lock);
+	int cpu;
 
-	stats->count = 0;
-	stats->last_duration = 0;
-	stats->max_duration = 0;
-	stats->average_duration = 0;
-	stats->average_frequency = 0;
-	stats->last = 0;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats->cpu, cpu), 0,
+		       sizeof(struct time_stats_cpu));
 
-	spin_unlock(&stats->lock);
+	WRITE_ONCE(stats->last_duration, 0);
+	WRITE_ONCE(stats->max_duration, 0);
+	WRITE_ONCE(stats->average_duration, 0);
+	WRITE_ONCE(stats->average_frequency, 0);
+	WRITE_ONCE(stats->last, 0);
 }
 
 void __bch_time_stats_update(struct time_stats *stats, u64 start_time)
 {
-	u64 now, duration, last;
-
-	stats->count++;
+	u64 now, duration, last, prev, v;
 
 	now		= local_clock();
 	duration	= time_after64(now, start_time)
 		? now - start_time : 0;
-	last		= time_after64(now, stats->last)
-		? now - stats->last : 0;
-
-	stats->last_duration = duration;
-	stats->max_duration = max(stats->max_duration, duration);
-
-	if (stats->last) {
-		stats->average_duration = ewma_add(stats->average_duration,
-						   duration << 8, 3);
-
-		if (stats->average_frequency)
-			stats->average_frequency =
-				ewma_add(stats->average_frequency,
-					 last << 8, 3);
-		else
-			stats->average_frequency  = last << 8;
-	} else {
-		stats->average_duration = duration << 8;
+	prev		= xchg(&stats->last, now ?: 1);
+	last		= time_after64(now, prev)
+		? now - prev : 0;
+
+	this_cpu_add(stats->cpu->sum, duration);
+	this_cpu_inc(stats->cpu->buckets[time_stats_bucket(duration)]);
+
+	WRITE_ONCE(stats->last_duration, duration);
+
+	v = READ_ONCE(stats->max_duration);
+	while (v < duration) {
+		u64 old = v;
+
+		if ((v = cmpxchg(&stats->max_duration, old, duration)) == old)
+			break;
 	}
 
-	stats->last = now ?: 1;
+	if (prev) {
+		WRITE_ONCE(stats->average_duration,
+			   ewma_add(READ_ONCE(stats->average_duration),
+				    duration << 8, 3));
+
+		v = READ_ONCE(stats->average_frequency);
+		WRITE_ONCE(stats->average_frequency, v
+			   ? ewma_add(v, last << 8, 3)
+			   : last << 8);
+	} else {
+		WRITE_ONCE(stats->average_duration, duration << 8);
+	}
 }
 
 void bch_time_stats_update(struct time_stats *stats, u64 start_time)
 {
-	spin_lock(&stats->lock);
 	__bch_time_stats_update(stats, start_time);
-	spin_unlock(&stats->lock);
+}
+
+static u64 time_stats_quantile(const u64 *buckets, u64 count, u64 max,
+			       unsigned permille)
+{
+	u64 rank = max_t(u64, DIV_ROUND_UP(count * permille, 1000), 1);
+	u64 seen = 0;
+	unsigned i;
+
+	for (i = 0; i < TIME_STATS_NR_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank)
+			return min(time_stats_bucket_max(i), max);
+	}
+
+	return max;
+}
+
+void bch_time_stats_summary(struct time_stats *stats,
+			    struct time_stats_summary *s)
+{
+	u64 *buckets, sum = 0;
+	unsigned i;
+	int cpu;
+
+	memset(s, 0, sizeof(*s));
+
+	buckets = kcalloc(TIME_STATS_NR_BUCKETS, sizeof(u64), GFP_KERNEL);
+	if (!buckets)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct time_stats_cpu *p = per_cpu_ptr(stats->cpu, cpu);
+
+		sum += READ_ONCE(p->sum);
+
+		for (i = 0; i < TIME_STATS_NR_BUCKETS; i++)
+			buckets[i] += READ_ONCE(p->buckets[i]);
+	}
+
+	for (i = 0; i < TIME_STATS_NR_BUCKETS; i++)
+		s->count += buckets[i];
+
+	if (s->count) {
+		s->max	= READ_ONCE(stats->max_duration);
+		s->mean	= div64_u64(sum, s->count);
+		s->p50	= time_stats_quantile(buckets, s->count, s->max, 500);
+		s->p99	= time_stats_quantile(buckets, s->count, s->max, 990);
+		s->p999	= time_stats_quantile(buckets, s->count, s->max, 999);
+	}
+
+	kfree(buckets);
 }
 
 /**
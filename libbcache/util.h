@@ -325,9 +325,28 @@ ssize_t bch_snprint_string_list(char *buf, size_t size, const char * const list[
 
 ssize_t bch_read_string_list(const char *buf, const char * const list[]);
 
+/*
+ * Durations are also recorded in log-linear histograms: each power of two is
+ * split into TIME_STATS_SUB_BUCKETS linear buckets, so quantiles are accurate
+ * to within 1/TIME_STATS_SUB_BUCKETS, from 1ns up to 2^TIME_STATS_MAX_SHIFT ns
+ * (about 18 minutes).
+ *
+ * Histograms are percpu, and nothing is locked on update - the averages may
+ * occasionally lose an update to a concurrent one.
+ */
+#define TIME_STATS_SUB_BITS	4
+#define TIME_STATS_SUB_BUCKETS	(1U << TIME_STATS_SUB_BITS)
+#define TIME_STATS_MAX_SHIFT	40
+#define TIME_STATS_NR_BUCKETS						\
+	((TIME_STATS_MAX_SHIFT - TIME_STATS_SUB_BITS + 1) * TIME_STATS_SUB_BUCKETS)
+
+struct time_stats_cpu {
+	u64		sum;
+	u64		buckets[TIME_STATS_NR_BUCKETS];
+};
+
 struct time_stats {
-	spinlock_t	lock;
-	u64		count;
+	struct time_stats_cpu __percpu *cpu;
 	/*
 	 * all fields are in nanoseconds, averages are ewmas stored left shifted
 	 * by 8
@@ -339,9 +358,22 @@ struct time_stats {
 	u64		last;
 };
 
+/* Durations in nanoseconds: */
+struct time_stats_summary {
+	u64		count;
+	u64		mean;
+	u64		p50;
+	u64		p99;
+	u64		p999;
+	u64		max;
+};
+
+void bch_time_stats_exit(struct time_stats *);
+int bch_time_stats_init(struct time_stats *);
 void bch_time_stats_clear(struct time_stats *stats);
 void __bch_time_stats_update(struct time_stats *stats, u64 time);
 void bch_time_stats_update(struct time_stats *stats, u64 time);
+void bch_time_stats_summary(struct time_stats *, struct time_stats_summary *);
 
 static inline unsigned local_clock_us(void)
 {
@@ -357,21 +389,35 @@ static inline unsigned local_clock_us(void)
 	sysfs_print(name ## _ ## stat ## _ ## units,			\
 		    div_u64((stats)->stat >> 8, NSEC_PER_ ## units))
 
+#define __print_time_stat_quantile(summary, name, stat, units)		\
+	sysfs_print(name ## _ ## stat ## _ ## units,			\
+		    div_u64((summary).stat, NSEC_PER_ ## units))
+
 #define sysfs_print_time_stats(stats, name,				\
 			       frequency_units,				\
 			       duration_units)				\
 do {									\
+	struct time_stats_summary _summary;				\
+									\
+	bch_time_stats_summary(stats, &_summary);			\
+									\
 	__print_time_stat(stats, name,					\
 			  average_frequency,	frequency_units);	\
 	__print_time_stat(stats, name,					\
 			  average_duration,	duration_units);	\
-	sysfs_print(name ## _ ##count, (stats)->count);			\
+	sysfs_print(name ## _ ##count, _summary.count);			\
 	sysfs_print(name ## _ ##last_duration ## _ ## duration_units,	\
 			div_u64((stats)->last_duration,			\
 				NSEC_PER_ ## duration_units));		\
 	sysfs_print(name ## _ ##max_duration ## _ ## duration_units,	\
 			div_u64((stats)->max_duration,			\
 				NSEC_PER_ ## duration_units));		\
+	__print_time_stat_quantile(_summary, name,			\
+				   p50,	duration_units);		\
+	__print_time_stat_quantile(_summary, name,			\
+				   p99,	duration_units);		\
+	__print_time_stat_quantile(_summary, name,			\
+				   p999,	duration_units);		\
 									\
 	sysfs_print(name ## _last_ ## frequency_units, (stats)->last	\
 		    ? div_s64(local_clock() - (stats)->last,		\
@@ -394,6 +440,9 @@ read_attribute(name ## _average_frequency_ ## frequency_units);		\
 read_attribute(name ## _average_duration_ ## duration_units);		\
 read_attribute(name ## _last_duration_ ## duration_units);		\
 read_attribute(name ## _max_duration_ ## duration_units);		\
+read_attribute(name ## _p50_ ## duration_units);			\
+read_attribute(name ## _p99_ ## duration_units);			\
+read_attribute(name ## _p999_ ## duration_units);			\
 read_attribute(name ## _last_ ## frequency_units)
 
 #define sysfs_time_stats_attribute_list(name,				\
@@ -405,6 +454,9 @@ read_attribute(name ## _last_ ## frequency_units)
 &sysfs_ ## name ## _average_duration_ ## duration_units,		\
 &sysfs_ ## name ## _last_duration_ ## duration_units,			\
 &sysfs_ ## name ## _max_duration_ ## duration_units,			\
+&sysfs_ ## name ## _p50_ ## duration_units,				\
+&sysfs_ ## name ## _p99_ ## duration_units,				\
+&sysfs_ ## name ## _p999_ ## duration_units,				\
 &sysfs_ ## name ## _last_ ## frequency_units,
 
 #define ewma_add(ewma, val, weight)					\
@@ -160,9 +160,13 @@ void bio_advance(struct bio *bio, unsigned bytes)
 
 static void bio_free(struct bio *bio)
 {
-	unsigned front_pad = bio->bi_pool ? bio->bi_pool->front_pad : 0;
+	struct bio_set *bs = bio->bi_pool;
+	void *p = (void *) bio - (bs ? bs->front_pad : 0);
 
-	kfree((void *) bio - front_pad);
+	if (bio_flagged(bio, BIO_MEMPOOLED))
+		mempool_free(p, &bs->bio_pool);
+	else
+		kfree(p);
 }
 
 void bio_put(struct bio *bio)
@@ -267,22 +271,41 @@ void bio_reset(struct bio *bio)
 	atomic_set(&bio->__bi_remaining, 1);
 }
 
+int bioset_init(struct bio_set *bs, unsigned pool_size, unsigned front_pad)
+{
+	bs->front_pad = front_pad;
+	bs->bio_slab = kmem_cache_create("bio", front_pad + sizeof(struct bio) +
+					 BIO_INLINE_VECS * sizeof(struct bio_vec),
+					 ARCH_KMALLOC_MINALIGN, 0, NULL);
+	if (!bs->bio_slab)
+		return -ENOMEM;
+
+	return mempool_init_slab_pool(&bs->bio_pool, pool_size, bs->bio_slab);
+}
+
 struct bio *bio_alloc_bioset(gfp_t gfp_mask, int nr_iovecs, struct bio_set *bs)
 {
 	unsigned front_pad = bs ? bs->front_pad : 0;
+	bool pooled = bs && nr_iovecs <= BIO_INLINE_VECS &&
+		mempool_initialized(&bs->bio_pool);
 	struct bio *bio;
 	void *p;
 
-	p = kmalloc(front_pad +
-		    sizeof(struct bio) +
-		    nr_iovecs * sizeof(struct bio_vec),
-		    gfp_mask);
+	if (pooled)
+		p = mempool_alloc(&bs->bio_pool, gfp_mask);
+	else
+		p = kmalloc(front_pad +
+			    sizeof(struct bio) +
+			    nr_iovecs * sizeof(struct bio_vec),
+			    gfp_mask);
 
 	if (unlikely(!p))
 		return NULL;
 
 	bio = p + front_pad;
 	bio_init(bio);
+	if (pooled)
+		bio_set_flag(bio, BIO_MEMPOOLED);
 	bio->bi_pool		= bs;
 	bio->bi_max_vecs	= nr_iovecs;
 	bio->bi_io_vec		= bio->bi_inline_vecs;
@@ -1,65 +1,127 @@
-
 #include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blktrace_api.h>
 #include <linux/fs.h>
+#include <linux/kthread.h>
 
-int submit_bio_wait(struct bio *bio)
+/* the uapi headers below need the real kernel types, not ours: */
+#include <linux/posix_types.h>
+#include <linux/aio_abi.h>
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
+#ifndef RWF_DSYNC
+#define RWF_DSYNC	0x00000002
+#endif
+
+static int bio_to_iovec(struct bio *bio, struct iovec *iov)
 {
-	struct iovec *iov;
 	struct bvec_iter iter;
 	struct bio_vec bv;
-	ssize_t ret;
-	unsigned i;
-
-	if (bio->bi_opf & REQ_PREFLUSH) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
-		if (ret) {
-			fprintf(stderr, "fsync error: %s\n",
-				strerror(errno));
-			return -EIO;
-		}
+	unsigned i = 0;
+
+	bio_for_each_segment(bv, bio, iter) {
+		if (iov)
+			iov[i] = (struct iovec) {
+				.iov_base = page_address(bv.bv_page) + bv.bv_offset,
+				.iov_len = bv.bv_len,
+			};
+		i++;
 	}
 
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		i++;
+	return i;
+}
 
-	iov = alloca(sizeof(*iov) * i);
+/*
+ * Devices are opened with O_DIRECT unless FMODE_BUFFERED was passed; bios that
+ * don't meet the alignment requirements for direct IO go to bd_buffered_fd
+ * instead:
+ */
+static int bio_fd(struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	unsigned mask = bdev->bd_dio_align - 1;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+	if (bdev->bd_fd == bdev->bd_buffered_fd)
+		return bdev->bd_fd;
+
+	if (((bio->bi_iter.bi_sector << 9) | bio->bi_iter.bi_size) & mask)
+		return bdev->bd_buffered_fd;
 
-	i = 0;
 	bio_for_each_segment(bv, bio, iter)
-		iov[i++] = (struct iovec) {
-			.iov_base = page_address(bv.bv_page) + bv.bv_offset,
-			.iov_len = bv.bv_len,
-		};
+		if ((((unsigned long) page_address(bv.bv_page) +
+		      bv.bv_offset) | bv.bv_len) & mask)
+			return bdev->bd_buffered_fd;
+
+	return bdev->bd_fd;
+}
+
+static int bio_preflush(struct bio *bio)
+{
+	if ((bio->bi_opf & REQ_PREFLUSH) &&
+	    fdatasync(bio->bi_bdev->bd_fd)) {
+		fprintf(stderr, "fsync error: %s\n", strerror(errno));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int bio_check_result(struct bio *bio, ssize_t ret)
+{
+	if (ret != bio->bi_iter.bi_size) {
+		fprintf(stderr, "IO error: %li (%s)\n",
+			ret, strerror(ret < 0 ? -ret : EIO));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int bio_rw_sync(struct bio *bio)
+{
+	struct iovec *iov;
+	ssize_t ret;
+	unsigned i;
+
+	i = bio_to_iovec(bio, NULL);
+	iov = alloca(sizeof(*iov) * i);
+	bio_to_iovec(bio, iov);
 
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
-		ret = preadv(bio->bi_bdev->bd_fd, iov, i,
+		ret = preadv(bio_fd(bio), iov, i,
 			     bio->bi_iter.bi_sector << 9);
 		break;
 	case REQ_OP_WRITE:
-		ret = pwritev(bio->bi_bdev->bd_fd, iov, i,
+		ret = pwritev(bio_fd(bio), iov, i,
 			      bio->bi_iter.bi_sector << 9);
 		break;
 	default:
 		BUG();
 	}
 
-	if (ret != bio->bi_iter.bi_size) {
-		fprintf(stderr, "IO error: %li (%s)\n",
-			ret, strerror(errno));
-		return -EIO;
-	}
+	ret = bio_check_result(bio, ret < 0 ? -errno : ret);
+	if (ret)
+		return ret;
 
 	if (bio->bi_opf & REQ_FUA) {
 		ret = fdatasync(bio->bi_bdev->bd_fd);
@@ -73,9 +135,412 @@ int submit_bio_wait(struct bio *bio)
 	return 0;
 }
 
+int submit_bio_wait(struct bio *bio)
+{
+	return bio_preflush(bio) ?: bio_rw_sync(bio);
+}
+
+/*
+ * Asynchronous IO:
+ *
+ * Bios are handed to the kernel with io_uring if we have it, otherwise with
+ * native Linux AIO, and completed from a dedicated reaper thread that calls
+ * bio_endio() - so callers may submit from any thread, and up to
+ * BLKDEV_QUEUE_DEPTH IOs may be in flight at once. If neither interface is
+ * available, generic_make_request() does the IO synchronously as before.
+ *
+ * FUA writes are issued with RWF_DSYNC; preflushes are still done
+ * synchronously, before the bio is queued.
+ */
+
+#define BLKDEV_QUEUE_DEPTH	256
+
+enum blkdev_io_engine {
+	BLKDEV_IO_SYNC,
+	BLKDEV_IO_AIO,
+	BLKDEV_IO_URING,
+};
+
+struct blkdev_io {
+	struct bio		*bio;
+	unsigned		nr_iov;
+	struct iovec		iov[];
+};
+
+static enum blkdev_io_engine	io_engine;
+static struct task_struct	*io_reaper;
+
+/* protects io_in_flight and the io_uring submission queue: */
+static pthread_mutex_t		io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		io_wait = PTHREAD_COND_INITIALIZER;
+static unsigned			io_in_flight;
+static unsigned			io_depth;
+
+static aio_context_t		aio_ctx;
+
+#ifdef HAVE_IO_URING
+static struct {
+	int			fd;
+	int			wake_fd;
+
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+} ring;
+#endif
+
+static struct blkdev_io *blkdev_io_alloc(struct bio *bio)
+{
+	struct blkdev_io *io;
+	unsigned nr_iov = bio_to_iovec(bio, NULL);
+
+	io = malloc(sizeof(*io) + sizeof(struct iovec) * nr_iov);
+	if (!io)
+		return NULL;
+
+	io->bio		= bio;
+	io->nr_iov	= nr_iov;
+	bio_to_iovec(bio, io->iov);
+	return io;
+}
+
+/*
+ * Returns false if the queue is full and we're the reaper thread - we can't
+ * wait on ourselves to free up a slot, so the caller has to do the IO
+ * synchronously:
+ */
+static bool io_slot_get(void)
+{
+	bool ret = true;
+
+	pthread_mutex_lock(&io_lock);
+	while (io_in_flight >= io_depth) {
+		if (current == io_reaper) {
+			ret = false;
+			goto out;
+		}
+		pthread_cond_wait(&io_wait, &io_lock);
+	}
+	io_in_flight++;
+out:
+	pthread_mutex_unlock(&io_lock);
+	return ret;
+}
+
+static void io_slots_put(unsigned nr)
+{
+	pthread_mutex_lock(&io_lock);
+	BUG_ON(io_in_flight < nr);
+	io_in_flight -= nr;
+	pthread_cond_broadcast(&io_wait);
+	pthread_mutex_unlock(&io_lock);
+}
+
+static void blkdev_io_complete(struct blkdev_io *io, long res)
+{
+	struct bio *bio = io->bio;
+
+	free(io);
+
+	bio->bi_error = bio_check_result(bio, res);
+	bio_endio(bio);
+}
+
+static int aio_submit(struct blkdev_io *io)
+{
+	struct bio *bio = io->bio;
+	struct iocb iocb = {
+		.aio_data	= (unsigned long) io,
+		.aio_lio_opcode	= bio_op(bio) == REQ_OP_READ
+			? IOCB_CMD_PREADV
+			: IOCB_CMD_PWRITEV,
+		.aio_fildes	= bio_fd(bio),
+		.aio_buf	= (unsigned long) io->iov,
+		.aio_nbytes	= io->nr_iov,
+		.aio_offset	= bio->bi_iter.bi_sector << 9,
+		.aio_rw_flags	= bio->bi_opf & REQ_FUA ? RWF_DSYNC : 0,
+	}, *iocbp = &iocb;
+	long ret;
+
+	do {
+		ret = syscall(__NR_io_submit, aio_ctx, 1, &iocbp);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	return ret == 1 ? 0 : -errno;
+}
+
+static int aio_reaper_thread(void *arg)
+{
+	struct io_event events[32], *ev;
+	long ret;
+
+	while (1) {
+		ret = syscall(__NR_io_getevents, aio_ctx, 1,
+			      ARRAY_SIZE(events), events, NULL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			panic("io_getevents() error: %s\n", strerror(errno));
+
+		io_slots_put(ret);
+
+		for (ev = events; ev < events + ret; ev++)
+			blkdev_io_complete((void *) (unsigned long) ev->data,
+					   ev->res);
+	}
+
+	return 0;
+}
+
+static bool aio_init(void)
+{
+	return !syscall(__NR_io_setup, BLKDEV_QUEUE_DEPTH, &aio_ctx);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring cancels the requests a thread submitted when that thread exits, so
+ * everything is submitted by the reaper thread: other threads just add their
+ * SQEs to the ring, and wake the reaper with ring.wake_fd, which it always has
+ * a poll on.
+ */
+
+#define URING_WAKE	0
+
+static void uring_sqe_add(struct io_uring_sqe *src)
+{
+	unsigned tail	= *ring.sq_tail;
+	unsigned idx	= tail & *ring.sq_mask;
+
+	ring.sqes[idx]		= *src;
+	ring.sq_array[idx]	= idx;
+	smp_store_release(ring.sq_tail, tail + 1);
+}
+
+static void uring_wake_poll(void)
+{
+	struct io_uring_sqe sqe = {
+		.opcode		= IORING_OP_POLL_ADD,
+		.fd		= ring.wake_fd,
+		.poll_events	= POLLIN,
+		.user_data	= URING_WAKE,
+	};
+	u64 v;
+
+	/* reset the eventfd, then poll it again: */
+	if (read(ring.wake_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		panic("eventfd read error: %s\n", strerror(errno));
+
+	pthread_mutex_lock(&io_lock);
+	uring_sqe_add(&sqe);
+	pthread_mutex_unlock(&io_lock);
+}
+
+static int uring_submit(struct blkdev_io *io)
+{
+	struct bio *bio = io->bio;
+	struct io_uring_sqe sqe = {
+		.opcode		= bio_op(bio) == REQ_OP_READ
+			? IORING_OP_READV
+			: IORING_OP_WRITEV,
+		.fd		= bio_fd(bio),
+		.off		= bio->bi_iter.bi_sector << 9,
+		.addr		= (unsigned long) io->iov,
+		.len		= io->nr_iov,
+		.rw_flags	= bio->bi_opf & REQ_FUA ? RWF_DSYNC : 0,
+		.user_data	= (unsigned long) io,
+	};
+	u64 v = 1;
+
+	pthread_mutex_lock(&io_lock);
+	uring_sqe_add(&sqe);
+	pthread_mutex_unlock(&io_lock);
+
+	/* the reaper submits what's queued before it next waits: */
+	if (current != io_reaper &&
+	    write(ring.wake_fd, &v, sizeof(v)) != sizeof(v))
+		panic("eventfd write error: %s\n", strerror(errno));
+
+	return 0;
+}
+
+static int uring_reaper_thread(void *arg)
+{
+	struct {
+		struct blkdev_io	*io;
+		long			res;
+	} done[32];
+	unsigned head, tail, nr, nr_cqes, i, to_submit;
+	bool wake;
+	long ret;
+
+	uring_wake_poll();
+
+	while (1) {
+		pthread_mutex_lock(&io_lock);
+		to_submit = *ring.sq_tail - smp_load_acquire(ring.sq_head);
+		pthread_mutex_unlock(&io_lock);
+
+		ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			panic("io_uring_enter() error: %s\n", strerror(errno));
+
+		while (1) {
+			head	= *ring.cq_head;
+			tail	= smp_load_acquire(ring.cq_tail);
+			nr	= 0;
+			nr_cqes	= 0;
+			wake	= false;
+
+			while (head != tail && nr < ARRAY_SIZE(done)) {
+				struct io_uring_cqe *cqe =
+					&ring.cqes[head & *ring.cq_mask];
+
+				if (cqe->user_data == URING_WAKE) {
+					wake = true;
+				} else {
+					done[nr].io	= (void *) (unsigned long)
+						cqe->user_data;
+					done[nr].res	= cqe->res;
+					nr++;
+				}
+				nr_cqes++;
+				head++;
+			}
+
+			if (!nr_cqes)
+				break;
+
+			smp_store_release(ring.cq_head, head);
+
+			if (wake)
+				uring_wake_poll();
+
+			if (!nr)
+				continue;
+
+			io_slots_put(nr);
+
+			for (i = 0; i < nr; i++)
+				blkdev_io_complete(done[i].io, done[i].res);
+		}
+	}
+
+	return 0;
+}
+
+static bool uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	void *sq, *cq, *sqes;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+
+	fd = syscall(__NR_io_uring_setup, BLKDEV_QUEUE_DEPTH, &p);
+	if (fd < 0)
+		return false;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = max(sq_size, cq_size);
+
+	sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+
+	cq = p.features & IORING_FEAT_SINGLE_MMAP
+		? sq
+		: mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto err;
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err;
+
+	ring.fd		= fd;
+	ring.sq_head	= sq + p.sq_off.head;
+	ring.sq_tail	= sq + p.sq_off.tail;
+	ring.sq_mask	= sq + p.sq_off.ring_mask;
+	ring.sq_array	= sq + p.sq_off.array;
+	ring.sqes	= sqes;
+	ring.cq_head	= cq + p.cq_off.head;
+	ring.cq_tail	= cq + p.cq_off.tail;
+	ring.cq_mask	= cq + p.cq_off.ring_mask;
+	ring.cqes	= cq + p.cq_off.cqes;
+
+	ring.wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (ring.wake_fd < 0)
+		goto err;
+
+	/* never more in flight than the CQ can hold, with the reaper's poll: */
+	io_depth = min(p.sq_entries, p.cq_entries) - 1;
+	return true;
+err:
+	/* mappings go away with the fd */
+	close(fd);
+	return false;
+}
+#endif
+
 void generic_make_request(struct bio *bio)
 {
-	bio->bi_error = submit_bio_wait(bio);
+	struct blkdev_io *io;
+	int ret;
+
+	if (io_engine == BLKDEV_IO_SYNC ||
+	    (bio_op(bio) != REQ_OP_READ && bio_op(bio) != REQ_OP_WRITE)) {
+		bio->bi_error = submit_bio_wait(bio);
+		bio_endio(bio);
+		return;
+	}
+
+	ret = bio_preflush(bio);
+	if (ret)
+		goto out;
+
+	io = blkdev_io_alloc(bio);
+	if (!io)
+		goto sync;
+
+	if (!io_slot_get()) {
+		free(io);
+		goto sync;
+	}
+
+#ifdef HAVE_IO_URING
+	if (io_engine == BLKDEV_IO_URING)
+		ret = uring_submit(io);
+	else
+#endif
+		ret = aio_submit(io);
+
+	if (!ret)
+		return;
+
+	io_slots_put(1);
+	free(io);
+sync:
+	ret = bio_rw_sync(bio);
+out:
+	bio->bi_error = ret;
 	bio_endio(bio);
 }
 
@@ -86,6 +551,45 @@ int blkdev_issue_discard(struct block_device *bdev,
 	return 0;
 }
 
+void blk_fill_rwbs(char *rwbs, unsigned int op, u32 rw, int bytes)
+{
+	int i = 0;
+
+	if (rw & REQ_PREFLUSH)
+		rwbs[i++] = 'F';
+
+	switch (op) {
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_SAME:
+		rwbs[i++] = 'W';
+		break;
+	case REQ_OP_DISCARD:
+		rwbs[i++] = 'D';
+		break;
+	case REQ_OP_SECURE_ERASE:
+		rwbs[i++] = 'D';
+		rwbs[i++] = 'E';
+		break;
+	case REQ_OP_FLUSH:
+		rwbs[i++] = 'F';
+		break;
+	case REQ_OP_READ:
+		rwbs[i++] = 'R';
+		break;
+	default:
+		rwbs[i++] = 'N';
+	}
+
+	if (rw & REQ_FUA)
+		rwbs[i++] = 'F';
+	if (rw & REQ_SYNC)
+		rwbs[i++] = 'S';
+	if (rw & REQ_META)
+		rwbs[i++] = 'M';
+
+	rwbs[i] = '\0';
+}
+
 unsigned bdev_logical_block_size(struct block_device *bdev)
 {
 	struct stat statbuf;
@@ -126,16 +630,42 @@ sector_t get_capacity(struct gendisk *disk)
 
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
-	fdatasync(bdev->bd_fd);
+	/* direct IO doesn't need this, but the device's write cache does: */
+	if (bdev->bd_mode & FMODE_WRITE)
+		fdatasync(bdev->bd_fd);
+
+	if (bdev->bd_buffered_fd != bdev->bd_fd)
+		close(bdev->bd_buffered_fd);
 	close(bdev->bd_fd);
 	free(bdev);
 }
 
+/*
+ * Alignment (of offset, length and memory) required for O_DIRECT: the logical
+ * block size for block devices; for files, the filesystem block size, which is
+ * conservative:
+ */
+static unsigned bdev_dio_align(int fd)
+{
+	struct stat statbuf;
+	int ret;
+
+	if (fstat(fd, &statbuf))
+		return PAGE_SIZE;
+
+	if (S_ISBLK(statbuf.st_mode) &&
+	    !ioctl(fd, BLKSSZGET, &ret) && ret > 0)
+		return ret;
+
+	return max_t(unsigned, statbuf.st_blksize, 512);
+}
+
 struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 					void *holder)
 {
 	struct block_device *bdev;
-	int fd, flags = O_DIRECT;
+	struct stat statbuf;
+	int fd, buffered_fd, flags = 0;
 
 	if ((mode & (FMODE_READ|FMODE_WRITE)) == (FMODE_READ|FMODE_WRITE))
 		flags = O_RDWR;
@@ -147,9 +677,31 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	if (mode & FMODE_EXCL)
 		flags |= O_EXCL;
 
-	fd = open(path, flags);
-	if (fd < 0)
-		return ERR_PTR(-errno);
+	fd = -1;
+	if (!(mode & FMODE_BUFFERED)) {
+		fd = open(path, flags|O_DIRECT);
+
+		/* image file on a filesystem that can't do direct IO: */
+		if (fd < 0 && errno != EINVAL)
+			return ERR_PTR(-errno);
+	}
+
+	if (fd < 0) {
+		fd = open(path, flags);
+		if (fd < 0)
+			return ERR_PTR(-errno);
+
+		buffered_fd = fd;
+	} else {
+		/* we already hold the exclusive open: */
+		buffered_fd = open(path, flags & ~O_EXCL);
+		if (buffered_fd < 0) {
+			int err = -errno;
+
+			close(fd);
+			return ERR_PTR(err);
+		}
+	}
 
 	bdev = malloc(sizeof(*bdev));
 	memset(bdev, 0, sizeof(*bdev));
@@ -157,9 +709,20 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	strncpy(bdev->name, path, sizeof(bdev->name));
 	bdev->name[sizeof(bdev->name) - 1] = '\0';
 
-	bdev->bd_fd	= fd;
-	bdev->bd_holder = holder;
-	bdev->bd_disk	= &bdev->__bd_disk;
+	bdev->bd_mode		= mode;
+	bdev->bd_fd		= fd;
+	bdev->bd_buffered_fd	= buffered_fd;
+	bdev->bd_dio_align	= bdev_dio_align(fd);
+	bdev->bd_holder		= holder;
+	bdev->bd_disk		= &bdev->__bd_disk;
+
+	/* image files don't have a device number: */
+	if (!fstat(fd, &statbuf) && S_ISBLK(statbuf.st_mode)) {
+		bdev->bd_disk->major		= major(statbuf.st_rdev);
+		bdev->bd_disk->first_minor	= minor(statbuf.st_rdev);
+		bdev->bd_dev = MKDEV(bdev->bd_disk->major,
+				     bdev->bd_disk->first_minor);
+	}
 
 	return bdev;
 }
@@ -173,3 +736,27 @@ struct block_device *lookup_bdev(const char *path)
 {
 	return ERR_PTR(-EINVAL);
 }
+
+__attribute__((constructor(104)))
+static void blkdev_init(void)
+{
+	int (*reaper_fn)(void *) = NULL;
+
+	io_depth = BLKDEV_QUEUE_DEPTH;
+
+#ifdef HAVE_IO_URING
+	if (uring_init()) {
+		io_engine = BLKDEV_IO_URING;
+		reaper_fn = uring_reaper_thread;
+	} else
+#endif
+	if (aio_init()) {
+		io_engine = BLKDEV_IO_AIO;
+		reaper_fn = aio_reaper_thread;
+	}
+
+	if (reaper_fn) {
+		io_reaper = kthread_run(reaper_fn, NULL, "blkdev_reaper");
+		BUG_ON(IS_ERR(io_reaper));
+	}
+}
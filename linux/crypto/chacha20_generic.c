@@ -19,6 +19,7 @@
 #include <crypto/algapi.h>
 #include <crypto/chacha20.h>
 
+#include <sodium/core.h>
 #include <sodium/crypto_stream_chacha20.h>
 
 struct chacha20_ctx {
@@ -95,5 +96,11 @@ static struct crypto_alg alg = {
 __attribute__((constructor(110)))
 static int chacha20_generic_mod_init(void)
 {
+	/*
+	 * libsodium only switches to its SIMD (AVX2/SSSE3) chacha20 once it's
+	 * been initialized - until then we get the reference implementation:
+	 */
+	BUG_ON(sodium_init() < 0);
+
 	return crypto_register_alg(&alg);
 }
@@ -21,6 +21,8 @@
 #include <crypto/internal/hash.h>
 #include <crypto/poly1305.h>
 
+#include <sodium/core.h>
+
 struct poly1305_desc_ctx {
 	bool					key_done;
 	crypto_onetimeauth_poly1305_state	s;
@@ -72,5 +74,8 @@ static struct shash_alg poly1305_alg = {
 __attribute__((constructor(110)))
 static int poly1305_mod_init(void)
 {
+	/* as with chacha20, this is what selects the SSE2 poly1305: */
+	BUG_ON(sodium_init() < 0);
+
 	return crypto_register_shash(&poly1305_alg);
 }
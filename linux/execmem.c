@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/bug.h>
+#include <linux/execmem.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+#define EXECMEM_CHUNK_SIZE	(1UL << 20)
+
+struct execmem_chunk {
+	struct list_head	list;
+	char			*rx;
+	char			*rw;
+};
+
+/* Free slots are linked through their first word, written via the rw alias: */
+struct execmem_free_slot {
+	void			*next;
+};
+
+static pthread_mutex_t	execmem_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(execmem_chunks);
+static void		*execmem_free_list;
+static bool		execmem_broken;
+
+static struct execmem_chunk *execmem_chunk_find(void *addr)
+{
+	struct execmem_chunk *chunk;
+
+	list_for_each_entry(chunk, &execmem_chunks, list)
+		if ((char *) addr >= chunk->rx &&
+		    (char *) addr <  chunk->rx + EXECMEM_CHUNK_SIZE)
+			return chunk;
+
+	BUG();
+}
+
+static void *execmem_rw(void *addr)
+{
+	struct execmem_chunk *chunk = execmem_chunk_find(addr);
+
+	return chunk->rw + ((char *) addr - chunk->rx);
+}
+
+static void __execmem_free(void *addr)
+{
+	struct execmem_free_slot *slot = execmem_rw(addr);
+
+	slot->next = execmem_free_list;
+	execmem_free_list = addr;
+}
+
+static int execmem_chunk_alloc(void)
+{
+	struct execmem_chunk *chunk;
+	size_t i;
+	int fd;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return -ENOMEM;
+
+	fd = memfd_create("bcache-execmem", MFD_CLOEXEC);
+	if (fd < 0)
+		goto err;
+
+	if (ftruncate(fd, EXECMEM_CHUNK_SIZE))
+		goto err_close;
+
+	chunk->rw = mmap(NULL, EXECMEM_CHUNK_SIZE, PROT_READ|PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	if (chunk->rw == MAP_FAILED)
+		goto err_close;
+
+	chunk->rx = mmap(NULL, EXECMEM_CHUNK_SIZE, PROT_READ|PROT_EXEC,
+			 MAP_SHARED, fd, 0);
+	if (chunk->rx == MAP_FAILED)
+		goto err_unmap;
+
+	close(fd);
+
+	list_add(&chunk->list, &execmem_chunks);
+
+	for (i = EXECMEM_CHUNK_SIZE; i; i -= EXECMEM_SLOT_SIZE)
+		__execmem_free(chunk->rx + i - EXECMEM_SLOT_SIZE);
+	return 0;
+err_unmap:
+	munmap(chunk->rw, EXECMEM_CHUNK_SIZE);
+err_close:
+	close(fd);
+err:
+	free(chunk);
+	return -ENOMEM;
+}
+
+void *execmem_alloc(size_t size)
+{
+	struct execmem_free_slot *slot;
+	void *ret = NULL;
+
+	BUG_ON(size > EXECMEM_SLOT_SIZE);
+
+	pthread_mutex_lock(&execmem_lock);
+	if (!execmem_free_list && !execmem_broken &&
+	    execmem_chunk_alloc())
+		execmem_broken = true;
+
+	if (execmem_free_list) {
+		ret = execmem_free_list;
+		slot = execmem_rw(ret);
+		execmem_free_list = slot->next;
+	}
+	pthread_mutex_unlock(&execmem_lock);
+
+	return ret;
+}
+
+void execmem_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&execmem_lock);
+	__execmem_free(ptr);
+	pthread_mutex_unlock(&execmem_lock);
+}
+
+void *text_poke_copy(void *addr, const void *src, size_t len)
+{
+	void *rw;
+
+	BUG_ON(((unsigned long) addr & (EXECMEM_SLOT_SIZE - 1)) +
+	       len > EXECMEM_SLOT_SIZE);
+
+	pthread_mutex_lock(&execmem_lock);
+	rw = execmem_rw(addr);
+	pthread_mutex_unlock(&execmem_lock);
+
+	memcpy(rw, src, len);
+	__builtin___clear_cache(addr, addr + len);
+	return addr;
+}
@@ -0,0 +1,264 @@
+
+#include <errno.h>
+#include <time.h>
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/mempool.h>
+#include <linux/sched.h>
+
+/* Lock free stacks of reserve slots: */
+
+static u32 slot_stack_pop(u64 *head, u32 *next)
+{
+	u64 old = __atomic_load_n(head, __ATOMIC_ACQUIRE), new;
+	u32 idx;
+
+	do {
+		idx = (u32) old;
+		if (!idx)
+			return 0;
+
+		/* next[] may be stale if we race - the generation catches it: */
+		new = ((old >> 32) + 1) << 32 | READ_ONCE(next[idx - 1]);
+	} while (!__atomic_compare_exchange_n(head, &old, new, false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+
+	return idx;
+}
+
+static void slot_stack_push(u64 *head, u32 *next, u32 idx)
+{
+	u64 old = __atomic_load_n(head, __ATOMIC_RELAXED), new;
+
+	do {
+		WRITE_ONCE(next[idx - 1], (u32) old);
+		new = ((old >> 32) + 1) << 32 | idx;
+	} while (!__atomic_compare_exchange_n(head, &old, new, false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_RELAXED));
+}
+
+static void *reserve_pop(mempool_t *pool)
+{
+	u32 idx = slot_stack_pop(&pool->full, pool->next);
+	void *element;
+
+	if (!idx)
+		return NULL;
+
+	element = pool->slots[idx - 1];
+	slot_stack_push(&pool->empty, pool->next, idx);
+	return element;
+}
+
+static bool reserve_push(mempool_t *pool, void *element)
+{
+	u32 idx = slot_stack_pop(&pool->empty, pool->next);
+
+	if (!idx)
+		return false;
+
+	pool->slots[idx - 1] = element;
+	slot_stack_push(&pool->full, pool->next, idx);
+	return true;
+}
+
+static bool reserve_nonempty(mempool_t *pool)
+{
+	return (u32) __atomic_load_n(&pool->full, __ATOMIC_ACQUIRE) != 0;
+}
+
+void mempool_exit(mempool_t *pool)
+{
+	struct mempool_cache *c;
+	void *element;
+	unsigned cpu;
+
+	if (pool->cache) {
+		for_each_possible_cpu(cpu) {
+			c = per_cpu_ptr(pool->cache, cpu);
+
+			while (c->nr)
+				pool->free(c->elements[--c->nr],
+					   pool->pool_data);
+		}
+
+		free_percpu(pool->cache);
+	}
+
+	if (pool->slots)
+		while ((element = reserve_pop(pool)))
+			pool->free(element, pool->pool_data);
+
+	kfree(pool->slots);
+	kfree(pool->next);
+	memset(pool, 0, sizeof(*pool));
+}
+
+int __mempool_init(mempool_t *pool, int min_nr, mempool_alloc_t *alloc_fn,
+		   mempool_free_t *free_fn, void *pool_data, size_t elem_size)
+{
+	void *element;
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+
+	pool->min_nr	= min_nr;
+	pool->pool_data	= pool_data;
+	pool->alloc	= alloc_fn;
+	pool->free	= free_fn;
+	pool->cache_nr	= elem_size
+		? clamp_t(size_t, MEMPOOL_CACHE_BYTES / elem_size,
+			  1, MEMPOOL_CACHE_MAX)
+		: MEMPOOL_CACHE_MAX;
+	init_waitqueue_head(&pool->wait);
+
+	pool->slots	= kcalloc(max(min_nr, 1), sizeof(pool->slots[0]),
+				  GFP_KERNEL);
+	pool->next	= kcalloc(max(min_nr, 1), sizeof(pool->next[0]),
+				  GFP_KERNEL);
+	pool->cache	= alloc_percpu(struct mempool_cache);
+	if (!pool->slots || !pool->next || !pool->cache)
+		goto err;
+
+	for (i = 0; i < min_nr; i++)
+		slot_stack_push(&pool->empty, pool->next, i + 1);
+
+	for (i = 0; i < min_nr; i++) {
+		element = pool->alloc(GFP_KERNEL, pool->pool_data);
+		if (!element)
+			goto err;
+
+		reserve_push(pool, element);
+	}
+
+	return 0;
+err:
+	mempool_exit(pool);
+	return -ENOMEM;
+}
+
+mempool_t *__mempool_create(int min_nr, mempool_alloc_t *alloc_fn,
+			    mempool_free_t *free_fn, void *pool_data,
+			    size_t elem_size)
+{
+	mempool_t *pool = kmalloc(sizeof(*pool), GFP_KERNEL);
+
+	if (pool &&
+	    __mempool_init(pool, min_nr, alloc_fn, free_fn,
+			   pool_data, elem_size)) {
+		kfree(pool);
+		pool = NULL;
+	}
+
+	return pool;
+}
+
+void mempool_destroy(mempool_t *pool)
+{
+	if (!pool)
+		return;
+
+	mempool_exit(pool);
+	kfree(pool);
+}
+
+/*
+ * Like in the kernel, the reserve is only used when the allocator fails; if the
+ * reserve is empty too and @gfp_mask allows blocking, we wait for an element to
+ * be freed (retrying the allocator every so often), so this never fails then.
+ */
+void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask)
+{
+	struct mempool_cache *c;
+	void *element = NULL;
+
+	BUG_ON(!pool->alloc);
+
+	c = this_cpu_ptr(pool->cache);
+	spin_lock(&c->lock);
+	if (c->nr)
+		element = c->elements[--c->nr];
+	spin_unlock(&c->lock);
+
+	if (element)
+		return element;
+
+	atomic64_inc(&pool->stats.alloc);
+
+	while (1) {
+		element = pool->alloc(gfp_mask & ~__GFP_ZERO, pool->pool_data);
+		if (likely(element))
+			return element;
+
+		element = reserve_pop(pool);
+		if (element) {
+			atomic64_inc(&pool->stats.reserve);
+			return element;
+		}
+
+		if (!gfpflags_allow_blocking(gfp_mask))
+			return NULL;
+
+		atomic64_inc(&pool->stats.wait);
+		wait_event_timeout(pool->wait, reserve_nonempty(pool), 5 * HZ);
+	}
+}
+
+void mempool_free(void *element, mempool_t *pool)
+{
+	struct mempool_cache *c;
+	bool cached = false;
+
+	if (unlikely(!element))
+		return;
+
+	if (unlikely(reserve_push(pool, element))) {
+		wake_up(&pool->wait);
+		return;
+	}
+
+	c = this_cpu_ptr(pool->cache);
+	spin_lock(&c->lock);
+	if (c->nr < pool->cache_nr) {
+		c->elements[c->nr++] = element;
+		cached = true;
+	}
+	spin_unlock(&c->lock);
+
+	if (!cached)
+		pool->free(element, pool->pool_data);
+}
+
+void *mempool_alloc_slab(gfp_t gfp_mask, void *pool_data)
+{
+	return kmem_cache_alloc(pool_data, gfp_mask);
+}
+
+void mempool_free_slab(void *element, void *pool_data)
+{
+	kmem_cache_free(pool_data, element);
+}
+
+void *mempool_kmalloc(gfp_t gfp_mask, void *pool_data)
+{
+	return kmalloc((size_t) pool_data, gfp_mask);
+}
+
+void mempool_kfree(void *element, void *pool_data)
+{
+	kfree(element);
+}
+
+void *mempool_alloc_pages(gfp_t gfp_mask, void *pool_data)
+{
+	return alloc_pages(gfp_mask, (long) pool_data);
+}
+
+void mempool_free_pages(void *element, void *pool_data)
+{
+	__free_pages(element, (long) pool_data);
+}
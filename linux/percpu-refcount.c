@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include <linux/percpu-refcount.h>
+
+/*
+ * Initially, a percpu refcount is just a set of percpu counters: we don't try
+ * to detect the ref hitting 0 - which means that get/put can just increment or
+ * decrement the local counter.  Note that the counter on a particular cpu can
+ * (and will) wrap - this is fine, when we go to shutdown the percpu counters
+ * will all sum to the correct value.
+ *
+ * percpu_ref_kill() switches the ref to atomic mode: once an RCU grace period
+ * has elapsed - so that no one is still using the percpu counters - they're
+ * summed into the atomic counter, and from then on a put that drops the count
+ * to 0 calls the release function.
+ *
+ * PERCPU_COUNT_BIAS keeps the atomic counter from hitting 0 while the percpu
+ * counters still hold (some of) the count.
+ */
+
+#define PERCPU_COUNT_BIAS	(1LU << (BITS_PER_LONG - 1))
+
+static pthread_mutex_t	percpu_ref_switch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	percpu_ref_switch_wait = PTHREAD_COND_INITIALIZER;
+
+static unsigned long __percpu *percpu_count_ptr(struct percpu_ref *ref)
+{
+	return (unsigned long __percpu *)
+		(ref->percpu_count_ptr & ~__PERCPU_REF_ATOMIC_DEAD);
+}
+
+/**
+ * percpu_ref_init - initialize a percpu refcount
+ * @ref: percpu_ref to initialize
+ * @release: function which will be called when refcount hits 0
+ * @flags: PERCPU_REF_INIT_* flags
+ * @gfp: allocation mask to use
+ *
+ * Initializes @ref.  If @flags is zero, @ref starts in percpu mode with a
+ * refcount of 1; analagous to atomic_long_set(ref, 1).  See the definitions
+ * of PERCPU_REF_INIT_* flags for flag behaviors.
+ */
+int percpu_ref_init(struct percpu_ref *ref, percpu_ref_func_t *release,
+		    unsigned int flags, gfp_t gfp)
+{
+	size_t align = max_t(size_t, 1 << __PERCPU_REF_FLAG_BITS,
+			     __alignof__(unsigned long));
+	unsigned long start_count = 0;
+
+	ref->percpu_count_ptr = (unsigned long)
+		__alloc_percpu_gfp(sizeof(unsigned long), align, gfp);
+	if (!ref->percpu_count_ptr)
+		return -ENOMEM;
+
+	ref->force_atomic = flags & PERCPU_REF_INIT_ATOMIC;
+
+	if (flags & (PERCPU_REF_INIT_ATOMIC | PERCPU_REF_INIT_DEAD))
+		ref->percpu_count_ptr |= __PERCPU_REF_ATOMIC;
+	else
+		start_count += PERCPU_COUNT_BIAS;
+
+	if (flags & PERCPU_REF_INIT_DEAD)
+		ref->percpu_count_ptr |= __PERCPU_REF_DEAD;
+	else
+		start_count++;
+
+	atomic_long_set(&ref->count, start_count);
+
+	ref->release = release;
+	ref->confirm_switch = NULL;
+	return 0;
+}
+
+/**
+ * percpu_ref_exit - undo percpu_ref_init()
+ * @ref: percpu_ref to exit
+ *
+ * This function exits @ref.  The caller is responsible for ensuring that
+ * @ref is no longer in active use.
+ */
+void percpu_ref_exit(struct percpu_ref *ref)
+{
+	unsigned long __percpu *percpu_count = percpu_count_ptr(ref);
+
+	if (percpu_count) {
+		/* non-NULL confirm_switch indicates switching in progress */
+		WARN_ON_ONCE(ref->confirm_switch);
+		free_percpu(percpu_count);
+		ref->percpu_count_ptr = __PERCPU_REF_ATOMIC_DEAD;
+	}
+}
+
+static void percpu_ref_switch_to_atomic_rcu(struct rcu_head *rcu)
+{
+	struct percpu_ref *ref = container_of(rcu, struct percpu_ref, rcu);
+	unsigned long __percpu *percpu_count = percpu_count_ptr(ref);
+	unsigned long count = 0;
+	unsigned cpu;
+
+	for_each_possible_cpu(cpu)
+		count += *per_cpu_ptr(percpu_count, cpu);
+
+	/*
+	 * It's crucial that we sum the percpu counters _before_ adding the sum
+	 * to &ref->count; since gets could be happening on one cpu while puts
+	 * happen on another, adding a single cpu's count could cause
+	 * @ref->count to hit 0 before we've got a consistent value - but the
+	 * sum of all the counts will be consistent and correct.
+	 */
+	atomic_long_add((long) count - PERCPU_COUNT_BIAS, &ref->count);
+
+	WARN_ONCE(atomic_long_read(&ref->count) <= 0,
+		  "percpu ref <= 0 after switching to atomic");
+
+	/* @ref is viewed as dead on all cpus, send out switch confirmation */
+	ref->confirm_switch(ref);
+
+	pthread_mutex_lock(&percpu_ref_switch_lock);
+	ref->confirm_switch = NULL;
+	pthread_cond_broadcast(&percpu_ref_switch_wait);
+	pthread_mutex_unlock(&percpu_ref_switch_lock);
+
+	/* drop ref from __percpu_ref_switch_to_atomic() */
+	percpu_ref_put(ref);
+}
+
+static void percpu_ref_noop_confirm_switch(struct percpu_ref *ref)
+{
+}
+
+/* returns true if the caller must start the RCU callback after unlocking: */
+static bool __percpu_ref_switch_to_atomic(struct percpu_ref *ref,
+					  percpu_ref_func_t *confirm_switch)
+{
+	if (ref->percpu_count_ptr & __PERCPU_REF_ATOMIC) {
+		if (confirm_switch)
+			confirm_switch(ref);
+		return false;
+	}
+
+	/* switching from percpu to atomic */
+	ref->percpu_count_ptr |= __PERCPU_REF_ATOMIC;
+
+	/*
+	 * Non-NULL ->confirm_switch is used to indicate that switching is in
+	 * progress.  Use noop one if unspecified.
+	 */
+	ref->confirm_switch = confirm_switch ?: percpu_ref_noop_confirm_switch;
+
+	percpu_ref_get(ref);	/* put after confirmation */
+	return true;
+}
+
+static void __percpu_ref_switch_to_percpu(struct percpu_ref *ref)
+{
+	unsigned long __percpu *percpu_count = percpu_count_ptr(ref);
+	unsigned cpu;
+
+	BUG_ON(!percpu_count);
+
+	if (!(ref->percpu_count_ptr & __PERCPU_REF_ATOMIC))
+		return;
+
+	atomic_long_add(PERCPU_COUNT_BIAS, &ref->count);
+
+	/*
+	 * Restore per-cpu operation.  smp_store_release() is paired with
+	 * READ_ONCE() in __ref_is_percpu() and guarantees that the zeroing
+	 * is visible to all cpus before they see the ATOMIC flag cleared.
+	 */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(percpu_count, cpu) = 0;
+
+	smp_store_release(&ref->percpu_count_ptr,
+			  ref->percpu_count_ptr & ~__PERCPU_REF_ATOMIC);
+}
+
+static bool __percpu_ref_switch_mode(struct percpu_ref *ref,
+				     percpu_ref_func_t *confirm_switch)
+{
+	/*
+	 * If the previous ATOMIC switching hasn't finished yet, wait for
+	 * its completion.  If the caller ensures that ATOMIC switching
+	 * isn't in progress, this function can be called from any context.
+	 */
+	while (ref->confirm_switch)
+		pthread_cond_wait(&percpu_ref_switch_wait,
+				  &percpu_ref_switch_lock);
+
+	if (ref->force_atomic || (ref->percpu_count_ptr & __PERCPU_REF_DEAD))
+		return __percpu_ref_switch_to_atomic(ref, confirm_switch);
+
+	__percpu_ref_switch_to_percpu(ref);
+	return false;
+}
+
+/*
+ * The RCU callback takes percpu_ref_switch_lock - and may run synchronously -
+ * so it's only started once we've dropped the lock:
+ */
+static void percpu_ref_switch_unlock(struct percpu_ref *ref, bool switching)
+{
+	pthread_mutex_unlock(&percpu_ref_switch_lock);
+
+	if (switching)
+		call_rcu(&ref->rcu, percpu_ref_switch_to_atomic_rcu);
+}
+
+/**
+ * percpu_ref_switch_to_atomic - switch a percpu_ref to atomic mode
+ * @ref: percpu_ref to switch to atomic mode
+ * @confirm_switch: optional confirmation callback
+ *
+ * There's no reason to use this function for the usual reference counting.
+ * Use percpu_ref_kill[_and_confirm]().
+ *
+ * Schedule switching of @ref to atomic mode.  All its percpu counts will
+ * be collected to the main atomic counter.  On completion, when all CPUs
+ * are guaraneed to be in atomic mode, @confirm_switch, which may not
+ * block, is invoked.
+ *
+ * This function may block if @ref is in the process of switching to atomic
+ * mode.  If the caller ensures that @ref is not in the process of
+ * switching to atomic mode, this function can be called from any context.
+ */
+void percpu_ref_switch_to_atomic(struct percpu_ref *ref,
+				 percpu_ref_func_t *confirm_switch)
+{
+	bool switching;
+
+	pthread_mutex_lock(&percpu_ref_switch_lock);
+	ref->force_atomic = true;
+	switching = __percpu_ref_switch_mode(ref, confirm_switch);
+	percpu_ref_switch_unlock(ref, switching);
+}
+
+/**
+ * percpu_ref_switch_to_percpu - switch a percpu_ref to percpu mode
+ * @ref: percpu_ref to switch to percpu mode
+ *
+ * There's no reason to use this function for the usual reference counting.
+ * To re-use an expired ref, use percpu_ref_reinit().
+ *
+ * Switch @ref to percpu mode.  This function may be invoked concurrently
+ * with all the get/put operations and can safely be mixed with kill and
+ * reinit operations.  This function reverses the sticky atomic state set
+ * by PERCPU_REF_INIT_ATOMIC or percpu_ref_switch_to_atomic().  If @ref is
+ * dying or dead, the actual switching takes place on the following
+ * percpu_ref_reinit().
+ */
+void percpu_ref_switch_to_percpu(struct percpu_ref *ref)
+{
+	bool switching;
+
+	pthread_mutex_lock(&percpu_ref_switch_lock);
+	ref->force_atomic = false;
+	switching = __percpu_ref_switch_mode(ref, NULL);
+	percpu_ref_switch_unlock(ref, switching);
+}
+
+/**
+ * percpu_ref_kill_and_confirm - drop the base ref and schedule confirmation
+ * @ref: percpu_ref to kill
+ * @confirm_kill: optional confirmation callback
+ *
+ * Equivalent to percpu_ref_kill() but also schedules kill confirmation if
+ * @confirm_kill is not NULL.  @confirm_kill, which may not block, will be
+ * called after @ref is seen as dead from all CPUs at which point all
+ * further invocations of percpu_ref_tryget_live() will fail.  See
+ * percpu_ref_tryget_live() for details.
+ *
+ * This function normally doesn't block and can be called from any context
+ * but it may block if @confirm_kill is specified and @ref is in the
+ * process of switching to atomic mode by percpu_ref_switch_to_atomic().
+ */
+void percpu_ref_kill_and_confirm(struct percpu_ref *ref,
+				 percpu_ref_func_t *confirm_kill)
+{
+	bool switching;
+
+	pthread_mutex_lock(&percpu_ref_switch_lock);
+
+	WARN_ONCE(ref->percpu_count_ptr & __PERCPU_REF_DEAD,
+		  "percpu_ref_kill() called more than once");
+
+	ref->percpu_count_ptr |= __PERCPU_REF_DEAD;
+	switching = __percpu_ref_switch_mode(ref, confirm_kill);
+	percpu_ref_put(ref);
+
+	percpu_ref_switch_unlock(ref, switching);
+}
+
+/**
+ * percpu_ref_reinit - re-initialize a percpu refcount
+ * @ref: perpcu_ref to re-initialize
+ *
+ * Re-initialize @ref so that it's in the same state as when it finished
+ * percpu_ref_init() ignoring %PERCPU_REF_INIT_DEAD.  @ref must have been
+ * initialized successfully and reached 0 but not exited.
+ *
+ * Note that percpu_ref_tryget[_live]() are safe to perform on @ref while
+ * this function is in progress.
+ */
+void percpu_ref_reinit(struct percpu_ref *ref)
+{
+	bool switching;
+
+	pthread_mutex_lock(&percpu_ref_switch_lock);
+
+	WARN_ON_ONCE(!percpu_ref_is_zero(ref));
+
+	ref->percpu_count_ptr &= ~__PERCPU_REF_DEAD;
+	percpu_ref_get(ref);
+	switching = __percpu_ref_switch_mode(ref, NULL);
+
+	percpu_ref_switch_unlock(ref, switching);
+}
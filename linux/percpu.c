@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/page.h>
+#include <linux/percpu.h>
+
+unsigned		nr_cpu_ids = 1;
+__thread int		pcpu_this_cpu = -1;
+static atomic_t		pcpu_next_cpu;
+
+int pcpu_assign_cpu(void)
+{
+	pcpu_this_cpu = (unsigned) atomic_inc_return(&pcpu_next_cpu) %
+		nr_cpu_ids;
+	return pcpu_this_cpu;
+}
+
+/*
+ * The percpu area is reserved up front, nr_cpu_ids units of PCPU_UNIT_SIZE;
+ * allocations are carved out of cpu 0's unit first fit, and the same range is
+ * made accessible in every unit as the high water mark grows:
+ */
+struct pcpu_alloc {
+	struct list_head	list;
+	size_t			offset;
+	size_t			size;
+};
+
+static pthread_mutex_t	pcpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(pcpu_allocs);		/* sorted by offset */
+static char		*pcpu_base;
+static size_t		pcpu_populated;
+
+static int pcpu_populate(size_t end)
+{
+	size_t new_populated = round_up(end, PAGE_SIZE);
+	unsigned cpu;
+
+	if (new_populated <= pcpu_populated)
+		return 0;
+
+	for_each_possible_cpu(cpu)
+		if (mprotect(per_cpu_ptr(pcpu_base, cpu) + pcpu_populated,
+			     new_populated - pcpu_populated,
+			     PROT_READ|PROT_WRITE))
+			return -ENOMEM;
+
+	pcpu_populated = new_populated;
+	return 0;
+}
+
+void __percpu *__alloc_percpu_gfp(size_t size, size_t align, gfp_t gfp)
+{
+	struct pcpu_alloc *a, *n;
+	struct list_head *prev = &pcpu_allocs;
+	size_t offset = 0;
+	void *ret = NULL;
+	unsigned cpu;
+
+	size = max_t(size_t, size, 1);
+	align = max_t(size_t, align, sizeof(long));
+
+	n = malloc(sizeof(*n));
+	if (!n)
+		return NULL;
+
+	pthread_mutex_lock(&pcpu_lock);
+	list_for_each_entry(a, &pcpu_allocs, list) {
+		if (offset + size <= a->offset)
+			break;
+
+		offset = round_up(a->offset + a->size, align);
+		prev = &a->list;
+	}
+
+	if (offset + size > PCPU_UNIT_SIZE ||
+	    pcpu_populate(offset + size)) {
+		free(n);
+		goto out;
+	}
+
+	n->offset	= offset;
+	n->size		= size;
+	list_add(&n->list, prev);
+
+	ret = pcpu_base + offset;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(ret, cpu), 0, size);
+out:
+	pthread_mutex_unlock(&pcpu_lock);
+	return ret;
+}
+
+void __percpu *__alloc_percpu(size_t size, size_t align)
+{
+	return __alloc_percpu_gfp(size, align, GFP_KERNEL);
+}
+
+void free_percpu(void __percpu *ptr)
+{
+	size_t offset = (char *) ptr - pcpu_base;
+	struct pcpu_alloc *a;
+
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&pcpu_lock);
+	list_for_each_entry(a, &pcpu_allocs, list)
+		if (a->offset == offset) {
+			list_del(&a->list);
+			free(a);
+			goto out;
+		}
+	BUG();
+out:
+	pthread_mutex_unlock(&pcpu_lock);
+}
+
+__attribute__((constructor(101)))
+static void percpu_init(void)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nr_cpu_ids = max(nr_cpus, 1L);
+
+	pcpu_base = mmap(NULL, (size_t) nr_cpu_ids << PCPU_UNIT_SHIFT,
+			 PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+			 -1, 0);
+	BUG_ON(pcpu_base == MAP_FAILED);
+}
@@ -0,0 +1,65 @@
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/kernel.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+
+__thread struct printk_capture *printk_capture;
+
+int __printk_capture(const char *fmt, ...)
+{
+	struct printk_capture *p = printk_capture;
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	if (len < 0)
+		return len;
+
+	if (p->len + len + 1 > p->size) {
+		size_t new_size = max(max(256UL, p->size * 2),
+				      p->len + len + 1);
+		char *n = krealloc(p->buf, new_size, GFP_KERNEL);
+
+		/* Better out of order than not at all: */
+		if (!n) {
+			va_start(args, fmt);
+			len = vprintf(fmt, args);
+			va_end(args);
+			return len;
+		}
+
+		p->buf	= n;
+		p->size	= new_size;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(p->buf + p->len, p->size - p->len, fmt, args);
+	va_end(args);
+
+	p->len += len;
+	return len;
+}
+
+/* Print and free everything captured in @p: */
+void printk_capture_flush(struct printk_capture *p)
+{
+	if (p->len)
+		fwrite(p->buf, 1, p->len, stdout);
+
+	kfree(p->buf);
+	memset(p, 0, sizeof(*p));
+}
+
+/* Free everything captured in @p, without printing it: */
+void printk_capture_discard(struct printk_capture *p)
+{
+	kfree(p->buf);
+	memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,60 @@
+
+#include <pthread.h>
+
+#include <linux/rwsem.h>
+
+static long rwsem_readers(struct rw_semaphore *sem)
+{
+	long ret = 0;
+	unsigned i;
+
+	for (i = 0; i < RWSEM_READER_SHARDS; i++)
+		ret += __atomic_load_n(&sem->readers[i].count,
+				       __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+/* Wake up a writer waiting for readers to drain, or readers waiting on it: */
+void __rwsem_wake(struct rw_semaphore *sem)
+{
+	pthread_mutex_lock(&sem->wait_lock);
+	pthread_cond_broadcast(&sem->wait);
+	pthread_mutex_unlock(&sem->wait_lock);
+}
+
+void __down_read(struct rw_semaphore *sem)
+{
+	do {
+		pthread_mutex_lock(&sem->wait_lock);
+		while (__atomic_load_n(&sem->writer, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&sem->wait, &sem->wait_lock);
+		pthread_mutex_unlock(&sem->wait_lock);
+	} while (!down_read_trylock(sem));
+}
+
+void down_write(struct rw_semaphore *sem)
+{
+	pthread_mutex_lock(&sem->writer_lock);
+
+	__atomic_store_n(&sem->writer, 1, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Readers that raced with us setting ->writer back off and wake us up
+	 * after dropping their count; since we check the counts with wait_lock
+	 * held, we can't miss the wakeup:
+	 */
+	pthread_mutex_lock(&sem->wait_lock);
+	while (rwsem_readers(sem))
+		pthread_cond_wait(&sem->wait, &sem->wait_lock);
+	pthread_mutex_unlock(&sem->wait_lock);
+}
+
+void up_write(struct rw_semaphore *sem)
+{
+	pthread_mutex_lock(&sem->wait_lock);
+	__atomic_store_n(&sem->writer, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&sem->wait);
+	pthread_mutex_unlock(&sem->wait_lock);
+
+	pthread_mutex_unlock(&sem->writer_lock);
+}
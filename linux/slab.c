@@ -0,0 +1,454 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+/*
+ * Slab allocator:
+ *
+ * Objects are carved out of spans of 64k runs, allocated from a big region of
+ * address space reserved up front - so kfree() can tell a slab object from a
+ * malloc()ed one by its address, and find its cache from the run it's in.
+ *
+ * Each cpu slot has a magazine of free objects that allocations and frees go
+ * to without touching anything shared; when a magazine runs empty or fills up,
+ * half a magazine's worth of objects is moved from or to the cache's depot, a
+ * freelist under the cache's lock. Spans are never returned to the system
+ * until the cache is destroyed.
+ */
+
+#define SLAB_REGION_SIZE	(1UL << 36)
+#define SLAB_RUN_SHIFT		16
+#define SLAB_RUN_SIZE		(1UL << SLAB_RUN_SHIFT)
+#define SLAB_NR_RUNS		(SLAB_REGION_SIZE >> SLAB_RUN_SHIFT)
+
+#define KMEM_MAG_MAX		64
+#define KMEM_MAG_BYTES		(256U << 10)
+
+struct kmem_cache_cpu {
+	spinlock_t		lock;
+	unsigned		nr;
+	u64			allocs;
+	u64			frees;
+	u64			hits;
+	void			*objs[KMEM_MAG_MAX];
+};
+
+struct kmem_cache {
+	const char		*name;
+	size_t			object_size;
+	size_t			size;
+	size_t			align;
+	size_t			free_offset;
+	void			(*ctor)(void *);
+	unsigned		mag_size;
+	unsigned		span_runs;
+
+	struct kmem_cache_cpu __percpu *cpu;
+
+	spinlock_t		lock;
+	void			*freelist;
+	size_t			nr_free;
+	u64			nr_objs;
+	u64			misses;
+	struct list_head	spans;
+
+	struct list_head	list;
+};
+
+struct slab_span {
+	struct list_head	list;
+	size_t			run;
+	size_t			nr_runs;
+};
+
+static char			*slab_base;
+static struct kmem_cache	**slab_run_cache;
+static size_t			slab_nr_runs_used;
+static pthread_mutex_t		slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(slab_free_spans);
+static LIST_HEAD(slab_caches);
+
+static struct kmem_cache	*kmalloc_caches[KMALLOC_SHIFT_HIGH + 1];
+static char			kmalloc_names[KMALLOC_SHIFT_HIGH + 1][16];
+
+static inline bool is_slab_obj(const void *p)
+{
+	return slab_base &&
+		(unsigned long) ((const char *) p - slab_base) < SLAB_REGION_SIZE;
+}
+
+static inline struct kmem_cache *slab_obj_cache(const void *p)
+{
+	return slab_run_cache[((const char *) p - slab_base) >> SLAB_RUN_SHIFT];
+}
+
+static inline void **obj_free_ptr(struct kmem_cache *s, void *obj)
+{
+	return obj + s->free_offset;
+}
+
+/* Backing: */
+
+static struct slab_span *slab_span_alloc(struct kmem_cache *s)
+{
+	struct slab_span *span;
+	size_t i;
+
+	pthread_mutex_lock(&slab_lock);
+
+	list_for_each_entry(span, &slab_free_spans, list)
+		if (span->nr_runs == s->span_runs) {
+			list_del(&span->list);
+			goto found;
+		}
+
+	span = NULL;
+
+	if (slab_nr_runs_used + s->span_runs > SLAB_NR_RUNS)
+		goto out;
+
+	span = malloc(sizeof(*span));
+	if (!span)
+		goto out;
+
+	span->run	= slab_nr_runs_used;
+	span->nr_runs	= s->span_runs;
+
+	if (mprotect(slab_base + (span->run << SLAB_RUN_SHIFT),
+		     span->nr_runs << SLAB_RUN_SHIFT,
+		     PROT_READ|PROT_WRITE)) {
+		free(span);
+		span = NULL;
+		goto out;
+	}
+
+	slab_nr_runs_used += span->nr_runs;
+found:
+	for (i = 0; i < span->nr_runs; i++)
+		slab_run_cache[span->run + i] = s;
+out:
+	pthread_mutex_unlock(&slab_lock);
+	return span;
+}
+
+static void slab_span_free(struct slab_span *span)
+{
+	size_t i;
+
+	madvise(slab_base + (span->run << SLAB_RUN_SHIFT),
+		span->nr_runs << SLAB_RUN_SHIFT, MADV_DONTNEED);
+
+	pthread_mutex_lock(&slab_lock);
+	for (i = 0; i < span->nr_runs; i++)
+		slab_run_cache[span->run + i] = NULL;
+	list_add(&span->list, &slab_free_spans);
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/* Add a new span's worth of objects to the depot - called with s->lock held: */
+static int kmem_cache_grow(struct kmem_cache *s)
+{
+	struct slab_span *span;
+	char *p, *end;
+
+	if (!slab_base)
+		return -ENOMEM;
+
+	span = slab_span_alloc(s);
+	if (!span)
+		return -ENOMEM;
+
+	list_add(&span->list, &s->spans);
+
+	p	= slab_base + (span->run << SLAB_RUN_SHIFT);
+	end	= p + (span->nr_runs << SLAB_RUN_SHIFT);
+
+	for (; p + s->size <= end; p += s->size) {
+		if (s->ctor)
+			s->ctor(p);
+
+		*obj_free_ptr(s, p) = s->freelist;
+		s->freelist = p;
+		s->nr_free++;
+		s->nr_objs++;
+	}
+
+	return 0;
+}
+
+/* Caches: */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		goto err;
+
+	align = max_t(size_t, align, sizeof(void *));
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max_t(size_t, align, L1_CACHE_BYTES);
+	align = roundup_pow_of_two(align);
+	BUG_ON(align > SLAB_RUN_SIZE);
+
+	s->name		= name;
+	s->object_size	= size;
+	s->align	= align;
+	s->ctor		= ctor;
+	s->size		= round_up(max_t(size_t, size, sizeof(void *)), align);
+
+	/* constructed objects keep their contents while free: */
+	if (ctor) {
+		s->free_offset	= round_up(size, sizeof(void *));
+		s->size		= round_up(s->free_offset + sizeof(void *),
+					   align);
+	}
+
+	s->mag_size	= clamp_t(size_t, KMEM_MAG_BYTES / s->size,
+				  2, KMEM_MAG_MAX);
+	s->span_runs	= DIV_ROUND_UP(max_t(size_t, s->size * 8,
+					     SLAB_RUN_SIZE),
+				       SLAB_RUN_SIZE);
+
+	spin_lock_init(&s->lock);
+	INIT_LIST_HEAD(&s->spans);
+
+	s->cpu = alloc_percpu(struct kmem_cache_cpu);
+	if (!s->cpu)
+		goto err;
+
+	pthread_mutex_lock(&slab_lock);
+	list_add(&s->list, &slab_caches);
+	pthread_mutex_unlock(&slab_lock);
+
+	return s;
+err:
+	free(s);
+	BUG_ON(flags & SLAB_PANIC);
+	return NULL;
+}
+
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+	struct slab_span *span, *n;
+
+	if (!s)
+		return;
+
+	pthread_mutex_lock(&slab_lock);
+	list_del(&s->list);
+	pthread_mutex_unlock(&slab_lock);
+
+	list_for_each_entry_safe(span, n, &s->spans, list)
+		slab_span_free(span);
+
+	free_percpu(s->cpu);
+	free(s);
+}
+
+size_t kmem_cache_size(struct kmem_cache *s)
+{
+	return s->object_size;
+}
+
+const char *kmem_cache_name(struct kmem_cache *s)
+{
+	return s->name;
+}
+
+/* Call @fn on every cache, oldest first - @fn mustn't create or destroy caches: */
+void kmem_cache_for_each(void (*fn)(struct kmem_cache *, void *), void *data)
+{
+	struct kmem_cache *s;
+
+	pthread_mutex_lock(&slab_lock);
+	list_for_each_entry_reverse(s, &slab_caches, list)
+		fn(s, data);
+	pthread_mutex_unlock(&slab_lock);
+}
+
+void kmem_cache_stats(struct kmem_cache *s, struct kmem_cache_stats *stats)
+{
+	struct kmem_cache_cpu *c;
+	u64 frees = 0;
+	unsigned cpu;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(s->cpu, cpu);
+
+		stats->allocs	+= READ_ONCE(c->allocs);
+		stats->hits	+= READ_ONCE(c->hits);
+		frees		+= READ_ONCE(c->frees);
+	}
+
+	stats->nr_objs		= READ_ONCE(s->nr_objs);
+	stats->nr_active	= stats->allocs - frees;
+	stats->misses		= READ_ONCE(s->misses);
+}
+
+static void *kmem_cache_alloc_fallback(struct kmem_cache *s)
+{
+	void *p = memalign(s->align, s->size);
+
+	if (p && s->ctor)
+		s->ctor(p);
+	return p;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t flags)
+{
+	struct kmem_cache_cpu *c = this_cpu_ptr(s->cpu);
+	unsigned nr;
+	void *p;
+
+	spin_lock(&c->lock);
+	c->allocs++;
+
+	if (likely(c->nr)) {
+		c->hits++;
+		p = c->objs[--c->nr];
+		spin_unlock(&c->lock);
+		goto out;
+	}
+
+	/* Refill half the magazine from the depot: */
+	spin_lock(&s->lock);
+	s->misses++;
+
+	if (s->nr_free < s->mag_size / 2)
+		kmem_cache_grow(s);
+
+	for (nr = min_t(size_t, s->mag_size / 2, s->nr_free); nr; --nr) {
+		c->objs[c->nr++] = s->freelist;
+		s->freelist = *obj_free_ptr(s, s->freelist);
+		s->nr_free--;
+	}
+	spin_unlock(&s->lock);
+
+	p = c->nr ? c->objs[--c->nr] : NULL;
+	spin_unlock(&c->lock);
+
+	if (unlikely(!p)) {
+		p = kmem_cache_alloc_fallback(s);
+		if (!p)
+			return NULL;
+	}
+out:
+	if (flags & __GFP_ZERO)
+		memset(p, 0, s->object_size);
+	return p;
+}
+
+void kmem_cache_free(struct kmem_cache *s, void *p)
+{
+	struct kmem_cache_cpu *c;
+
+	if (unlikely(!is_slab_obj(p))) {
+		free(p);
+		return;
+	}
+
+	c = this_cpu_ptr(s->cpu);
+	spin_lock(&c->lock);
+	c->frees++;
+
+	/* Magazine full - move half of it to the depot: */
+	if (unlikely(c->nr == s->mag_size)) {
+		spin_lock(&s->lock);
+		while (c->nr > s->mag_size / 2) {
+			void *obj = c->objs[--c->nr];
+
+			*obj_free_ptr(s, obj) = s->freelist;
+			s->freelist = obj;
+			s->nr_free++;
+		}
+		spin_unlock(&s->lock);
+	}
+
+	c->objs[c->nr++] = p;
+	spin_unlock(&c->lock);
+}
+
+/* kmalloc: */
+
+static inline unsigned kmalloc_index(size_t size)
+{
+	return size <= (1UL << KMALLOC_SHIFT_LOW)
+		? KMALLOC_SHIFT_LOW
+		: fls_long(size - 1);
+}
+
+void *__kmalloc(size_t size, gfp_t flags)
+{
+	struct kmem_cache *s;
+	void *p;
+
+	if (size <= KMALLOC_MAX_CACHE_SIZE &&
+	    (s = kmalloc_caches[kmalloc_index(size)]) &&
+	    (p = kmem_cache_alloc(s, flags)))
+		return p;
+
+	if (flags & __GFP_ZERO)
+		return calloc(1, size);
+
+	return malloc(size);
+}
+
+void kfree(const void *p)
+{
+	if (is_slab_obj(p))
+		kmem_cache_free(slab_obj_cache(p), (void *) p);
+	else
+		free((void *) p);
+}
+
+size_t ksize(const void *p)
+{
+	return is_slab_obj(p)
+		? slab_obj_cache(p)->object_size
+		: malloc_usable_size((void *) p);
+}
+
+__attribute__((constructor(102)))
+static void slab_init(void)
+{
+	unsigned i;
+
+	slab_run_cache = mmap(NULL, SLAB_NR_RUNS * sizeof(slab_run_cache[0]),
+			      PROT_READ|PROT_WRITE,
+			      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (slab_run_cache == MAP_FAILED)
+		goto err;
+
+	slab_base = mmap(NULL, SLAB_REGION_SIZE, PROT_NONE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (slab_base == MAP_FAILED)
+		goto err;
+
+	for (i = KMALLOC_SHIFT_LOW; i <= KMALLOC_SHIFT_HIGH; i++) {
+		snprintf(kmalloc_names[i], sizeof(kmalloc_names[i]),
+			 "kmalloc-%lu", 1UL << i);
+		kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1UL << i,
+					min(1UL << i, PAGE_SIZE), 0, NULL);
+	}
+	return;
+err:
+	/* No address space for the slab region: everything comes from malloc() */
+	slab_base = NULL;
+}
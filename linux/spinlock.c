@@ -0,0 +1,68 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+
+/*
+ * How long we spin before sleeping, in cpu_relax() calls: the backoff between
+ * attempts doubles each time, up to SPIN_BACKOFF_MAX.
+ */
+#define SPIN_LIMIT		4096
+#define SPIN_BACKOFF_MAX	128
+
+#ifdef CONFIG_LOCK_STAT
+static atomic_long_t spinlock_contended;
+static atomic_long_t spinlock_slept;
+
+__attribute__((destructor))
+static void spinlock_stats_print(void)
+{
+	fprintf(stderr, "spinlocks: %li contended, %li slept\n",
+		atomic_long_read(&spinlock_contended),
+		atomic_long_read(&spinlock_slept));
+}
+
+#define lock_stat_inc(_stat)	atomic_long_inc(&spinlock_##_stat)
+#else
+#define lock_stat_inc(_stat)	do {} while (0)
+#endif
+
+static inline long sys_futex(int *uaddr, int op, int val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+void raw_spin_lock_slowpath(raw_spinlock_t *lock)
+{
+	unsigned i, spins = 0, backoff = 1;
+
+	lock_stat_inc(contended);
+
+	while (spins < SPIN_LIMIT) {
+		for (i = 0; i < backoff; i++)
+			cpu_relax();
+		spins += backoff;
+
+		if (!READ_ONCE(lock->count) &&
+		    raw_spin_trylock(lock))
+			return;
+
+		backoff = min_t(unsigned, backoff * 2, SPIN_BACKOFF_MAX);
+	}
+
+	/*
+	 * The holder's probably been preempted: mark the lock as having
+	 * waiters, so that unlock wakes us up, and sleep:
+	 */
+	lock_stat_inc(slept);
+
+	while (xchg_acquire(&lock->count, 2))
+		sys_futex(&lock->count, FUTEX_WAIT_PRIVATE, 2);
+}
+
+void raw_spin_unlock_wake(raw_spinlock_t *lock)
+{
+	sys_futex(&lock->count, FUTEX_WAKE_PRIVATE, 1);
+}
@@ -45,7 +45,18 @@ do {									\
 	(heap)->data = NULL;						\
 } while (0)
 
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
+/*
+ * Pending timers track their own position in the heap, so that del_timer() and
+ * mod_timer() don't have to search for them:
+ */
+#define heap_set_backpointer(h, i)	((h)->data[i].timer->idx = (i))
+
+#define heap_swap(h, i, j)						\
+do {									\
+	swap((h)->data[i], (h)->data[j]);				\
+	heap_set_backpointer(h, i);					\
+	heap_set_backpointer(h, j);					\
+} while (0)
 
 #define heap_sift(h, i, cmp)						\
 do {									\
@@ -80,6 +91,7 @@ do {									\
 	if (_r) {							\
 		size_t _i = (h)->used++;				\
 		(h)->data[_i] = d;					\
+		heap_set_backpointer(h, _i);				\
 									\
 		heap_sift_down(h, _i, cmp);				\
 		heap_sift(h, _i, cmp);					\
@@ -93,9 +105,13 @@ do {									\
 									\
 	BUG_ON(_i >= (h)->used);					\
 	(h)->used--;							\
-	heap_swap(h, _i, (h)->used);					\
-	heap_sift_down(h, _i, cmp);					\
-	heap_sift(h, _i, cmp);						\
+									\
+	/* Deleting the last slot: nothing was moved, nothing to sift */\
+	if (_i != (h)->used) {						\
+		heap_swap(h, _i, (h)->used);				\
+		heap_sift_down(h, _i, cmp);				\
+		heap_sift(h, _i, cmp);					\
+	}								\
 } while (0)
 
 #define heap_pop(h, d, cmp)						\
@@ -124,10 +140,14 @@ struct pending_timer {
 	unsigned long		expires;
 };
 
+/*
+ * The heap macros keep the element that compares greatest at the top: the next
+ * timer to expire has to compare greatest.
+ */
 static inline bool pending_timer_cmp(struct pending_timer a,
 				     struct pending_timer b)
 {
-	return a.expires < b.expires;
+	return time_after(a.expires, b.expires);
 }
 
 static DECLARE_HEAP(struct pending_timer) pending_timers;
@@ -144,12 +164,11 @@ static inline bool timer_running(void)
 
 static size_t timer_idx(struct timer_list *timer)
 {
-	size_t i;
+	size_t i = timer->idx;
 
-	for (i = 0; i < pending_timers.size; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
-	BUG();
+	BUG_ON(i >= pending_timers.used ||
+	       pending_timers.data[i].timer != timer);
+	return i;
 }
 
 int del_timer(struct timer_list *timer)
@@ -0,0 +1,528 @@
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/trace_events.h>
+
+/*
+ * Tracepoints are recorded into per thread ring buffers: recording an event is
+ * a copy and a couple of stores to memory only the current thread writes, with
+ * no locking or atomic read-modify-writes. When a thread's buffer is full, its
+ * oldest events are overwritten.
+ *
+ * Events are dumped at exit - merged across threads, in timestamp order, and
+ * printed with their TP_printk() formats. Buffers are never freed, so events
+ * from threads that have already exited are still dumped.
+ *
+ * Tracing is enabled either with bcache trace, or for any command by setting
+ * BCACHE_TRACE to a comma separated list of events to record (or "all"), with
+ * BCACHE_TRACE_BUF_SIZE and BCACHE_TRACE_FILE optionally setting the size of
+ * each thread's buffer and where to dump the events.
+ */
+
+struct trace_entry {
+	u16			id;	/* 0 for padding */
+	u16			len;	/* including this header */
+	u32			pad;
+	u64			ts;
+	u8			data[];
+};
+
+#define TRACE_ENTRY_PAD		0
+#define TRACE_ENTRY_ALIGN	8
+#define TRACE_BUF_SIZE_MIN	(1 << 16)
+#define TRACE_BUF_SIZE_MAX	(1 << 30)
+
+/*
+ * @head and @tail count bytes written to the buffer: [tail, head) are the
+ * events that haven't been overwritten. An event never wraps around the end of
+ * the buffer - instead, the rest of the buffer is filled with padding:
+ */
+struct trace_buffer {
+	struct list_head	list;
+	pid_t			tid;
+	char			comm[TASK_COMM_LEN];
+
+	u64			head;
+	u64			tail;
+	u64			overwritten;
+
+	size_t			size;
+	u8			data[] __aligned(TRACE_ENTRY_ALIGN);
+};
+
+/* For dumping: */
+struct trace_record {
+	u64			ts;
+	struct trace_buffer	*buf;
+	struct trace_entry	*entry;
+};
+
+extern struct trace_event_call *__start_trace_events[] __attribute__((weak));
+extern struct trace_event_call *__stop_trace_events[] __attribute__((weak));
+
+static pthread_mutex_t		trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(trace_buffers);
+static size_t			trace_buf_size = 1 << 20;
+static char			*trace_file;
+static u64			trace_start;
+static bool			trace_enabled;
+
+static __thread struct trace_buffer *trace_buf;
+
+#define for_each_trace_event(_call)					\
+	for (struct trace_event_call **_i = __start_trace_events;	\
+	     _i < __stop_trace_events && ((_call) = *_i, true);		\
+	     _i++)
+
+static struct trace_event_call *trace_event_by_id(unsigned id)
+{
+	return __start_trace_events + id - 1 < __stop_trace_events
+		? __start_trace_events[id - 1] : NULL;
+}
+
+static struct trace_buffer *trace_buffer_alloc(void)
+{
+	struct trace_buffer *b;
+
+	b = kmalloc(sizeof(*b) + trace_buf_size, GFP_KERNEL);
+	if (!b)
+		return NULL;
+
+	memset(b, 0, sizeof(*b));
+	b->tid	= syscall(SYS_gettid);
+	b->size	= trace_buf_size;
+	strncpy(b->comm, current && current->comm[0]
+		? current->comm : program_invocation_short_name,
+		sizeof(b->comm) - 1);
+
+	pthread_mutex_lock(&trace_lock);
+	list_add_tail(&b->list, &trace_buffers);
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_buf = b;
+	return b;
+}
+
+/*
+ * Move the tail past the oldest events until there's room to write up to
+ * @head; the new tail has to be visible before those events are overwritten,
+ * so that trace_dump() knows not to trust them:
+ */
+static void trace_buffer_make_room(struct trace_buffer *b, u64 head)
+{
+	u64 tail = b->tail;
+
+	if (head - tail <= b->size)
+		return;
+
+	while (head - tail > b->size) {
+		struct trace_entry *e = (void *) b->data +
+			(tail & (b->size - 1));
+
+		if (e->id != TRACE_ENTRY_PAD)
+			b->overwritten++;
+		tail += e->len;
+	}
+
+	WRITE_ONCE(b->tail, tail);
+	smp_wmb();
+}
+
+void trace_event_write(struct trace_event_call *call,
+		       const void *data, unsigned size)
+{
+	struct trace_buffer *b = trace_buf;
+	struct trace_entry *e;
+	unsigned len = round_up(sizeof(*e) + size, TRACE_ENTRY_ALIGN);
+	unsigned pad = 0;
+	u64 head, offset;
+
+	if (!READ_ONCE(call->record))
+		return;
+
+	if (unlikely(!b) && !(b = trace_buffer_alloc()))
+		return;
+
+	head	= b->head;
+	offset	= head & (b->size - 1);
+
+	if (offset + len > b->size)
+		pad = b->size - offset;
+
+	trace_buffer_make_room(b, head + pad + len);
+
+	if (pad) {
+		e = (void *) b->data + offset;
+		e->id	= TRACE_ENTRY_PAD;
+		e->len	= pad;
+		offset	= 0;
+	}
+
+	e = (void *) b->data + offset;
+	e->id	= call->id;
+	e->len	= len;
+	e->ts	= local_clock();
+	memcpy(e->data, data, size);
+
+	smp_store_release(&b->head, head + pad + len);
+}
+
+/*
+ * Copy out the events in @b that haven't been overwritten - @b may still be
+ * written to while we're copying:
+ */
+static u8 *trace_buffer_copy(struct trace_buffer *b, u64 *start, u64 *end)
+{
+	u64 head, tail;
+	size_t offset, len, first;
+	u8 *data;
+
+	data = kmalloc(b->size, GFP_KERNEL);
+	if (!data)
+		return NULL;
+
+	head = smp_load_acquire(&b->head);
+	tail = READ_ONCE(b->tail);
+
+	offset	= tail & (b->size - 1);
+	len	= head - tail;
+	first	= min(len, b->size - offset);
+
+	memcpy(data + offset, b->data + offset, first);
+	memcpy(data, b->data, len - first);
+
+	smp_rmb();
+	*start	= max(tail, READ_ONCE(b->tail));
+	*end	= head;
+
+	return data;
+}
+
+static int trace_record_cmp(const void *_l, const void *_r)
+{
+	const struct trace_record *l = _l, *r = _r;
+
+	return (l->ts > r->ts) - (l->ts < r->ts) ?:
+		(l->buf->tid > r->buf->tid) - (l->buf->tid < r->buf->tid);
+}
+
+void trace_dump(FILE *out)
+{
+	struct trace_buffer *b;
+	struct trace_record *records = NULL, *r;
+	size_t nr = 0, size = 0;
+	u8 **copies = NULL;
+	unsigned nr_copies = 0, i;
+	u64 overwritten = 0, start, end;
+
+	pthread_mutex_lock(&trace_lock);
+
+	list_for_each_entry(b, &trace_buffers, list) {
+		u8 *data, **n;
+
+		n = krealloc(copies, sizeof(*copies) * (nr_copies + 1),
+			     GFP_KERNEL);
+		if (!n)
+			break;
+		copies = n;
+
+		data = trace_buffer_copy(b, &start, &end);
+		if (!data)
+			break;
+		copies[nr_copies++] = data;
+
+		overwritten += READ_ONCE(b->overwritten);
+
+		while (start < end) {
+			struct trace_entry *e = (void *) data +
+				(start & (b->size - 1));
+
+			start += e->len;
+
+			if (e->id == TRACE_ENTRY_PAD)
+				continue;
+
+			if (nr == size) {
+				size = max_t(size_t, 1024, size * 2);
+				r = krealloc(records, sizeof(*r) * size,
+					     GFP_KERNEL);
+				if (!r)
+					goto out;
+				records = r;
+			}
+
+			records[nr++] = (struct trace_record) {
+				.ts	= e->ts,
+				.buf	= b,
+				.entry	= e,
+			};
+		}
+	}
+out:
+	pthread_mutex_unlock(&trace_lock);
+
+	sort(records, nr, sizeof(*records), trace_record_cmp, NULL);
+
+	for (r = records; r < records + nr; r++) {
+		struct trace_event_call *call = trace_event_by_id(r->entry->id);
+		u64 ts = r->ts - trace_start;
+
+		fprintf(out, "%16s-%-7d %5llu.%09llu: %s: ",
+			r->buf->comm, r->buf->tid,
+			ts / NSEC_PER_SEC, ts % NSEC_PER_SEC,
+			call->tp->name);
+		call->print(out, r->entry->data);
+		fputc('\n', out);
+	}
+
+	if (overwritten)
+		fprintf(out, "# %llu events overwritten, trace buffers were too small\n",
+			overwritten);
+
+	for (i = 0; i < nr_copies; i++)
+		kfree(copies[i]);
+	kfree(copies);
+	kfree(records);
+}
+
+/*
+ * printf(), plus the kernel's %pU for uuids, which the TP_printk() formats use;
+ * each conversion is passed to fprintf() with an argument of the type its
+ * length modifier says:
+ */
+void trace_printf(FILE *out, const char *fmt, ...)
+{
+	char spec[32];
+	va_list args;
+
+	va_start(args, fmt);
+
+	while (*fmt) {
+		const char *start = fmt;
+		unsigned longs = 0;
+		char conv;
+
+		if (*fmt != '%') {
+			fmt = strchrnul(fmt, '%');
+			fwrite(start, 1, fmt - start, out);
+			continue;
+		}
+
+		fmt++;
+		fmt += strspn(fmt, "#0- +'");
+		fmt += strspn(fmt, "0123456789.");
+
+		for (; *fmt && strchr("hlLqjzt", *fmt); fmt++)
+			longs += *fmt == 'l' || *fmt == 'z' || *fmt == 't'
+				? 1 : *fmt == 'h' ? 0 : 2;
+
+		conv = *fmt;
+		if (!conv)
+			break;
+		fmt++;
+
+		snprintf(spec, sizeof(spec), "%.*s",
+			 (int) min_t(size_t, fmt - start, sizeof(spec) - 1),
+			 start);
+
+		switch (conv) {
+		case 'd':
+		case 'i':
+			if (longs > 1)
+				fprintf(out, spec, va_arg(args, long long));
+			else if (longs)
+				fprintf(out, spec, va_arg(args, long));
+			else
+				fprintf(out, spec, va_arg(args, int));
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			if (longs > 1)
+				fprintf(out, spec, va_arg(args, unsigned long long));
+			else if (longs)
+				fprintf(out, spec, va_arg(args, unsigned long));
+			else
+				fprintf(out, spec, va_arg(args, unsigned));
+			break;
+		case 'c':
+			fprintf(out, spec, va_arg(args, int));
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'g':
+		case 'G':
+			fprintf(out, spec, va_arg(args, double));
+			break;
+		case 's':
+			fprintf(out, spec, va_arg(args, const char *));
+			break;
+		case 'p':
+			if (*fmt == 'U') {
+				const u8 *u = va_arg(args, const u8 *);
+
+				fmt++;
+				if (*fmt && strchr("bBlL", *fmt))
+					fmt++;
+
+				fprintf(out, "%02x%02x%02x%02x-%02x%02x-%02x%02x-"
+					"%02x%02x-%02x%02x%02x%02x%02x%02x",
+					u[0], u[1], u[2], u[3], u[4], u[5],
+					u[6], u[7], u[8], u[9], u[10], u[11],
+					u[12], u[13], u[14], u[15]);
+			} else {
+				fprintf(out, spec, va_arg(args, void *));
+			}
+			break;
+		case '%':
+			fputc('%', out);
+			break;
+		default:
+			fwrite(start, 1, fmt - start, out);
+			break;
+		}
+	}
+
+	va_end(args);
+}
+
+void trace_list_events(FILE *out)
+{
+	struct trace_event_call *call;
+
+	for_each_trace_event(call)
+		fprintf(out, "%-40s %s\n", call->tp->name, call->class);
+}
+
+static bool trace_event_match(struct trace_event_call *call,
+			      const char *events)
+{
+	char *s = strdup(events), *p = s, *pattern;
+	bool ret = false;
+
+	while ((pattern = strsep(&p, ",")) && !ret)
+		ret = !strcmp(pattern, "all") ||
+			!fnmatch(pattern, call->tp->name, 0) ||
+			!fnmatch(pattern, call->class, 0);
+
+	free(s);
+	return ret;
+}
+
+static void trace_exit(void)
+{
+	FILE *out = stderr;
+
+	if (trace_file) {
+		out = fopen(trace_file, "w");
+		if (!out) {
+			fprintf(stderr, "error opening %s: %m\n", trace_file);
+			return;
+		}
+	}
+
+	trace_dump(out);
+
+	if (out != stderr)
+		fclose(out);
+}
+
+/**
+ * trace_init - start recording events
+ *
+ * @events:	comma separated list of globs matching event or event class
+ *		names, or "all"
+ * @buf_size:	size of each thread's trace buffer, 0 for the default
+ * @file:	where to dump the trace at exit, NULL for stderr
+ *
+ * Returns the number of events enabled, or -ENOENT if no events matched.
+ */
+int trace_init(const char *events, size_t buf_size, const char *file)
+{
+	struct trace_event_call *call;
+	int nr = 0;
+
+	if (trace_enabled)
+		return -EBUSY;
+
+	if (buf_size)
+		trace_buf_size = roundup_pow_of_two(clamp_t(size_t, buf_size,
+							    TRACE_BUF_SIZE_MIN,
+							    TRACE_BUF_SIZE_MAX));
+	trace_file	= file ? strdup(file) : NULL;
+	trace_start	= local_clock();
+
+	for_each_trace_event(call)
+		if (trace_event_match(call, events)) {
+			WRITE_ONCE(call->record, true);
+			WRITE_ONCE(call->tp->enabled, true);
+			nr++;
+		}
+
+	if (!nr)
+		return -ENOENT;
+
+	trace_enabled = true;
+	atexit(trace_exit);
+	return nr;
+}
+
+static size_t trace_parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v = strtoull(s, &end, 10);
+
+	switch (tolower(*end)) {
+	case 'g':
+		v <<= 10;
+		/* fallthrough */
+	case 'm':
+		v <<= 10;
+		/* fallthrough */
+	case 'k':
+		v <<= 10;
+	}
+
+	return v;
+}
+
+__attribute__((constructor(105)))
+static void trace_events_init(void)
+{
+	struct trace_event_call *call;
+	const char *events = getenv("BCACHE_TRACE");
+	const char *buf_size = getenv("BCACHE_TRACE_BUF_SIZE");
+	unsigned id = 1;
+
+	for_each_trace_event(call) {
+		call->id = id++;
+#ifdef CONFIG_USDT
+		/* Probes can be attached at any time: */
+		call->tp->enabled = true;
+#endif
+	}
+
+	if (events && *events &&
+	    trace_init(events, buf_size ? trace_parse_size(buf_size) : 0,
+		       getenv("BCACHE_TRACE_FILE")) < 0)
+		fprintf(stderr, "BCACHE_TRACE: no events matching %s\n",
+			events);
+}
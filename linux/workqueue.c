@@ -1,21 +1,47 @@
 #include <pthread.h>
+#include <sched.h>
 
+#include <linux/cpumask.h>
 #include <linux/kthread.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
-static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(wq_list);
-
-struct workqueue_struct {
-	struct list_head	list;
+/*
+ * Each workqueue has its own lock and its own pool of worker threads: ordered
+ * workqueues get exactly one worker, everything else gets up to max_active
+ * (times the number of CPUs, for per cpu workqueues) - capped at the number of
+ * CPUs, since we have no concurrency management to tell us when a worker
+ * blocks. Workers are started on demand, and queueing work hands it to an idle
+ * worker if there is one.
+ *
+ * As in the kernel, a work item never runs concurrently with itself: if a
+ * worker picks up an item that another worker is already running, it hands it
+ * off to that worker's scheduled list instead.
+ */
+
+struct worker {
+	struct list_head	list;		/* wq->workers */
+	struct list_head	idle;		/* wq->idle_workers */
+	struct workqueue_struct	*wq;
+	struct task_struct	*task;
 
 	struct work_struct	*current_work;
-	struct list_head	pending_work;
+	struct list_head	scheduled;
+	pthread_cond_t		wait;
+};
 
+struct workqueue_struct {
+	pthread_mutex_t		lock;
+	struct list_head	pending_work;
 	pthread_cond_t		work_finished;
 
-	struct task_struct	*worker;
+	struct list_head	workers;
+	struct list_head	idle_workers;
+	unsigned		nr_workers;
+	unsigned		max_workers;
+	bool			stopping;
+
+	unsigned		flags;
 	char			name[24];
 };
 
@@ -33,24 +59,66 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+static int worker_thread(void *arg);
+
+static void wq_start_worker(struct workqueue_struct *wq)
+{
+	struct worker *worker = kzalloc(sizeof(*worker), GFP_KERNEL);
+
+	BUG_ON(!worker);
+
+	worker->wq = wq;
+	INIT_LIST_HEAD(&worker->idle);
+	INIT_LIST_HEAD(&worker->scheduled);
+	pthread_cond_init(&worker->wait, NULL);
+
+	worker->task = kthread_create(worker_thread, worker, "%s/%u",
+				      wq->name, wq->nr_workers);
+	BUG_ON(IS_ERR(worker->task));
+
+	/*
+	 * Workers exit on their own once the workqueue is stopping, possibly
+	 * before destroy_workqueue() gets to kthread_stop() - hold a ref so the
+	 * task_struct stays around until then:
+	 */
+	get_task_struct(worker->task);
+
+	list_add_tail(&worker->list, &wq->workers);
+	wq->nr_workers++;
+
+	wake_up_process(worker->task);
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
+	struct worker *worker;
+
 	BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
+
+	pthread_mutex_lock(&wq->lock);
 	BUG_ON(!list_empty(&work->entry));
 
+	work->wq = wq;
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+
+	worker = list_first_entry_or_null(&wq->idle_workers,
+					  struct worker, idle);
+	if (worker) {
+		list_del_init(&worker->idle);
+		pthread_cond_signal(&worker->wait);
+	} else if (wq->nr_workers < wq->max_workers) {
+		wq_start_worker(wq);
+	}
+	pthread_mutex_unlock(&wq->lock);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	if ((ret = set_work_pending(work)))
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -59,9 +127,7 @@ void delayed_work_timer_fn(unsigned long __data)
 {
 	struct delayed_work *dwork = (struct delayed_work *) __data;
 
-	pthread_mutex_lock(&wq_lock);
 	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -92,16 +158,20 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	if ((ret = set_work_pending(work)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+/*
+ * Steal the pending bit: returns true if the work was pending (on a timer or a
+ * workqueue), false if it was idle - either way, the caller now owns
+ * WORK_PENDING_BIT:
+ */
 static bool grab_pending(struct work_struct *work, bool is_dwork)
 {
+	struct workqueue_struct *wq;
 retry:
 	if (set_work_pending(work)) {
 		BUG_ON(!list_empty(&work->entry));
@@ -117,30 +187,56 @@ retry:
 		}
 	}
 
-	if (!list_empty(&work->entry)) {
-		list_del_init(&work->entry);
-		return true;
-	}
+	wq = READ_ONCE(work->wq);
+	if (wq) {
+		bool queued;
+
+		pthread_mutex_lock(&wq->lock);
+		queued = work->wq == wq && !list_empty(&work->entry);
+		if (queued)
+			list_del_init(&work->entry);
+		pthread_mutex_unlock(&wq->lock);
 
-	BUG_ON(!is_dwork);
+		if (queued)
+			return true;
+	}
 
-	pthread_mutex_unlock(&wq_lock);
-	flush_timers();
-	pthread_mutex_lock(&wq_lock);
+	/*
+	 * Raced with queue_work() or the timer firing, and it hasn't made it
+	 * onto a workqueue yet:
+	 */
+	if (is_dwork)
+		flush_timers();
+	else
+		sched_yield();
 	goto retry;
 }
 
+static bool work_running(struct workqueue_struct *wq,
+			 struct work_struct *work)
+{
+	struct worker *worker;
+
+	list_for_each_entry(worker, &wq->workers, list)
+		if (worker->current_work == work)
+			return true;
+	return false;
+}
+
 static bool __flush_work(struct work_struct *work)
 {
-	struct workqueue_struct *wq;
+	struct workqueue_struct *wq = READ_ONCE(work->wq);
 	bool ret = false;
-retry:
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work) {
-			pthread_cond_wait(&wq->work_finished, &wq_lock);
-			ret = true;
-			goto retry;
-		}
+
+	if (!wq)
+		return false;
+
+	pthread_mutex_lock(&wq->lock);
+	while (work_running(wq, work)) {
+		pthread_cond_wait(&wq->work_finished, &wq->lock);
+		ret = true;
+	}
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -149,12 +245,10 @@ bool cancel_work_sync(struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, false);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -166,11 +260,9 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -180,11 +272,9 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -194,66 +284,120 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork)
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	ret = grab_pending(work, true);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+/*
+ * Next work item for @worker: first anything handed off to us, then the
+ * workqueue's shared list - skipping (and handing off) items another worker is
+ * already running:
+ */
+static struct work_struct *worker_next_work(struct worker *worker)
+{
+	struct workqueue_struct *wq = worker->wq;
+	struct work_struct *work;
+	struct worker *w;
+
+	work = list_first_entry_or_null(&worker->scheduled,
+					struct work_struct, entry);
+	if (work)
+		return work;
+retry:
+	work = list_first_entry_or_null(&wq->pending_work,
+					struct work_struct, entry);
+	if (!work)
+		return NULL;
+
+	list_for_each_entry(w, &wq->workers, list)
+		if (w != worker && w->current_work == work) {
+			list_move_tail(&work->entry, &w->scheduled);
+			goto retry;
+		}
+
+	return work;
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
 	struct work_struct *work;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	while (1) {
-		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
-
-		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
-			break;
-		}
+		work = worker_next_work(worker);
 
 		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
-			schedule();
-			pthread_mutex_lock(&wq_lock);
+			if (wq->stopping)
+				break;
+
+			if (list_empty(&worker->idle))
+				list_add(&worker->idle, &wq->idle_workers);
+			pthread_cond_wait(&worker->wait, &wq->lock);
 			continue;
 		}
 
 		BUG_ON(!test_bit(WORK_PENDING_BIT, work_data_bits(work)));
 		list_del_init(&work->entry);
 		clear_work_pending(work);
+		worker->current_work = work;
 
-		pthread_mutex_unlock(&wq_lock);
+		pthread_mutex_unlock(&wq->lock);
 		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+		pthread_mutex_lock(&wq->lock);
 
+		worker->current_work = NULL;
 		pthread_cond_broadcast(&wq->work_finished);
 	}
-	pthread_mutex_unlock(&wq_lock);
+
+	list_del_init(&worker->idle);
+	pthread_mutex_unlock(&wq->lock);
 
 	return 0;
 }
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
-
-	pthread_mutex_lock(&wq_lock);
-	list_del(&wq->list);
-	pthread_mutex_unlock(&wq_lock);
+	struct worker *worker, *n;
+
+	/* workers exit once there's no work left: */
+	pthread_mutex_lock(&wq->lock);
+	wq->stopping = true;
+	list_for_each_entry(worker, &wq->workers, list)
+		pthread_cond_signal(&worker->wait);
+	pthread_mutex_unlock(&wq->lock);
+
+	list_for_each_entry_safe(worker, n, &wq->workers, list) {
+		kthread_stop(worker->task);
+		put_task_struct(worker->task);
+		kfree(worker);
+	}
 
+	BUG_ON(!list_empty(&wq->pending_work));
 	kfree(wq);
 }
 
+static unsigned wq_max_workers(unsigned flags, int max_active)
+{
+	unsigned ret;
+
+	if (flags & __WQ_ORDERED)
+		return 1;
+
+	ret = max_active ?: WQ_DFL_ACTIVE;
+
+	/* per cpu workqueues get max_active workers per cpu: */
+	if (!(flags & WQ_UNBOUND))
+		ret *= num_online_cpus();
+
+	return clamp_t(unsigned, ret, 1, num_online_cpus());
+}
+
 struct workqueue_struct *alloc_workqueue(const char *fmt,
 					 unsigned flags,
 					 int max_active,
@@ -266,25 +410,20 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	if (!wq)
 		return NULL;
 
-	INIT_LIST_HEAD(&wq->list);
 	INIT_LIST_HEAD(&wq->pending_work);
+	INIT_LIST_HEAD(&wq->workers);
+	INIT_LIST_HEAD(&wq->idle_workers);
 
+	pthread_mutex_init(&wq->lock, NULL);
 	pthread_cond_init(&wq->work_finished, NULL);
 
+	wq->flags	= flags;
+	wq->max_workers	= wq_max_workers(flags, max_active);
+
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
-		kfree(wq);
-		return NULL;
-	}
-
-	pthread_mutex_lock(&wq_lock);
-	list_add(&wq->list, &wq_list);
-	pthread_mutex_unlock(&wq_lock);
-
 	return wq;
 }
 
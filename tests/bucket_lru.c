@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The LRU index's list manipulation is static to alloc.c: */
+#include "bcache-userspace-shim.c"
+
+static struct cache_set *c;
+static struct cache *ca;
+
+static void noop_release(struct percpu_ref *ref) {}
+
+/*
+ * Just enough of a cache set and a device for the LRU index - every bucket
+ * starts out empty, which is available, but not on any list until resynced:
+ */
+static void lru_setup(size_t nbuckets)
+{
+	c	= kzalloc(sizeof(*c), GFP_KERNEL);
+	ca	= kzalloc(sizeof(*ca), GFP_KERNEL);
+	BUG_ON(!c || !ca);
+
+	mutex_init(&c->bucket_lock);
+	c->sb.nr_devices	= 1;
+	c->gc_pos.phase		= GC_PHASE_DONE;
+
+	BUG_ON(percpu_ref_init(&ca->ref, noop_release, 0, GFP_KERNEL));
+	spin_lock_init(&ca->bucket_lru_lock);
+	ca->set			= c;
+	ca->mi.nbuckets		= nbuckets;
+	ca->buckets		= kcalloc(nbuckets, sizeof(*ca->buckets),
+					  GFP_KERNEL);
+	ca->oldest_gens		= kcalloc(nbuckets, sizeof(u8), GFP_KERNEL);
+	ca->bucket_lru		= kcalloc(nbuckets + BUCKET_LRU_NR,
+					  sizeof(*ca->bucket_lru), GFP_KERNEL);
+	BUG_ON(!ca->buckets || !ca->oldest_gens || !ca->bucket_lru);
+
+	rcu_assign_pointer(c->cache[0], ca);
+	bch_dev_bucket_lru_init(ca);
+}
+
+static void lru_teardown(void)
+{
+	percpu_ref_exit(&ca->ref);
+	kfree(ca->bucket_lru);
+	kfree(ca->oldest_gens);
+	kfree(ca->buckets);
+	kfree(ca);
+	kfree(c);
+}
+
+static void set_mark(size_t b, unsigned dirty_sectors,
+		     unsigned cached_sectors, bool owned_by_allocator)
+{
+	struct bucket *g = ca->buckets + b;
+
+	g->_mark.dirty_sectors		= dirty_sectors;
+	g->_mark.cached_sectors		= cached_sectors;
+	g->_mark.owned_by_allocator	= owned_by_allocator;
+	bch_bucket_lru_update(ca, g);
+}
+
+static struct bucket *lru_pop(void)
+{
+	struct bucket *g;
+
+	spin_lock(&ca->bucket_lru_lock);
+	g = bucket_lru_pop(ca);
+	spin_unlock(&ca->bucket_lru_lock);
+
+	return g;
+}
+
+/*
+ * Check the lists are well formed, and that every bucket is on the list for
+ * its current mark - or parked waiting on gc:
+ */
+static int lru_check(const char *when)
+{
+	size_t nbuckets = ca->mi.nbuckets, b, head, nr_seen = 0, nr_needs_gc = 0;
+	unsigned level;
+	int ret = 0;
+
+	for (level = 1; level < BUCKET_LRU_NR; level++) {
+		head = nbuckets + level;
+
+		for (b = ca->bucket_lru[head].next;
+		     b != head;
+		     b = ca->bucket_lru[b].next) {
+			if (b >= nbuckets ||
+			    ca->bucket_lru[ca->bucket_lru[b].next].prev != b ||
+			    ca->bucket_lru[b].level != level ||
+			    nr_seen++ > nbuckets) {
+				fprintf(stderr, "%s: list %u corrupt at %zu\n",
+					when, level, b);
+				return 1;
+			}
+
+			nr_needs_gc += level == BUCKET_LRU_NEEDS_GC;
+		}
+	}
+
+	for (b = 0; b < nbuckets; b++) {
+		unsigned want = bucket_lru_level(ca->buckets[b].mark);
+		unsigned have = ca->bucket_lru[b].level;
+
+		if (have != want &&
+		    !(want && have == BUCKET_LRU_NEEDS_GC)) {
+			fprintf(stderr, "%s: bucket %zu on list %u, should be on %u\n",
+				when, b, have, want);
+			ret = 1;
+		}
+	}
+
+	if (nr_needs_gc != ca->bucket_lru_needs_gc) {
+		fprintf(stderr, "%s: %zu buckets parked, counted %zu\n",
+			when, nr_needs_gc, ca->bucket_lru_needs_gc);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Buckets come out of the index in order of level - fewest cached sectors
+ * first - and each available bucket exactly once:
+ */
+static int test_pop_order(void)
+{
+	size_t nbuckets = 256, b, nr_available = 0, nr_popped = 0;
+	unsigned last_level = 0;
+	bool *popped = kcalloc(nbuckets, sizeof(bool), GFP_KERNEL);
+	struct bucket *g;
+	int ret = 0;
+
+	lru_setup(nbuckets);
+
+	/* While gc is running, mark updates leave the index alone: */
+	c->gc_pos.phase = GC_PHASE_PENDING_DELETE;
+	for (b = 0; b < nbuckets; b++) {
+		set_mark(b, b % 5 ? 0 : 8, (b * 37) % 2000, false);
+		nr_available += is_available_bucket(ca->buckets[b].mark);
+	}
+
+	for (b = 0; b < nbuckets; b++)
+		if (ca->bucket_lru[b].level) {
+			fprintf(stderr, "pop order: index updated during gc\n");
+			ret = 1;
+			goto out;
+		}
+
+	c->gc_pos.phase = GC_PHASE_DONE;
+	bch_dev_bucket_lru_resync(ca);
+
+	ret = lru_check("pop order: after resync");
+	if (ret)
+		goto out;
+
+	while ((g = lru_pop())) {
+		unsigned level = bucket_lru_level(g->mark);
+
+		b = g - ca->buckets;
+
+		if (!is_available_bucket(g->mark) || popped[b] ||
+		    level < last_level) {
+			fprintf(stderr, "pop order: popped bucket %zu (level %u after %u)%s\n",
+				b, level, last_level,
+				popped[b] ? " twice" : "");
+			ret = 1;
+			goto out;
+		}
+
+		popped[b] = true;
+		last_level = level;
+		nr_popped++;
+	}
+
+	if (nr_popped != nr_available) {
+		fprintf(stderr, "pop order: popped %zu of %zu available buckets\n",
+			nr_popped, nr_available);
+		ret = 1;
+	}
+out:
+	lru_teardown();
+	kfree(popped);
+	return ret;
+}
+
+/* A bucket read since it was added goes to the back of its list: */
+static int test_second_chance(void)
+{
+	size_t nbuckets = 8, b, i = 0;
+	static const size_t expect[] = { 1, 2, 3, 4, 5, 6, 7, 0 };
+	struct bucket *g;
+	int ret = 0;
+
+	lru_setup(nbuckets);
+	bch_dev_bucket_lru_resync(ca);
+
+	ca->buckets[0].read_prio++;
+
+	while ((g = lru_pop())) {
+		b = g - ca->buckets;
+
+		if (i >= ARRAY_SIZE(expect) || b != expect[i]) {
+			fprintf(stderr, "second chance: popped %zu, expected %zu\n",
+				b, i < ARRAY_SIZE(expect) ? expect[i] : -1UL);
+			ret = 1;
+			break;
+		}
+		i++;
+	}
+
+	if (!ret && i != ARRAY_SIZE(expect)) {
+		fprintf(stderr, "second chance: popped %zu buckets, expected %zu\n",
+			i, ARRAY_SIZE(expect));
+		ret = 1;
+	}
+
+	lru_teardown();
+	return ret;
+}
+
+/*
+ * A bucket whose gen can't be incremented is parked until gc has updated
+ * oldest_gens, then resync puts it back:
+ */
+static int test_needs_gc(void)
+{
+	size_t nbuckets = 8, b;
+	struct bucket *g;
+	int ret = 0;
+
+	lru_setup(nbuckets);
+	bch_dev_bucket_lru_resync(ca);
+
+	ca->buckets[3]._mark.gen = BUCKET_GC_GEN_MAX;
+
+	while ((g = lru_pop())) {
+		b = g - ca->buckets;
+
+		if (b == 3) {
+			fprintf(stderr, "needs gc: popped bucket that needs gc\n");
+			ret = 1;
+			goto out;
+		}
+
+		/* Invalidated by the allocator: */
+		set_mark(b, 0, 0, true);
+	}
+
+	if (ca->bucket_lru[3].level != BUCKET_LRU_NEEDS_GC ||
+	    ca->bucket_lru_needs_gc != 1) {
+		fprintf(stderr, "needs gc: bucket not parked\n");
+		ret = 1;
+		goto out;
+	}
+
+	ret = lru_check("needs gc: parked");
+	if (ret)
+		goto out;
+
+	/* gc found no pointers with old gens: */
+	ca->oldest_gens[3] = ca->buckets[3].mark.gen;
+	bch_dev_bucket_lru_resync(ca);
+
+	ret = lru_check("needs gc: after resync");
+	if (ret)
+		goto out;
+
+	g = lru_pop();
+	if (!g || g - ca->buckets != 3 || lru_pop()) {
+		fprintf(stderr, "needs gc: parked bucket not available after resync\n");
+		ret = 1;
+	}
+out:
+	lru_teardown();
+	return ret;
+}
+
+/* Mark changes move buckets between lists, or take them off: */
+static int test_mark_changes(void)
+{
+	size_t nbuckets = 64, b;
+	int ret = 0;
+
+	lru_setup(nbuckets);
+	bch_dev_bucket_lru_resync(ca);
+
+	for (b = 0; b < nbuckets && !ret; b++) {
+		set_mark(b, 0, 1U << (b % 12), false);
+		ret = lru_check("mark changes: cached");
+	}
+
+	for (b = 0; b < nbuckets && !ret; b += 3) {
+		set_mark(b, 16, 0, false);
+		ret = lru_check("mark changes: dirty");
+	}
+
+	for (b = 0; b < nbuckets && !ret; b += 3) {
+		set_mark(b, 0, 0, false);
+		ret = lru_check("mark changes: emptied");
+	}
+
+	lru_teardown();
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_pop_order() ||
+	    test_second_chance() ||
+	    test_needs_gc() ||
+	    test_mark_changes())
+		return EXIT_FAILURE;
+
+	printf("bucket_lru: ok\n");
+	return EXIT_SUCCESS;
+}
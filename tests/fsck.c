@@ -0,0 +1,566 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* fsck_run_jobs() is static to fs-gc.c: */
+#include "bcache-userspace-shim.c"
+
+/* Poll @cond for up to ten seconds; returns its final value: */
+#define wait_until(cond)						\
+({									\
+	unsigned _i;							\
+									\
+	for (_i = 0; _i < 10000 && !(cond); _i++)			\
+		usleep(1000);						\
+	(cond);								\
+})
+
+static int saved_stdout = -1;
+
+/* Send stdout - including output printed by other threads - to @path: */
+static void capture_start(const char *path)
+{
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+
+	if (fd < 0)
+		die("error creating %s: %s", path, strerror(errno));
+
+	fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+static char *capture_end(const char *path)
+{
+	char *buf;
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	buf = read_file_str(AT_FDCWD, path);
+	unlink(path);
+	return buf;
+}
+
+static char *tmp_path(const char *name)
+{
+	char *path = xmalloc(PATH_MAX);
+
+	snprintf(path, PATH_MAX, "/tmp/bcache-test-fsck.%u.%s",
+		 getpid(), name);
+	return path;
+}
+
+/* Jobs run in parallel, but their output comes out in job order: */
+
+#define ORDER_NR_JOBS		8
+
+static int order_job(struct fsck_job *job)
+{
+	/* finish in reverse order: */
+	usleep((ORDER_NR_JOBS - job->idx) * 5000);
+	printk("job %u\n", job->idx);
+	return 0;
+}
+
+static int test_output_order(void)
+{
+	struct fsck_job jobs[ORDER_NR_JOBS] = { 0 };
+	char *out = tmp_path("out"), expect[256] = "", *buf;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < ORDER_NR_JOBS; i++) {
+		jobs[i].fn = order_job;
+		sprintf(expect + strlen(expect), "job %u\n", i);
+	}
+
+	/* read_file_str() drops the last newline: */
+	expect[strlen(expect) - 1] = '\0';
+
+	capture_start(out);
+	ret = fsck_run_jobs(jobs, ORDER_NR_JOBS, 4);
+	buf = capture_end(out);
+
+	if (!ret && strcmp(buf, expect)) {
+		fprintf(stderr, "output order: got\n%s\nexpected\n%s\n",
+			buf, expect);
+		ret = 1;
+	}
+
+	free(buf);
+	free(out);
+	return ret;
+}
+
+/*
+ * When a job fails, the jobs after it - that a single threaded fsck would never
+ * have run - must stop before repairing anything, and their output is thrown
+ * away:
+ */
+
+#define HALT_NR_JOBS		8
+#define HALT_FAIL_JOB		2
+
+static atomic_t halt_later_running;
+static bool halt_ran[HALT_NR_JOBS];
+static bool halt_saw_halted[HALT_NR_JOBS];
+static bool halt_continued[HALT_NR_JOBS];
+
+static int halt_job(struct fsck_job *job)
+{
+	int ret = 0;
+
+	halt_ran[job->idx] = true;
+	printk("job %u\n", job->idx);
+
+	if (job->idx < HALT_FAIL_JOB)
+		return 0;
+
+	if (job->idx == HALT_FAIL_JOB) {
+		/* fail while a later job is running: */
+		wait_until(atomic_read(&halt_later_running));
+
+		mustfix_fsck_err(job->c, "job %u: error", job->idx);
+		return 0;
+	}
+
+	atomic_inc(&halt_later_running);
+
+	halt_saw_halted[job->idx] = wait_until(bch_fsck_halted());
+
+	(void) fsck_err_on(true, job->c, "job %u: error", job->idx);
+	halt_continued[job->idx] = true;
+fsck_err:
+	return ret;
+}
+
+static int test_halt(void)
+{
+	struct fsck_job jobs[HALT_NR_JOBS] = { 0 };
+	char *out = tmp_path("out"), *answers = tmp_path("answers"), *buf;
+	unsigned i, nr_ran = 0;
+	int ret;
+	FILE *f;
+
+	/* the failing job is asked if it should fix its error, and says no: */
+	f = fopen(answers, "w");
+	for (i = 0; i < HALT_NR_JOBS; i++)
+		fputs("n\n", f);
+	fclose(f);
+
+	if (!freopen(answers, "r", stdin))
+		die("error opening %s: %s", answers, strerror(errno));
+	unlink(answers);
+
+	for (i = 0; i < HALT_NR_JOBS; i++)
+		jobs[i].fn = halt_job;
+
+	fsck_err_opt = FSCK_ERR_ASK;
+
+	capture_start(out);
+	ret = fsck_run_jobs(jobs, HALT_NR_JOBS, 4);
+	buf = capture_end(out);
+
+	fsck_err_opt = FSCK_ERR_YES;
+
+	if (ret != BCH_FSCK_ERRORS_NOT_FIXED) {
+		fprintf(stderr, "halt: returned %i, expected %i\n",
+			ret, BCH_FSCK_ERRORS_NOT_FIXED);
+		ret = 1;
+		goto out;
+	}
+	ret = 0;
+
+	if (!atomic_read(&halt_later_running)) {
+		fprintf(stderr, "halt: no later job ran alongside the failing job\n");
+		ret = 1;
+	}
+
+	for (i = HALT_FAIL_JOB + 1; i < HALT_NR_JOBS; i++) {
+		char line[32];
+
+		if (!halt_ran[i])
+			continue;
+
+		nr_ran++;
+		sprintf(line, "job %u\n", i);
+
+		if (!halt_saw_halted[i] || halt_continued[i]) {
+			fprintf(stderr, "halt: job %u not halted\n", i);
+			ret = 1;
+		}
+
+		if (strstr(buf, line)) {
+			fprintf(stderr, "halt: job %u output not discarded\n", i);
+			ret = 1;
+		}
+	}
+
+	for (i = 0; i <= HALT_FAIL_JOB; i++) {
+		char line[32];
+
+		sprintf(line, "job %u\n", i);
+		if (!strstr(buf, line)) {
+			fprintf(stderr, "halt: job %u output missing\n", i);
+			ret = 1;
+		}
+	}
+
+	if (!nr_ran) {
+		fprintf(stderr, "halt: no jobs after the failing job ran\n");
+		ret = 1;
+	}
+out:
+	if (ret)
+		fprintf(stderr, "halt: output was\n%s\n", buf);
+	free(buf);
+	free(out);
+	return ret;
+}
+
+/*
+ * A real filesystem, with errors for each of the parallel passes to find in
+ * every part of each btree - fsck with four threads has to find and fix the
+ * same errors and print the same output as fsck with one thread:
+ */
+
+#define NR_DIRS			32
+#define NR_FILES		64
+
+/* Inode numbers past any the filesystem allocates: */
+#define MISSING_INUM(n)		((1ULL << 32) + (n))
+
+struct data_buf {
+	char			data[PAGE_SIZE] __aligned(PAGE_SIZE);
+	struct closure		cl;
+	struct bch_write_op	op;
+	struct bch_write_bio	bio;
+	struct bio_vec		bv;
+};
+
+static void write_data_block(struct cache_set *c, u64 inum, u64 offset)
+{
+	static struct data_buf b;
+	struct disk_reservation res;
+	int ret;
+
+	memset(b.data, inum, sizeof(b.data));
+
+	closure_init_stack(&b.cl);
+
+	bio_init(&b.bio.bio);
+	b.bio.bio.bi_max_vecs	= 1;
+	b.bio.bio.bi_io_vec	= &b.bv;
+	b.bio.bio.bi_iter.bi_size = PAGE_SIZE;
+	bch_bio_map(&b.bio.bio, b.data);
+
+	ret = bch_disk_reservation_get(c, &res, PAGE_SECTORS, 0);
+	if (ret)
+		die("error reserving space: %s", strerror(-ret));
+
+	bch_write_op_init(&b.op, c, &b.bio, res, c->write_points,
+			  POS(inum, offset), NULL, 0);
+	closure_call(&b.op.cl, bch_write, NULL, &b.cl);
+	closure_sync(&b.cl);
+}
+
+static void update_inode(struct cache_set *c, struct bch_inode_unpacked *inode)
+{
+	struct bkey_inode_buf packed;
+	int ret;
+
+	bch_inode_pack(&packed, inode);
+	ret = bch_btree_update(c, BTREE_ID_INODES, &packed.inode.k_i, NULL);
+	if (ret)
+		die("error updating inode: %s", strerror(-ret));
+}
+
+static void create_dirent(struct cache_set *c,
+			  struct bch_inode_unpacked *parent,
+			  const char *name, u64 inum, u8 type)
+{
+	struct bch_hash_info parent_hash_info = bch_hash_info_init(parent);
+	struct qstr qname = { { { .len = strlen(name), } }, .name = name };
+	int ret;
+
+	ret = bch_dirent_create(c, parent->inum, &parent_hash_info,
+				type, &qname, inum, NULL,
+				BCH_HASH_SET_MUST_CREATE);
+	if (ret)
+		die("error creating dirent: %s", strerror(-ret));
+
+	if (type == DT_DIR)
+		parent->i_nlink++;
+}
+
+static struct bch_inode_unpacked create_inode(struct cache_set *c,
+					      mode_t mode)
+{
+	struct bch_inode_unpacked inode;
+	struct bkey_inode_buf packed;
+	int ret;
+
+	bch_inode_init(c, &inode, 0, 0, mode, 0);
+	bch_inode_pack(&packed, &inode);
+
+	ret = bch_inode_create(c, &packed.inode.k_i, BLOCKDEV_INODE_MAX, 0,
+			       &c->unused_inode_hint);
+	if (ret)
+		die("error creating inode: %s", strerror(-ret));
+
+	inode.inum = packed.inode.k.p.inode;
+	return inode;
+}
+
+static struct bch_inode_unpacked create_file(struct cache_set *c,
+					     struct bch_inode_unpacked *parent,
+					     const char *name, mode_t mode)
+{
+	struct bch_inode_unpacked inode = create_inode(c, mode);
+
+	create_dirent(c, parent, name, inode.inum, mode_to_type(mode));
+	return inode;
+}
+
+static void set_xattr(struct cache_set *c, u64 inum,
+		      const struct bch_hash_info *hash_info)
+{
+	int ret = __bch_xattr_set(c, inum, hash_info, "test", "value", 5,
+				  0, BCH_XATTR_INDEX_USER, NULL);
+	if (ret)
+		die("error setting xattr: %s", strerror(-ret));
+}
+
+static void populate(struct cache_set *c)
+{
+	struct bch_inode_unpacked root, dir, file;
+	struct bch_hash_info hash_info;
+	char name[64];
+	unsigned d, f;
+	int ret;
+
+	ret = bch_inode_find_by_inum(c, BCACHE_ROOT_INO, &root);
+	if (ret)
+		die("error looking up root directory: %s", strerror(-ret));
+
+	for (d = 0; d < NR_DIRS; d++) {
+		bool bad = !(d % 4);
+
+		sprintf(name, "dir-%u", d);
+		dir = create_file(c, &root, name, S_IFDIR|0755);
+		hash_info = bch_hash_info_init(&dir);
+
+		for (f = 0; f < NR_FILES; f++) {
+			sprintf(name, "a-file-with-a-fairly-long-name-%u", f);
+			file = create_file(c, &dir, name, S_IFREG|0644);
+
+			write_data_block(c, file.inum, 0);
+			file.i_size	= PAGE_SIZE;
+			file.i_sectors	= PAGE_SECTORS;
+
+			/* i_sectors wrong: */
+			if (bad && f == d % NR_FILES)
+				file.i_sectors++;
+
+			update_inode(c, &file);
+			set_xattr(c, file.inum, &hash_info);
+		}
+
+		if (!bad)
+			goto update_dir;
+
+		/* dirent points to missing inode: */
+		create_dirent(c, &dir, "missing", MISSING_INUM(d), DT_REG);
+
+		/* dirent points to own directory: */
+		create_dirent(c, &dir, "self", dir.inum, DT_REG);
+
+		/* incorrect d_type: */
+		file = create_inode(c, S_IFREG|0644);
+		create_dirent(c, &dir, "wrong-type", file.inum, DT_LNK);
+
+		/* extent and xattr for missing inode: */
+		write_data_block(c, MISSING_INUM(d), 0);
+		set_xattr(c, MISSING_INUM(d), &hash_info);
+update_dir:
+		update_inode(c, &dir);
+	}
+
+	update_inode(c, &root);
+}
+
+static void copy_image(const char *src, const char *dst)
+{
+	int in = xopen(src, O_RDONLY);
+	int out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	static char buf[1 << 20];
+	ssize_t r;
+
+	if (out < 0)
+		die("error creating %s: %s", dst, strerror(errno));
+
+	while ((r = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, r) != r)
+			die("error writing %s: %s", dst, strerror(errno));
+	if (r < 0)
+		die("error reading %s: %s", src, strerror(errno));
+
+	close(out);
+	close(in);
+}
+
+static const char *fs_open(char *path, unsigned nr_threads,
+			   struct cache_set **c)
+{
+	struct bch_opts opts = bch_opts_empty();
+
+	opts.buffered_io	= true;
+	opts.fsck_threads	= nr_threads;
+
+	return bch_fs_open(&path, 1, opts, c);
+}
+
+/*
+ * Open, and so fsck, @img - returns fsck's output, less the journal replay
+ * line: the seq it prints depends on when background journal writes happen:
+ */
+static char *fsck(char *img, unsigned nr_threads)
+{
+	char *out = tmp_path("out"), *buf, *replay, *eol;
+	struct cache_set *c;
+	const char *err;
+
+	capture_start(out);
+	err = fs_open(img, nr_threads, &c);
+	if (!err)
+		bch_fs_stop(c);
+	buf = capture_end(out);
+
+	if (err)
+		die("error opening %s: %s\n%s", img, err, buf);
+
+	replay = strstr(buf, "journal replay done");
+	if (replay) {
+		eol = strchrnul(replay, '\n');
+		if (*eol)
+			eol++;
+		memmove(replay, eol, strlen(eol) + 1);
+	}
+
+	free(out);
+	return buf;
+}
+
+static int test_fsck_threads(void)
+{
+	static const char * const errors[] = {
+		"dirent points to missing inode",
+		"dirent points to own directory",
+		"incorrect d_type",
+		"extent type 128 for missing inode",
+		"xattr for missing inode",
+		"i_sectors wrong",
+	};
+	static const enum btree_id ids[] = {
+		BTREE_ID_EXTENTS,
+		BTREE_ID_INODES,
+		BTREE_ID_DIRENTS,
+		BTREE_ID_XATTRS,
+	};
+	struct format_opts format_opts = format_opts_default();
+	struct dev_opts dev = { 0 };
+	char *img = tmp_path("img"), *img1 = tmp_path("img1"),
+	     *img4 = tmp_path("img4"), *out = tmp_path("out");
+	char *out1 = NULL, *out4 = NULL, *again = NULL;
+	struct cache_set *c;
+	const char *err;
+	unsigned i;
+	int ret = 0;
+
+	format_opts.block_size		= PAGE_SECTORS;
+	/* small btree nodes, so that each btree is split between jobs: */
+	format_opts.btree_node_size	= 2 * PAGE_SECTORS;
+
+	dev.path	= img;
+	dev.size	= (64 << 20) >> 9;
+	dev.fd		= open(img, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (dev.fd < 0 || ftruncate(dev.fd, dev.size << 9))
+		die("error creating %s: %s", img, strerror(errno));
+
+	free(bcache_format(format_opts, &dev, 1));
+
+	capture_start(out);
+	err = fs_open(img, 1, &c);
+	if (!err)
+		populate(c);
+	free(capture_end(out));
+
+	if (err)
+		die("error opening %s: %s", img, err);
+
+	for (i = 0; i < ARRAY_SIZE(ids); i++)
+		if (!c->btree_roots[ids[i]].b->level) {
+			fprintf(stderr, "fsck threads: btree %u not split\n",
+				ids[i]);
+			ret = 1;
+		}
+
+	bch_fs_stop(c);
+
+	if (ret)
+		goto out;
+
+	copy_image(img, img1);
+	copy_image(img, img4);
+
+	out1 = fsck(img1, 1);
+	out4 = fsck(img4, 4);
+
+	for (i = 0; i < ARRAY_SIZE(errors); i++)
+		if (!strstr(out1, errors[i])) {
+			fprintf(stderr, "fsck threads: error \"%s\" not found:\n%s\n",
+				errors[i], out1);
+			ret = 1;
+		}
+
+	if (strcmp(out1, out4)) {
+		fprintf(stderr, "fsck threads: output differs - one thread:\n%s\n"
+			"four threads:\n%s\n", out1, out4);
+		ret = 1;
+	}
+
+	/* everything that can be fixed was: */
+	again = fsck(img4, 4);
+	if (strstr(again, "fixing")) {
+		fprintf(stderr, "fsck threads: errors not fixed:\n%s\n", again);
+		ret = 1;
+	}
+out:
+	unlink(img);
+	unlink(img1);
+	unlink(img4);
+	free(again);
+	free(out4);
+	free(out1);
+	free(out);
+	free(img4);
+	free(img1);
+	free(img);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_output_order() ||
+	    test_halt() ||
+	    test_fsck_threads())
+		return EXIT_FAILURE;
+
+	printf("fsck: ok\n");
+	return EXIT_SUCCESS;
+}
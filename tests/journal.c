@@ -0,0 +1,680 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache-userspace-shim.c"
+
+#define NR_DEVS		2
+
+static int saved_stdout = -1;
+
+/* Send stdout - including output printed by other threads - to @path: */
+static void capture_start(const char *path)
+{
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+
+	if (fd < 0)
+		die("error creating %s: %s", path, strerror(errno));
+
+	fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+static char *capture_end(const char *path)
+{
+	char *buf;
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	buf = read_file_str(AT_FDCWD, path);
+	unlink(path);
+	return buf;
+}
+
+static char *tmp_path(const char *name)
+{
+	char *path = xmalloc(PATH_MAX);
+
+	snprintf(path, PATH_MAX, "/tmp/bcache-test-journal.%u.%s",
+		 getpid(), name);
+	return path;
+}
+
+static const char *fs_open(char **devs, bool nostart, unsigned nr_threads,
+			   struct cache_set **c)
+{
+	struct bch_opts opts = bch_opts_empty();
+
+	opts.buffered_io	= true;
+	opts.nostart		= nostart;
+	opts.fsck_threads	= nr_threads;
+
+	return bch_fs_open(devs, NR_DEVS, opts, c);
+}
+
+static void format(char **devs, bool encrypted, bool journal_gens)
+{
+	struct format_opts format_opts = format_opts_default();
+	struct dev_opts dev[NR_DEVS] = { { 0 } };
+	unsigned i;
+
+	format_opts.block_size	= PAGE_SECTORS;
+	format_opts.encrypted	= encrypted;
+	format_opts.journal_gens = journal_gens;
+	/* every journal entry is written to both devices: */
+	format_opts.meta_replicas = NR_DEVS;
+
+	for (i = 0; i < NR_DEVS; i++) {
+		dev[i].path	= devs[i];
+		dev[i].size	= (32 << 20) >> 9;
+		/* small buckets, so the journal is spread over many of them: */
+		dev[i].bucket_size = 16 << 1;
+		dev[i].fd	= open(devs[i], O_RDWR|O_CREAT|O_TRUNC, 0600);
+		if (dev[i].fd < 0 || ftruncate(dev[i].fd, dev[i].size << 9))
+			die("error creating %s: %s", devs[i], strerror(errno));
+	}
+
+	free(bcache_format(format_opts, dev, NR_DEVS));
+}
+
+/* Byte offset of the first entry in the oldest journal bucket on @ca: */
+static off_t oldest_journal_entry(struct cache *ca)
+{
+	struct journal_device *ja = &ca->journal;
+	unsigned i, b = ja->nr;
+
+	for (i = 0; i < ja->nr; i++)
+		if (ja->bucket_seq[i] &&
+		    (b == ja->nr || ja->bucket_seq[i] < ja->bucket_seq[b]))
+			b = i;
+
+	if (b == ja->nr)
+		die("no journal entries on device %u", ca->dev_idx);
+
+	return bucket_to_sector(ca, ja->buckets[b]) << 9;
+}
+
+static void corrupt(const char *dev, off_t offset)
+{
+	int fd = xopen(dev, O_RDWR);
+	u8 v;
+
+	if (pread(fd, &v, 1, offset) != 1)
+		die("error reading %s: %s", dev, strerror(errno));
+	v ^= 0xff;
+	if (pwrite(fd, &v, 1, offset) != 1)
+		die("error writing %s: %s", dev, strerror(errno));
+	close(fd);
+}
+
+/* Read the journal, with the filesystem opened but not started: */
+static char *journal_read(char **devs, unsigned nr_threads,
+			  struct list_head *list)
+{
+	char *out = tmp_path("out"), *buf;
+	struct cache_set *c;
+	const char *err;
+	int ret;
+
+	capture_start(out);
+	err = fs_open(devs, true, nr_threads, &c);
+	ret = err ? 0 : bch_journal_read(c, list);
+	if (!err)
+		bch_fs_stop(c);
+	buf = capture_end(out);
+
+	if (err || ret)
+		die("error reading journal: %s %i\n%s", err ?: "", ret, buf);
+
+	free(out);
+	return buf;
+}
+
+static int journal_list_cmp(struct list_head *l, struct list_head *r)
+{
+	struct journal_replay *i, *j;
+
+	j = list_first_entry(r, struct journal_replay, list);
+
+	list_for_each_entry(i, l, list) {
+		if (&j->list == r ||
+		    vstruct_bytes(&i->j) != vstruct_bytes(&j->j) ||
+		    memcmp(&i->j, &j->j, vstruct_bytes(&i->j)))
+			return 1;
+
+		j = list_next_entry(j, list);
+	}
+
+	return &j->list != r;
+}
+
+/*
+ * Buckets are processed in whatever order their reads finish, on any number of
+ * devices - but the entries we end up with, the errors reported and the order
+ * they're reported in should be the same as reading one bucket at a time:
+ */
+static int test_read(bool encrypted)
+{
+	char *devs[NR_DEVS], name[16], *out = tmp_path("out");
+	char *out1 = NULL, *out4 = NULL;
+	LIST_HEAD(list1);
+	LIST_HEAD(list4);
+	struct journal_replay *i;
+	struct cache_set *c;
+	struct cache *ca;
+	const char *err;
+	off_t bad[NR_DEVS];
+	unsigned n, iter;
+	u64 seq = 0;
+	int ret = 0;
+
+	for (n = 0; n < NR_DEVS; n++) {
+		snprintf(name, sizeof(name), "dev%u", n);
+		devs[n] = tmp_path(name);
+	}
+
+	format(devs, encrypted, false);
+
+	capture_start(out);
+	err = fs_open(devs, false, 1, &c);
+	if (err)
+		die("error opening filesystem: %s\n%s", err, capture_end(out));
+
+	/* enough entries to fill some of the journal on both devices: */
+	for (n = 0; n < 1000; n++)
+		bch_journal_meta(&c->journal);
+
+	for_each_cache(ca, c, iter)
+		bad[ca->dev_idx] = oldest_journal_entry(ca);
+
+	bch_fs_stop(c);
+	free(capture_end(out));
+
+	/* a bad checksum on one device, and a bad size on the other: */
+	corrupt(devs[0], bad[0] + sizeof(struct jset) + 8);
+	corrupt(devs[1], bad[1] + offsetof(struct jset, u64s) + 1);
+
+	out1 = journal_read(devs, 1, &list1);
+	out4 = journal_read(devs, 4, &list4);
+
+	if (!strstr(out1, "journal checksum bad") ||
+	    !strstr(out1, "journal entry too big")) {
+		fprintf(stderr, "read: errors not reported:\n%s\n", out1);
+		ret = 1;
+	}
+
+	if (strcmp(out1, out4)) {
+		fprintf(stderr, "read: output differs - in order:\n%s\n"
+			"as reads complete:\n%s\n", out1, out4);
+		ret = 1;
+	}
+
+	list_for_each_entry(i, &list1, list) {
+		if (le64_to_cpu(i->j.seq) <= seq) {
+			fprintf(stderr, "read: entries out of order (%llu after %llu)\n",
+				le64_to_cpu(i->j.seq), seq);
+			ret = 1;
+		}
+		seq = le64_to_cpu(i->j.seq);
+	}
+
+	if (list_empty(&list1) || journal_list_cmp(&list1, &list4)) {
+		fprintf(stderr, "read: journal entries differ\n");
+		ret = 1;
+	}
+
+	bch_journal_entries_free(&list4);
+	bch_journal_entries_free(&list1);
+	free(out4);
+	free(out1);
+	for (n = 0; n < NR_DEVS; n++) {
+		unlink(devs[n]);
+		free(devs[n]);
+	}
+	free(out);
+	return ret;
+}
+
+static void copy_file(const char *src, const char *dst)
+{
+	int in = xopen(src, O_RDONLY);
+	int out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	char buf[1 << 16];
+	ssize_t ret;
+
+	if (out < 0)
+		die("error creating %s: %s", dst, strerror(errno));
+
+	while ((ret = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, ret) != ret)
+			die("error writing %s: %s", dst, strerror(errno));
+	if (ret < 0)
+		die("error reading %s: %s", src, strerror(errno));
+
+	close(out);
+	close(in);
+}
+
+/*
+ * What the allocator thread does when it runs out of free buckets: refill
+ * free_inc with newly invalidated buckets, and make their gens persistent -
+ * returns the number of prio sets that were rewritten:
+ */
+static unsigned invalidate_cycle(struct cache *ca)
+{
+	struct cache_set *c = ca->set;
+	u64 old[16];
+	unsigned i, nr = 0;
+	long bucket;
+
+	BUG_ON(prio_buckets(ca) > ARRAY_SIZE(old));
+	memcpy(old, ca->prio_buckets, sizeof(old[0]) * prio_buckets(ca));
+
+	/* Refill the freelists - writing the prios uses RESERVE_PRIO: */
+	while (!fifo_empty(&ca->free_inc) &&
+	       bch_allocator_push(ca, fifo_peek(&ca->free_inc)))
+		;
+
+	spin_lock(&ca->freelist_lock);
+	while (fifo_pop(&ca->free_inc, bucket))
+		bch_mark_free_bucket(ca, ca->buckets + bucket);
+	spin_unlock(&ca->freelist_lock);
+
+	down_read(&c->gc_lock);
+	while (!fifo_full(&ca->free_inc))
+		invalidate_buckets(ca);
+	up_read(&c->gc_lock);
+
+	if (bch_prio_journal_gens(ca))
+		die("error writing gens");
+
+	for (i = 0; i < prio_buckets(ca); i++)
+		nr += ca->prio_buckets[i] != old[i];
+	return nr;
+}
+
+/*
+ * With BCH_FEATURE_JOURNAL_GENS, the gens of invalidated buckets are journalled
+ * instead of rewriting the prios each time - after a crash, the gens we read
+ * back must be the ones we'd made persistent:
+ */
+static int test_gens(bool journal_gens)
+{
+	char *devs[NR_DEVS], *crash[NR_DEVS], name[16], *out = tmp_path("out");
+	struct bch_opts opts = bch_opts_empty();
+	struct cache_set *c;
+	struct cache *ca;
+	const char *err;
+	u8 *gens[NR_DEVS];
+	unsigned n, iter, cycles = 20, nr_sets = 0;
+	size_t b;
+	int ret = 0;
+
+	for (n = 0; n < NR_DEVS; n++) {
+		snprintf(name, sizeof(name), "dev%u", n);
+		devs[n] = tmp_path(name);
+		snprintf(name, sizeof(name), "crash%u", n);
+		crash[n] = tmp_path(name);
+	}
+
+	format(devs, false, journal_gens);
+
+	capture_start(out);
+	err = fs_open(devs, false, 1, &c);
+	if (err)
+		die("error opening filesystem: %s\n%s", err, capture_end(out));
+
+	/* We'll do the allocator's work ourselves: */
+	for_each_cache(ca, c, iter) {
+		kthread_stop(ca->alloc_thread);
+		put_task_struct(ca->alloc_thread);
+		ca->alloc_thread = NULL;
+	}
+
+	for (n = 0; n < cycles; n++)
+		for_each_cache(ca, c, iter)
+			nr_sets += invalidate_cycle(ca);
+
+	for_each_cache(ca, c, iter) {
+		gens[ca->dev_idx] = xmalloc(ca->mi.nbuckets);
+		for (b = 0; b < ca->mi.nbuckets; b++)
+			gens[ca->dev_idx][b] = ca->buckets[b].mark.gen;
+	}
+
+	/* Crash, without writing the prios out: */
+	for (n = 0; n < NR_DEVS; n++)
+		copy_file(devs[n], crash[n]);
+
+	bch_fs_stop(c);
+	free(capture_end(out));
+
+	/*
+	 * Without journalled gens every cycle rewrites at least one prio set -
+	 * with them, the prios are only rewritten when the journal fills up:
+	 */
+	if (journal_gens
+	    ? nr_sets >= cycles
+	    : nr_sets < cycles * NR_DEVS) {
+		fprintf(stderr, "gens: %u prio sets written in %u cycles\n",
+			nr_sets, cycles);
+		ret = 1;
+	}
+
+	/* Read the gens back, without the allocator changing them: */
+	opts.buffered_io	= true;
+	opts.read_only		= true;
+	opts.noreplay		= true;
+
+	capture_start(out);
+	err = bch_fs_open(crash, NR_DEVS, opts, &c);
+	if (err)
+		die("error opening filesystem: %s\n%s", err, capture_end(out));
+
+	for_each_cache(ca, c, iter)
+		for (b = 0; b < ca->mi.nbuckets; b++)
+			if (ca->buckets[b].mark.gen != gens[ca->dev_idx][b]) {
+				fprintf(stderr, "gens: dev %u bucket %zu gen %u, should be %u\n",
+					ca->dev_idx, b, ca->buckets[b].mark.gen,
+					gens[ca->dev_idx][b]);
+				ret = 1;
+				break;
+			}
+
+	bch_fs_stop(c);
+	free(capture_end(out));
+
+	for (n = 0; n < NR_DEVS; n++) {
+		unlink(crash[n]);
+		unlink(devs[n]);
+		free(gens[n]);
+		free(crash[n]);
+		free(devs[n]);
+	}
+	free(out);
+	return ret;
+}
+
+#define REPLAY_INUM		4096
+#define REPLAY_MAX_PAGES	8
+
+struct data_buf {
+	u8			data[REPLAY_MAX_PAGES * PAGE_SIZE] __aligned(PAGE_SIZE);
+	struct closure		cl;
+	struct bch_write_op	op;
+	struct bch_write_bio	bio;
+	struct bio_vec		bv[REPLAY_MAX_PAGES];
+};
+
+static void write_data(struct cache_set *c, u64 inum, u64 offset,
+		       unsigned pages, u8 v)
+{
+	static struct data_buf b;
+	struct disk_reservation res;
+	int ret;
+
+	memset(b.data, v, sizeof(b.data));
+
+	closure_init_stack(&b.cl);
+
+	bio_init(&b.bio.bio);
+	b.bio.bio.bi_max_vecs	= REPLAY_MAX_PAGES;
+	b.bio.bio.bi_io_vec	= b.bv;
+	b.bio.bio.bi_iter.bi_size = pages * PAGE_SIZE;
+	bch_bio_map(&b.bio.bio, b.data);
+
+	ret = bch_disk_reservation_get(c, &res, pages * PAGE_SECTORS, 0);
+	if (ret)
+		die("error reserving space: %s", strerror(-ret));
+
+	bch_write_op_init(&b.op, c, &b.bio, res, c->write_points,
+			  POS(inum, offset * PAGE_SECTORS), NULL, 0);
+	closure_call(&b.op.cl, bch_write, NULL, &b.cl);
+	closure_sync(&b.cl);
+}
+
+static void update_inode(struct cache_set *c, u64 inum, u64 size)
+{
+	struct bch_inode_unpacked inode;
+	struct bkey_inode_buf packed;
+	int ret;
+
+	bch_inode_init(c, &inode, 0, 0, S_IFREG|0644, 0);
+	inode.inum	= inum;
+	inode.i_size	= size;
+
+	bch_inode_pack(&packed, &inode);
+	packed.inode.k.p.inode = inum;
+
+	ret = bch_btree_insert(c, BTREE_ID_INODES, &packed.inode.k_i,
+			       NULL, NULL, NULL, 0);
+	if (ret)
+		die("error updating inode: %s", strerror(-ret));
+}
+
+static void set_xattr(struct cache_set *c, u64 inum, unsigned v)
+{
+	struct bch_inode_unpacked inode;
+	struct bch_hash_info hash_info;
+	char value[16];
+	int ret;
+
+	bch_inode_init(c, &inode, 0, 0, S_IFREG|0644, 0);
+	hash_info = bch_hash_info_init(&inode);
+
+	snprintf(value, sizeof(value), "value-%u", v);
+	ret = __bch_xattr_set(c, inum, &hash_info, "test", value,
+			      strlen(value), 0, BCH_XATTR_INDEX_USER, NULL);
+	if (ret)
+		die("error setting xattr: %s", strerror(-ret));
+}
+
+/* Every key in the btrees, and the sectors in every data bucket, as text: */
+static char *fs_contents(struct cache_set *c)
+{
+	static const enum btree_id ids[] = {
+		BTREE_ID_EXTENTS,
+		BTREE_ID_INODES,
+		BTREE_ID_XATTRS,
+	};
+	size_t size = 1 << 20, used = 0;
+	char *buf = xmalloc(size), line[512];
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct cache *ca;
+	struct bucket_mark m;
+	unsigned i, iter_dev;
+	size_t b;
+
+	buf[0] = '\0';
+
+#define append(...)							\
+	do {								\
+		snprintf(line, sizeof(line), __VA_ARGS__);		\
+		if (used + strlen(line) + 1 > size)			\
+			buf = realloc(buf, size *= 2);			\
+		strcpy(buf + used, line);				\
+		used += strlen(line);					\
+	} while (0)
+
+	for (i = 0; i < ARRAY_SIZE(ids); i++) {
+		for_each_btree_key(&iter, c, ids[i], POS_MIN, k) {
+			char t[400];
+
+			bch_bkey_val_to_text(c, bkey_type(0, ids[i]),
+					     t, sizeof(t), k);
+			append("%s: %s\n", bch_btree_ids[ids[i]], t);
+		}
+		bch_btree_iter_unlock(&iter);
+	}
+
+	for_each_cache(ca, c, iter_dev)
+		for (b = ca->mi.first_bucket; b < ca->mi.nbuckets; b++) {
+			m = READ_ONCE(ca->buckets[b].mark);
+
+			if (m.data_type == BUCKET_DATA &&
+			    (m.dirty_sectors || m.cached_sectors))
+				append("dev %u bucket %zu: dirty %u cached %u\n",
+				       ca->dev_idx, b,
+				       m.dirty_sectors, m.cached_sectors);
+		}
+#undef append
+
+	return buf;
+}
+
+/*
+ * Replay inserts each btree's keys in sorted batches, and skips extents that a
+ * later key overwrites entirely - the result should be the same as inserting
+ * every key in journal order, which is what the filesystem did before we
+ * crashed it:
+ */
+static int test_replay(void)
+{
+	char *devs[NR_DEVS], *crash[NR_DEVS], name[16], *out = tmp_path("out");
+	char *before, *after;
+	struct bch_opts opts = bch_opts_empty();
+	struct cache_set *c;
+	const char *err;
+	unsigned n, i;
+	int ret = 0;
+
+	for (n = 0; n < NR_DEVS; n++) {
+		snprintf(name, sizeof(name), "dev%u", n);
+		devs[n] = tmp_path(name);
+		snprintf(name, sizeof(name), "crash%u", n);
+		crash[n] = tmp_path(name);
+	}
+
+	format(devs, false, false);
+
+	capture_start(out);
+	err = fs_open(devs, false, 1, &c);
+	if (err)
+		die("error opening filesystem: %s\n%s", err, capture_end(out));
+
+	for (i = 0; i < 200; i++) {
+		u64 inum = REPLAY_INUM + i % 3;
+
+		/* overlapping extents, some entirely overwritten: */
+		write_data(c, inum, (i * 5) % 24,
+			   1 + (i * 7) % REPLAY_MAX_PAGES, i);
+
+		/* the same keys, over and over: */
+		update_inode(c, inum, i * PAGE_SIZE);
+		set_xattr(c, inum, i);
+	}
+
+	if (bch_journal_flush(&c->journal))
+		die("error flushing journal");
+
+	before = fs_contents(c);
+
+	/* Crash: */
+	for (n = 0; n < NR_DEVS; n++)
+		copy_file(devs[n], crash[n]);
+
+	bch_fs_stop(c);
+	free(capture_end(out));
+
+	opts.buffered_io	= true;
+	opts.read_only		= true;
+	opts.norecovery		= true;
+
+	capture_start(out);
+	err = bch_fs_open(crash, NR_DEVS, opts, &c);
+	if (err)
+		die("error opening filesystem: %s\n%s", err, capture_end(out));
+
+	after = fs_contents(c);
+
+	bch_fs_stop(c);
+	free(capture_end(out));
+
+	if (!strstr(before, "extents: ") ||
+	    !strstr(before, "inodes: ") ||
+	    !strstr(before, "xattrs: ")) {
+		fprintf(stderr, "replay: keys missing before crash:\n%s\n",
+			before);
+		ret = 1;
+	}
+
+	if (strcmp(before, after)) {
+		fprintf(stderr, "replay: contents differ - before crash:\n%s\n"
+			"after replay:\n%s\n", before, after);
+		ret = 1;
+	}
+
+	free(after);
+	free(before);
+	for (n = 0; n < NR_DEVS; n++) {
+		unlink(crash[n]);
+		unlink(devs[n]);
+		free(crash[n]);
+		free(devs[n]);
+	}
+	free(out);
+	return ret;
+}
+
+/* Filesystems with features we don't know about must be refused: */
+static int test_unknown_feature(void)
+{
+	char *devs[NR_DEVS], name[16];
+	struct bcache_superblock sb;
+	const char *err;
+	unsigned n;
+	int ret = 0;
+
+	for (n = 0; n < NR_DEVS; n++) {
+		snprintf(name, sizeof(name), "dev%u", n);
+		devs[n] = tmp_path(name);
+	}
+
+	format(devs, false, true);
+
+	err = bch_read_super(&sb, bch_opts_empty(), devs[0]);
+	if (err)
+		die("error reading superblock: %s", err);
+
+	err = bch_validate_cache_super(&sb);
+	if (err) {
+		fprintf(stderr, "features: %s\n", err);
+		ret = 1;
+	}
+
+	sb.sb->features[0] |= cpu_to_le64(1ULL << BCH_FEATURE_NR);
+	if (!bch_validate_cache_super(&sb)) {
+		fprintf(stderr, "features: unknown feature accepted\n");
+		ret = 1;
+	}
+
+	bch_free_super(&sb);
+
+	for (n = 0; n < NR_DEVS; n++) {
+		unlink(devs[n]);
+		free(devs[n]);
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	fsck_err_opt = FSCK_ERR_YES;
+
+	if (test_read(false) ||
+	    test_read(true) ||
+	    test_replay() ||
+	    test_gens(false) ||
+	    test_gens(true) ||
+	    test_unknown_feature())
+		return EXIT_FAILURE;
+
+	printf("journal: ok\n");
+	return EXIT_SUCCESS;
+}
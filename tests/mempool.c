@@ -0,0 +1,352 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/mempool.h>
+#include <linux/sched.h>
+
+#define NR_THREADS	8
+#define NR_ITERS	100000
+#define RESERVE		16
+#define NR_HELD		RESERVE
+
+/*
+ * Elements know who has them, so an element handed out twice - or freed by
+ * someone who doesn't have it - is caught:
+ */
+struct element {
+	unsigned long		owner;
+	unsigned long		pad[7];
+};
+
+static atomic_t nr_live;		/* allocated and not yet freed */
+static unsigned fail_one_in;		/* 1 fails every allocation */
+
+static unsigned long rand_next(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+	return *seed >> 33;
+}
+
+static __thread unsigned long alloc_seed = 1;
+
+static void *test_alloc(gfp_t gfp, void *pool_data)
+{
+	unsigned n = READ_ONCE(fail_one_in);
+	struct element *e;
+
+	if (n && !(rand_next(&alloc_seed) % n))
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	if (e)
+		atomic_inc(&nr_live);
+	return e;
+}
+
+static void test_free(void *p, void *pool_data)
+{
+	free(p);
+	atomic_dec(&nr_live);
+}
+
+static int take(struct element *e, unsigned long owner)
+{
+	if (!__sync_bool_compare_and_swap(&e->owner, 0, owner)) {
+		fprintf(stderr, "mempool: element %p handed out to %lu, already had by %lu\n",
+			e, owner, e->owner);
+		return 1;
+	}
+	return 0;
+}
+
+static int give_back(struct element *e, unsigned long owner)
+{
+	if (!__sync_bool_compare_and_swap(&e->owner, owner, 0)) {
+		fprintf(stderr, "mempool: element %p freed by %lu, but had by %lu\n",
+			e, owner, e->owner);
+		return 1;
+	}
+	return 0;
+}
+
+static int pool_check(mempool_t *pool, const char *when)
+{
+	int ret = 0;
+
+	mempool_exit(pool);
+
+	if (atomic_read(&nr_live)) {
+		fprintf(stderr, "mempool: %s: %i elements leaked\n",
+			when, atomic_read(&nr_live));
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * With the allocator failing, the reserve hands out exactly min_nr elements,
+ * and elements that are freed go back to the reserve before anywhere else:
+ */
+static int test_reserve(void)
+{
+	struct element *e[RESERVE + 1];
+	mempool_t pool;
+	unsigned i, round;
+	int ret = 0;
+
+	if (__mempool_init(&pool, RESERVE, test_alloc, test_free, NULL,
+			   sizeof(struct element)))
+		return 1;
+
+	if (atomic_read(&nr_live) != RESERVE) {
+		fprintf(stderr, "mempool: reserve: %i preallocated, should be %u\n",
+			atomic_read(&nr_live), RESERVE);
+		ret = 1;
+		goto out;
+	}
+
+	fail_one_in = 1;
+
+	for (round = 0; round < 3 && !ret; round++) {
+		for (i = 0; i < RESERVE; i++) {
+			e[i] = mempool_alloc(&pool, GFP_NOWAIT);
+			if (!e[i]) {
+				fprintf(stderr, "mempool: reserve: round %u: only %u elements\n",
+					round, i);
+				ret = 1;
+				goto out;
+			}
+			ret |= take(e[i], 1);
+		}
+
+		/* exhausted: */
+		e[RESERVE] = mempool_alloc(&pool, GFP_NOWAIT);
+		if (e[RESERVE]) {
+			fprintf(stderr, "mempool: reserve: round %u: allocated past the reserve\n",
+				round);
+			ret = 1;
+		}
+
+		/* refilled: */
+		for (i = 0; i < RESERVE; i++) {
+			ret |= give_back(e[i], 1);
+			mempool_free(e[i], &pool);
+		}
+	}
+
+	if (atomic64_read(&pool.stats.reserve) != RESERVE * 3) {
+		fprintf(stderr, "mempool: reserve: used %llu times, should be %u\n",
+			(u64) atomic64_read(&pool.stats.reserve), RESERVE * 3);
+		ret = 1;
+	}
+out:
+	fail_one_in = 0;
+	return pool_check(&pool, "reserve") || ret;
+}
+
+struct waiter {
+	mempool_t		*pool;
+	struct element		*e;
+};
+
+static int waiter_fn(void *p)
+{
+	struct waiter *w = p;
+
+	w->e = mempool_alloc(w->pool, GFP_KERNEL);
+	return 0;
+}
+
+static struct task_struct *thread_start(int (*fn)(void *), void *arg)
+{
+	struct task_struct *p = kthread_create(fn, arg, "mempool_test");
+
+	BUG_ON(IS_ERR(p));
+	get_task_struct(p);
+	wake_up_process(p);
+	return p;
+}
+
+static void thread_join(struct task_struct *p)
+{
+	kthread_stop(p);
+	put_task_struct(p);
+}
+
+/* A blocking allocation with the reserve empty waits for an element to be freed: */
+static int test_wait(void)
+{
+	struct element *e[RESERVE];
+	struct waiter w;
+	mempool_t pool;
+	struct task_struct *thread;
+	unsigned i;
+	int ret = 0;
+
+	if (__mempool_init(&pool, RESERVE, test_alloc, test_free, NULL,
+			   sizeof(struct element)))
+		return 1;
+
+	fail_one_in = 1;
+
+	for (i = 0; i < RESERVE; i++)
+		e[i] = mempool_alloc(&pool, GFP_NOWAIT);
+
+	w.pool	= &pool;
+	w.e	= NULL;
+	thread = thread_start(waiter_fn, &w);
+
+	while (!atomic64_read(&pool.stats.wait))
+		usleep(1000);
+
+	mempool_free(e[0], &pool);
+	thread_join(thread);
+
+	if (w.e != e[0]) {
+		fprintf(stderr, "mempool: wait: got %p, should have got %p\n",
+			w.e, e[0]);
+		ret = 1;
+	}
+
+	fail_one_in = 0;
+
+	mempool_free(w.e, &pool);
+	for (i = 1; i < RESERVE; i++)
+		mempool_free(e[i], &pool);
+
+	return pool_check(&pool, "wait") || ret;
+}
+
+struct stress_thread {
+	struct task_struct	*thread;
+	unsigned long		id;
+	mempool_t		*pool;
+	unsigned		nr_failed;
+	int			ret;
+};
+
+/*
+ * Elements that threads have handed to another thread to free - each slot
+ * holds at most one:
+ */
+static struct element *shared[NR_THREADS];
+
+/*
+ * Threads allocate and free at random, holding up to a reserve's worth of
+ * elements each and sometimes freeing each other's. Blocking allocations are
+ * only done holding nothing, so someone can always make progress:
+ */
+static int stress_fn(void *p)
+{
+	struct stress_thread *t = p;
+	struct element *held[NR_HELD] = { NULL }, *e;
+	unsigned long seed = t->id;
+	unsigned i, j, nr = 0;
+
+	alloc_seed = t->id * 7919;
+
+	for (i = 0; i < NR_ITERS && !t->ret; i++) {
+		if (!(i % 64))
+			sched_yield();
+
+		j = rand_next(&seed) % NR_HELD;
+
+		if (held[j]) {
+			t->ret |= give_back(held[j], t->id);
+
+			if (!(rand_next(&seed) % 4)) {
+				e = xchg(&shared[rand_next(&seed) % NR_THREADS],
+					 held[j]);
+				if (e)
+					mempool_free(e, t->pool);
+			} else {
+				mempool_free(held[j], t->pool);
+			}
+
+			held[j] = NULL;
+			nr--;
+			continue;
+		}
+
+		held[j] = mempool_alloc(t->pool, nr ? GFP_NOWAIT : GFP_KERNEL);
+		if (held[j]) {
+			t->ret |= take(held[j], t->id);
+			nr++;
+		} else {
+			t->nr_failed++;
+		}
+	}
+
+	for (j = 0; j < NR_HELD; j++)
+		if (held[j]) {
+			t->ret |= give_back(held[j], t->id);
+			mempool_free(held[j], t->pool);
+		}
+
+	return 0;
+}
+
+/*
+ * With @fail_one_in 1, every element handed out comes from the reserve, which
+ * is exhausted and refilled over and over; otherwise we're also allocating and
+ * freeing to the allocator:
+ */
+static int test_stress(unsigned fail)
+{
+	struct stress_thread threads[NR_THREADS];
+	mempool_t pool;
+	unsigned i, nr_failed = 0;
+	int ret = 0;
+
+	if (__mempool_init(&pool, RESERVE, test_alloc, test_free, NULL,
+			   sizeof(struct element)))
+		return 1;
+
+	fail_one_in = fail;
+
+	for (i = 0; i < NR_THREADS; i++) {
+		threads[i].id		= i + 1;
+		threads[i].pool		= &pool;
+		threads[i].nr_failed	= 0;
+		threads[i].ret		= 0;
+		threads[i].thread	= thread_start(stress_fn, &threads[i]);
+	}
+
+	for (i = 0; i < NR_THREADS; i++) {
+		thread_join(threads[i].thread);
+		nr_failed	+= threads[i].nr_failed;
+		ret		|= threads[i].ret;
+	}
+
+	fail_one_in = 0;
+
+	for (i = 0; i < NR_THREADS; i++)
+		mempool_free(xchg(&shared[i], NULL), &pool);
+
+	if (!atomic64_read(&pool.stats.reserve) ||
+	    (fail == 1 && !nr_failed)) {
+		fprintf(stderr, "mempool: stress: reserve used %llu times, exhausted %u times\n",
+			(u64) atomic64_read(&pool.stats.reserve), nr_failed);
+		ret = 1;
+	}
+
+	return pool_check(&pool, "stress") || ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_reserve() ||
+	    test_wait() ||
+	    test_stress(1) ||
+	    test_stress(3))
+		return EXIT_FAILURE;
+
+	printf("mempool: ok\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,290 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#define NR_THREADS	8
+#define NR_ITERS	20000
+#define NR_HELD		32
+#define NR_CLASSES	(KMALLOC_SHIFT_HIGH + 1)
+
+struct obj {
+	void			*p;
+	size_t			size;
+	u8			v;
+};
+
+/*
+ * Objects threads have handed to another thread to free - each slot holds at
+ * most one:
+ */
+static struct {
+	spinlock_t		lock;
+	struct obj		obj;
+} shared[NR_THREADS];
+
+static unsigned long rand_next(unsigned long *seed)
+{
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+	return *seed >> 33;
+}
+
+static unsigned size_class(size_t size)
+{
+	return size <= (1UL << KMALLOC_SHIFT_LOW)
+		? KMALLOC_SHIFT_LOW
+		: fls_long(size - 1);
+}
+
+/*
+ * Objects are filled with a pattern where it's cheap to check - the start, the
+ * end and every page boundary - so one handed out twice, or overlapping
+ * another, is caught when it's freed:
+ */
+#define PATTERN_BYTES	64
+
+static void pattern_range(struct obj *o, size_t *start, size_t *end,
+			  size_t offset)
+{
+	*start	= offset;
+	*end	= min(offset + PATTERN_BYTES, o->size);
+}
+
+static void obj_fill(struct obj *o)
+{
+	size_t offset, i, end;
+
+	for (offset = 0; offset < o->size; offset += PAGE_SIZE) {
+		pattern_range(o, &i, &end, offset);
+		memset(o->p + i, o->v, end - i);
+	}
+
+	i = o->size - min_t(size_t, o->size, PATTERN_BYTES);
+	memset(o->p + i, o->v, o->size - i);
+}
+
+static int obj_check(struct obj *o, const char *when)
+{
+	size_t offset, i, end;
+	u8 *p = o->p;
+
+	for (offset = 0; offset < o->size; offset += PAGE_SIZE) {
+		pattern_range(o, &i, &end, offset);
+		for (; i < end; i++)
+			if (p[i] != o->v)
+				goto bad;
+	}
+
+	for (i = o->size - min_t(size_t, o->size, PATTERN_BYTES);
+	     i < o->size; i++)
+		if (p[i] != o->v)
+			goto bad;
+
+	return 0;
+bad:
+	fprintf(stderr, "slab: %s: %zu byte object %p corrupted at %zu: %02x, should be %02x\n",
+		when, o->size, o->p, i, p[i], o->v);
+	return 1;
+}
+
+/*
+ * Sizes up to KMALLOC_MAX_CACHE_SIZE come from their size class's cache, and
+ * are naturally aligned up to a page:
+ */
+static int obj_alloc(struct obj *o, unsigned long *seed)
+{
+	unsigned class = KMALLOC_SHIFT_LOW +
+		rand_next(seed) % (NR_CLASSES + 1 - KMALLOC_SHIFT_LOW);
+	size_t min = class == KMALLOC_SHIFT_LOW ? 1 : (1UL << (class - 1)) + 1;
+	size_t align;
+	bool zero = !(rand_next(seed) % 8);
+	u8 *p;
+	size_t i;
+
+	o->size	= min + rand_next(seed) % ((1UL << class) - min + 1);
+	o->v	= rand_next(seed);
+	o->p	= p = kmalloc(o->size, zero ? GFP_KERNEL|__GFP_ZERO : GFP_KERNEL);
+
+	if (!p) {
+		fprintf(stderr, "slab: allocating %zu bytes failed\n", o->size);
+		return 1;
+	}
+
+	if (o->size <= KMALLOC_MAX_CACHE_SIZE) {
+		class = size_class(o->size);
+		align = min(1UL << class, PAGE_SIZE);
+
+		if (ksize(p) != 1UL << class ||
+		    (unsigned long) p & (align - 1)) {
+			fprintf(stderr, "slab: %zu byte object %p: ksize %zu, should be %lu aligned to %zu\n",
+				o->size, p, ksize(p), 1UL << class, align);
+			return 1;
+		}
+	} else if (ksize(p) < o->size) {
+		fprintf(stderr, "slab: %zu byte object %p: ksize %zu\n",
+			o->size, p, ksize(p));
+		return 1;
+	}
+
+	if (zero)
+		for (i = 0; i < o->size; i++)
+			if (p[i]) {
+				fprintf(stderr, "slab: %zu byte zeroed object %p not zeroed at %zu\n",
+					o->size, p, i);
+				return 1;
+			}
+
+	obj_fill(o);
+	return 0;
+}
+
+static int obj_free(struct obj *o, const char *when)
+{
+	int ret = obj_check(o, when);
+
+	kfree(o->p);
+	o->p = NULL;
+	return ret;
+}
+
+struct slab_thread {
+	struct task_struct	*thread;
+	unsigned long		id;
+	int			ret;
+};
+
+/*
+ * Threads allocate and free objects of every size class at random, and free
+ * some of each other's - an object freed by another thread goes to that
+ * thread's magazine, and from there to whoever allocates next:
+ */
+static int slab_fn(void *arg)
+{
+	struct slab_thread *t = arg;
+	struct obj held[NR_HELD] = { { NULL } }, o;
+	unsigned long seed = t->id;
+	unsigned i, j, k;
+
+	for (i = 0; i < NR_ITERS && !t->ret; i++) {
+		if (!(i % 64))
+			sched_yield();
+
+		j = rand_next(&seed) % NR_HELD;
+
+		if (!held[j].p) {
+			t->ret |= obj_alloc(&held[j], &seed);
+			continue;
+		}
+
+		if (rand_next(&seed) % 4) {
+			t->ret |= obj_free(&held[j], "freed by owner");
+			continue;
+		}
+
+		/* hand it to another thread to free: */
+		k = rand_next(&seed) % NR_THREADS;
+
+		spin_lock(&shared[k].lock);
+		o = shared[k].obj;
+		shared[k].obj = held[j];
+		spin_unlock(&shared[k].lock);
+
+		held[j].p = NULL;
+		if (o.p)
+			t->ret |= obj_free(&o, "freed by another thread");
+	}
+
+	for (j = 0; j < NR_HELD; j++)
+		if (held[j].p)
+			t->ret |= obj_free(&held[j], "freed by owner");
+
+	return 0;
+}
+
+static struct task_struct *thread_start(int (*fn)(void *), void *arg)
+{
+	struct task_struct *p = kthread_create(fn, arg, "slab_test");
+
+	BUG_ON(IS_ERR(p));
+	get_task_struct(p);
+	wake_up_process(p);
+	return p;
+}
+
+static void thread_join(struct task_struct *p)
+{
+	kthread_stop(p);
+	put_task_struct(p);
+}
+
+static struct kmem_cache_stats kmalloc_stats[NR_CLASSES];
+
+static void kmalloc_stats_read(struct kmem_cache *s, void *data)
+{
+	struct kmem_cache_stats *stats = data;
+
+	if (!strncmp(kmem_cache_name(s), "kmalloc-", 8))
+		kmem_cache_stats(s, &stats[ilog2(kmem_cache_size(s))]);
+}
+
+static int test_threads(void)
+{
+	struct kmem_cache_stats before[NR_CLASSES];
+	struct slab_thread threads[NR_THREADS];
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < NR_THREADS; i++)
+		spin_lock_init(&shared[i].lock);
+
+	memset(kmalloc_stats, 0, sizeof(kmalloc_stats));
+	kmem_cache_for_each(kmalloc_stats_read, kmalloc_stats);
+	memcpy(before, kmalloc_stats, sizeof(before));
+
+	for (i = 0; i < NR_THREADS; i++) {
+		threads[i].id		= i + 1;
+		threads[i].ret		= 0;
+		threads[i].thread	= thread_start(slab_fn, &threads[i]);
+	}
+
+	for (i = 0; i < NR_THREADS; i++) {
+		thread_join(threads[i].thread);
+		ret |= threads[i].ret;
+	}
+
+	for (i = 0; i < NR_THREADS; i++)
+		if (shared[i].obj.p)
+			ret |= obj_free(&shared[i].obj, "freed at exit");
+
+	kmem_cache_for_each(kmalloc_stats_read, kmalloc_stats);
+
+	/* Every size class was used, and everything allocated was freed: */
+	for (i = KMALLOC_SHIFT_LOW; i < NR_CLASSES; i++)
+		if (kmalloc_stats[i].allocs == before[i].allocs ||
+		    kmalloc_stats[i].nr_active != before[i].nr_active) {
+			fprintf(stderr, "slab: kmalloc-%lu: %llu allocs, %lli objects still allocated\n",
+				1UL << i,
+				kmalloc_stats[i].allocs - before[i].allocs,
+				(s64) (kmalloc_stats[i].nr_active -
+				       before[i].nr_active));
+			ret = 1;
+		}
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_threads())
+		return EXIT_FAILURE;
+
+	printf("slab: ok\n");
+	return EXIT_SUCCESS;
+}
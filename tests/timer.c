@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/timer.h>
+
+#define NR_TIMERS	16
+
+static struct timer_list timers[NR_TIMERS];
+static int fired[NR_TIMERS];
+
+static void timer_fn(unsigned long data)
+{
+	__atomic_add_fetch(&fired[data], 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Timers with the same expires compare equal - deleting the one in the last
+ * heap slot mustn't push any of the others out of the heap:
+ */
+static int test_del_last_equal_expires(void)
+{
+	unsigned long expires = jiffies + HZ / 10;
+	int i, last = -1, ret = 0;
+
+	for (i = 0; i < NR_TIMERS; i++) {
+		setup_timer(&timers[i], timer_fn, i);
+		mod_timer(&timers[i], expires);
+	}
+
+	for (i = 0; i < NR_TIMERS; i++)
+		if (timers[i].idx == NR_TIMERS - 1)
+			last = i;
+
+	if (last < 0 || !del_timer(&timers[last])) {
+		fprintf(stderr, "timer: couldn't find timer in last slot\n");
+		return 1;
+	}
+
+	while (time_before_eq(jiffies, expires + HZ / 2))
+		usleep(10000);
+
+	for (i = 0; i < NR_TIMERS; i++) {
+		int expect = i != last;
+
+		if (fired[i] != expect || timer_pending(&timers[i])) {
+			fprintf(stderr, "timer %i: fired %i times, expected %i\n",
+				i, fired[i], expect);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (test_del_last_equal_expires())
+		return EXIT_FAILURE;
+
+	printf("timer: ok\n");
+	return EXIT_SUCCESS;
+}